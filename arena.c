@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/***
+ * Arena allocator for per-message parse data. Allocating is a bump of the current block's
+ * offset, freeing is arena_reset after each message. Blocks stay with the arena until it is
+ * freed, so once the first messages have grown it to the largest one's needs, parsing the rest of
+ * a folder takes nothing more from malloc.
+*/
+
+void arena_init(arena_t *arena) {
+    arena->head = arena->current = NULL;
+    arena->in_use = 0;
+    memset(&arena->stats, 0, sizeof(arena->stats));
+}
+
+void arena_free(arena_t *arena) {
+    arena_block_t *block = arena->head;
+    while (block != NULL) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(arena);
+}
+
+// Function to add a block of at least len bytes at the end of the chain
+static arena_block_t *add_block(arena_t *arena, size_t len) {
+    size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+    arena_block_t *block = malloc(sizeof(arena_block_t) + size);
+    if (block == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    if (arena->head == NULL) {
+        arena->head = block;
+    } else {
+        arena_block_t *last = arena->current;
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        last->next = block;
+    }
+    arena->stats.blocks++;
+    arena->stats.reserved += size;
+    return block;
+}
+
+void *arena_alloc(arena_t *arena, size_t len) {
+    // Rounded up so the next allocation stays aligned
+    len = (len + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+    // Blocks too full for this are passed over, what is left in them is used after the next reset
+    arena_block_t *block = arena->current;
+    while (block != NULL && block->size - block->used < len) {
+        block = block->next;
+    }
+    if (block == NULL) {
+        block = add_block(arena, len);
+    }
+    if (arena->current == NULL || arena->current->size - arena->current->used < len) {
+        arena->current = block;
+    }
+
+    void *data = (char *)block->data + block->used;
+    block->used += len;
+    arena->in_use += len;
+    arena->stats.allocations++;
+    if (arena->in_use > arena->stats.peak) {
+        arena->stats.peak = arena->in_use;
+    }
+    return data;
+}
+
+char *arena_strndup(arena_t *arena, const char *s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_reset(arena_t *arena) {
+    for (arena_block_t *block = arena->head; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->head;
+    arena->in_use = 0;
+    arena->stats.resets++;
+}
+
+void arena_report(const arena_t *arena, FILE *out) {
+    const arena_stats_t *stats = &arena->stats;
+    fprintf(out, "Parse arena: %llu allocations over %llu messages, peak %zu bytes, %zu blocks (%zu bytes) from malloc\n",
+            stats->allocations, stats->resets, stats->peak, stats->blocks, stats->reserved);
+}
@@ -0,0 +1,55 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Size of the blocks an arena takes from malloc, larger allocations get a block of their own
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct arena_block arena_block_t;
+
+struct arena_block {
+    arena_block_t *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+// What an arena has done, reported by -v
+typedef struct arena_stats {
+    unsigned long long allocations; // arena_alloc calls
+    unsigned long long resets;      // messages it was cleared after
+    size_t peak;                    // most bytes in use between two resets
+    size_t blocks;                  // blocks taken from malloc
+    size_t reserved;                // bytes in those blocks
+} arena_stats_t;
+
+// Region allocator for the parse data of one message: the literal, the header list, decode
+// buffers. Nothing is freed on its own, arena_reset clears all of it at once and keeps the
+// blocks for the next message, arena_free gives them back
+typedef struct arena {
+    arena_block_t *head;
+    arena_block_t *current;     // first block with room, the ones before it are full
+    size_t in_use;
+    arena_stats_t stats;
+} arena_t;
+
+// Functions to manage an arena
+void arena_init(arena_t *arena);
+
+void arena_free(arena_t *arena);
+
+// Allocate len bytes aligned for any type, exits if memory runs out
+void *arena_alloc(arena_t *arena, size_t len);
+
+// Copy the first len bytes of s into the arena, NUL terminated
+char *arena_strndup(arena_t *arena, const char *s, size_t len);
+
+// Forget everything allocated, keeping the blocks to allocate from again
+void arena_reset(arena_t *arena);
+
+// Print the arena's statistics
+void arena_report(const arena_t *arena, FILE *out);
+
+#endif
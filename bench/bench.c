@@ -0,0 +1,566 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../imap_client.h"
+#include "../command.h"
+#include "packet_list.h"
+#include "../mime.h"
+#include "../decode.h"
+#include "../header_index.h"
+
+/***
+ * Microbenchmarks for the parsing hot paths, run over generated corpora from a single message
+ * up to 100k message folders and multi-MB bodies.
+ *
+ * Each case runs in its own child process so its peak RSS can be read from wait4(). Output is
+ * one JSON document on stdout, with ns per call, ns per byte, allocations per call and per
+ * message, and peak RSS. Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time (-Wl,--wrap), so only calls made from our own code are seen, not those inside libc.
+ *
+ * Usage: bench_parsers [--quick] [--filter <text>] [--min-time <seconds>]
+*/
+
+typedef struct result {
+    long iterations;
+    double seconds;         // time spent inside the benchmarked calls
+    size_t bytes;           // input bytes per call
+    long messages;          // messages per call
+    long allocs;            // allocations made inside the benchmarked calls
+    size_t alloc_bytes;
+} result_t;
+
+typedef struct corpus {
+    char *data;
+    size_t len;
+    size_t size;
+    long messages;
+} corpus_t;
+
+typedef struct bench_case {
+    const char *name;       // function being measured
+    const char *corpus;     // description of the input
+    void (*run)(const struct bench_case *bench, result_t *result);
+    long messages;          // folder size, or packet count for concatenate_packets
+    size_t size;            // message or body size
+    int reversed;           // folder listed in descending order
+    int quick;              // part of the --quick set
+} bench_case_t;
+
+static double min_time = 0.3;
+
+
+//////////// Allocation counting ///////////////////////////
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static long alloc_count = 0;
+static size_t alloc_bytes = 0;
+
+void *__wrap_malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    alloc_count++;
+    alloc_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+
+//////////// Timing ///////////////////////////
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Marks around one benchmarked call, so setup work between calls is not measured
+static double call_start;
+static long call_allocs;
+static size_t call_alloc_bytes;
+
+static void begin_call() {
+    call_allocs = alloc_count;
+    call_alloc_bytes = alloc_bytes;
+    call_start = now();
+}
+
+static void end_call(result_t *result) {
+    result->seconds += now() - call_start;
+    result->allocs += alloc_count - call_allocs;
+    result->alloc_bytes += alloc_bytes - call_alloc_bytes;
+    result->iterations++;
+}
+
+// Keep calling until enough time has been measured (at least 3 calls). Calls much cheaper than
+// their setup also stop once the whole loop has run for ten times min_time
+static int keep_going(const result_t *result) {
+    static double loop_start;
+    if (result->iterations == 0) {
+        loop_start = now();
+    }
+    return result->iterations < 3 ||
+           (result->seconds < min_time && result->iterations < 1000000 && now() - loop_start < 10 * min_time);
+}
+
+
+//////////// Corpora ///////////////////////////
+
+static void corpus_append(corpus_t *corpus, const char *data, size_t len) {
+    if (corpus->len + len + 1 > corpus->size) {
+        corpus->size = (corpus->len + len + 1) * 2;
+        corpus->data = realloc(corpus->data, corpus->size);
+        if (corpus->data == NULL) {
+            perror("realloc");
+            exit(5);
+        }
+    }
+    memcpy(corpus->data + corpus->len, data, len);
+    corpus->len += len;
+    corpus->data[corpus->len] = '\0';
+}
+
+static void corpus_printf(corpus_t *corpus, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void corpus_printf(corpus_t *corpus, const char *format, ...) {
+    char buffer[4096];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    corpus_append(corpus, buffer, len);
+}
+
+// Lines of text up to size bytes
+static void corpus_text(corpus_t *corpus, size_t size) {
+    static const char line[] = "The quick brown fox jumps over the lazy dog while the kernel flushes buffers\r\n";
+    size_t start = corpus->len;
+    while (corpus->len - start + sizeof(line) - 1 <= size) {
+        corpus_append(corpus, line, sizeof(line) - 1);
+    }
+}
+
+// The header fields parse fetches, with folded To and Subject lines
+static void header_block(corpus_t *corpus, long n) {
+    corpus_printf(corpus, "From: Sender %ld <sender%ld@bench.test>\r\n", n, n);
+    corpus_printf(corpus, "To: first@bench.test,\r\n second%ld@bench.test,\r\n\tthird@bench.test\r\n", n);
+    corpus_printf(corpus, "Date: Mon, 22 Apr 2024 23:44:%02ld +0000\r\n", n % 60);
+    corpus_printf(corpus, "Subject: Benchmark message %ld about\r\n a folded subject line\r\n\r\n", n);
+}
+
+// Response to the parse FETCH of messages
+static void parse_response(corpus_t *corpus, long messages) {
+    corpus_t headers = {NULL, 0, 0, 0};
+    for (long i = 1; i <= messages; i++) {
+        headers.len = 0;
+        header_block(&headers, i);
+        corpus_printf(corpus, "* %ld FETCH (BODY[HEADER.FIELDS (FROM TO DATE SUBJECT)] {%zu}\r\n", i, headers.len);
+        corpus_append(corpus, headers.data, headers.len);
+        corpus_printf(corpus, ")\r\n");
+    }
+    corpus_printf(corpus, "C001 OK Fetch completed (0.001 + 0.000 secs).\r\n");
+    corpus->messages = messages;
+    free(headers.data);
+}
+
+// Response to the list FETCH, in the order given (the server sends ascending order)
+static void list_response(corpus_t *corpus, long messages, int reversed) {
+    for (long i = 1; i <= messages; i++) {
+        long n = reversed ? messages - i + 1 : i;
+        char subject[128];
+        int len;
+        if (n % 10 == 0) {
+            len = snprintf(subject, sizeof(subject), "\r\n");
+        } else {
+            len = snprintf(subject, sizeof(subject), "Subject: Synthetic message %ld\r\n\r\n", n);
+        }
+        corpus_printf(corpus, "* %ld FETCH (BODY[HEADER.FIELDS (SUBJECT)] {%d}\r\n%s)\r\n", n, len, subject);
+    }
+    corpus_printf(corpus, "C001 OK Fetch completed (0.001 + 0.000 secs).\r\n");
+    corpus->messages = messages;
+}
+
+// A multipart/alternative message whose text/plain part is about size bytes
+static void mime_message_corpus(corpus_t *corpus, size_t size) {
+    corpus_printf(corpus, "Return-Path: <sender@bench.test>\r\nDelivered-To: staff@bench.test\r\n");
+    for (int i = 0; i < 20; i++) {
+        corpus_printf(corpus, "Received: from relay%d.bench.test (relay%d.bench.test [10.0.0.%d])\r\n\tby mx.bench.test; Mon, 22 Apr 2024 23:44:%02d +0000\r\n", i, i, i, i);
+    }
+    corpus_printf(corpus, "From: Sender <sender@bench.test>\r\nTo: staff@bench.test\r\nSubject: MIME benchmark\r\n");
+    corpus_printf(corpus, "MIME-Version: 1.0\r\nContent-Type: multipart/alternative;\r\n boundary=\"bench-boundary\"\r\n\r\n");
+    corpus_printf(corpus, "--bench-boundary\r\nContent-Type: text/plain;\r\n charset=UTF-8\r\nContent-Transfer-Encoding: quoted-printable\r\n\r\n");
+    corpus_text(corpus, size);
+    corpus_printf(corpus, "\r\n--bench-boundary\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n<p>html</p>\r\n");
+    corpus_printf(corpus, "\r\n--bench-boundary--\r\n");
+    corpus->messages = 1;
+}
+
+// About size bytes of base64 in 76 character lines, of pseudo-random data
+static void corpus_base64(corpus_t *corpus, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char line[78];
+    unsigned int state = 12345;
+    for (size_t written = 0; written + sizeof(line) <= size; written += sizeof(line)) {
+        for (int i = 0; i < 76; i++) {
+            state = state * 1103515245 + 12345;
+            line[i] = alphabet[(state >> 16) & 63];
+        }
+        line[76] = '\r';
+        line[77] = '\n';
+        corpus_append(corpus, line, sizeof(line));
+    }
+}
+
+// About size bytes of quoted-printable text with encoded characters and soft line breaks
+static void corpus_quoted_printable(corpus_t *corpus, size_t size) {
+    static const char line[] = "The quick brown fox jumps over the lazy dog, caf=C3=A9 and na=C3=AFve =\r\n"
+                               "buffers flushed by the kernel =3D 100% of the time\r\n";
+    size_t start = corpus->len;
+    while (corpus->len - start + sizeof(line) - 1 <= size) {
+        corpus_append(corpus, line, sizeof(line) - 1);
+    }
+}
+
+//////////// Benchmarks ///////////////////////////
+
+static void run_concatenate_packets(const bench_case_t *bench, result_t *result) {
+    // The packets read() used to return, 2047 bytes each
+    char packet[2048];
+    memset(packet, 'x', sizeof(packet) - 1);
+    packet[sizeof(packet) - 1] = '\0';
+
+    arena_t arena;
+    arena_init(&arena);
+    list_t *packets = make_empty_list(&arena);
+    for (long i = 0; i < bench->messages; i++) {
+        insert_at_foot(packets, packet, NULL);
+    }
+    result->bytes = bench->messages * (sizeof(packet) - 1);
+    result->messages = 1;
+
+    while (keep_going(result)) {
+        begin_call();
+        char *buffer = concatenate_packets(packets);
+        end_call(result);
+        free(buffer);
+    }
+    arena_free(&arena);
+}
+
+// Index a header block and look up the fields parse prints by default, one block per message
+static void run_header_index(const bench_case_t *bench, result_t *result) {
+    static const char *names[] = {"From", "To", "Date", "Subject"};
+    corpus_t corpus = {NULL, 0, 0, 0};
+    header_block(&corpus, 1);
+    arena_t arena;
+    arena_init(&arena);
+    result->bytes = corpus.len * bench->messages;
+    result->messages = bench->messages;
+
+    size_t found = 0;
+    while (keep_going(result)) {
+        begin_call();
+        for (long i = 0; i < bench->messages; i++) {
+            header_index_t index;
+            header_index_build(&index, corpus.data, corpus.len, &arena);
+            for (int n = 0; n < 4; n++) {
+                found += header_index_find(&index, names[n], strlen(names[n])) != NULL;
+            }
+            arena_reset(&arena);
+        }
+        end_call(result);
+    }
+    if (found == 0) {
+        fprintf(stderr, "header_index found nothing\n");
+    }
+    arena_free(&arena);
+    free(corpus.data);
+}
+
+// Parse a list response into subjects, as list does with the server response
+static void read_subjects(const corpus_t *corpus, subject_list_t *subjects) {
+    memory_source_t source = {corpus->data, corpus->len, 0};
+    transport_t transport;
+    transport_memory(&transport, &source);
+    imap_reader_t reader;
+    int count;
+    reader_init(&reader, &transport);
+    command_queue_t commands;
+    command_queue_init(&commands, &reader, transport_send, &transport, 0);
+    imap_command_t *fetch = command_send(&commands, "FETCH 1:* (BODY.PEEK[HEADER.FIELDS (SUBJECT)])");
+    command_fetch(&commands, fetch, collect_subject, subjects, &count);
+    command_free(fetch);
+}
+
+// parse of a whole FETCH response as a session runs it, the arena kept from one call to the next
+static void run_parse(const bench_case_t *bench, result_t *result) {
+    corpus_t corpus = {NULL, 0, 0, 0};
+    parse_response(&corpus, bench->messages);
+    fetch_mail_t fetch_mail = {NULL};
+    arena_t arena;
+    arena_init(&arena);
+    fetch_context_t context = {plan_command("parse"), 1, &fetch_mail, &arena};
+    result->bytes = corpus.len;
+    result->messages = corpus.messages;
+
+    while (keep_going(result)) {
+        memory_source_t source = {corpus.data, corpus.len, 0};
+        transport_t transport;
+        transport_memory(&transport, &source);
+        imap_reader_t reader;
+        reader_init(&reader, &transport);
+        command_queue_t commands;
+        command_queue_init(&commands, &reader, transport_send, &transport, 0);
+        int count;
+        begin_call();
+        imap_command_t *fetch = command_send(&commands, "FETCH 1:* %s", context.plan->items);
+        command_fetch(&commands, fetch, handle_message, &context, &count);
+        command_free(fetch);
+        end_call(result);
+    }
+    arena_free(&arena);
+    free(corpus.data);
+}
+
+static void run_subject_list_add(const bench_case_t *bench, result_t *result) {
+    corpus_t corpus = {NULL, 0, 0, 0};
+    list_response(&corpus, bench->messages, 0);
+    result->bytes = corpus.len;
+    result->messages = corpus.messages;
+
+    while (keep_going(result)) {
+        subject_list_t subjects;
+        subject_list_init(&subjects);
+        begin_call();
+        read_subjects(&corpus, &subjects);
+        end_call(result);
+        subject_list_free(&subjects);
+    }
+    free(corpus.data);
+}
+
+static void run_subject_list_sort(const bench_case_t *bench, result_t *result) {
+    corpus_t corpus = {NULL, 0, 0, 0};
+    list_response(&corpus, bench->messages, bench->reversed);
+    result->bytes = corpus.len;
+    result->messages = corpus.messages;
+
+    // Parse once, and put the records back in server order before each call
+    subject_list_t subjects;
+    subject_list_init(&subjects);
+    read_subjects(&corpus, &subjects);
+    size_t records_size = subjects.count * sizeof(subject_record_t);
+    subject_record_t *server_order = malloc(records_size);
+    memcpy(server_order, subjects.records, records_size);
+    int ordered = subjects.ordered;
+
+    while (keep_going(result)) {
+        memcpy(subjects.records, server_order, records_size);
+        subjects.ordered = ordered;
+        begin_call();
+        subject_list_sort(&subjects);
+        end_call(result);
+    }
+    free(server_order);
+    subject_list_free(&subjects);
+    free(corpus.data);
+}
+
+static void run_mime_parse(const bench_case_t *bench, result_t *result) {
+    corpus_t corpus = {NULL, 0, 0, 0};
+    mime_message_corpus(&corpus, bench->size);
+    result->bytes = corpus.len;
+    result->messages = 1;
+
+    while (keep_going(result)) {
+        mime_tree_t tree;
+        begin_call();
+        mime_parse(&tree, corpus.data, corpus.len);
+        end_call(result);
+        mime_tree_free(&tree);
+    }
+    free(corpus.data);
+}
+
+static void run_mime(const bench_case_t *bench, result_t *result) {
+    corpus_t corpus = {NULL, 0, 0, 0};
+    mime_message_corpus(&corpus, bench->size);
+    byte_buffer_t message = {corpus.data, corpus.len, corpus.size};
+    fetch_mail_t fetch_mail = {NULL};
+    result->bytes = corpus.len;
+    result->messages = 1;
+
+    while (keep_going(result)) {
+        begin_call();
+        mime(&message, &fetch_mail);
+        end_call(result);
+    }
+    free(corpus.data);
+}
+
+// Decode an encoded body in the chunks mime --decode uses
+static void run_decode(const bench_case_t *bench, result_t *result, int encoding) {
+    corpus_t corpus = {NULL, 0, 0, 0};
+    if (encoding == DECODE_BASE64) {
+        corpus_base64(&corpus, bench->size);
+    } else {
+        corpus_quoted_printable(&corpus, bench->size);
+    }
+    char *out = malloc(DECODE_OUT_SIZE(DECODE_CHUNK_SIZE));
+    result->bytes = corpus.len;
+    result->messages = 1;
+
+    while (keep_going(result)) {
+        decoder_t decoder;
+        begin_call();
+        decoder_init(&decoder, encoding);
+        for (size_t offset = 0; offset < corpus.len; offset += DECODE_CHUNK_SIZE) {
+            size_t chunk = corpus.len - offset < DECODE_CHUNK_SIZE ? corpus.len - offset : DECODE_CHUNK_SIZE;
+            decode_update(&decoder, corpus.data + offset, chunk, out);
+        }
+        decode_final(&decoder, out);
+        end_call(result);
+    }
+    free(out);
+    free(corpus.data);
+}
+
+static void run_decode_base64(const bench_case_t *bench, result_t *result) {
+    run_decode(bench, result, DECODE_BASE64);
+}
+
+static void run_decode_quoted_printable(const bench_case_t *bench, result_t *result) {
+    run_decode(bench, result, DECODE_QUOTED_PRINTABLE);
+}
+
+static const bench_case_t cases[] = {
+    {"concatenate_packets", "64KB in 2047 byte packets", run_concatenate_packets, 32, 0, 0, 1},
+    {"concatenate_packets", "16MB in 2047 byte packets", run_concatenate_packets, 8192, 0, 0, 0},
+    {"header_index", "1 message", run_header_index, 1, 0, 0, 1},
+    {"header_index", "10k messages", run_header_index, 10000, 0, 0, 0},
+    {"parse", "1k messages", run_parse, 1000, 0, 0, 1},
+    {"parse", "100k messages", run_parse, 100000, 0, 0, 0},
+    {"subject_list_add", "10 message folder", run_subject_list_add, 10, 0, 0, 1},
+    {"subject_list_add", "1k message folder", run_subject_list_add, 1000, 0, 0, 1},
+    {"subject_list_add", "100k message folder", run_subject_list_add, 100000, 0, 0, 0},
+    {"subject_list_add", "1M message folder", run_subject_list_add, 1000000, 0, 0, 0},
+    {"subject_list_sort", "1k message folder, server order", run_subject_list_sort, 1000, 0, 0, 1},
+    {"subject_list_sort", "100k message folder, server order", run_subject_list_sort, 100000, 0, 0, 0},
+    {"subject_list_sort", "10k message folder, reversed", run_subject_list_sort, 10000, 0, 1, 0},
+    {"subject_list_sort", "1M message folder, reversed", run_subject_list_sort, 1000000, 0, 1, 0},
+    {"mime_parse", "4KB text part", run_mime_parse, 1, 4096, 0, 1},
+    {"mime_parse", "4MB text part", run_mime_parse, 1, 4 << 20, 0, 0},
+    {"mime", "4KB text part", run_mime, 1, 4096, 0, 1},
+    {"mime", "64KB text part", run_mime, 1, 64 << 10, 0, 1},
+    {"mime", "4MB text part", run_mime, 1, 4 << 20, 0, 0},
+    {"decode_base64", "64KB attachment", run_decode_base64, 1, 64 << 10, 0, 1},
+    {"decode_base64", "16MB attachment", run_decode_base64, 1, 16 << 20, 0, 0},
+    {"decode_quoted_printable", "64KB text part", run_decode_quoted_printable, 1, 64 << 10, 0, 1},
+    {"decode_quoted_printable", "4MB text part", run_decode_quoted_printable, 1, 4 << 20, 0, 0},
+};
+
+
+//////////// Runner ///////////////////////////
+
+// Run one case in a child process, returns 0 if it failed
+static int run_case(const bench_case_t *bench, result_t *result, long *peak_rss_kb) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(5);
+    }
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The functions print what they parse, only the results go back to the parent
+        close(fds[0]);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+
+        result_t child = {0, 0, 0, 0, 0, 0};
+        bench->run(bench, &child);
+        fflush(stdout);
+        if (write(fds[1], &child, sizeof(child)) != sizeof(child)) {
+            _exit(5);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    *peak_rss_kb = usage.ru_maxrss;
+    return got == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    int quick = 0;
+    const char *filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            min_time = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--filter <text>] [--min-time <seconds>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("{\"benchmarks\": [");
+    int first = 1;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const bench_case_t *bench = &cases[i];
+        if ((quick && !bench->quick) || (filter && !strstr(bench->name, filter))) {
+            continue;
+        }
+
+        result_t result;
+        long peak_rss_kb;
+        fprintf(stderr, "%s (%s)...\n", bench->name, bench->corpus);
+        if (!run_case(bench, &result, &peak_rss_kb)) {
+            fprintf(stderr, "%s (%s) failed\n", bench->name, bench->corpus);
+            return 5;
+        }
+
+        double ns_per_op = result.seconds * 1e9 / result.iterations;
+        printf("%s\n  {\"name\": \"%s\", \"corpus\": \"%s\", \"iterations\": %ld, \"bytes\": %zu, "
+               "\"messages\": %ld, \"ns_per_op\": %.1f, \"ns_per_byte\": %.4f, \"allocs_per_op\": %.2f, "
+               "\"allocs_per_message\": %.4f, \"alloc_bytes_per_op\": %.1f, \"peak_rss_kb\": %ld}",
+               first ? "" : ",", bench->name, bench->corpus, result.iterations, result.bytes,
+               result.messages, ns_per_op, result.bytes ? ns_per_op / result.bytes : 0.0,
+               (double)result.allocs / result.iterations,
+               (double)result.allocs / result.iterations / (result.messages ? result.messages : 1),
+               (double)result.alloc_bytes / result.iterations, peak_rss_kb);
+        first = 0;
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include "packet_list.h"
+
+/***
+ * The linked list the client used to keep a server response in, one node per packet read(), and
+ * the copy that joined the packets back together. The client now reads responses through
+ * imap_reader and never holds them like this; the list is kept here only so bench_parsers can
+ * compare against the old way.
+*/
+
+// create an empty list in the arena
+list_t *make_empty_list(arena_t *arena) {
+    list_t *list = arena_alloc(arena, sizeof(*list));
+    list->head = list->foot = NULL;
+    list->arena = arena;
+    return list;
+}
+
+void insert_at_foot(list_t *list, const char *packet, const char *type) {
+    assert(list != NULL && packet != NULL);
+
+    // The node and copies of packet and type come from the list's arena, nothing is freed until
+    // the arena is reset
+    node_t *new_node = arena_alloc(list->arena, sizeof(*new_node));
+    new_node->packet = arena_strndup(list->arena, packet, strlen(packet));
+    new_node->type = type != NULL ? arena_strndup(list->arena, type, strlen(type)) : NULL;
+
+    // Initialization of node and list pointers
+    new_node->next = NULL;
+    if (list->head == NULL) {
+        list->head = list->foot = new_node;
+    } else {
+        list->foot->next = new_node;
+        list->foot = new_node;
+    }
+}
+
+char *concatenate_packets(list_t *packet_list) {
+    // calcualte the total size needed
+    size_t total_size = 0;
+
+    node_t *current = packet_list->head;
+    while (current != NULL) {
+        total_size += strlen(current->packet);
+        current = current->next;
+    }
+
+    // Allocate memory for the concatenated buffer
+    char *buffer = (char *)malloc(total_size + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    // Copy packet data into the buffer, keeping track of the end so each copy is O(packet)
+    size_t offset = 0;
+    current = packet_list->head;
+    while (current != NULL) {
+        size_t packet_len = strlen(current->packet);
+        memcpy(buffer + offset, current->packet, packet_len);
+        offset += packet_len;
+        current = current->next;
+    }
+    buffer[offset] = '\0';
+
+    return buffer;
+}
@@ -0,0 +1,31 @@
+#ifndef PACKET_LIST_H
+#define PACKET_LIST_H
+
+#include "../arena.h"
+
+// linked list node
+typedef struct node node_t;
+
+struct node {
+    char *type;
+    char *packet;
+    node_t *next;
+};
+
+// construct a linked list, its nodes and their strings live in the arena
+typedef struct {
+    node_t *head;
+    node_t *foot;
+    arena_t *arena;
+} list_t;
+
+// create an empty linked list in arena, freed with the arena
+list_t *make_empty_list(arena_t *arena);
+
+// function to append node to end of the list. Append to foot
+void insert_at_foot(list_t *list, const char *packet, const char *type);
+
+// Helper function to concatenate packets into a single buffer, freed by the caller
+char *concatenate_packets(list_t *packet_list);
+
+#endif
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "bodystructure.h"
+
+/***
+ * BODYSTRUCTURE parser (RFC 3501 7.4.2). mime uses it to pick the part it prints from the
+ * structure the server sends, and then fetches just that section instead of the whole message.
+ * Parts are numbered the way mime_parse numbers them, so --part means the same in both.
+ *
+ * Only what picking a part needs is kept: type, charset, encoding and size. Envelopes, other
+ * parameters and extension data are skipped, strings may be quoted or literals.
+*/
+
+typedef struct parser {
+    const char *p;
+    const char *end;
+    int failed;
+} parser_t;
+
+static void skip_spaces(parser_t *ps) {
+    while (ps->p < ps->end && *ps->p == ' ') {
+        ps->p++;
+    }
+}
+
+static int peek(const parser_t *ps, char c) {
+    return !ps->failed && ps->p < ps->end && *ps->p == c;
+}
+
+// Function to copy up to size - 1 bytes into out (if it is not NULL) and terminate it
+static void copy_field(char *out, size_t size, const char *text, size_t length) {
+    if (out == NULL) {
+        return;
+    }
+    if (length >= size) {
+        length = size - 1;
+    }
+    memcpy(out, text, length);
+    out[length] = '\0';
+}
+
+// Function to read a quoted string, a literal, NIL (stored as "") or an atom such as a number.
+// An atom runs to a space or parenthesis, except inside brackets (BODY[HEADER.FIELDS (A B)])
+static void read_string(parser_t *ps, char *out, size_t size) {
+    skip_spaces(ps);
+    if (ps->failed || ps->p >= ps->end) {
+        ps->failed = 1;
+        return;
+    }
+
+    if (*ps->p == '"') {
+        size_t length = 0;
+        ps->p++;
+        while (ps->p < ps->end && *ps->p != '"') {
+            if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+                ps->p++;
+            }
+            if (out != NULL && length + 1 < size) {
+                out[length++] = *ps->p;
+            }
+            ps->p++;
+        }
+        if (ps->p >= ps->end) {
+            ps->failed = 1;
+            return;
+        }
+        ps->p++;
+        if (out != NULL) {
+            out[length] = '\0';
+        }
+    } else if (*ps->p == '{') {
+        char *close;
+        unsigned long length = strtoul(ps->p + 1, &close, 10);
+        if (close >= ps->end || *close != '}' || (size_t)(ps->end - close) < 3 + length ||
+            close[1] != '\r' || close[2] != '\n') {
+            ps->failed = 1;
+            return;
+        }
+        copy_field(out, size, close + 3, length);
+        ps->p = close + 3 + length;
+    } else {
+        const char *start = ps->p;
+        int depth = 0;
+        while (ps->p < ps->end && ((*ps->p != ' ' && *ps->p != '(' && *ps->p != ')') || depth > 0) &&
+               *ps->p != '\r' && *ps->p != '\n') {
+            if (*ps->p == '[') {
+                depth++;
+            } else if (*ps->p == ']') {
+                depth--;
+            }
+            ps->p++;
+        }
+        if (ps->p == start) {
+            ps->failed = 1;
+            return;
+        }
+        if (ps->p - start == 3 && strncasecmp(start, "NIL", 3) == 0) {
+            copy_field(out, size, "", 0);
+        } else {
+            copy_field(out, size, start, ps->p - start);
+        }
+    }
+}
+
+// Function to skip one value: a string, an atom or a parenthesised list of values
+static void skip_value(parser_t *ps, int depth) {
+    skip_spaces(ps);
+    if (!peek(ps, '(')) {
+        read_string(ps, NULL, 0);
+        return;
+    }
+    if (depth > 2 * MIME_MAX_DEPTH) {
+        ps->failed = 1;
+        return;
+    }
+    ps->p++;
+    while (1) {
+        skip_spaces(ps);
+        if (ps->failed || ps->p >= ps->end) {
+            ps->failed = 1;
+            return;
+        }
+        if (*ps->p == ')') {
+            ps->p++;
+            return;
+        }
+        skip_value(ps, depth + 1);
+    }
+}
+
+// Function to skip what is left of a list (extension data) and its closing parenthesis
+static void skip_rest(parser_t *ps) {
+    while (1) {
+        skip_spaces(ps);
+        if (ps->failed || ps->p >= ps->end) {
+            ps->failed = 1;
+            return;
+        }
+        if (*ps->p == ')') {
+            ps->p++;
+            return;
+        }
+        skip_value(ps, 0);
+    }
+}
+
+static void lower(char *text) {
+    for (; *text; text++) {
+        *text = tolower((unsigned char)*text);
+    }
+}
+
+// Function to add an empty part, returns its index (parts may move, so indexes are kept)
+static int add_part(body_structure_t *structure) {
+    if (structure->count == structure->size) {
+        size_t new_size = structure->size ? structure->size * 2 : 16;
+        body_part_t *parts = realloc(structure->parts, new_size * sizeof(body_part_t));
+        if (parts == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(5);
+        }
+        structure->parts = parts;
+        structure->size = new_size;
+    }
+    memset(&structure->parts[structure->count], 0, sizeof(body_part_t));
+    return structure->count++;
+}
+
+// Function to set the section number of a child, "n" under the message or "parent.n"
+// Returns 0 if it does not fit
+static int child_section(char *section, const char *parent, int number) {
+    int written;
+    if (parent[0] == '\0') {
+        written = snprintf(section, MIME_SECTION_SIZE, "%d", number);
+    } else {
+        written = snprintf(section, MIME_SECTION_SIZE, "%s.%d", parent, number);
+    }
+    return written < MIME_SECTION_SIZE;
+}
+
+// Function to name the header of a part: a message's own header, or the MIME header of a part
+static void header_section(char *headers, const char *section, int is_message) {
+    if (is_message) {
+        snprintf(headers, MIME_SECTION_SIZE + 8, "%s%sHEADER", section, section[0] ? "." : "");
+    } else {
+        snprintf(headers, MIME_SECTION_SIZE + 8, "%s.MIME", section);
+    }
+}
+
+// Function to parse one body. section and is_message work as in mime_parse's parse_entity: a
+// message (the whole message or a message/rfc822 body) that is not a multipart is numbered section.1
+static void parse_body(parser_t *ps, body_structure_t *structure, const char *section, int is_message, int depth) {
+    skip_spaces(ps);
+    if (depth > MIME_MAX_DEPTH || !peek(ps, '(')) {
+        ps->failed = 1;
+        return;
+    }
+    ps->p++;
+
+    int index = add_part(structure);
+    body_part_t part;
+    memset(&part, 0, sizeof(part));
+    part.depth = depth;
+    header_section(part.headers, section, is_message);
+
+    skip_spaces(ps);
+    if (peek(ps, '(')) {
+        // multipart: the parts, then the subtype
+        snprintf(part.section, MIME_SECTION_SIZE, "%s", section);
+        int number = 1;
+        while (peek(ps, '(')) {
+            char child[MIME_SECTION_SIZE];
+            if (!child_section(child, part.section, number++)) {
+                ps->failed = 1;
+                break;
+            }
+            parse_body(ps, structure, child, 0, depth + 1);
+            skip_spaces(ps);
+        }
+        char subtype[BODY_FIELD_SIZE / 2] = "";
+        read_string(ps, subtype, sizeof(subtype));
+        snprintf(part.type, BODY_FIELD_SIZE, "multipart/%s", subtype);
+        snprintf(part.encoding, BODY_FIELD_SIZE, "7bit");
+    } else {
+        char type[BODY_FIELD_SIZE / 2] = "", subtype[BODY_FIELD_SIZE / 2] = "", size[32] = "";
+        read_string(ps, type, sizeof(type));
+        read_string(ps, subtype, sizeof(subtype));
+        snprintf(part.type, BODY_FIELD_SIZE, "%s/%s", type, subtype);
+
+        // Parameters are name value pairs, or NIL
+        skip_spaces(ps);
+        if (peek(ps, '(')) {
+            ps->p++;
+            while (!ps->failed) {
+                skip_spaces(ps);
+                if (peek(ps, ')')) {
+                    ps->p++;
+                    break;
+                }
+                char name[BODY_FIELD_SIZE] = "", value[BODY_FIELD_SIZE] = "";
+                read_string(ps, name, sizeof(name));
+                read_string(ps, value, sizeof(value));
+                if (strcasecmp(name, "charset") == 0) {
+                    snprintf(part.charset, BODY_FIELD_SIZE, "%s", value);
+                }
+            }
+        } else {
+            read_string(ps, NULL, 0);
+        }
+
+        read_string(ps, NULL, 0);   // body id
+        read_string(ps, NULL, 0);   // body description
+        read_string(ps, part.encoding, sizeof(part.encoding));
+        read_string(ps, size, sizeof(size));
+        part.size = strtoul(size, NULL, 10);
+
+        if (is_message) {
+            if (!child_section(part.section, section, 1)) {
+                ps->failed = 1;
+            }
+        } else {
+            snprintf(part.section, MIME_SECTION_SIZE, "%s", section);
+        }
+        lower(part.type);
+        if (!is_message && strcmp(part.type, "message/rfc822") == 0) {
+            // The envelope, then the structure of the message inside
+            skip_value(ps, 0);
+            parse_body(ps, structure, part.section, 1, depth + 1);
+        }
+    }
+    if (!ps->failed) {
+        skip_rest(ps);
+    }
+
+    lower(part.type);
+    lower(part.encoding);
+    if (part.encoding[0] == '\0') {
+        snprintf(part.encoding, BODY_FIELD_SIZE, "7bit");
+    }
+    structure->parts[index] = part;
+}
+
+int bodystructure_next_fetch(const char **p, const char *end, unsigned long *number, unsigned long *uid,
+                             body_structure_t *structure) {
+    while (*p < end) {
+        const char *line = *p;
+        const char *line_end = memchr(line, '\n', end - line);
+        line_end = line_end ? line_end + 1 : end;
+
+        char *after;
+        unsigned long n = 0;
+        if (end - line > 2 && line[0] == '*' && line[1] == ' ' && isdigit((unsigned char)line[2])) {
+            n = strtoul(line + 2, &after, 10);
+        }
+        if (n == 0 || end - after < 8 || strncasecmp(after, " FETCH (", 8) != 0) {
+            *p = line_end;
+            continue;
+        }
+
+        *number = n;
+        *uid = 0;
+        structure->count = 0;
+        int found = 0;
+        parser_t ps = {after + 8, end, 0};
+
+        // The message data items, each a name and a value
+        while (!ps.failed) {
+            skip_spaces(&ps);
+            if (peek(&ps, ')')) {
+                ps.p++;
+                break;
+            }
+            char name[BODY_FIELD_SIZE];
+            read_string(&ps, name, sizeof(name));
+            if (ps.failed) {
+                break;
+            }
+            if (strcasecmp(name, "UID") == 0) {
+                char value[32] = "";
+                read_string(&ps, value, sizeof(value));
+                *uid = strtoul(value, NULL, 10);
+            } else if (strcasecmp(name, "BODYSTRUCTURE") == 0) {
+                parse_body(&ps, structure, "", 1, 0);
+                found = 1;
+            } else {
+                skip_value(&ps, 0);
+            }
+        }
+
+        if (ps.failed || !found) {
+            // Carry on from the next line, there is nothing to trust in this one
+            structure->count = 0;
+            *p = line_end;
+            return 1;
+        }
+        // On to the line after the closing parenthesis
+        const char *next = memchr(ps.p, '\n', end - ps.p);
+        *p = next ? next + 1 : end;
+        return 1;
+    }
+    return 0;
+}
+
+void bodystructure_free(body_structure_t *structure) {
+    free(structure->parts);
+    structure->parts = NULL;
+    structure->count = structure->size = 0;
+}
+
+// The same choice as mime_text_part: text/plain in UTF-8, in an encoding that is readable as it is
+const body_part_t *bodystructure_text_part(const body_structure_t *structure, int decoding) {
+    for (size_t i = 0; i < structure->count; i++) {
+        const body_part_t *part = &structure->parts[i];
+        if (strcmp(part->type, "text/plain") != 0 || strcasecmp(part->charset, "UTF-8") != 0) {
+            continue;
+        }
+        if (strcmp(part->encoding, "quoted-printable") == 0 || strcmp(part->encoding, "7bit") == 0 ||
+            strcmp(part->encoding, "8bit") == 0 || (decoding && strcmp(part->encoding, "base64") == 0)) {
+            return part;
+        }
+    }
+    return NULL;
+}
+
+const body_part_t *bodystructure_find_section(const body_structure_t *structure, const char *section) {
+    for (size_t i = 0; i < structure->count; i++) {
+        if (strcmp(structure->parts[i].section, section) == 0) {
+            return &structure->parts[i];
+        }
+    }
+    return NULL;
+}
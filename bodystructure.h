@@ -0,0 +1,44 @@
+#ifndef BODYSTRUCTURE_H
+#define BODYSTRUCTURE_H
+
+#include <stddef.h>
+
+#include "mime.h"
+
+// Longest type, charset or encoding kept for a part, longer values are cut
+#define BODY_FIELD_SIZE 64
+
+// One part of a BODYSTRUCTURE, in the same order and with the same section numbers as mime_parse
+typedef struct body_part {
+    int depth;
+    char section[MIME_SECTION_SIZE];        // IMAP section number, "" for a multipart message
+    char headers[MIME_SECTION_SIZE + 8];    // section of its header: "HEADER", "2.HEADER" or "1.2.MIME"
+    char type[BODY_FIELD_SIZE];             // media type in lower case, e.g. "text/plain"
+    char charset[BODY_FIELD_SIZE];          // "" if there is none
+    char encoding[BODY_FIELD_SIZE];         // Content-Transfer-Encoding in lower case
+    unsigned long size;                     // body octets, 0 for a multipart
+} body_part_t;
+
+// The parts of one message as the server describes them
+typedef struct body_structure {
+    body_part_t *parts;
+    size_t count;
+    size_t size;
+} body_structure_t;
+
+// Function to parse the next "* n FETCH (...)" response in [*p, end), which may hold literals as
+// they were sent, and move *p past it. Fills in the message number, its UID (0 if not sent) and
+// its structure (no parts if the BODYSTRUCTURE is missing or malformed)
+// Returns 0 when there are no FETCH responses left
+int bodystructure_next_fetch(const char **p, const char *end, unsigned long *number, unsigned long *uid,
+                             body_structure_t *structure);
+
+void bodystructure_free(body_structure_t *structure);
+
+// Function to find the part mime prints, chosen like mime_text_part, NULL if none
+const body_part_t *bodystructure_text_part(const body_structure_t *structure, int decoding);
+
+// Function to find the part with an IMAP section number such as "1.2", NULL if there is none
+const body_part_t *bodystructure_find_section(const body_structure_t *structure, const char *section);
+
+#endif
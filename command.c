@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "command.h"
+#include "stats.h"
+
+/***
+ * Tagged commands kept in flight together. IMAP lets a client send commands without waiting for
+ * the responses to the ones before, and the server answers them in order. So a connection can be
+ * set up in one round trip: LOGIN, SELECT and COMPRESS are sent together and each waits for its
+ * own tagged line afterwards. Queued commands are written together when the first of them is
+ * waited for, one segment (and one TLS record) rather than a write per command that Nagle's
+ * algorithm would hold back until the first is acknowledged.
+ *
+ * Untagged responses carry no tag, they belong to the command the server is working on, which is
+ * the oldest one that has not completed yet. Lines with a tag nobody is waiting for are passed
+ * over. Every command after the greeting goes through the queue, FETCH included: a FETCH is
+ * streamed with command_stream or command_fetch, its untagged lines handed over as they are read
+ * rather than buffered, and the FETCHes for a sequence set are pipelined like the setup commands.
+*/
+
+void command_queue_init(command_queue_t *queue, imap_reader_t *reader, send_fn_t send_fn, void *sink, int greeting) {
+    queue->reader = reader;
+    queue->send_fn = send_fn;
+    queue->sink = sink;
+    queue->next_tag = 1;
+    buffer_init(&queue->out);
+    queue->count = 0;
+    queue->greeting_pending = greeting;
+    queue->greeting[0] = '\0';
+}
+
+imap_command_t *command_send(command_queue_t *queue, const char *format, ...) {
+    // Only so many are kept in flight, the oldest has to complete before another is sent
+    while (queue->count == MAX_IN_FLIGHT) {
+        command_wait(queue, queue->in_flight[0]);
+    }
+
+    imap_command_t *command = malloc(sizeof(imap_command_t));
+    if (command == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    command_tag(command->tag, sizeof(command->tag), queue->next_tag++);
+    command->status = COMMAND_PENDING;
+    buffer_init(&command->response);
+    buffer_append(&command->response, "", 0);
+
+    // "<tag> <command>\r\n"
+    byte_buffer_t *out = &queue->out;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    buffer_reserve(out, strlen(command->tag) + length + 3);
+    out->len += sprintf(out->data + out->len, "%s ", command->tag);
+    va_start(args, format);
+    out->len += vsprintf(out->data + out->len, format, args);
+    va_end(args);
+    buffer_append(out, "\r\n", 2);
+
+    queue->in_flight[queue->count++] = command;
+    return command;
+}
+
+void command_tag(char *tag, size_t size, unsigned int number) {
+    snprintf(tag, size, "C%03u", number);
+}
+
+// Function to find the command in flight with the tag that starts line, -1 if there is none
+static int find_tagged(const command_queue_t *queue, const char *line, size_t len) {
+    for (size_t i = 0; i < queue->count; i++) {
+        if (parse_tagged_status(line, len, queue->in_flight[i]->tag) >= 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void command_collect(imap_reader_t *reader, byte_buffer_t *line, void *ctx) {
+    byte_buffer_t discard;
+    buffer_init(&discard);
+    byte_buffer_t *out = ctx != NULL ? ctx : &discard;
+
+    buffer_append(out, line->data, line->len);
+    size_t length;
+    while (parse_literal_length(line->data, line->len, &length)) {
+        reader_read_literal(reader, length, out);
+        line->len = 0;
+        reader_read_line(reader, line);
+        buffer_append(out, line->data, line->len);
+    }
+    buffer_free(&discard);
+}
+
+// Function to send the queued commands and read responses until command has completed. Untagged
+// lines for command go to on_response, or are buffered in its response if that is NULL
+static int read_until(command_queue_t *queue, imap_command_t *command, response_fn_t on_response, void *ctx) {
+    if (queue->out.len > 0) {
+        queue->send_fn(queue->sink, queue->out.data);
+        buffer_free(&queue->out);
+    }
+
+    byte_buffer_t line;
+    buffer_init(&line);
+
+    while (command->status == COMMAND_PENDING) {
+        line.len = 0;
+        reader_read_line(queue->reader, &line);
+        stats_end(STATS_FIRST_BYTE);
+
+        if (queue->greeting_pending) {
+            snprintf(queue->greeting, sizeof(queue->greeting), "%s", line.data);
+            queue->greeting_pending = 0;
+            continue;
+        }
+
+        int index = find_tagged(queue, line.data, line.len);
+        if (index < 0) {
+            // Untagged data (or a continuation request) goes to the oldest command, the
+            // completion of a command this queue did not send is passed over
+            int untagged = line.data[0] == '*' || line.data[0] == '+';
+            if (untagged && queue->count > 0 && queue->in_flight[0] == command && on_response != NULL) {
+                on_response(queue->reader, &line, ctx);
+            } else {
+                command_collect(queue->reader, &line, untagged && queue->count > 0 ? &queue->in_flight[0]->response : NULL);
+            }
+            continue;
+        }
+
+        imap_command_t *done = queue->in_flight[index];
+        done->status = parse_tagged_status(line.data, line.len, done->tag);
+        buffer_append(&done->response, line.data, line.len);
+        memmove(&queue->in_flight[index], &queue->in_flight[index + 1],
+                (queue->count - index - 1) * sizeof(imap_command_t *));
+        queue->count--;
+    }
+
+    buffer_free(&line);
+    return command->status;
+}
+
+int command_wait(command_queue_t *queue, imap_command_t *command) {
+    return read_until(queue, command, NULL, NULL);
+}
+
+int command_stream(command_queue_t *queue, imap_command_t *command, response_fn_t on_response, void *ctx) {
+    stats_begin(STATS_FETCH);
+    stats_begin(STATS_FIRST_BYTE);
+    int status = read_until(queue, command, on_response, ctx);
+    stats_end(STATS_FETCH);
+    return status;
+}
+
+// State of a command_fetch
+typedef struct fetch_literals {
+    literal_fn_t on_literal;
+    void *ctx;
+    int count;
+} fetch_literals_t;
+
+// response_fn_t handing each literal of a line to the FETCH's literal_fn_t, a line may carry
+// several, each one followed by the rest of the line
+static void pass_literals(imap_reader_t *reader, byte_buffer_t *line, void *ctx) {
+    fetch_literals_t *fetch = ctx;
+    size_t length;
+    while (parse_literal_length(line->data, line->len, &length)) {
+        fetch->on_literal(reader, line->data, length, fetch->ctx);
+        fetch->count++;
+        line->len = 0;
+        reader_read_line(reader, line);
+    }
+}
+
+int command_fetch(command_queue_t *queue, imap_command_t *command, literal_fn_t on_literal, void *ctx, int *count) {
+    fetch_literals_t fetch = {on_literal, ctx, 0};
+    int status = command_stream(queue, command, pass_literals, &fetch);
+    *count = fetch.count;
+    return status;
+}
+
+void command_free(imap_command_t *command) {
+    buffer_free(&command->response);
+    free(command);
+}
@@ -0,0 +1,71 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include "imap_client.h"
+
+// Most commands a queue keeps in flight at once
+#define MAX_IN_FLIGHT 32
+
+// Status of a command whose tagged line has not arrived yet
+#define COMMAND_PENDING -1
+
+// One tagged command and what the server has sent back for it
+typedef struct imap_command {
+    char tag[16];
+    int status;             // COMMAND_PENDING, then IMAP_OK, IMAP_NO or IMAP_BAD
+    byte_buffer_t response; // untagged lines routed to it (with their literals), then the tagged line
+} imap_command_t;
+
+// Commands sent ahead of their responses over one connection. Each gets its own tag, and responses
+// are routed back as they arrive: a tagged line to the command with that tag, an untagged line to
+// the oldest command still in flight, the one the server is answering (command_queue_t is declared
+// in imap_client.h, whose commands take a queue)
+struct command_queue {
+    imap_reader_t *reader;
+    send_fn_t send_fn;
+    void *sink;
+    unsigned int next_tag;
+    byte_buffer_t out;      // commands not sent yet, they go out in one write when one is waited for
+    imap_command_t *in_flight[MAX_IN_FLIGHT]; // oldest first
+    size_t count;
+    int greeting_pending;   // the server greeting has not been read yet
+    char greeting[BUFFER_SIZE]; // its first line, cut if longer
+};
+
+// Function called by command_stream with each untagged line of the command's response. If the
+// line announces a literal the function reads it and the rest of the line into line, command_collect
+// does that when nothing in the literal is needed
+typedef void (*response_fn_t)(imap_reader_t *reader, byte_buffer_t *line, void *ctx);
+
+// Set up a queue over a connection. With greeting set the first line read is kept as the
+// greeting, so commands can be sent before the server has sent it
+void command_queue_init(command_queue_t *queue, imap_reader_t *reader, send_fn_t send_fn, void *sink, int greeting);
+
+// Queue a command, format is everything after the tag without the CRLF. Returns the command,
+// which the caller waits for with command_wait and frees with command_free
+imap_command_t *command_send(command_queue_t *queue, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Send the queued commands and read responses until command has completed, routing what belongs
+// to the commands before it. Returns its status
+int command_wait(command_queue_t *queue, imap_command_t *command);
+
+// Like command_wait, but command's own untagged lines are handed to on_response as they arrive
+// instead of being buffered, so large responses are never held in memory. With --stats the wait
+// is timed, to the first line and to the completion
+int command_stream(command_queue_t *queue, imap_command_t *command, response_fn_t on_response, void *ctx);
+
+// command_stream for a FETCH: every literal of its response is handed to on_literal and count is
+// set to the number of literals seen
+int command_fetch(command_queue_t *queue, imap_command_t *command, literal_fn_t on_literal, void *ctx, int *count);
+
+// response_fn_t appending the line and its literals to the byte_buffer_t ctx, or skipping them if
+// ctx is NULL
+void command_collect(imap_reader_t *reader, byte_buffer_t *line, void *ctx);
+
+// Tag the queue gives its number'th command (from 1), for responses to commands sent elsewhere
+// that are read back through a new queue
+void command_tag(char *tag, size_t size, unsigned int number);
+
+void command_free(imap_command_t *command);
+
+#endif
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "compress.h"
+
+/***
+ * IMAP COMPRESS=DEFLATE (RFC 4978). Once the server has said OK to COMPRESS DEFLATE, both
+ * directions are a raw deflate stream, flushed at the end of every command and response. The
+ * stream sits between the connection and the reader, so every command reads and writes through
+ * it without knowing.
+*/
+
+// Chunk of compressed output written to the connection at a time
+#define DEFLATE_CHUNK_SIZE 4096
+
+// Function to set up the deflate streams for both directions
+compress_stream_t *compress_start(const transport_t *under) {
+    compress_stream_t *stream = calloc(1, sizeof(compress_stream_t));
+    if (stream == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    stream->under = *under;
+
+    // RFC 4978 uses raw deflate, without the zlib header and checksum
+    if (inflateInit2(&stream->inflater, -15) != Z_OK ||
+        deflateInit2(&stream->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Failed to set up compression\n");
+        exit(5);
+    }
+    return stream;
+}
+
+void compress_free(compress_stream_t *stream) {
+    if (stream == NULL) {
+        return;
+    }
+    inflateEnd(&stream->inflater);
+    deflateEnd(&stream->deflater);
+    free(stream);
+}
+
+// Function to hand the stream compressed bytes the reader took in with the tagged OK
+void compress_feed(compress_stream_t *stream, const char *data, size_t len) {
+    memcpy(stream->in, data, len);
+    stream->inflater.next_in = (Bytef *)stream->in;
+    stream->inflater.avail_in = len;
+    stream->counts.wire_in += len;
+}
+
+// Function to read decompressed bytes. The connection is only read when nothing is left to inflate
+static int compress_read(transport_t *transport, char *buf, int len) {
+    compress_stream_t *stream = transport->ctx;
+    z_stream *inflater = &stream->inflater;
+    inflater->next_out = (Bytef *)buf;
+    inflater->avail_out = len;
+
+    while (inflater->avail_out == (uInt)len) {
+        if (inflater->avail_in == 0) {
+            int numBytes = stream->under.read(&stream->under, stream->in, sizeof(stream->in));
+            if (numBytes <= 0) {
+                return numBytes;
+            }
+            inflater->next_in = (Bytef *)stream->in;
+            inflater->avail_in = numBytes;
+            stream->counts.wire_in += numBytes;
+        }
+
+        int result = inflate(inflater, Z_SYNC_FLUSH);
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            fprintf(stderr, "Compressed data from the server is corrupt\n");
+            // Not EAGAIN or EINTR, so the caller does not read again
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    int count = len - inflater->avail_out;
+    stream->counts.raw_in += count;
+    return count;
+}
+
+// Function to compress bytes and write them, flushed so the server sees all of them now.
+// Returns len once everything is written, or what the connection underneath returned on error
+static int compress_write(transport_t *transport, const char *buf, int len) {
+    compress_stream_t *stream = transport->ctx;
+    z_stream *deflater = &stream->deflater;
+    deflater->next_in = (Bytef *)buf;
+    deflater->avail_in = len;
+    stream->counts.raw_out += len;
+
+    char out[DEFLATE_CHUNK_SIZE];
+    do {
+        deflater->next_out = (Bytef *)out;
+        deflater->avail_out = sizeof(out);
+        deflate(deflater, Z_SYNC_FLUSH);
+
+        int count = sizeof(out) - deflater->avail_out;
+        int written = 0;
+        while (written < count) {
+            int numBytes = stream->under.write(&stream->under, out + written, count - written);
+            if (numBytes <= 0) {
+                return numBytes;
+            }
+            written += numBytes;
+        }
+        stream->counts.wire_out += count;
+    } while (deflater->avail_out == 0);
+    return len;
+}
+
+void transport_compress(transport_t *transport, compress_stream_t *stream) {
+    transport->read = compress_read;
+    transport->write = compress_write;
+    transport->pending = NULL;
+    transport->ctx = stream;
+    // Inflated bytes only exist in memory
+    transport->fd = -1;
+}
+
+// Function to print the compression ratio of each direction
+void compress_report(const compress_stream_t *stream, const compress_counts_t *before, FILE *out) {
+    if (stream == NULL) {
+        fprintf(out, "Compression: not in use\n");
+        return;
+    }
+
+    compress_counts_t counts = stream->counts;
+    counts.wire_in -= before->wire_in;
+    counts.raw_in -= before->raw_in;
+    counts.wire_out -= before->wire_out;
+    counts.raw_out -= before->raw_out;
+
+    fprintf(out, "Compression: received %llu bytes as %llu (%.2fx), sent %llu bytes as %llu (%.2fx)\n",
+            counts.raw_in, counts.wire_in, counts.wire_in ? (double)counts.raw_in / counts.wire_in : 1.0,
+            counts.raw_out, counts.wire_out, counts.wire_out ? (double)counts.raw_out / counts.wire_out : 1.0);
+}
@@ -0,0 +1,43 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <zlib.h>
+
+#include "imap_client.h"
+#include "transport.h"
+
+// Byte counts of a compressed connection, wire is what crossed the network
+typedef struct compress_counts {
+    unsigned long long wire_in;
+    unsigned long long raw_in;
+    unsigned long long wire_out;
+    unsigned long long raw_out;
+} compress_counts_t;
+
+// COMPRESS=DEFLATE (RFC 4978) layered over a plain or TLS connection, used through the transport
+// set up by transport_compress
+typedef struct compress_stream {
+    transport_t under;      // the connection underneath
+    z_stream inflater;
+    z_stream deflater;
+    char in[READER_BUFFER_SIZE]; // compressed bytes read but not inflated yet
+    compress_counts_t counts;
+} compress_stream_t;
+
+// Start compressing over the connection, once the server has answered OK to COMPRESS DEFLATE
+compress_stream_t *compress_start(const transport_t *under);
+
+// Pass bytes read from the connection after the OK to the stream, len at most READER_BUFFER_SIZE
+void compress_feed(compress_stream_t *stream, const char *data, size_t len);
+
+// Set up a transport that inflates what it reads and deflates what it writes through stream
+void transport_compress(transport_t *transport, compress_stream_t *stream);
+
+// Release the stream's inflate and deflate state and the stream itself, NULL does nothing
+void compress_free(compress_stream_t *stream);
+
+// Print how much the connection was compressed since before was taken (NULL when not compressing)
+void compress_report(const compress_stream_t *stream, const compress_counts_t *before, FILE *out);
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "connect.h"
+#include "stats.h"
+
+/***
+ * Connecting to the server, plain or TLS. Every address of the server is raced as in RFC 8305
+ * (Happy Eyeballs): the addresses alternate between IPv6 and IPv4, and each attempt gets
+ * CONNECT_ATTEMPT_DELAY_MS before the next one starts alongside it. A dead AAAA record costs
+ * 250ms instead of the kernel's TCP timeout. getaddrinfo answers AAAA and A together, so the
+ * resolution delay of RFC 8305 does not apply.
+ *
+ * Lookups are cached for a minute, which the engine (many accounts on one server), --dir (several
+ * connections) and the daemon (workers inherit the cache of the daemon) all share.
+*/
+
+typedef struct dns_entry {
+    char *host;
+    char *port;
+    time_t expires;
+    server_address_t *addresses;
+    size_t count;
+} dns_entry_t;
+
+static dns_entry_t dns_cache[DNS_CACHE_ENTRIES];
+
+// Function to copy the result of getaddrinfo into addresses, interleaving the families
+static size_t order_addresses(const struct addrinfo *list, server_address_t *addresses) {
+    const struct addrinfo *first[CONNECT_MAX_ADDRESSES], *other[CONNECT_MAX_ADDRESSES];
+    size_t first_count = 0, other_count = 0;
+
+    for (const struct addrinfo *info = list; info != NULL; info = info->ai_next) {
+        if (info->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        if (info->ai_family == list->ai_family) {
+            if (first_count < CONNECT_MAX_ADDRESSES) {
+                first[first_count++] = info;
+            }
+        } else if (other_count < CONNECT_MAX_ADDRESSES) {
+            other[other_count++] = info;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; count < CONNECT_MAX_ADDRESSES && (i < first_count || i < other_count); i++) {
+        const struct addrinfo *pair[2] = {i < first_count ? first[i] : NULL, i < other_count ? other[i] : NULL};
+        for (int j = 0; j < 2 && count < CONNECT_MAX_ADDRESSES; j++) {
+            if (pair[j] == NULL) {
+                continue;
+            }
+            server_address_t *address = &addresses[count++];
+            address->family = pair[j]->ai_family;
+            address->protocol = pair[j]->ai_protocol;
+            address->length = pair[j]->ai_addrlen;
+            memcpy(&address->address, pair[j]->ai_addr, pair[j]->ai_addrlen);
+        }
+    }
+    return count;
+}
+
+// Function to find the cache entry for host and port, or the slot to replace with it
+static dns_entry_t *find_entry(const char *hostname, const char *port) {
+    dns_entry_t *slot = &dns_cache[0];
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+        dns_entry_t *entry = &dns_cache[i];
+        if (entry->host != NULL && strcmp(entry->host, hostname) == 0 && strcmp(entry->port, port) == 0) {
+            return entry;
+        }
+        // An empty slot, or else the one closest to expiring
+        if (slot->host != NULL && (entry->host == NULL || entry->expires < slot->expires)) {
+            slot = entry;
+        }
+    }
+    return slot;
+}
+
+size_t resolve_server(const char *hostname, const char *port, server_address_t **addresses) {
+    time_t now = time(NULL);
+    dns_entry_t *entry = find_entry(hostname, port);
+
+    if (entry->host == NULL || strcmp(entry->host, hostname) != 0 || strcmp(entry->port, port) != 0 ||
+        entry->expires <= now) {
+        struct addrinfo hints, *list;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(hostname, port, &hints, &list) != 0) {
+            *addresses = NULL;
+            return 0;
+        }
+
+        free(entry->host);
+        free(entry->port);
+        free(entry->addresses);
+        entry->host = strdup(hostname);
+        entry->port = strdup(port);
+        entry->addresses = malloc(CONNECT_MAX_ADDRESSES * sizeof(server_address_t));
+        if (entry->host == NULL || entry->port == NULL || entry->addresses == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(5);
+        }
+        entry->count = order_addresses(list, entry->addresses);
+        entry->expires = now + DNS_CACHE_SECONDS;
+        freeaddrinfo(list);
+    }
+
+    if (entry->count == 0) {
+        *addresses = NULL;
+        return 0;
+    }
+    *addresses = malloc(entry->count * sizeof(server_address_t));
+    if (*addresses == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    memcpy(*addresses, entry->addresses, entry->count * sizeof(server_address_t));
+    return entry->count;
+}
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Function to set how long a read or write on the socket may wait
+static void set_io_timeout(int sockfd, int timeout_ms) {
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+int connect_server(const char *hostname, const char *port, int connect_timeout_ms, int read_timeout_ms) {
+    server_address_t *addresses;
+    stats_begin(STATS_DNS);
+    size_t count = resolve_server(hostname, port, &addresses);
+    stats_end(STATS_DNS);
+    if (count == 0) {
+        fprintf(stderr, "ERROR, no such host\n");
+        exit(1);
+    }
+
+    // Attempts in progress
+    struct pollfd attempts[CONNECT_MAX_ADDRESSES];
+    int active = 0;
+    size_t next = 0;
+    int sockfd = -1;
+    long long deadline = now_ms() + connect_timeout_ms;
+    long long next_start = 0;
+    stats_begin(STATS_CONNECT);
+
+    while (sockfd < 0) {
+        long long now = now_ms();
+
+        // Start the next address when its turn comes, or straight away when nothing is in progress
+        if (next < count && (active == 0 || now >= next_start)) {
+            server_address_t *address = &addresses[next++];
+            next_start = now + CONNECT_ATTEMPT_DELAY_MS;
+            int fd = socket(address->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, address->protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (connect(fd, (struct sockaddr *)&address->address, address->length) == 0) {
+                sockfd = fd;
+            } else if (errno == EINPROGRESS) {
+                attempts[active].fd = fd;
+                attempts[active].events = POLLOUT;
+                attempts[active].revents = 0;
+                active++;
+            } else {
+                close(fd);
+            }
+            continue;
+        }
+
+        if (active == 0) {
+            fprintf(stderr, "ERROR connecting to %s\n", hostname);
+            exit(2);
+        }
+        if (now >= deadline) {
+            fprintf(stderr, "Timed out connecting to %s\n", hostname);
+            exit(2);
+        }
+
+        long long wait = deadline - now;
+        if (next < count && next_start - now < wait) {
+            wait = next_start - now;
+        }
+        if (poll(attempts, active, wait) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(2);
+        }
+
+        // The first attempt to connect wins, failed ones are dropped
+        for (int i = 0; i < active && sockfd < 0; i++) {
+            if (attempts[i].revents == 0) {
+                continue;
+            }
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error == 0) {
+                sockfd = attempts[i].fd;
+                attempts[i] = attempts[--active];
+            } else {
+                close(attempts[i].fd);
+                attempts[i--] = attempts[--active];
+                next_start = now_ms();
+            }
+        }
+    }
+
+    stats_end(STATS_CONNECT);
+
+    // The others lost the race
+    for (int i = 0; i < active; i++) {
+        close(attempts[i].fd);
+    }
+    free(addresses);
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+    if (read_timeout_ms > 0) {
+        set_io_timeout(sockfd, read_timeout_ms);
+    }
+    return sockfd;
+}
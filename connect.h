@@ -0,0 +1,41 @@
+#ifndef CONNECT_H
+#define CONNECT_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+// Defaults for --connect-timeout and --timeout
+#define CONNECT_TIMEOUT_MS 10000
+#define READ_TIMEOUT_MS 60000
+
+// Time before the next address is tried while earlier attempts are still going (RFC 8305)
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+// Most addresses of one server that are tried
+#define CONNECT_MAX_ADDRESSES 16
+
+// Lookups kept, and for how long
+#define DNS_CACHE_ENTRIES 16
+#define DNS_CACHE_SECONDS 60
+
+// One address of a server, copied out of getaddrinfo so it can be cached and handed out
+typedef struct server_address {
+    int family;
+    int protocol;
+    socklen_t length;
+    struct sockaddr_storage address;
+} server_address_t;
+
+// Function to look up a server. The addresses are in the order to try them, alternating between
+// IPv6 and IPv4 starting with the family getaddrinfo prefers. Answers are cached in the process
+// for DNS_CACHE_SECONDS. Returns how many there are (0 if the name does not resolve) and stores
+// a copy in *addresses, which the caller frees
+size_t resolve_server(const char *hostname, const char *port, server_address_t **addresses);
+
+// Function to connect to a server, racing its addresses: a new attempt starts every
+// CONNECT_ATTEMPT_DELAY_MS (or as soon as one fails) and the first to connect wins. Gives up
+// after connect_timeout_ms in all. Reads and writes on the socket returned time out after
+// read_timeout_ms (0 for no limit). Exits if the server cannot be reached
+int connect_server(const char *hostname, const char *port, int connect_timeout_ms, int read_timeout_ms);
+
+#endif
@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "daemon.h"
+#include "session.h"
+#include "tls.h"
+#include "utils.h"
+#include "connect.h"
+#include "stats.h"
+
+/***
+ * Session daemon. fetchmail --daemon listens on a Unix socket. Each pooled session lives in its
+ * own worker process, keyed by (server, user, password, folder, TLS), so a failing command can
+ * exit() as usual without taking the daemon down.
+ *
+ * A client sends one SOCK_SEQPACKET message: the key, then its arguments, each NUL terminated,
+ * with its stdout and stderr attached (SCM_RIGHTS). The worker writes the output straight into
+ * those descriptors and the daemon replies with a single byte, the exit status. A client is polled
+ * like the workers until its request arrives, so one that connects and sends nothing holds up no one.
+*/
+
+typedef struct worker {
+    pid_t pid;
+    int ctrl_fd;    // socketpair to the worker process
+    int client_fd;  // client waiting for this worker, -1 when idle
+    char *key;
+} worker_t;
+
+static worker_t workers[DAEMON_MAX_WORKERS];
+static int num_workers = 0;
+
+// A connected client whose request has not arrived yet
+typedef struct pending_client {
+    int fd;
+    long long deadline;     // when it is dropped, in ms
+} pending_client_t;
+
+static pending_client_t pending[DAEMON_MAX_PENDING];
+static int num_pending = 0;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+// Function to pick the socket path, in the runtime directory if there is one, otherwise in a
+// directory under /tmp that only this user can enter
+int default_socket_path(char *path, size_t size) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+        snprintf(path, size, "%s/fetchmail.sock", runtime_dir);
+        return 0;
+    }
+
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/fetchmail-%d", (int)getuid());
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+
+    // Anyone can create it first in /tmp, so it is only used if it is ours and closed to others
+    struct stat st;
+    if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        fprintf(stderr, "%s is not a private directory, use --socket\n", dir);
+        return -1;
+    }
+    snprintf(path, size, "%s/fetchmail.sock", dir);
+    return 0;
+}
+
+// Function to check that the process at the other end of a Unix socket runs as this user
+static int peer_is_user(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+// Send a request with the two output descriptors attached
+static int send_request(int fd, const char *payload, size_t len, const int fds[2]) {
+    struct iovec iov = {(void *)payload, len};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+
+    return sendmsg(fd, &msg, 0) == (ssize_t)len ? 0 : -1;
+}
+
+// Receive a request and its two output descriptors, returns the payload length or -1
+static ssize_t recv_request(int fd, char *payload, size_t size, int fds[2]) {
+    struct iovec iov = {payload, size - 1};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (len <= 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)) || (msg.msg_flags & MSG_TRUNC)) {
+        if (len > 0 && cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+            // Close whatever descriptors did arrive with a malformed request
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                close(((int *)CMSG_DATA(cmsg))[i]);
+            }
+        }
+        return -1;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    payload[len] = '\0';
+    return len;
+}
+
+// Send the exit status to a waiting client and hang up
+static void reply_status(int client_fd, int status) {
+    unsigned char byte = status;
+    if (send(client_fd, &byte, 1, MSG_NOSIGNAL) != 1) {
+        perror("daemon: failed to reply to client");
+    }
+    close(client_fd);
+}
+
+
+
+// Worker process: open the session on the first request, then run every request on it
+static void worker_main(int ctrl_fd) {
+    char payload[DAEMON_MAX_REQUEST];
+    session_t session;
+    int opened = 0;
+    int null_fd = open("/dev/null", O_RDWR);
+
+    while (1) {
+        struct pollfd pfd = {ctrl_fd, POLLIN, 0};
+        if (poll(&pfd, 1, opened ? DAEMON_IDLE_TIMEOUT_MS : -1) <= 0) {
+            break; // Idle for too long
+        }
+
+        int fds[2];
+        ssize_t len = recv_request(ctrl_fd, payload, sizeof(payload), fds);
+        if (len < 0) {
+            break; // The daemon closed the pool
+        }
+
+        // Output goes straight to the client's stdout and stderr
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        // Skip the key, the arguments follow as NUL terminated strings
+        char *argv[DAEMON_MAX_REQUEST / 2];
+        int argc = 0;
+        char *arg = payload + strlen(payload) + 1;
+        while (arg < payload + len && argc < (int)(sizeof(argv) / sizeof(argv[0])) - 1) {
+            argv[argc++] = arg;
+            arg += strlen(arg) + 1;
+        }
+        argv[argc] = NULL;
+
+        fetch_mail_t fetch_mail = {0};
+        parse_args(argc, argv, &fetch_mail);
+        const command_plan_t *plan = plan_command(fetch_mail.command);
+        if (plan == NULL) {
+            fprintf(stderr, "Unknown command: %s\n", fetch_mail.command);
+            exit(1);
+        }
+        custom_plan_t custom;
+        plan = plan_options(plan, &fetch_mail, &custom);
+
+        // A request on an open session only times its own commands
+        if (fetch_mail.stats) {
+            stats_start(fetch_mail.command, fetch_mail.stats_file, opened ? session.sockfd : -1);
+        }
+        if (!opened) {
+            open_session(&session, &fetch_mail);
+            opened = 1;
+        }
+        run_command(&session, &fetch_mail, plan);
+
+        // Detach from the client before reporting, so its pipes see end of file
+        fflush(stdout);
+        fflush(stderr);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+
+        unsigned char status = 0;
+        if (send(ctrl_fd, &status, 1, MSG_NOSIGNAL) != 1) {
+            break;
+        }
+    }
+
+    if (opened) {
+        close_session(&session);
+    }
+    exit(0);
+}
+
+// Function to look up the server a key names before a worker is forked for it. The worker inherits
+// the DNS cache, so only the first session with a server waits for the lookup
+static void resolve_key(const char *key) {
+    char fields[8][DAEMON_MAX_REQUEST / 8];
+    int count = 0;
+    const char *start = key;
+    while (count < 8) {
+        size_t len = strcspn(start, "\n");
+        snprintf(fields[count++], sizeof(fields[0]), "%.*s", (int)len, start);
+        if (start[len] == '\0') {
+            break;
+        }
+        start += len + 1;
+    }
+    if (count < 6) {
+        return;
+    }
+
+    // server, port ("" for the default of the protocol), user, password, folder, TLS
+    const char *port = fields[1][0] ? fields[1] : (strcmp(fields[5], "1") == 0 ? "993" : "143");
+    server_address_t *addresses;
+    if (resolve_server(fields[0], port, &addresses) > 0) {
+        free(addresses);
+    }
+}
+
+// Start a worker process for a new session. fds are the client's output descriptors, which the
+// worker gets through its control socket and must not inherit
+static worker_t *spawn_worker(int listen_fd, int client_fd, const int fds[2], const char *key) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("daemon: socketpair");
+        return NULL;
+    }
+
+    resolve_key(key);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("daemon: fork");
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+
+    if (pid == 0) {
+        // The worker keeps nothing of the daemon but its own control socket
+        close(listen_fd);
+        close(client_fd);
+        close(fds[0]);
+        close(fds[1]);
+        close(sv[0]);
+        for (int i = 0; i < num_workers; i++) {
+            close(workers[i].ctrl_fd);
+            if (workers[i].client_fd >= 0) {
+                close(workers[i].client_fd);
+            }
+        }
+        for (int i = 0; i < num_pending; i++) {
+            close(pending[i].fd);
+        }
+        signal(SIGPIPE, handle_sigpipe);
+        worker_main(sv[1]);
+        exit(0);
+    }
+
+    close(sv[1]);
+    worker_t *worker = &workers[num_workers++];
+    worker->pid = pid;
+    worker->ctrl_fd = sv[0];
+    worker->client_fd = -1;
+    worker->key = strdup(key);
+    return worker;
+}
+
+// Remove a worker from the pool, waiting for its process and returning its exit status
+static int remove_worker(int index) {
+    worker_t *worker = &workers[index];
+    int wstatus = 0;
+    int status = 5;
+
+    close(worker->ctrl_fd);
+    if (waitpid(worker->pid, &wstatus, 0) == worker->pid && WIFEXITED(wstatus)) {
+        status = WEXITSTATUS(wstatus);
+    }
+    free(worker->key);
+
+    workers[index] = workers[--num_workers];
+    return status;
+}
+
+// Find an idle worker for key, starting one (and evicting an idle one if the pool is full)
+static worker_t *find_worker(int listen_fd, int client_fd, const int fds[2], const char *key) {
+    int idle = -1;
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i].client_fd < 0) {
+            if (strcmp(workers[i].key, key) == 0) {
+                return &workers[i];
+            }
+            idle = i;
+        }
+    }
+
+    if (num_workers == DAEMON_MAX_WORKERS) {
+        if (idle < 0) {
+            return NULL;
+        }
+        remove_worker(idle);
+    }
+    return spawn_worker(listen_fd, client_fd, fds, key);
+}
+
+// Accept a newly connected client, its request is read once it arrives (read_client)
+static void accept_client(int listen_fd) {
+    int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client_fd < 0) {
+        return;
+    }
+
+    // The socket's mode keeps other users out, this also holds if it was loosened
+    if (!peer_is_user(client_fd)) {
+        close(client_fd);
+        return;
+    }
+
+    // Too many clients still to send anything, this one runs its command itself
+    if (num_pending == DAEMON_MAX_PENDING) {
+        reply_status(client_fd, DAEMON_STATUS_RETRY);
+        return;
+    }
+    pending[num_pending].fd = client_fd;
+    pending[num_pending].deadline = now_ms() + DAEMON_REQUEST_TIMEOUT_MS;
+    num_pending++;
+}
+
+// Take the request of a pending client and pass it to a worker. The client stays pending if its
+// request has not arrived yet
+static void read_client(int listen_fd, int index) {
+    int client_fd = pending[index].fd;
+    char payload[DAEMON_MAX_REQUEST];
+    int fds[2];
+
+    errno = 0;
+    ssize_t len = recv_request(client_fd, payload, sizeof(payload), fds);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    pending[index] = pending[--num_pending];
+    if (len < 0) {
+        close(client_fd);
+        return;
+    }
+
+    worker_t *worker = find_worker(listen_fd, client_fd, fds, payload);
+    if (worker == NULL || send_request(worker->ctrl_fd, payload, len, fds) < 0) {
+        reply_status(client_fd, DAEMON_STATUS_RETRY);
+    } else {
+        worker->client_fd = client_fd;
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Function to run the daemon
+int run_daemon(const char *socket_path) {
+    char default_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    if (socket_path == NULL) {
+        if (default_socket_path(default_path, sizeof(default_path)) < 0) {
+            return 1;
+        }
+        socket_path = default_path;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // Only this user may talk to the daemon, it holds their logged in sessions
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    mode_t old_mask = umask(077);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+        perror("daemon: cannot listen");
+        return 2;
+    }
+    umask(old_mask);
+
+    // A client going away must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers inherit the SSL context, so the CA file is only parsed once
+    tls_context(NULL);
+    fprintf(stderr, "fetchmail daemon listening on %s\n", socket_path);
+
+    while (1) {
+        struct pollfd pfds[DAEMON_MAX_WORKERS + DAEMON_MAX_PENDING + 1];
+        int count = num_workers;
+        int waiting = num_pending;
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        for (int i = 0; i < count; i++) {
+            pfds[i + 1].fd = workers[i].ctrl_fd;
+            pfds[i + 1].events = POLLIN;
+        }
+
+        // Wake up in time to drop the first pending client that has not sent its request
+        int timeout = -1;
+        long long now = now_ms();
+        for (int i = 0; i < waiting; i++) {
+            pfds[count + 1 + i].fd = pending[i].fd;
+            pfds[count + 1 + i].events = POLLIN;
+            long long left = pending[i].deadline > now ? pending[i].deadline - now : 0;
+            if (timeout < 0 || left < timeout) {
+                timeout = left;
+            }
+        }
+
+        if (poll(pfds, count + waiting + 1, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("daemon: poll");
+            return 2;
+        }
+
+        // Workers report back first, walking backwards as finished ones are removed
+        for (int i = count - 1; i >= 0; i--) {
+            if (!(pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            unsigned char status;
+            if (recv(workers[i].ctrl_fd, &status, 1, 0) == 1) {
+                if (workers[i].client_fd >= 0) {
+                    reply_status(workers[i].client_fd, status);
+                    workers[i].client_fd = -1;
+                }
+            } else {
+                // The worker exited: a failed command (its exit status goes to the client) or idle
+                int client_fd = workers[i].client_fd;
+                int exit_status = remove_worker(i);
+                if (client_fd >= 0) {
+                    reply_status(client_fd, exit_status);
+                }
+            }
+        }
+
+        // Pending clients, backwards as taken ones are removed. They are only ever appended
+        // below, so the indices still match pfds
+        now = now_ms();
+        for (int i = waiting - 1; i >= 0; i--) {
+            if (pfds[count + 1 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_client(listen_fd, i);
+            } else if (pending[i].deadline <= now) {
+                close(pending[i].fd);
+                pending[i] = pending[--num_pending];
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            accept_client(listen_fd);
+        }
+    }
+}
+
+// Function to run a command through the daemon
+void daemon_request(const char *socket_path, const fetch_mail_t *fetch_mail, int argc, char *argv[]) {
+    char payload[DAEMON_MAX_REQUEST];
+    size_t len = 0;
+
+    // The key names the session: none of these can contain a newline (see check_for_injection)
+    int written = snprintf(payload, sizeof(payload), "%s\n%s\n%s\n%s\n%s\n%d\n%s\n%d\n%d", fetch_mail->server_name,
+                           fetch_mail->port ? fetch_mail->port : "", fetch_mail->username, fetch_mail->password,
+                           fetch_mail->folder ? fetch_mail->folder : "INBOX", fetch_mail->isTLS,
+                           fetch_mail->ca_file ? fetch_mail->ca_file : "", fetch_mail->noCompress,
+                           fetch_mail->useKTLS);
+    if (written < 0 || (size_t)written >= sizeof(payload)) {
+        return;
+    }
+    len = written + 1;
+
+    for (int i = 0; i < argc; i++) {
+        size_t arg_len = strlen(argv[i]) + 1;
+        if (len + arg_len > sizeof(payload) - 1) {
+            return; // Too large for one request, run it here instead
+        }
+        memcpy(payload + len, argv[i], arg_len);
+        len += arg_len;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return; // No daemon running
+    }
+
+    // The output descriptors and the password only go to a daemon run by this user
+    if (!peer_is_user(fd)) {
+        fprintf(stderr, "Daemon on %s belongs to another user, not using it\n", socket_path);
+        close(fd);
+        return;
+    }
+
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    fflush(stdout);
+    if (send_request(fd, payload, len, fds) < 0) {
+        close(fd);
+        return;
+    }
+
+    unsigned char status;
+    ssize_t numBytes;
+    do {
+        numBytes = recv(fd, &status, 1, 0);
+    } while (numBytes < 0 && errno == EINTR);
+    close(fd);
+
+    if (numBytes != 1) {
+        fprintf(stderr, "Daemon disconnected unexpectedly\n");
+        exit(3);
+    }
+    if (status == DAEMON_STATUS_RETRY) {
+        return;
+    }
+    exit(status);
+}
@@ -0,0 +1,31 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "imap_client.h"
+
+// Maximum number of pooled sessions (one worker process each)
+#define DAEMON_MAX_WORKERS 64
+
+// Maximum size of a request sent to the daemon (key and arguments)
+#define DAEMON_MAX_REQUEST 8192
+
+// Idle sessions are closed before the server would log them out
+#define DAEMON_IDLE_TIMEOUT_MS (5 * 60 * 1000)
+
+// Clients connected but whose request has not arrived yet, and how long they get to send it
+#define DAEMON_MAX_PENDING 64
+#define DAEMON_REQUEST_TIMEOUT_MS 5000
+
+// Status sent back when the daemon cannot take the request, the client then runs it itself
+#define DAEMON_STATUS_RETRY 255
+
+// Socket path used when --socket is not given, returns -1 if there is no safe place for it
+int default_socket_path(char *path, size_t size);
+
+// Listen on socket_path and serve requests from pooled sessions, never returns on success
+int run_daemon(const char *socket_path);
+
+// Send the command to the daemon and exit with its status. Returns if the daemon cannot be used
+void daemon_request(const char *socket_path, const fetch_mail_t *fetch_mail, int argc, char *argv[]);
+
+#endif
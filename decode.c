@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <strings.h>
+
+#include "decode.h"
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODE_X86 1
+#include <immintrin.h>
+#endif
+
+/***
+ * Streaming Content-Transfer-Encoding decoders (RFC 2045 6.7 and 6.8). The input comes in chunks
+ * of any size, e.g. as it is read from the socket, and whatever a chunk ends in the middle of (an
+ * = sequence, a base64 quantum) is kept in the decoder until the next one.
+ *
+ * Quoted-printable: =XX (either case) is the byte XX, = followed by optional white space and a line
+ * break is a soft line break and is removed. Any other = sequence is invalid and copied as it is.
+ * Line breaks and everything else are copied as they are.
+ * Base64: characters outside the alphabet (line breaks, white space, junk) are skipped. = ends the
+ * quantum, so 2 or 3 sextets give 1 or 2 bytes, and a lone sextet is dropped. Decoding carries on
+ * with the next character of the alphabet, so concatenated encodings decode as a whole.
+*/
+
+#define QP_TEXT 0       // not in an = sequence
+#define QP_EQUALS 1     // after =
+#define QP_HEX 2        // after = and one hex digit
+#define QP_SPACE 3      // after = and white space
+#define QP_CR 4         // after = [white space] CR
+
+#define B64_INVALID 0xff
+#define B64_PAD 0xfe
+
+static unsigned char b64_values[256];
+static int b64_ready = 0;
+
+int decode_encoding(const char *name, size_t length) {
+    if (length == strlen("quoted-printable") && strncasecmp(name, "quoted-printable", length) == 0) {
+        return DECODE_QUOTED_PRINTABLE;
+    }
+    if (length == strlen("base64") && strncasecmp(name, "base64", length) == 0) {
+        return DECODE_BASE64;
+    }
+    return DECODE_IDENTITY;
+}
+
+void decoder_init(decoder_t *decoder, int encoding) {
+    memset(decoder, 0, sizeof(decoder_t));
+    decoder->encoding = encoding;
+
+    if (!b64_ready) {
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(b64_values, B64_INVALID, sizeof(b64_values));
+        for (int i = 0; i < 64; i++) {
+            b64_values[(unsigned char)alphabet[i]] = i;
+        }
+        b64_values['='] = B64_PAD;
+        b64_ready = 1;
+    }
+}
+
+
+
+//////////// Quoted-printable ///////////////////////////
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Function to give up on an invalid = sequence: it is copied to the output as it is
+static size_t qp_flush(decoder_t *decoder, char *out) {
+    size_t n = decoder->pending_len;
+    memcpy(out, decoder->pending, n);
+    decoder->pending_len = 0;
+    decoder->state = QP_TEXT;
+    return n;
+}
+
+static size_t qp_update(decoder_t *decoder, const char *in, size_t len, char *out) {
+    const char *p = in;
+    const char *end = in + len;
+    char *o = out;
+
+    while (p < end) {
+        if (decoder->state == QP_TEXT) {
+            // Most of the text has no =, copy up to the next one in one go
+            const char *equals = memchr(p, '=', end - p);
+            size_t run = (equals ? equals : end) - p;
+            memcpy(o, p, run);
+            o += run;
+            p += run;
+            if (equals == NULL) {
+                break;
+            }
+            decoder->pending[0] = '=';
+            decoder->pending_len = 1;
+            decoder->state = QP_EQUALS;
+            p++;
+            continue;
+        }
+
+        char c = *p;
+        int accepted = 1;
+        switch (decoder->state) {
+            case QP_EQUALS:
+                if (hex_value(c) >= 0) {
+                    decoder->state = QP_HEX;
+                } else if (c == ' ' || c == '\t') {
+                    decoder->state = QP_SPACE;
+                } else if (c == '\r') {
+                    decoder->state = QP_CR;
+                } else if (c == '\n') {
+                    decoder->pending_len = 0;
+                    decoder->state = QP_TEXT;
+                    p++;
+                    continue;
+                } else {
+                    accepted = 0;
+                }
+                break;
+            case QP_HEX:
+                if (hex_value(c) >= 0) {
+                    *o++ = (char)(hex_value(decoder->pending[1]) << 4 | hex_value(c));
+                    decoder->pending_len = 0;
+                    decoder->state = QP_TEXT;
+                    p++;
+                    continue;
+                }
+                accepted = 0;
+                break;
+            case QP_SPACE:
+                if ((c == ' ' || c == '\t') && decoder->pending_len < DECODE_PENDING_SIZE - 1) {
+                    break;
+                } else if (c == '\r') {
+                    decoder->state = QP_CR;
+                } else if (c == '\n') {
+                    decoder->pending_len = 0;
+                    decoder->state = QP_TEXT;
+                    p++;
+                    continue;
+                } else {
+                    accepted = 0;
+                }
+                break;
+            case QP_CR:
+                if (c == '\n') {
+                    decoder->pending_len = 0;
+                    decoder->state = QP_TEXT;
+                    p++;
+                    continue;
+                }
+                accepted = 0;
+                break;
+        }
+
+        if (accepted) {
+            decoder->pending[decoder->pending_len++] = c;
+            p++;
+        } else {
+            // c does not belong to the sequence, it is looked at again as text
+            o += qp_flush(decoder, o);
+        }
+    }
+
+    return o - out;
+}
+
+
+
+//////////// Base64 ///////////////////////////
+
+// Function to decode with the lookup table until the quantum is complete and at least stop is
+// reached, so the vector kernel can take over on a quantum boundary
+static const char *b64_scalar(decoder_t *decoder, const char *p, const char *stop, const char *end, char **out) {
+    char *o = *out;
+    while (p < end && (p < stop || decoder->state != 0)) {
+        // Whole quanta at once while there is no line break or padding among them
+        if (decoder->state == 0 && stop - p >= 4) {
+            unsigned int a = b64_values[(unsigned char)p[0]], b = b64_values[(unsigned char)p[1]];
+            unsigned int c = b64_values[(unsigned char)p[2]], d = b64_values[(unsigned char)p[3]];
+            if ((a | b | c | d) < 64) {
+                unsigned int bits = a << 18 | b << 12 | c << 6 | d;
+                o[0] = (char)(bits >> 16);
+                o[1] = (char)(bits >> 8);
+                o[2] = (char)bits;
+                o += 3;
+                p += 4;
+                continue;
+            }
+        }
+        unsigned char value = b64_values[(unsigned char)*p++];
+        if (value < 64) {
+            decoder->bits = decoder->bits << 6 | value;
+            if (++decoder->state == 4) {
+                o[0] = (char)(decoder->bits >> 16);
+                o[1] = (char)(decoder->bits >> 8);
+                o[2] = (char)decoder->bits;
+                o += 3;
+                decoder->bits = 0;
+                decoder->state = 0;
+            }
+        } else if (value == B64_PAD && decoder->state != 0) {
+            if (decoder->state == 2) {
+                *o++ = (char)(decoder->bits >> 4);
+            } else if (decoder->state == 3) {
+                *o++ = (char)(decoder->bits >> 10);
+                *o++ = (char)(decoder->bits >> 2);
+            }
+            decoder->bits = 0;
+            decoder->state = 0;
+        }
+    }
+    *out = o;
+    return p;
+}
+
+#ifdef DECODE_X86
+
+// Function to decode 32 characters into 24 bytes (storing 32), returns a mask of the characters
+// outside the alphabet and writes nothing if there are any. Classifies each character by its two
+// nibbles with shuffle lookups, then packs the sextets with multiply-adds
+__attribute__((target("avx2")))
+static unsigned int b64_block_avx2(const char *in, char *out) {
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+
+    __m256i chars = _mm256_loadu_si256((const __m256i *)in);
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(chars, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(chars, mask_2f);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+
+    // A character is in the alphabet when its two lookups share no bit
+    __m256i valid = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+    unsigned int invalid = ~(unsigned int)_mm256_movemask_epi8(valid);
+    if (invalid != 0) {
+        return invalid;
+    }
+
+    // '/' is the one character its high nibble does not place
+    __m256i eq_2f = _mm256_cmpeq_epi8(chars, mask_2f);
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    __m256i sextets = _mm256_add_epi8(chars, roll);
+
+    __m256i pairs = _mm256_maddubs_epi16(sextets, _mm256_set1_epi32(0x01400140));
+    __m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+    __m256i bytes = _mm256_shuffle_epi8(words, _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    bytes = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+    _mm256_storeu_si256((__m256i *)out, bytes);
+    return 0;
+}
+
+#endif
+
+static size_t b64_update(decoder_t *decoder, const char *in, size_t len, char *out) {
+    const char *p = in;
+    const char *end = in + len;
+    char *o = out;
+
+#ifdef DECODE_X86
+    // Follows the scan functions, so FETCHMAIL_SCAN=scalar turns the kernel off too
+    if (strcmp(scan_level(), "avx2") == 0) {
+        while (end - p >= 32) {
+            if (decoder->state != 0) {
+                p = b64_scalar(decoder, p, p, end, &o);
+                continue;
+            }
+            unsigned int invalid = b64_block_avx2(p, o);
+            if (invalid == 0) {
+                p += 32;
+                o += 24;
+            } else {
+                // Up to and past the line break (or whatever it is) one character at a time
+                int first = __builtin_ctz(invalid);
+                int run = __builtin_ctz(~(invalid >> first));
+                p = b64_scalar(decoder, p, p + first + run, end, &o);
+            }
+        }
+    }
+#endif
+
+    b64_scalar(decoder, p, end, end, &o);
+    return o - out;
+}
+
+
+
+//////////// Entry points ///////////////////////////
+
+size_t decode_update(decoder_t *decoder, const char *in, size_t len, char *out) {
+    switch (decoder->encoding) {
+        case DECODE_QUOTED_PRINTABLE:
+            return qp_update(decoder, in, len, out);
+        case DECODE_BASE64:
+            return b64_update(decoder, in, len, out);
+        default:
+            memcpy(out, in, len);
+            return len;
+    }
+}
+
+size_t decode_final(decoder_t *decoder, char *out) {
+    size_t n = 0;
+    if (decoder->encoding == DECODE_QUOTED_PRINTABLE) {
+        n = qp_flush(decoder, out);
+    } else if (decoder->encoding == DECODE_BASE64) {
+        // A missing = is forgiven, a lone sextet cannot make a byte
+        if (decoder->state == 2) {
+            out[n++] = (char)(decoder->bits >> 4);
+        } else if (decoder->state == 3) {
+            out[n++] = (char)(decoder->bits >> 10);
+            out[n++] = (char)(decoder->bits >> 2);
+        }
+        decoder->bits = 0;
+        decoder->state = 0;
+    }
+    return n;
+}
@@ -0,0 +1,43 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stddef.h>
+
+// Content-Transfer-Encodings a decoder handles, anything else is passed through
+#define DECODE_IDENTITY 0
+#define DECODE_QUOTED_PRINTABLE 1
+#define DECODE_BASE64 2
+
+// Longest quoted-printable sequence held back between chunks ("=", white space, CR)
+#define DECODE_PENDING_SIZE 80
+
+// Chunk size for decoding data that is already in memory, small enough to stay in cache
+#define DECODE_CHUNK_SIZE (64 * 1024)
+
+// Room decode_update and decode_final may need for len input bytes (the base64 kernel stores
+// a few bytes past its output)
+#define DECODE_OUT_SIZE(len) ((len) + DECODE_PENDING_SIZE + 32)
+
+// Decoder state carried from one chunk to the next, so data can be decoded as it arrives
+typedef struct decoder {
+    int encoding;
+    int state;                      // quoted-printable: position in an = sequence, base64: sextets held
+    unsigned int bits;              // base64: the sextets of the unfinished quantum
+    char pending[DECODE_PENDING_SIZE]; // quoted-printable: bytes of an unfinished = sequence
+    size_t pending_len;
+} decoder_t;
+
+// Function to map a Content-Transfer-Encoding value to DECODE_*, ignoring case
+int decode_encoding(const char *name, size_t length);
+
+void decoder_init(decoder_t *decoder, int encoding);
+
+// Function to decode the next chunk into out, which needs DECODE_OUT_SIZE(len) bytes
+// Returns the number of bytes written
+size_t decode_update(decoder_t *decoder, const char *in, size_t len, char *out);
+
+// Function to flush what the last chunk left unfinished, returns the number of bytes written
+// Quoted-printable keeps an unfinished = sequence as it is, base64 decodes a partial quantum
+size_t decode_final(decoder_t *decoder, char *out);
+
+#endif
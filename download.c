@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "download.h"
+
+/***
+ * Download of many messages over several connections to the same folder. The sizes of all the
+ * messages are fetched first, then the messages are cut into chunks, largest first, so one huge
+ * message starts early instead of setting the total time at the end. Each connection is its own
+ * process and takes the next chunk from the shared queue whenever it is done with one, so a slow
+ * connection simply ends up doing fewer chunks.
+*/
+
+// Progress shared by the connections, in memory all of them map
+typedef struct download_state {
+    size_t next;                // next chunk to hand out
+    size_t chunks_done;
+    size_t messages;            // messages saved
+    size_t missing;             // messages the server no longer had
+    unsigned long long bytes;
+} download_state_t;
+
+// A run of messages in the size-sorted list, fetched with one UID FETCH
+typedef struct download_chunk {
+    size_t first;
+    size_t count;
+} download_chunk_t;
+
+// State of the chunk being fetched
+typedef struct download_context {
+    const char *dir;
+    const message_size_t *messages;
+    size_t count;
+    char saved[DOWNLOAD_CHUNK_MESSAGES];
+    download_state_t *state;
+} download_context_t;
+
+// Largest first, ties in UID order
+static int compare_sizes(const void *a, const void *b) {
+    const message_size_t *x = a;
+    const message_size_t *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    return (x->uid > y->uid) - (x->uid < y->uid);
+}
+
+static int compare_uids(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+// Sizes read so far by the size sweep
+typedef struct size_list {
+    message_size_t *messages;
+    size_t count;
+    size_t allocated;
+} size_list_t;
+
+// response_fn_t keeping the sequence number, UID and size of each message of the size sweep
+static void add_size(imap_reader_t *reader, byte_buffer_t *line, void *ctx) {
+    size_list_t *list = ctx;
+
+    // Nothing here should carry a literal, but one must not be read as lines
+    size_t length;
+    if (parse_literal_length(line->data, line->len, &length)) {
+        command_collect(reader, line, NULL);
+        return;
+    }
+
+    const char *uid = strcasestr(line->data, "UID ");
+    const char *size = strcasestr(line->data, "RFC822.SIZE ");
+    if (strncmp(line->data, "* ", 2) != 0 || uid == NULL || size == NULL) {
+        return;
+    }
+    if (list->count == list->allocated) {
+        list->allocated = list->allocated ? list->allocated * 2 : 1024;
+        list->messages = realloc(list->messages, list->allocated * sizeof(message_size_t));
+        if (list->messages == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(5);
+        }
+    }
+    message_size_t *message = &list->messages[list->count++];
+    message->seq = strtoul(line->data + 2, NULL, 10);
+    message->uid = strtoul(uid + 4, NULL, 10);
+    message->size = strtoul(size + 12, NULL, 10);
+}
+
+// Function to fetch the UID and size of every message to download. Exits if there are none
+static size_t fetch_sizes(session_t *session, const fetch_mail_t *fetch_mail, message_size_t **messages_out) {
+    const char *sequence = fetch_mail->sequence ? fetch_mail->sequence : "1:*";
+    imap_command_t *fetch = command_send(&session->commands, "%sFETCH %s (UID RFC822.SIZE)",
+                                         fetch_mail->useUID ? "UID " : "", sequence);
+
+    size_list_t list = {NULL, 0, 0};
+    int status = command_stream(&session->commands, fetch, add_size, &list);
+    command_free(fetch);
+
+    if (status != IMAP_OK || list.count == 0) {
+        printf("Message not found\n");
+        exit(3);
+    }
+    *messages_out = list.messages;
+    return list.count;
+}
+
+// Function to cut the size-sorted messages into chunks of at most DOWNLOAD_CHUNK_MESSAGES
+// messages or DOWNLOAD_CHUNK_BYTES bytes. A message larger than that is a chunk of its own
+static size_t make_chunks(const message_size_t *messages, size_t count, download_chunk_t **chunks_out) {
+    download_chunk_t *chunks = malloc(count * sizeof(download_chunk_t));
+    if (chunks == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+
+    size_t chunk_count = 0;
+    size_t i = 0;
+    while (i < count) {
+        size_t first = i;
+        unsigned long long bytes = messages[i++].size;
+        while (i < count && i - first < DOWNLOAD_CHUNK_MESSAGES && bytes + messages[i].size <= DOWNLOAD_CHUNK_BYTES) {
+            bytes += messages[i++].size;
+        }
+        chunks[chunk_count].first = first;
+        chunks[chunk_count].count = i - first;
+        chunk_count++;
+    }
+    *chunks_out = chunks;
+    return chunk_count;
+}
+
+// Function to build "UID FETCH <uids> <items>" for a chunk, runs of UIDs become ranges
+static void chunk_command(const message_size_t *messages, size_t count, const char *items, byte_buffer_t *command) {
+    unsigned long uids[DOWNLOAD_CHUNK_MESSAGES];
+    for (size_t i = 0; i < count; i++) {
+        uids[i] = messages[i].uid;
+    }
+    qsort(uids, count, sizeof(unsigned long), compare_uids);
+
+    command->len = 0;
+    buffer_append(command, "UID FETCH ", 10);
+    for (size_t i = 0; i < count; i++) {
+        size_t run = i;
+        while (run + 1 < count && uids[run + 1] == uids[run] + 1) {
+            run++;
+        }
+        char set[48];
+        const char *comma = i > 0 ? "," : "";
+        int len = (run == i) ? snprintf(set, sizeof(set), "%s%lu", comma, uids[i])
+                             : snprintf(set, sizeof(set), "%s%lu:%lu", comma, uids[i], uids[run]);
+        buffer_append(command, set, len);
+        i = run;
+    }
+    buffer_append(command, " ", 1);
+    buffer_append(command, items, strlen(items));
+}
+
+// literal_fn_t writing a message to <dir>/<uid>.eml. It is written under a temporary name first,
+// so a file with the final name is always a whole message
+static void save_message(imap_reader_t *reader, const char *line, size_t length, void *ctx) {
+    download_context_t *context = ctx;
+
+    // The UID is normally on the line, otherwise the sequence number from the size sweep is used
+    const char *uid_start = strcasestr(line, "UID ");
+    unsigned long uid = uid_start ? strtoul(uid_start + 4, NULL, 10) : 0;
+    unsigned long seq = strtoul(line + 2, NULL, 10);
+    size_t i = 0;
+    while (i < context->count && (uid ? context->messages[i].uid != uid : context->messages[i].seq != seq)) {
+        i++;
+    }
+    if (i == context->count || context->saved[i]) {
+        byte_buffer_t discard;
+        buffer_init(&discard);
+        reader_read_literal(reader, length, &discard);
+        buffer_free(&discard);
+        return;
+    }
+    uid = context->messages[i].uid;
+
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%lu.eml", context->dir, uid);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%lu.eml.tmp", context->dir, uid);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(tmp_path);
+        exit(5);
+    }
+    reader_stream_literal(reader, length, fd);
+    if (close(fd) != 0 || rename(tmp_path, path) != 0) {
+        perror(path);
+        exit(5);
+    }
+
+    context->saved[i] = 1;
+    __atomic_fetch_add(&context->state->messages, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&context->state->bytes, length, __ATOMIC_RELAXED);
+}
+
+// Function run by each connection: take chunks off the queue until it is empty
+static void save_chunks(session_t *session, const fetch_mail_t *fetch_mail, const message_size_t *messages,
+                        const download_chunk_t *chunks, size_t chunk_count, download_state_t *state) {
+    const command_plan_t *plan = plan_command("retrieve");
+    byte_buffer_t command;
+    buffer_init(&command);
+
+    while (1) {
+        size_t index = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+        if (index >= chunk_count) {
+            break;
+        }
+        const download_chunk_t *chunk = &chunks[index];
+
+        download_context_t context;
+        memset(&context, 0, sizeof(context));
+        context.dir = fetch_mail->out_dir;
+        context.messages = messages + chunk->first;
+        context.count = chunk->count;
+        context.state = state;
+
+        chunk_command(context.messages, context.count, plan->items, &command);
+        imap_command_t *fetch = command_send(&session->commands, "%s", command.data);
+        int count;
+        command_fetch(&session->commands, fetch, save_message, &context, &count);
+        command_free(fetch);
+
+        // Messages expunged since the size sweep are reported like a missing -n message
+        for (size_t i = 0; i < context.count; i++) {
+            if (!context.saved[i]) {
+                printf("Message %lu not found\n", context.messages[i].uid);
+                __atomic_fetch_add(&state->missing, 1, __ATOMIC_RELAXED);
+            }
+        }
+        fflush(stdout);
+        __atomic_fetch_add(&state->chunks_done, 1, __ATOMIC_RELAXED);
+    }
+    buffer_free(&command);
+}
+
+// Function to download the messages over several connections, see download.h
+void download_messages(session_t *session, const fetch_mail_t *fetch_mail) {
+    if (mkdir(fetch_mail->out_dir, 0755) < 0 && errno != EEXIST) {
+        perror(fetch_mail->out_dir);
+        exit(5);
+    }
+
+    message_size_t *messages;
+    size_t count = fetch_sizes(session, fetch_mail, &messages);
+    qsort(messages, count, sizeof(message_size_t), compare_sizes);
+
+    download_chunk_t *chunks;
+    size_t chunk_count = make_chunks(messages, count, &chunks);
+
+    download_state_t *state = mmap(NULL, sizeof(download_state_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("mmap");
+        exit(5);
+    }
+    memset(state, 0, sizeof(*state));
+
+    // No point in more connections than chunks
+    int connections = fetch_mail->connections > 0 ? fetch_mail->connections : DOWNLOAD_CONNECTIONS;
+    if ((size_t)connections > chunk_count) {
+        connections = chunk_count;
+    }
+
+    // Every connection is a child, the first one takes over the session that is already open
+    fflush(stdout);
+    pid_t *workers = malloc(connections * sizeof(pid_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    int started = 0;
+    for (int i = 0; i < connections; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (i > 0) {
+                close_session(session);
+                open_session(session, fetch_mail);
+            }
+            save_chunks(session, fetch_mail, messages, chunks, chunk_count, state);
+            fflush(stdout);
+            exit(0);
+        } else if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        workers[started++] = pid;
+    }
+    close_session(session);
+
+    // A connection that failed (e.g. the server allows fewer sessions) only matters if the others
+    // could not finish its work
+    int worst = 0;
+    for (int i = 0; i < started; i++) {
+        int wait_status;
+        while (waitpid(workers[i], &wait_status, 0) < 0 && errno == EINTR) {
+        }
+        int status = WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 5;
+        if (status > worst) {
+            worst = status;
+        }
+    }
+
+    int status = 0;
+    if (state->chunks_done < chunk_count) {
+        fprintf(stderr, "Only %zu of %zu messages were downloaded\n", state->messages, count);
+        status = worst ? worst : 5;
+    } else if (state->missing > 0) {
+        status = 3;
+    }
+    if (fetch_mail->verbose) {
+        fprintf(stderr, "Downloaded %zu messages, %llu bytes over %d connection%s\n", state->messages, state->bytes,
+                started, started == 1 ? "" : "s");
+    }
+
+    munmap(state, sizeof(*state));
+    free(workers);
+    free(chunks);
+    free(messages);
+    if (status != 0) {
+        exit(status);
+    }
+}
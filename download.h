@@ -0,0 +1,25 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include "session.h"
+
+// Connections used by retrieve --dir unless -k says otherwise
+#define DOWNLOAD_CONNECTIONS 4
+
+// A chunk of work ends at this many messages or bytes, whichever comes first
+#define DOWNLOAD_CHUNK_MESSAGES 64
+#define DOWNLOAD_CHUNK_BYTES (4 * 1024 * 1024)
+
+// Size of a message, from the RFC822.SIZE sweep before downloading
+typedef struct message_size {
+    unsigned long seq;
+    unsigned long uid;
+    unsigned long size;
+} message_size_t;
+
+// Function to save the -n messages (the whole folder by default) into fetch_mail->out_dir, one
+// file per message named by UID, over fetch_mail->connections sessions. The open session is
+// handed to the first of them. Exits with the status of the command
+void download_messages(session_t *session, const fetch_mail_t *fetch_mail);
+
+#endif
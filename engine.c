@@ -0,0 +1,970 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "engine.h"
+#include "imap_client.h"
+#include "command.h"
+#include "tls.h"
+#include "utils.h"
+#include "connect.h"
+
+/***
+ * Engine for polling many accounts at once. fetchmail --accounts <file> reads one account per
+ * line and runs every account's connect, TLS handshake, LOGIN, SELECT, COMPRESS and FETCH as a
+ * state machine on non-blocking sockets, all on one thread with epoll. TLS is driven through
+ * memory BIOs, so OpenSSL never touches the sockets.
+ *
+ * Once an account's FETCH responses are all in, they are replayed through the same list and
+ * retrieve code a direct run uses, in a short-lived child process with stdout on the account's
+ * sink (its -o file, or stdout). Output and exit status are those of running the account's
+ * command on its own, and a message that fails to parse only takes down its own child. The
+ * child is reaped through a pidfd in the same epoll set, so printing overlaps the network.
+ * Accounts without -o share stdout: their replays queue and print one at a time, each starting
+ * when the one before it is reaped, and their messages wait until no replay is printing.
+*/
+
+#define ENGINE_MAX_ARGS 64
+#define ENGINE_MAX_EVENTS 64
+
+typedef enum {
+    ACCOUNT_WAITING,
+    ACCOUNT_CONNECTING,
+    ACCOUNT_HANDSHAKE,
+    ACCOUNT_GREETING,
+    ACCOUNT_LOGIN,
+    ACCOUNT_SELECT,
+    ACCOUNT_CAPABILITY,
+    ACCOUNT_COMPRESS,
+    ACCOUNT_FETCH,
+    ACCOUNT_QUEUED,             // the connection is closed, waiting for stdout to print
+    ACCOUNT_REPLAY,             // the output is being printed
+    ACCOUNT_DONE
+} account_state_t;
+
+typedef struct account {
+    fetch_mail_t fetch_mail;    // the account's line, parsed like a command line
+    char *text;                 // the line, fetch_mail points into it
+    char *argv[ENGINE_MAX_ARGS];
+    const char *output;         // -o file, NULL for stdout
+    const command_plan_t *plan;
+    custom_plan_t custom;       // the plan as the account's options change it
+    int line;
+    account_state_t state;
+    int fd;                     // the socket, or a pidfd for the replay
+    pid_t replay;
+    struct account *next_queued; // next account waiting for stdout
+    uint32_t events;            // what the socket is registered for
+    server_address_t *addresses; // the server's addresses, in the order they are tried
+    size_t address_count;
+    size_t next_address;
+    time_t connect_started;
+    SSL *ssl;
+    byte_buffer_t out;          // bytes waiting to be sent (encrypted under TLS)
+    size_t out_sent;
+    byte_buffer_t in;           // response bytes, decrypted and inflated
+    size_t scanned;             // how far the line scan has got in in
+    size_t literal_left;        // bytes of a literal still to be skipped
+    const char *tag;            // tag ending the current step, "" for the greeting
+    char last_tag[24];
+    int compress_offered;
+    int capabilities_known;
+    z_stream *deflater;         // set once COMPRESS is active
+    z_stream *inflater;
+    time_t last_activity;
+    int status;                 // exit status of the account's command
+} account_t;
+
+typedef struct engine {
+    int epoll_fd;
+    account_t *accounts;
+    size_t count;
+    size_t next;                // first account not started yet
+    int active;                 // accounts with a connection open or output to print
+    account_t *stdout_replay;   // the replay printing to stdout, NULL if none
+    account_t *queue_first;     // replays waiting for stdout, in the order their responses completed
+    account_t *queue_last;
+    byte_buffer_t held;         // messages for stdout, held while a replay prints
+} engine_t;
+
+static void account_readable(engine_t *engine, account_t *account);
+static void step_done(engine_t *engine, account_t *account, int status);
+static void next_stdout(engine_t *engine);
+
+
+
+//////////// Accounts file ///////////////////////////
+
+// Split a line into arguments at white space, '...' and "..." keep spaces in one argument
+static int split_arguments(char *line, char **args, int max) {
+    int count = 0;
+    char *p = line;
+    while (1) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            return count;
+        }
+        if (count == max) {
+            return -1;
+        }
+
+        if (*p == '\'' || *p == '"') {
+            char quote = *p++;
+            args[count++] = p;
+            p = strchr(p, quote);
+            if (p == NULL) {
+                return -1;
+            }
+        } else {
+            args[count++] = p;
+            p += strcspn(p, " \t");
+            if (*p == '\0') {
+                return count;
+            }
+        }
+        *p++ = '\0';
+    }
+}
+
+// Function to read the accounts file. Each line holds the arguments of one command line, plus
+// -o <file> for where its output goes. A line that is not a valid command line stops the run
+static void load_accounts(engine_t *engine, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int line_number = 0;
+    size_t allocated = 0;
+
+    while ((len = getline(&line, &size, file)) >= 0) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (engine->count == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            engine->accounts = realloc(engine->accounts, allocated * sizeof(account_t));
+            if (engine->accounts == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(5);
+            }
+        }
+        account_t *account = &engine->accounts[engine->count];
+        memset(account, 0, sizeof(*account));
+        account->text = strdup(line);
+        account->line = line_number;
+        account->fd = -1;
+
+        // argv[0] stands for the program name, as parse_args expects
+        account->argv[0] = "fetchmail";
+        int argc = split_arguments(account->text, account->argv + 1, ENGINE_MAX_ARGS - 2);
+        if (argc < 0) {
+            fprintf(stderr, "%s:%d: Cannot read the arguments\n", path, line_number);
+            exit(1);
+        }
+        if (argc == 0) {
+            free(account->text);
+            continue;
+        }
+        argc++;
+
+        // -o is only known here, the rest is parsed like a command line
+        for (int i = 1; i + 1 < argc; i++) {
+            if (strcmp(account->argv[i], "-o") == 0) {
+                account->output = account->argv[i + 1];
+                memmove(&account->argv[i], &account->argv[i + 2], (argc - i - 2) * sizeof(char *));
+                argc -= 2;
+                break;
+            }
+        }
+        account->argv[argc] = NULL;
+
+        parse_args(argc, account->argv, &account->fetch_mail);
+        account->plan = plan_command(account->fetch_mail.command);
+        if (account->plan == NULL) {
+            fprintf(stderr, "%s:%d: Unknown command: %s\n", path, line_number, account->fetch_mail.command);
+            exit(1);
+        }
+        if (account->fetch_mail.out_dir != NULL || account->plan->on_message == NULL) {
+            fprintf(stderr, "%s:%d: --dir and export cannot be used in an accounts file\n", path, line_number);
+            exit(1);
+        }
+        if (account->fetch_mail.stats) {
+            fprintf(stderr, "%s:%d: --stats cannot be used in an accounts file\n", path, line_number);
+            exit(1);
+        }
+        engine->count++;
+    }
+
+    free(line);
+    fclose(file);
+}
+
+
+
+//////////// Output ///////////////////////////
+
+// Function to open where an account's output goes, stdout unless -o was given
+static int open_sink(const account_t *account) {
+    if (account->output == NULL) {
+        return STDOUT_FILENO;
+    }
+    int fd = open(account->output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(account->output);
+    }
+    return fd;
+}
+
+// Function to write a message (e.g. "Login failure") to the account's sink. On stdout it is held
+// until the replay printing there has finished
+static void write_sink(engine_t *engine, const account_t *account, const char *message) {
+    if (account->output == NULL && engine->stdout_replay != NULL) {
+        buffer_append(&engine->held, message, strlen(message));
+        return;
+    }
+    int fd = open_sink(account);
+    if (fd < 0) {
+        return;
+    }
+    fflush(stdout);
+    write_all(fd, message, strlen(message));
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+}
+
+// Function to wait for a replay to finish, returns the exit status of the command
+static int wait_replay(pid_t pid) {
+    int wait_status;
+    while (waitpid(pid, &wait_status, 0) < 0) {
+        if (errno != EINTR) {
+            return 5;
+        }
+    }
+    return WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 5;
+}
+
+// Function to print an account's command output from its FETCH responses. The replay runs in a
+// child so that the command's exit() on a missing or malformed message ends only the replay.
+// Returns the child's pid, or -1 if it could not be started
+static pid_t start_replay(const account_t *account) {
+    int fd = open_sink(account);
+    if (fd < 0) {
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fd != STDOUT_FILENO) {
+            dup2(fd, STDOUT_FILENO);
+        }
+        // The commands were sent by the engine already, the memory transport drops them. A new
+        // queue tags them as send_fetch did
+        memory_source_t memory = {account->in.data, account->in.len, 0};
+        transport_t transport;
+        transport_memory(&transport, &memory);
+        imap_reader_t reader;
+        reader_init(&reader, &transport);
+        command_queue_t commands;
+        command_queue_init(&commands, &reader, transport_send, &transport, 0);
+        arena_t arena;
+        arena_init(&arena);
+
+        const fetch_mail_t *fetch_mail = &account->fetch_mail;
+        if (account->plan->all_messages) {
+            list(&commands, account->plan);
+        } else {
+            retrieve(&commands, &arena, fetch_mail, account->plan);
+        }
+        fflush(stdout);
+        exit(0);
+    }
+
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+    if (pid < 0) {
+        perror("fork");
+    }
+    return pid;
+}
+
+
+
+//////////// Connections ///////////////////////////
+
+// Function to close an account's connection and record how its command ended
+static void finish_account(engine_t *engine, account_t *account, int status) {
+    if (account->fd >= 0) {
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, account->fd, NULL);
+        close(account->fd);
+        account->fd = -1;
+    }
+    if (account->ssl != NULL) {
+        free_ssl_connection(account->ssl);
+        account->ssl = NULL;
+    }
+    if (account->deflater != NULL) {
+        deflateEnd(account->deflater);
+        inflateEnd(account->inflater);
+        free(account->deflater);
+        free(account->inflater);
+        account->deflater = account->inflater = NULL;
+    }
+    buffer_free(&account->out);
+    buffer_free(&account->in);
+    free(account->addresses);
+    account->addresses = NULL;
+
+    account->status = status;
+    account->state = ACCOUNT_DONE;
+    engine->active--;
+
+    if (engine->stdout_replay == account) {
+        engine->stdout_replay = NULL;
+        next_stdout(engine);
+    }
+}
+
+// Function to give up on an account, the reason goes to stderr as for a direct run and the
+// account's output file is left empty
+static void fail_account(engine_t *engine, account_t *account, int status, const char *reason) {
+    fprintf(stderr, "%s@%s: %s\n", account->fetch_mail.username, account->fetch_mail.server_name, reason);
+    write_sink(engine, account, "");
+    finish_account(engine, account, status);
+}
+
+// Function to start an account's replay and reap it when its pidfd turns readable
+static void run_replay(engine_t *engine, account_t *account) {
+    pid_t pid = start_replay(account);
+    if (pid < 0) {
+        finish_account(engine, account, 5);
+        return;
+    }
+
+    int pidfd = pidfd_open(pid, 0);
+    if (pidfd < 0) {
+        // Only left waiting for the child if the kernel has no pidfds
+        perror("pidfd_open");
+        finish_account(engine, account, wait_replay(pid));
+        return;
+    }
+    account->replay = pid;
+    account->fd = pidfd;
+    account->state = ACCOUNT_REPLAY;
+    account->events = EPOLLIN;
+    struct epoll_event event = {EPOLLIN, {.ptr = account}};
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, pidfd, &event);
+    if (account->output == NULL) {
+        engine->stdout_replay = account;
+    }
+
+    // The child has its own copy of the responses
+    buffer_free(&account->in);
+}
+
+// Function to hand stdout to whoever is waiting for it: the messages held while the last replay
+// printed, then the next replay in the queue
+static void next_stdout(engine_t *engine) {
+    if (engine->stdout_replay != NULL) {
+        return;
+    }
+    if (engine->held.len > 0) {
+        fflush(stdout);
+        write_all(STDOUT_FILENO, engine->held.data, engine->held.len);
+        engine->held.len = 0;
+        engine->held.data[0] = '\0';
+    }
+    while (engine->stdout_replay == NULL && engine->queue_first != NULL) {
+        account_t *account = engine->queue_first;
+        engine->queue_first = account->next_queued;
+        if (engine->queue_first == NULL) {
+            engine->queue_last = NULL;
+        }
+        run_replay(engine, account);
+    }
+}
+
+// Function to register for what the socket should wake the engine for
+static void update_events(engine_t *engine, account_t *account) {
+    if (account->state >= ACCOUNT_QUEUED) {
+        return;
+    }
+    uint32_t events = EPOLLIN;
+    if (account->state == ACCOUNT_CONNECTING) {
+        events = EPOLLOUT;
+    } else if (account->out_sent < account->out.len) {
+        events |= EPOLLOUT;
+    }
+    if (events != account->events) {
+        struct epoll_event event = {events, {.ptr = account}};
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, account->fd, &event);
+        account->events = events;
+    }
+}
+
+// Function to send as much of the pending output as the socket takes
+static void send_pending(engine_t *engine, account_t *account) {
+    while (account->out_sent < account->out.len) {
+        ssize_t numBytes = send(account->fd, account->out.data + account->out_sent,
+                                account->out.len - account->out_sent, MSG_NOSIGNAL);
+        if (numBytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            fail_account(engine, account, 2, "Failed to write to the server");
+            return;
+        }
+        account->out_sent += numBytes;
+    }
+
+    if (account->out_sent == account->out.len) {
+        account->out.len = account->out_sent = 0;
+    }
+    update_events(engine, account);
+}
+
+// Function to move what OpenSSL has written into its memory BIO to the socket
+static void flush_tls(engine_t *engine, account_t *account) {
+    BIO *wbio = SSL_get_wbio(account->ssl);
+    char chunk[READER_BUFFER_SIZE];
+    int numBytes;
+    while ((numBytes = BIO_read(wbio, chunk, sizeof(chunk))) > 0) {
+        buffer_append(&account->out, chunk, numBytes);
+    }
+    send_pending(engine, account);
+}
+
+// Function to send bytes of one or more commands, through deflate and TLS where they are active
+static void account_send(engine_t *engine, account_t *account, const char *data, size_t len) {
+    byte_buffer_t packed;
+    buffer_init(&packed);
+
+    if (account->deflater != NULL) {
+        z_stream *deflater = account->deflater;
+        deflater->next_in = (Bytef *)data;
+        deflater->avail_in = len;
+        do {
+            buffer_reserve(&packed, READER_BUFFER_SIZE);
+            deflater->next_out = (Bytef *)packed.data + packed.len;
+            deflater->avail_out = READER_BUFFER_SIZE;
+            deflate(deflater, Z_SYNC_FLUSH);
+            packed.len += READER_BUFFER_SIZE - deflater->avail_out;
+        } while (deflater->avail_out == 0);
+        data = packed.data;
+        len = packed.len;
+    }
+
+    if (account->ssl != NULL) {
+        // Writing to a memory BIO always succeeds
+        SSL_write(account->ssl, data, len);
+        flush_tls(engine, account);
+    } else {
+        buffer_append(&account->out, data, len);
+        send_pending(engine, account);
+    }
+    buffer_free(&packed);
+}
+
+// Function to start the next step of the conversation: send a command and wait for its tag
+static void send_step(engine_t *engine, account_t *account, account_state_t state, const char *tag, const char *command) {
+    account->state = state;
+    account->tag = tag;
+    account_send(engine, account, command, strlen(command));
+}
+
+// Function to drop the response that was just handled, keeping anything after it
+static void discard_response(account_t *account) {
+    account->in.len -= account->scanned;
+    memmove(account->in.data, account->in.data + account->scanned, account->in.len);
+    account->in.data[account->in.len] = '\0';
+    account->scanned = 0;
+}
+
+// Function to scan the new response bytes for the tagged line ending the current step. Literals
+// are skipped by length, so a message body never ends a step
+static void scan_responses(engine_t *engine, account_t *account) {
+    while (account->state >= ACCOUNT_GREETING && account->state <= ACCOUNT_FETCH) {
+        size_t available = account->in.len - account->scanned;
+        if (account->literal_left > 0) {
+            size_t skip = available < account->literal_left ? available : account->literal_left;
+            account->scanned += skip;
+            account->literal_left -= skip;
+            if (account->literal_left > 0) {
+                return;
+            }
+            continue;
+        }
+
+        const char *line = account->in.data + account->scanned;
+        const char *newline = memchr(line, '\n', available);
+        if (newline == NULL) {
+            return;
+        }
+        size_t len = newline - line + 1;
+        account->scanned += len;
+
+        size_t literal;
+        if (parse_literal_length(line, len, &literal)) {
+            account->literal_left = literal;
+            continue;
+        }
+        int status = account->tag[0] == '\0' ? IMAP_OK : parse_tagged_status(line, len, account->tag);
+        if (status >= 0) {
+            step_done(engine, account, status);
+        }
+    }
+}
+
+// Function to take in decrypted bytes from the server, inflating them once COMPRESS is active
+static void receive_plain(engine_t *engine, account_t *account, const char *data, size_t len) {
+    if (account->inflater == NULL) {
+        buffer_append(&account->in, data, len);
+    } else {
+        z_stream *inflater = account->inflater;
+        inflater->next_in = (Bytef *)data;
+        inflater->avail_in = len;
+        do {
+            buffer_reserve(&account->in, READER_BUFFER_SIZE);
+            inflater->next_out = (Bytef *)account->in.data + account->in.len;
+            inflater->avail_out = READER_BUFFER_SIZE;
+            int result = inflate(inflater, Z_SYNC_FLUSH);
+            account->in.len += READER_BUFFER_SIZE - inflater->avail_out;
+            account->in.data[account->in.len] = '\0';
+            if (result != Z_OK && result != Z_BUF_ERROR) {
+                fail_account(engine, account, 3, "Compressed data from the server is corrupt");
+                return;
+            }
+        } while (inflater->avail_in > 0 || inflater->avail_out == 0);
+    }
+    scan_responses(engine, account);
+}
+
+// Function to turn on deflate for both directions after the server's OK to COMPRESS
+static void start_compression(engine_t *engine, account_t *account) {
+    account->deflater = calloc(1, sizeof(z_stream));
+    account->inflater = calloc(1, sizeof(z_stream));
+    if (account->deflater == NULL || account->inflater == NULL ||
+        deflateInit2(account->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK ||
+        inflateInit2(account->inflater, -15) != Z_OK) {
+        fprintf(stderr, "Failed to set up compression\n");
+        exit(5);
+    }
+}
+
+// Function to append "<tag> <command>\r\n" for the number'th FETCH, tagged as the replay's queue
+// will expect it
+static void append_fetch(byte_buffer_t *commands, unsigned int number, const char *command) {
+    char tag[24];
+    command_tag(tag, sizeof(tag), number);
+    buffer_append(commands, tag, strlen(tag));
+    buffer_append(commands, " ", 1);
+    buffer_append(commands, command, strlen(command));
+    buffer_append(commands, "\r\n", 2);
+}
+
+// Function to send the command's FETCH commands, all at once as nothing here blocks on them
+static void send_fetch(engine_t *engine, account_t *account) {
+    const fetch_mail_t *fetch_mail = &account->fetch_mail;
+    char command[BUFFER_SIZE];
+    byte_buffer_t commands;
+    buffer_init(&commands);
+
+    size_t count = 1;
+    if (account->plan->all_messages) {
+        list_command(command, sizeof(command), account->plan);
+        append_fetch(&commands, 1, command);
+    } else {
+        char **element = split_sequence(fetch_mail->sequence, &count);
+        for (size_t i = 0; i < count; i++) {
+            fetch_command(command, sizeof(command), element[i], fetch_mail->useUID, account->plan);
+            append_fetch(&commands, i + 1, command);
+        }
+        free(element[0]);
+        free(element);
+    }
+    command_tag(account->last_tag, sizeof(account->last_tag), count);
+
+    account->state = ACCOUNT_FETCH;
+    account->tag = account->last_tag;
+    account_send(engine, account, commands.data, commands.len);
+    buffer_free(&commands);
+}
+
+// Function to ask for compression once the folder is selected, as a direct run does
+static void after_select(engine_t *engine, account_t *account) {
+    if (account->fetch_mail.noCompress || (account->capabilities_known && !account->compress_offered)) {
+        send_fetch(engine, account);
+    } else if (!account->capabilities_known) {
+        send_step(engine, account, ACCOUNT_CAPABILITY, "A03", "A03 CAPABILITY\r\n");
+    } else {
+        send_step(engine, account, ACCOUNT_COMPRESS, "A04", "A04 COMPRESS DEFLATE\r\n");
+    }
+}
+
+// Function to move an account on once the response ending its current step is in
+static void step_done(engine_t *engine, account_t *account, int status) {
+    const fetch_mail_t *fetch_mail = &account->fetch_mail;
+    char command[3*BUFFER_SIZE];
+
+    switch (account->state) {
+    case ACCOUNT_GREETING:
+        discard_response(account);
+        snprintf(command, sizeof(command), "A01 LOGIN %s %s\r\n", fetch_mail->username, fetch_mail->password);
+        send_step(engine, account, ACCOUNT_LOGIN, "A01", command);
+        break;
+
+    case ACCOUNT_LOGIN:
+        if (status != IMAP_OK) {
+            write_sink(engine, account, "Login failure\n");
+            finish_account(engine, account, 3);
+            return;
+        }
+        account->capabilities_known = strcasestr(account->in.data, "[CAPABILITY ") != NULL;
+        account->compress_offered = strcasestr(account->in.data, "COMPRESS=DEFLATE") != NULL;
+        discard_response(account);
+        select_command(fetch_mail->folder, command, sizeof(command));
+        send_step(engine, account, ACCOUNT_SELECT, "A02", command);
+        break;
+
+    case ACCOUNT_SELECT:
+        if (status != IMAP_OK) {
+            write_sink(engine, account, "Folder not found\n");
+            finish_account(engine, account, 3);
+            return;
+        }
+        discard_response(account);
+        after_select(engine, account);
+        break;
+
+    case ACCOUNT_CAPABILITY:
+        account->capabilities_known = 1;
+        account->compress_offered = strcasestr(account->in.data, "COMPRESS=DEFLATE") != NULL;
+        discard_response(account);
+        after_select(engine, account);
+        break;
+
+    case ACCOUNT_COMPRESS: {
+        // Anything the server sent after its OK is already compressed
+        discard_response(account);
+        byte_buffer_t rest = account->in;
+        buffer_init(&account->in);
+        if (status == IMAP_OK) {
+            start_compression(engine, account);
+        }
+        send_fetch(engine, account);
+        if (rest.len > 0 && account->state == ACCOUNT_FETCH) {
+            receive_plain(engine, account, rest.data, rest.len);
+        }
+        buffer_free(&rest);
+        break;
+    }
+
+    case ACCOUNT_FETCH:
+        // Everything needed is in, the connection can go before the output is printed
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, account->fd, NULL);
+        close(account->fd);
+        account->fd = -1;
+
+        // A replay with its own output file runs alongside the other accounts, replays to the
+        // shared stdout go one at a time
+        if (account->output == NULL) {
+            account->state = ACCOUNT_QUEUED;
+            account->next_queued = NULL;
+            if (engine->queue_last != NULL) {
+                engine->queue_last->next_queued = account;
+            } else {
+                engine->queue_first = account;
+            }
+            engine->queue_last = account;
+            next_stdout(engine);
+        } else {
+            run_replay(engine, account);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Function to run the TLS handshake and decrypt whatever has arrived
+static void drive_tls(engine_t *engine, account_t *account) {
+    if (account->state == ACCOUNT_HANDSHAKE) {
+        int result = SSL_do_handshake(account->ssl);
+        if (result != 1) {
+            int error = SSL_get_error(account->ssl, result);
+            if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+                ERR_clear_error();
+                fail_account(engine, account, 2, "Error performing SSL handshake");
+                return;
+            }
+            flush_tls(engine, account);
+            return;
+        }
+        if (SSL_get_verify_result(account->ssl) != X509_V_OK) {
+            fail_account(engine, account, 2, "Certificate verification failed");
+            return;
+        }
+        account->state = ACCOUNT_GREETING;
+        account->tag = "";
+    }
+
+    char chunk[READER_BUFFER_SIZE];
+    int numBytes;
+    while (account->state < ACCOUNT_QUEUED && (numBytes = SSL_read(account->ssl, chunk, sizeof(chunk))) > 0) {
+        receive_plain(engine, account, chunk, numBytes);
+    }
+    if (account->state >= ACCOUNT_QUEUED) {
+        return;
+    }
+
+    int error = SSL_get_error(account->ssl, numBytes);
+    if (error == SSL_ERROR_ZERO_RETURN) {
+        fail_account(engine, account, 3, "Server disconnected unexpectedly");
+        return;
+    } else if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        ERR_clear_error();
+        fail_account(engine, account, 2, "ERROR reading from SSL connection");
+        return;
+    }
+    flush_tls(engine, account);
+}
+
+// Function to read everything the socket has for an account
+static void account_readable(engine_t *engine, account_t *account) {
+    char chunk[READER_BUFFER_SIZE];
+    while (account->state < ACCOUNT_QUEUED) {
+        ssize_t numBytes = recv(account->fd, chunk, sizeof(chunk), 0);
+        if (numBytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fail_account(engine, account, 2, "ERROR reading from socket");
+            }
+            return;
+        } else if (numBytes == 0) {
+            fail_account(engine, account, 3, "Server disconnected unexpectedly");
+            return;
+        }
+
+        account->last_activity = time(NULL);
+        if (account->ssl != NULL) {
+            BIO_write(SSL_get_rbio(account->ssl), chunk, numBytes);
+            drive_tls(engine, account);
+        } else {
+            receive_plain(engine, account, chunk, numBytes);
+        }
+    }
+}
+
+// Function to start the conversation once the socket is connected
+static void connected(engine_t *engine, account_t *account) {
+    const fetch_mail_t *fetch_mail = &account->fetch_mail;
+
+    if (!fetch_mail->isTLS) {
+        account->state = ACCOUNT_GREETING;
+        account->tag = "";
+        update_events(engine, account);
+        return;
+    }
+
+    const char *port = fetch_mail->port ? fetch_mail->port : "993";
+    account->ssl = new_ssl_connection(tls_context(fetch_mail->ca_file), fetch_mail->server_name, port);
+    if (account->ssl == NULL) {
+        fail_account(engine, account, 2, "Error creating SSL object");
+        return;
+    }
+
+    // Reads from an empty BIO ask for more data instead of reporting end of file
+    BIO *rbio = BIO_new(BIO_s_mem());
+    BIO *wbio = BIO_new(BIO_s_mem());
+    BIO_set_mem_eof_return(rbio, -1);
+    SSL_set_bio(account->ssl, rbio, wbio);
+    SSL_set_connect_state(account->ssl);
+
+    account->state = ACCOUNT_HANDSHAKE;
+    update_events(engine, account);
+    drive_tls(engine, account);
+}
+
+// Function to connect to the next address of the server, without waiting for the connection
+static void connect_next(engine_t *engine, account_t *account) {
+    while (account->next_address < account->address_count) {
+        server_address_t *address = &account->addresses[account->next_address++];
+
+        int fd = socket(address->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, address->protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, (struct sockaddr *)&address->address, address->length) == 0 || errno == EINPROGRESS) {
+            account->fd = fd;
+            account->state = ACCOUNT_CONNECTING;
+            account->events = EPOLLOUT;
+            account->last_activity = time(NULL);
+            struct epoll_event event = {EPOLLOUT, {.ptr = account}};
+            epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            return;
+        }
+        close(fd);
+    }
+    fail_account(engine, account, 2, "ERROR connecting");
+}
+
+// Function to start an account's connection. The server is looked up through the shared cache,
+// so it is resolved once for all the accounts on it
+static void start_account(engine_t *engine, account_t *account) {
+    const fetch_mail_t *fetch_mail = &account->fetch_mail;
+    const char *port = fetch_mail->port ? fetch_mail->port : (fetch_mail->isTLS ? "993" : "143");
+
+    // The accounts array no longer moves, so the plan can point into the account
+    account->plan = plan_options(account->plan, fetch_mail, &account->custom);
+
+    engine->active++;
+    account->connect_started = time(NULL);
+    account->address_count = resolve_server(fetch_mail->server_name, port, &account->addresses);
+    account->next_address = 0;
+    if (account->address_count == 0) {
+        fail_account(engine, account, 1, "ERROR, no such host");
+        return;
+    }
+    connect_next(engine, account);
+}
+
+// Function to handle what epoll reported for an account
+static void account_event(engine_t *engine, account_t *account, uint32_t events) {
+    if (account->state == ACCOUNT_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(account->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            // Refused or unreachable, try the server's next address
+            epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, account->fd, NULL);
+            close(account->fd);
+            account->fd = -1;
+            connect_next(engine, account);
+            return;
+        }
+        account->last_activity = time(NULL);
+        connected(engine, account);
+        return;
+    }
+    if (account->state == ACCOUNT_REPLAY) {
+        finish_account(engine, account, wait_replay(account->replay));
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        send_pending(engine, account);
+    }
+    if (account->state != ACCOUNT_DONE && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        account_readable(engine, account);
+    }
+}
+
+// Function to give up on accounts whose server has gone quiet. An address that has not answered
+// within a second or two is left for the next one (the engine only checks once a second), until
+// the connect timeout runs out
+static void check_timeouts(engine_t *engine) {
+    time_t now = time(NULL);
+    for (size_t i = 0; i < engine->next; i++) {
+        account_t *account = &engine->accounts[i];
+        const fetch_mail_t *fetch_mail = &account->fetch_mail;
+
+        if (account->state == ACCOUNT_CONNECTING) {
+            if ((now - account->connect_started) * 1000 > fetch_mail->connectTimeout) {
+                fail_account(engine, account, 2, "Connection timed out");
+            } else if (now - account->last_activity > 1 && account->next_address < account->address_count) {
+                epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, account->fd, NULL);
+                close(account->fd);
+                account->fd = -1;
+                connect_next(engine, account);
+            }
+        } else if (account->state < ACCOUNT_QUEUED && (now - account->last_activity) * 1000 > fetch_mail->readTimeout) {
+            fail_account(engine, account, 2, "Connection timed out");
+        }
+    }
+}
+
+int run_accounts(const char *path, int parallel) {
+    engine_t engine;
+    memset(&engine, 0, sizeof(engine));
+    load_accounts(&engine, path);
+
+    engine.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (engine.epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(5);
+    }
+
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    time_t last_check = time(NULL);
+
+    while (engine.next < engine.count || engine.active > 0) {
+        while (engine.active < parallel && engine.next < engine.count) {
+            start_account(&engine, &engine.accounts[engine.next++]);
+        }
+        if (engine.active == 0) {
+            continue;
+        }
+
+        int count = epoll_wait(engine.epoll_fd, events, ENGINE_MAX_EVENTS, 1000);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(5);
+        }
+        for (int i = 0; i < count; i++) {
+            account_t *account = events[i].data.ptr;
+            if (account->state != ACCOUNT_DONE) {
+                account_event(&engine, account, events[i].events);
+            }
+        }
+
+        if (time(NULL) != last_check) {
+            last_check = time(NULL);
+            check_timeouts(&engine);
+        }
+    }
+
+    // Every account has finished, report the ones that failed
+    int status = 0;
+    for (size_t i = 0; i < engine.count; i++) {
+        account_t *account = &engine.accounts[i];
+        if (account->status != 0) {
+            fprintf(stderr, "%s:%d: %s@%s exited with status %d\n", path, account->line,
+                    account->fetch_mail.username, account->fetch_mail.server_name, account->status);
+        }
+        if (account->status > status) {
+            status = account->status;
+        }
+        free(account->text);
+    }
+    buffer_free(&engine.held);
+    free(engine.accounts);
+    close(engine.epoll_fd);
+    return status;
+}
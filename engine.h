@@ -0,0 +1,11 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+// Accounts with a connection open at the same time, unless --parallel says otherwise
+#define ENGINE_PARALLEL 100
+
+// Function to run the command of every account in the accounts file on one thread
+// Returns the highest exit status of the accounts
+int run_accounts(const char *path, int parallel);
+
+#endif
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "export.h"
+
+/***
+ * Export of a folder into a Maildir or an mboxrd file. Messages are fetched in UID order and
+ * written through stdio buffers with their line endings turned into LF. Nothing is synced until a
+ * batch is complete: then the batch is fsynced, Maildir files move from tmp/ to new/, and the
+ * checkpoint (UIDVALIDITY and last UID) is replaced. A later export of the same folder starts
+ * after the checkpoint. --fsync-each makes every message a batch of its own.
+*/
+
+// A Maildir message written to tmp/, moved to new/ once it is on disk
+typedef struct pending_file {
+    FILE *file;
+    unsigned long uid;
+} pending_file_t;
+
+// Where the folder is exported to and how far it has got
+typedef struct export_target {
+    const fetch_mail_t *fetch_mail;
+    const char *folder;
+    unsigned long uidvalidity;
+    char checkpoint[PATH_MAX];
+    char checkpoint_dir[PATH_MAX];  // directory holding the checkpoint, synced after renaming it
+    FILE *mbox;                     // NULL when exporting to a Maildir
+    char host[256];                 // host part of Maildir file names
+    size_t batch_limit;
+
+    // The batch being written
+    pending_file_t pending[EXPORT_BATCH_MESSAGES];
+    size_t pending_count;
+    unsigned long long pending_bytes;
+
+    unsigned long written_uid;      // last UID written, possibly not on disk yet
+    size_t exported;
+    byte_buffer_t line;             // a line split across reads
+} export_target_t;
+
+// Function to exit if a file could not be written
+static void check_io(int failed, const char *path) {
+    if (failed) {
+        perror(path);
+        exit(5);
+    }
+}
+
+// Function to make a directory unless it is there already
+static void make_dir(const char *path) {
+    check_io(mkdir(path, 0755) < 0 && errno != EEXIST, path);
+}
+
+// Function to flush a directory entry change (a rename) to disk
+static void sync_dir(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    check_io(fd < 0 || fsync(fd) < 0, path);
+    close(fd);
+}
+
+// Function to build the name of a Maildir message. It only depends on the message, so writing
+// the same message again after an interrupted export replaces the file instead of adding one
+static void maildir_name(const export_target_t *target, unsigned long uid, const char *sub, char *path, size_t size) {
+    snprintf(path, size, "%s/%s/fetchmail.U%luV%lu.%s", target->fetch_mail->maildir, sub, uid, target->uidvalidity, target->host);
+}
+
+// Function to read the checkpoint, returns the last UID exported or 0 to start from the beginning
+// The mbox size at the checkpoint is stored in mbox_size
+static unsigned long read_checkpoint(const export_target_t *target, long long *mbox_size) {
+    FILE *file = fopen(target->checkpoint, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    unsigned long uidvalidity = 0;
+    unsigned long last_uid = 0;
+    char folder[1024] = "";
+    int fields = fscanf(file, "%lu %lu %lld\n", &uidvalidity, &last_uid, mbox_size);
+    if (fgets(folder, sizeof(folder), file) != NULL) {
+        folder[strcspn(folder, "\n")] = '\0';
+    }
+    fclose(file);
+
+    // Another folder, or the server renumbered this one
+    if (fields != 3 || uidvalidity != target->uidvalidity || strcmp(folder, target->folder) != 0) {
+        fprintf(stderr, "%s is for another folder or UIDVALIDITY, exporting all messages\n", target->checkpoint);
+        *mbox_size = -1;
+        return 0;
+    }
+    return last_uid;
+}
+
+// Function to replace the checkpoint with the last UID that is on disk
+static void write_checkpoint(const export_target_t *target) {
+    long long mbox_size = target->mbox ? ftello(target->mbox) : 0;
+
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", target->checkpoint);
+    FILE *file = fopen(tmp_path, "w");
+    check_io(file == NULL, tmp_path);
+    fprintf(file, "%lu %lu %lld\n%s\n", target->uidvalidity, target->written_uid, mbox_size, target->folder);
+    check_io(fflush(file) != 0 || fsync(fileno(file)) < 0, tmp_path);
+    fclose(file);
+
+    check_io(rename(tmp_path, target->checkpoint) < 0, target->checkpoint);
+    sync_dir(target->checkpoint_dir);
+}
+
+// Function to get the batch onto disk and move the checkpoint past it
+static void commit_batch(export_target_t *target) {
+    if (target->mbox != NULL) {
+        check_io(fflush(target->mbox) != 0 || fsync(fileno(target->mbox)) < 0, target->fetch_mail->mbox);
+    } else if (target->pending_count > 0) {
+        char tmp_path[PATH_MAX];
+        char new_path[PATH_MAX];
+        for (size_t i = 0; i < target->pending_count; i++) {
+            maildir_name(target, target->pending[i].uid, "tmp", tmp_path, sizeof(tmp_path));
+            FILE *file = target->pending[i].file;
+            check_io(fflush(file) != 0 || fsync(fileno(file)) < 0, tmp_path);
+            fclose(file);
+        }
+
+        // Only whole messages that are on disk appear in new/
+        for (size_t i = 0; i < target->pending_count; i++) {
+            maildir_name(target, target->pending[i].uid, "tmp", tmp_path, sizeof(tmp_path));
+            maildir_name(target, target->pending[i].uid, "new", new_path, sizeof(new_path));
+            check_io(rename(tmp_path, new_path) < 0, new_path);
+        }
+        snprintf(new_path, sizeof(new_path), "%s/new", target->fetch_mail->maildir);
+        sync_dir(new_path);
+    }
+
+    write_checkpoint(target);
+    target->pending_count = 0;
+    target->pending_bytes = 0;
+}
+
+// Function to write one line with an LF ending. In an mboxrd file a line that starts with
+// "From " after any number of '>' gets one more '>', so readers can undo it
+static void put_line(FILE *out, const char *line, size_t len, int quote_from) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        len--;
+    }
+    if (quote_from) {
+        size_t quotes = 0;
+        while (quotes < len && line[quotes] == '>') {
+            quotes++;
+        }
+        if (len - quotes >= 5 && memcmp(line + quotes, "From ", 5) == 0) {
+            fputc('>', out);
+        }
+    }
+    fwrite(line, 1, len, out);
+    fputc('\n', out);
+}
+
+// Function to pass a message literal through to out one line at a time
+static void write_message(export_target_t *target, imap_reader_t *reader, size_t length, FILE *out) {
+    int quote_from = target->mbox != NULL;
+    byte_buffer_t *line = &target->line;
+    char chunk[STREAM_CHUNK_SIZE];
+
+    while (length > 0) {
+        size_t numBytes = reader_read_chunk(reader, length, chunk, sizeof(chunk));
+        length -= numBytes;
+
+        const char *p = chunk;
+        const char *end = chunk + numBytes;
+        while (p < end) {
+            const char *newline = memchr(p, '\n', end - p);
+            if (newline == NULL) {
+                buffer_append(line, p, end - p);
+                break;
+            }
+            if (line->len > 0) {
+                buffer_append(line, p, newline - p + 1);
+                put_line(out, line->data, line->len, quote_from);
+                line->len = 0;
+            } else {
+                put_line(out, p, newline - p + 1, quote_from);
+            }
+            p = newline + 1;
+        }
+    }
+
+    // A message not ending in a newline gets one
+    if (line->len > 0) {
+        put_line(out, line->data, line->len, quote_from);
+        line->len = 0;
+    }
+}
+
+// Function to skip a literal that is not exported
+static void skip_literal(imap_reader_t *reader, size_t length) {
+    char chunk[STREAM_CHUNK_SIZE];
+    while (length > 0) {
+        length -= reader_read_chunk(reader, length, chunk, sizeof(chunk));
+    }
+}
+
+// literal_fn_t writing each fetched message to the export target
+static void export_message(imap_reader_t *reader, const char *line, size_t length, void *ctx) {
+    export_target_t *target = ctx;
+
+    // UID n:* also returns the last message when n is past it, that one is already exported
+    const char *uid_start = strcasestr(line, "UID ");
+    unsigned long uid = uid_start ? strtoul(uid_start + 4, NULL, 10) : 0;
+    if (uid == 0 || uid <= target->written_uid) {
+        skip_literal(reader, length);
+        return;
+    }
+
+    if (target->mbox != NULL) {
+        char date[64];
+        time_t now = time(NULL);
+        strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", gmtime(&now));
+        fprintf(target->mbox, "From MAILER-DAEMON %s\n", date);
+        write_message(target, reader, length, target->mbox);
+        fputc('\n', target->mbox);
+        target->pending[target->pending_count].file = NULL;
+    } else {
+        char tmp_path[PATH_MAX];
+        maildir_name(target, uid, "tmp", tmp_path, sizeof(tmp_path));
+        FILE *file = fopen(tmp_path, "we");
+        check_io(file == NULL, tmp_path);
+        write_message(target, reader, length, file);
+        target->pending[target->pending_count].file = file;
+    }
+    target->pending[target->pending_count].uid = uid;
+    target->pending_count++;
+    target->pending_bytes += length;
+    target->written_uid = uid;
+    target->exported++;
+
+    if (target->pending_count >= target->batch_limit || target->pending_bytes >= EXPORT_BATCH_BYTES) {
+        commit_batch(target);
+    }
+}
+
+// Function to set up the Maildir or mbox file, returns the last UID already exported
+static unsigned long open_target(export_target_t *target) {
+    const fetch_mail_t *fetch_mail = target->fetch_mail;
+    long long mbox_size = -1;
+
+    if (fetch_mail->maildir != NULL) {
+        char path[PATH_MAX];
+        make_dir(fetch_mail->maildir);
+        const char *subdirs[] = {"tmp", "new", "cur"};
+        for (int i = 0; i < 3; i++) {
+            snprintf(path, sizeof(path), "%s/%s", fetch_mail->maildir, subdirs[i]);
+            make_dir(path);
+        }
+        snprintf(target->checkpoint, sizeof(target->checkpoint), "%s/%s", fetch_mail->maildir, EXPORT_CHECKPOINT);
+        snprintf(target->checkpoint_dir, sizeof(target->checkpoint_dir), "%s", fetch_mail->maildir);
+
+        // Maildir file names may not contain '/' or ':'
+        gethostname(target->host, sizeof(target->host) - 1);
+        for (char *c = target->host; *c; c++) {
+            if (*c == '/' || *c == ':') {
+                *c = '_';
+            }
+        }
+        return read_checkpoint(target, &mbox_size);
+    }
+
+    snprintf(target->checkpoint, sizeof(target->checkpoint), "%s%s", fetch_mail->mbox, EXPORT_CHECKPOINT);
+    char mbox_path[PATH_MAX];
+    snprintf(mbox_path, sizeof(mbox_path), "%s", fetch_mail->mbox);
+    snprintf(target->checkpoint_dir, sizeof(target->checkpoint_dir), "%s", dirname(mbox_path));
+
+    int fd = open(fetch_mail->mbox, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    check_io(fd < 0, fetch_mail->mbox);
+    unsigned long last_uid = read_checkpoint(target, &mbox_size);
+
+    // Messages written after the checkpoint are written again, drop the partial batch first
+    struct stat mbox_stat;
+    check_io(fstat(fd, &mbox_stat) < 0, fetch_mail->mbox);
+    if (mbox_size >= 0 && mbox_size < mbox_stat.st_size) {
+        check_io(ftruncate(fd, mbox_size) < 0, fetch_mail->mbox);
+    }
+
+    target->mbox = fdopen(fd, "a");
+    check_io(target->mbox == NULL, fetch_mail->mbox);
+    setvbuf(target->mbox, NULL, _IOFBF, EXPORT_BUFFER_SIZE);
+    fseeko(target->mbox, 0, SEEK_END);
+    return last_uid;
+}
+
+// Function to export the folder, see export.h
+void export_messages(session_t *session, const fetch_mail_t *fetch_mail) {
+    export_target_t *target = calloc(1, sizeof(export_target_t));
+    if (target == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    target->fetch_mail = fetch_mail;
+    target->folder = (fetch_mail->folder && fetch_mail->folder[0]) ? fetch_mail->folder : "INBOX";
+    target->uidvalidity = session->mailbox.uidvalidity;
+    target->batch_limit = fetch_mail->fsyncEach ? 1 : EXPORT_BATCH_MESSAGES;
+    buffer_init(&target->line);
+
+    unsigned long last_uid = open_target(target);
+    target->written_uid = last_uid;
+
+    // Nothing new if the next UID the server hands out follows the checkpoint
+    int has_new = session->mailbox.exists > 0 && (session->mailbox.uidnext == 0 || session->mailbox.uidnext > last_uid + 1);
+    if (has_new) {
+        imap_command_t *fetch = command_send(&session->commands, "UID FETCH %lu:* (UID BODY.PEEK[])", last_uid + 1);
+
+        int count;
+        int status = command_fetch(&session->commands, fetch, export_message, target, &count);
+        command_free(fetch);
+        if (status != IMAP_OK) {
+            printf("Export failed\n");
+            exit(3);
+        }
+    }
+    if (target->pending_count > 0 || target->written_uid != last_uid) {
+        commit_batch(target);
+    }
+    if (target->mbox != NULL) {
+        check_io(fclose(target->mbox) != 0, fetch_mail->mbox);
+    }
+
+    printf("Exported %zu messages, up to UID %lu\n", target->exported, target->written_uid);
+    buffer_free(&target->line);
+    free(target);
+}
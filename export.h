@@ -0,0 +1,20 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "session.h"
+
+// Messages (or bytes) written before they are synced to disk and the checkpoint moves on
+#define EXPORT_BATCH_MESSAGES 256
+#define EXPORT_BATCH_BYTES (32 * 1024 * 1024)
+
+// Output buffer of the mbox file
+#define EXPORT_BUFFER_SIZE (1024 * 1024)
+
+// Suffix of the checkpoint file, kept next to the mbox file or inside the Maildir
+#define EXPORT_CHECKPOINT ".fetchmail-export"
+
+// Function to export the selected folder into fetch_mail->maildir or fetch_mail->mbox. Only
+// messages with a UID above the last checkpoint are fetched, so an interrupted export resumes
+void export_messages(session_t *session, const fetch_mail_t *fetch_mail);
+
+#endif
@@ -0,0 +1,696 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "header_cache.h"
+#include "utils.h"
+
+/***
+ * Local cache of the header fields list and parse fetch, so a folder is only swept once. Entries
+ * are keyed by UID under the folder's UIDVALIDITY (a new UIDVALIDITY throws the cache away).
+ * Messages never change once they have a UID, so a run only asks the server for UIDs from the
+ * cached UIDNEXT on, plus a UID-only sweep when messages were expunged. An unchanged folder costs
+ * no command at all. FETCHMAIL_HEADER_CACHE names the directory, empty turns the cache off.
+*/
+
+#define CACHE_MAGIC "fetchmail header cache 1\n"
+
+// Longest UID set sent in one command when fetching missing headers
+#define MAX_UID_SET 4000
+
+// Called for each message of a FETCH response with its UID, literal is NULL if there was none
+typedef void (*uid_fn_t)(header_cache_t *cache, unsigned long uid, const char *literal, size_t length, void *ctx);
+
+
+// Append an entry with no headers yet
+static size_t add_entry(header_cache_t *cache, unsigned long uid) {
+    if (cache->count == cache->size) {
+        size_t new_size = cache->size ? cache->size * 2 : 1024;
+        cache_entry_t *entries = realloc(cache->entries, new_size * sizeof(cache_entry_t));
+        if (entries == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(5);
+        }
+        cache->entries = entries;
+        cache->size = new_size;
+    }
+
+    cache_entry_t *entry = &cache->entries[cache->count];
+    entry->uid = uid;
+    for (int slot = 0; slot < CACHE_SLOTS; slot++) {
+        entry->offset[slot] = 0;
+        entry->length[slot] = CACHE_MISSING;
+    }
+    return cache->count++;
+}
+
+// Store the headers of one slot of an entry
+static void set_slot(header_cache_t *cache, size_t index, int slot, const char *data, size_t length) {
+    cache->entries[index].offset[slot] = cache->text.len;
+    cache->entries[index].length[slot] = length;
+    buffer_append(&cache->text, data, length);
+    cache->dirty = 1;
+}
+
+// Index of the first entry with a UID of at least uid
+static size_t lower_bound(const header_cache_t *cache, unsigned long uid) {
+    size_t low = 0, high = cache->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (cache->entries[middle].uid < uid) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Drop every entry, for a new UIDVALIDITY or a damaged file
+static void clear_entries(header_cache_t *cache) {
+    cache->count = 0;
+    cache->uidnext = 0;
+    cache->text.len = 0;
+    cache->dirty = 1;
+}
+
+
+//////////// Cache file ///////////////////////////
+
+// Hash of the key, to name the file
+static unsigned long long key_hash(const byte_buffer_t *key) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key->len; i++) {
+        hash = (hash ^ (unsigned char)key->data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Read a decimal number ending in end_char at *pos, returns 0 if there is none
+static int read_number(const byte_buffer_t *file, size_t *pos, char end_char, unsigned long *value) {
+    size_t start = *pos;
+    *value = 0;
+    while (*pos < file->len && file->data[*pos] >= '0' && file->data[*pos] <= '9') {
+        *value = *value * 10 + (file->data[*pos] - '0');
+        (*pos)++;
+    }
+    if (*pos == start || *pos >= file->len || file->data[*pos] != end_char) {
+        return 0;
+    }
+    (*pos)++;
+    return 1;
+}
+
+// Read a slot length ("-" if missing) ending in end_char
+static int read_length(const byte_buffer_t *file, size_t *pos, char end_char, size_t *length) {
+    if (*pos + 1 < file->len && file->data[*pos] == '-' && file->data[*pos + 1] == end_char) {
+        *pos += 2;
+        *length = CACHE_MISSING;
+        return 1;
+    }
+    unsigned long value;
+    if (!read_number(file, pos, end_char, &value)) {
+        return 0;
+    }
+    *length = value;
+    return 1;
+}
+
+// Parse the loaded file in cache->text. The headers stay where they are in the buffer
+static int parse_cache_file(header_cache_t *cache) {
+    const byte_buffer_t *file = &cache->text;
+    size_t magic_len = strlen(CACHE_MAGIC);
+    if (file->len < magic_len || memcmp(file->data, CACHE_MAGIC, magic_len) != 0) {
+        return 0;
+    }
+
+    size_t pos = magic_len;
+    unsigned long uidvalidity, uidnext, count, key_len;
+    if (!read_number(file, &pos, ' ', &uidvalidity) || !read_number(file, &pos, ' ', &uidnext) ||
+        !read_number(file, &pos, ' ', &count) || !read_number(file, &pos, '\n', &key_len)) {
+        return 0;
+    }
+
+    // The hash only names the file, the key itself has to match
+    if (key_len != cache->key.len || file->len - pos < key_len + 1 ||
+        memcmp(file->data + pos, cache->key.data, key_len) != 0 || file->data[pos + key_len] != '\n') {
+        return 0;
+    }
+    pos += key_len + 1;
+
+    for (unsigned long i = 0; i < count; i++) {
+        unsigned long uid;
+        size_t length[CACHE_SLOTS];
+        if (!read_number(file, &pos, ' ', &uid)) {
+            return 0;
+        }
+        for (int slot = 0; slot < CACHE_SLOTS; slot++) {
+            if (!read_length(file, &pos, slot == CACHE_SLOTS - 1 ? '\n' : ' ', &length[slot])) {
+                return 0;
+            }
+        }
+        if (cache->count > 0 && uid <= cache->entries[cache->count - 1].uid) {
+            return 0;
+        }
+
+        size_t index = add_entry(cache, uid);
+        for (int slot = 0; slot < CACHE_SLOTS; slot++) {
+            if (length[slot] == CACHE_MISSING) {
+                continue;
+            }
+            if (file->len - pos < length[slot]) {
+                return 0;
+            }
+            cache->entries[index].offset[slot] = pos;
+            cache->entries[index].length[slot] = length[slot];
+            pos += length[slot];
+        }
+    }
+
+    cache->uidvalidity = uidvalidity;
+    cache->uidnext = uidnext;
+    return 1;
+}
+
+// Read the whole cache file into cache->text, returns 0 if there is none
+static int load_cache_file(header_cache_t *cache) {
+    FILE *file = fopen(cache->path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    struct stat file_stat;
+    int ok = fstat(fileno(file), &file_stat) == 0;
+    if (ok) {
+        buffer_reserve(&cache->text, file_stat.st_size);
+        cache->text.len = fread(cache->text.data, 1, file_stat.st_size, file);
+        cache->text.data[cache->text.len] = '\0';
+        ok = cache->text.len == (size_t)file_stat.st_size;
+    }
+    fclose(file);
+    return ok;
+}
+
+// Write the cache to a new file and rename it over the old one, so concurrent runs never see
+// half a cache. Headers are private, so the file is only readable by this user
+static void save_cache_file(const header_cache_t *cache) {
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", cache->path, (int)getpid());
+
+    mode_t old_mask = umask(077);
+    FILE *file = fopen(tmp_path, "w");
+    umask(old_mask);
+    if (file == NULL) {
+        return;
+    }
+
+    fprintf(file, "%s%lu %lu %zu %zu\n", CACHE_MAGIC, cache->uidvalidity, cache->uidnext, cache->count, cache->key.len);
+    fwrite(cache->key.data, 1, cache->key.len, file);
+    fputc('\n', file);
+
+    for (size_t i = 0; i < cache->count; i++) {
+        const cache_entry_t *entry = &cache->entries[i];
+        fprintf(file, "%lu", entry->uid);
+        for (int slot = 0; slot < CACHE_SLOTS; slot++) {
+            if (entry->length[slot] == CACHE_MISSING) {
+                fputs(" -", file);
+            } else {
+                fprintf(file, " %zu", entry->length[slot]);
+            }
+        }
+        fputc('\n', file);
+        for (int slot = 0; slot < CACHE_SLOTS; slot++) {
+            if (entry->length[slot] != CACHE_MISSING) {
+                fwrite(cache->text.data + entry->offset[slot], 1, entry->length[slot], file);
+            }
+        }
+    }
+
+    if (fclose(file) != 0 || rename(tmp_path, cache->path) < 0) {
+        unlink(tmp_path);
+    }
+}
+
+// Load the cache for the session's folder
+int header_cache_open(header_cache_t *cache, const session_t *session, const fetch_mail_t *fetch_mail) {
+    const mailbox_t *mailbox = &session->mailbox;
+    char dir[PATH_MAX];
+
+    // Without UIDVALIDITY there is no telling whether cached UIDs still mean the same messages
+    if (mailbox->uidvalidity == 0 || mailbox->uidnext == 0 || !cache_dir("FETCHMAIL_HEADER_CACHE", dir, sizeof(dir))) {
+        return 0;
+    }
+
+    buffer_init(&cache->key);
+    buffer_init(&cache->text);
+    buffer_init(&cache->literal);
+    cache->entries = NULL;
+    cache->count = cache->size = 0;
+    cache->uidvalidity = cache->uidnext = 0;
+    cache->dirty = 0;
+
+    // The password is left out, the headers are the same whoever logs in
+    const char *port = fetch_mail->port ? fetch_mail->port : (fetch_mail->isTLS ? "993" : "143");
+    const char *folder = (fetch_mail->folder && fetch_mail->folder[0]) ? fetch_mail->folder : "INBOX";
+    const char *parts[] = {fetch_mail->server_name, port, fetch_mail->username, folder};
+    for (int i = 0; i < 4; i++) {
+        if (i > 0) {
+            buffer_append(&cache->key, "\n", 1);
+        }
+        buffer_append(&cache->key, parts[i], strlen(parts[i]));
+    }
+    if (snprintf(cache->path, sizeof(cache->path), "%s/headers-%016llx", dir, key_hash(&cache->key)) >= (int)sizeof(cache->path)) {
+        buffer_free(&cache->key);
+        return 0;
+    }
+
+    if (!load_cache_file(cache) || !parse_cache_file(cache) || cache->uidvalidity != mailbox->uidvalidity) {
+        clear_entries(cache);
+        cache->uidvalidity = mailbox->uidvalidity;
+    }
+    return 1;
+}
+
+// Write the cache back if it changed and free it
+void header_cache_close(header_cache_t *cache) {
+    if (cache->dirty) {
+        save_cache_file(cache);
+    }
+    free(cache->entries);
+    buffer_free(&cache->key);
+    buffer_free(&cache->text);
+    buffer_free(&cache->literal);
+}
+
+
+//////////// Fetching from the server ///////////////////////////
+
+// State while the response to a UID FETCH is read
+typedef struct uid_response {
+    header_cache_t *cache;
+    uid_fn_t on_message;
+    void *ctx;
+} uid_response_t;
+
+// response_fn_t for a FETCH asking for UID (and maybe one header literal), passes each message on
+static void read_uid_line(imap_reader_t *reader, byte_buffer_t *line, void *ctx) {
+    uid_response_t *response = ctx;
+    header_cache_t *cache = response->cache;
+
+    // Only FETCH responses carry messages, others (EXISTS, EXPUNGE, ...) are skipped
+    const char *uid_start = strcasestr(line->data, "UID ");
+    int is_fetch = strncmp(line->data, "* ", 2) == 0 && strcasestr(line->data, " FETCH (") != NULL;
+    unsigned long uid = uid_start ? strtoul(uid_start + 4, NULL, 10) : 0;
+
+    size_t length;
+    int has_literal = 0;
+    cache->literal.len = 0;
+    while (parse_literal_length(line->data, line->len, &length)) {
+        // Only the first literal is the requested header fields
+        if (!has_literal) {
+            reader_read_literal(reader, length, &cache->literal);
+            has_literal = 1;
+        } else {
+            byte_buffer_t discard;
+            buffer_init(&discard);
+            reader_read_literal(reader, length, &discard);
+            buffer_free(&discard);
+        }
+        line->len = 0;
+        reader_read_line(reader, line);
+    }
+
+    // Some servers send the UID after the literal
+    if (uid == 0 && (uid_start = strcasestr(line->data, "UID ")) != NULL) {
+        uid = strtoul(uid_start + 4, NULL, 10);
+    }
+
+    if (is_fetch && uid > 0) {
+        response->on_message(cache, uid, has_literal ? cache->literal.data : NULL, cache->literal.len, response->ctx);
+    }
+}
+
+// Read the response to a UID FETCH sent through the session's commands up to its tagged line,
+// handing each message to on_message. Returns the tagged status
+static int read_uid_response(header_cache_t *cache, session_t *session, imap_command_t *fetch, uid_fn_t on_message, void *ctx) {
+    uid_response_t response = {cache, on_message, ctx};
+    int status = command_stream(&session->commands, fetch, read_uid_line, &response);
+    command_free(fetch);
+    return status;
+}
+
+// FETCH items asking for the UID and, unless slot is CACHE_NONE, the slot's header fields
+static void uid_items(char *items, size_t size, int slot, const char *header_items) {
+    if (slot == CACHE_NONE) {
+        snprintf(items, size, "(UID)");
+    } else {
+        snprintf(items, size, "(UID %s)", header_items);
+    }
+}
+
+// State while new messages are read
+typedef struct new_messages {
+    unsigned long from;     // UIDs below this are already cached
+    int slot;
+} new_messages_t;
+
+// uid_fn_t appending messages that are new. UID FETCH n:* also returns the last message when
+// there is none from n on, so older UIDs are skipped
+static void add_new_message(header_cache_t *cache, unsigned long uid, const char *literal, size_t length, void *ctx) {
+    new_messages_t *new = ctx;
+    if (uid < new->from || (cache->count > 0 && uid <= cache->entries[cache->count - 1].uid)) {
+        return;
+    }
+    size_t index = add_entry(cache, uid);
+    if (literal != NULL && new->slot != CACHE_NONE) {
+        set_slot(cache, index, new->slot, literal, length);
+    }
+    cache->dirty = 1;
+}
+
+// uid_fn_t collecting the UIDs of the whole folder in order, ctx is a uid_list_t
+typedef struct uid_list {
+    unsigned long *uids;
+    size_t count;
+    size_t size;
+} uid_list_t;
+
+static void collect_uid(header_cache_t *cache, unsigned long uid, const char *literal, size_t length, void *ctx) {
+    uid_list_t *list = ctx;
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 1024;
+        list->uids = realloc(list->uids, list->size * sizeof(unsigned long));
+        if (list->uids == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(5);
+        }
+    }
+    list->uids[list->count++] = uid;
+}
+
+// uid_fn_t storing the headers of a cached message, ctx points to the slot
+static void store_headers(header_cache_t *cache, unsigned long uid, const char *literal, size_t length, void *ctx) {
+    int slot = *(int *)ctx;
+    size_t index = lower_bound(cache, uid);
+    if (literal != NULL && index < cache->count && cache->entries[index].uid == uid) {
+        set_slot(cache, index, slot, literal, length);
+    }
+}
+
+// Replace the entries by the folder's UIDs, keeping the headers of messages still there
+static void sweep_uids(header_cache_t *cache, session_t *session) {
+    uid_list_t list = {NULL, 0, 0};
+
+    // FETCH 1:* is an error on an empty folder
+    if (session->mailbox.exists > 0) {
+        imap_command_t *fetch = command_send(&session->commands, "FETCH 1:* (UID)");
+        if (read_uid_response(cache, session, fetch, collect_uid, &list) != IMAP_OK) {
+            list.count = 0;
+        }
+    }
+
+    cache_entry_t *old = cache->entries;
+    size_t old_count = cache->count;
+    cache->entries = NULL;
+    cache->count = cache->size = 0;
+
+    // Both are in ascending UID order, so one pass matches them up
+    size_t j = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        while (j < old_count && old[j].uid < list.uids[i]) {
+            j++;
+        }
+        size_t index = add_entry(cache, list.uids[i]);
+        if (j < old_count && old[j].uid == list.uids[i]) {
+            cache->entries[index] = old[j];
+        }
+    }
+
+    free(old);
+    free(list.uids);
+    cache->dirty = 1;
+}
+
+// Bring the entries up to date with the folder: new messages are fetched from the cached UIDNEXT
+// on (with the header fields of slot), and the UIDs are swept if the count still does not match.
+// Returns 0 if the entries still do not match the folder
+static int sync_cache(header_cache_t *cache, session_t *session, int slot, const char *header_items) {
+    const mailbox_t *mailbox = &session->mailbox;
+
+    if (cache->uidnext < mailbox->uidnext) {
+        char items[BUFFER_SIZE];
+        new_messages_t new = {cache->uidnext ? cache->uidnext : 1, slot};
+
+        uid_items(items, sizeof(items), slot, header_items);
+        imap_command_t *fetch = command_send(&session->commands, "UID FETCH %lu:* %s", new.from, items);
+        read_uid_response(cache, session, fetch, add_new_message, &new);
+
+        unsigned long next = cache->count > 0 ? cache->entries[cache->count - 1].uid + 1 : 1;
+        cache->uidnext = mailbox->uidnext > next ? mailbox->uidnext : next;
+        cache->dirty = 1;
+    }
+
+    if (cache->count != mailbox->exists) {
+        sweep_uids(cache, session);
+    }
+    return cache->count == mailbox->exists;
+}
+
+// Fetch the slot's header fields for the entries in ranges first[i]..last[i]-1 that do not have
+// them, in UID sets of up to MAX_UID_SET characters. Returns 0 if some are still missing afterwards
+static int fill_missing(header_cache_t *cache, session_t *session, const size_t *first, const size_t *last, size_t ranges,
+                        int slot, const char *header_items) {
+    char items[BUFFER_SIZE];
+    uid_items(items, sizeof(items), slot, header_items);
+
+    byte_buffer_t command;
+    buffer_init(&command);
+
+    size_t range = 0;
+    size_t i = ranges > 0 ? first[0] : 0;
+    while (range < ranges) {
+        command.len = 0;
+        buffer_append(&command, "UID FETCH ", 10);
+        size_t set_start = command.len;
+
+        // Runs of missing entries become ranges, "4:9,12,15:20"
+        while (range < ranges && command.len - set_start < MAX_UID_SET) {
+            if (i >= last[range]) {
+                if (++range < ranges) {
+                    i = first[range];
+                }
+                continue;
+            }
+            if (cache->entries[i].length[slot] != CACHE_MISSING) {
+                i++;
+                continue;
+            }
+            size_t run = i;
+            while (run + 1 < last[range] && cache->entries[run + 1].length[slot] == CACHE_MISSING) {
+                run++;
+            }
+
+            char uids[48];
+            const char *comma = command.len > set_start ? "," : "";
+            int len = (run == i) ? snprintf(uids, sizeof(uids), "%s%lu", comma, cache->entries[i].uid)
+                                 : snprintf(uids, sizeof(uids), "%s%lu:%lu", comma, cache->entries[i].uid, cache->entries[run].uid);
+            buffer_append(&command, uids, len);
+            i = run + 1;
+        }
+
+        if (command.len == set_start) {
+            break;
+        }
+        buffer_append(&command, " ", 1);
+        buffer_append(&command, items, strlen(items));
+        imap_command_t *fetch = command_send(&session->commands, "%s", command.data);
+        read_uid_response(cache, session, fetch, store_headers, &slot);
+    }
+    buffer_free(&command);
+
+    for (range = 0; range < ranges; range++) {
+        for (i = first[range]; i < last[range]; i++) {
+            if (cache->entries[i].length[slot] == CACHE_MISSING) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+//////////// Answering commands ///////////////////////////
+
+// Print the list output from the cache
+int header_cache_list(header_cache_t *cache, session_t *session, const command_plan_t *plan) {
+    int slot = plan->cache_slot;
+    if (!sync_cache(cache, session, slot, plan->items)) {
+        return 0;
+    }
+    size_t first = 0, last = cache->count;
+    if (!fill_missing(cache, session, &first, &last, 1, slot, plan->items)) {
+        return 0;
+    }
+
+    subject_list_t subjects;
+    subject_list_init(&subjects);
+    for (size_t i = 0; i < cache->count; i++) {
+        const cache_entry_t *entry = &cache->entries[i];
+        subject_list_add(&subjects, i + 1, cache->text.data + entry->offset[slot], entry->length[slot]);
+    }
+
+    // An empty folder exits, keep what was learnt about it first
+    if (subjects.count == 0 && cache->dirty) {
+        save_cache_file(cache);
+        cache->dirty = 0;
+    }
+    print_subject_list(&subjects);
+
+    subject_list_free(&subjects);
+    return 1;
+}
+
+// Read one end of a sequence set range, "*" is star. Returns 0 if it is not a number
+static int range_value(const char *text, char **end, unsigned long star, unsigned long *value) {
+    if (*text == '*') {
+        *value = star;
+        *end = (char *)text + 1;
+        return 1;
+    }
+    *value = strtoul(text, end, 10);
+    return *end != text && *value > 0;
+}
+
+// Find the entries an element of the -n sequence set stands for, entries first..last-1.
+// Returns 0 if only the server can answer it (e.g. a sequence number past the end of the folder,
+// which the server reports as an error)
+static int resolve_element(const header_cache_t *cache, const char *element, int use_uid, size_t *first, size_t *last) {
+    if (cache->count == 0) {
+        return 0;
+    }
+
+    unsigned long star = use_uid ? cache->entries[cache->count - 1].uid : cache->count;
+    unsigned long low, high;
+    char *end;
+    if (!range_value(element, &end, star, &low)) {
+        return 0;
+    }
+    high = low;
+    if (*end == ':' && !range_value(end + 1, &end, star, &high)) {
+        return 0;
+    }
+    if (*end != '\0') {
+        return 0;
+    }
+    if (low > high) {
+        unsigned long swap = low;
+        low = high;
+        high = swap;
+    }
+
+    if (use_uid) {
+        *first = lower_bound(cache, low);
+        *last = high == ULONG_MAX ? cache->count : lower_bound(cache, high + 1);
+        return 1;
+    }
+
+    if (high > cache->count) {
+        return 0;
+    }
+    *first = low - 1;
+    *last = high;
+    return 1;
+}
+
+// Print the -n messages from the cache, the same way retrieve prints them from the server
+int header_cache_fetch(header_cache_t *cache, session_t *session, const fetch_mail_t *fetch_mail, const command_plan_t *plan) {
+    int slot = plan->cache_slot;
+    const char *sequence = fetch_mail->sequence ? fetch_mail->sequence : "*";
+
+    // The folder's UIDs are only known once list has swept it
+    if (cache->count == 0 || !sync_cache(cache, session, CACHE_NONE, NULL)) {
+        return 0;
+    }
+
+    // Resolve every element first, so nothing is printed unless the cache can answer them all
+    char *elements = strdup(sequence);
+    size_t count = 1;
+    for (char *c = elements; *c; c++) {
+        if (*c == ',') {
+            *c = '\0';
+            count++;
+        }
+    }
+    size_t *first = malloc(count * sizeof(size_t));
+    size_t *last = malloc(count * sizeof(size_t));
+    char **element = malloc(count * sizeof(char *));
+    if (elements == NULL || first == NULL || last == NULL || element == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+
+    int resolved = 1;
+    char *next = elements;
+    for (size_t i = 0; i < count && resolved; i++) {
+        element[i] = next;
+        next += strlen(next) + 1;
+        resolved = resolve_element(cache, element[i], fetch_mail->useUID, &first[i], &last[i]);
+    }
+    resolved = resolved && fill_missing(cache, session, first, last, count, slot, plan->items);
+
+    if (resolved) {
+        // The cached literal is replayed under the response line the server would have sent
+        char item[BUFFER_SIZE];
+        const char *peek = strstr(plan->items, ".PEEK");
+        if (peek != NULL) {
+            snprintf(item, sizeof(item), "%.*s%s", (int)(peek - plan->items), plan->items, peek + 5);
+        } else {
+            snprintf(item, sizeof(item), "%s", plan->items);
+        }
+
+        fetch_context_t context = {plan, is_sequence_set(sequence), fetch_mail, &session->arena};
+        int missing = 0;
+        for (size_t i = 0; i < count; i++) {
+            for (size_t j = first[i]; j < last[i]; j++) {
+                const cache_entry_t *entry = &cache->entries[j];
+                char line[2 * BUFFER_SIZE];
+                if (fetch_mail->useUID) {
+                    snprintf(line, sizeof(line), "* %zu FETCH (UID %lu %s {%zu}\r\n", j + 1, entry->uid, item, entry->length[slot]);
+                } else {
+                    snprintf(line, sizeof(line), "* %zu FETCH (%s {%zu}\r\n", j + 1, item, entry->length[slot]);
+                }
+
+                memory_source_t source = {cache->text.data + entry->offset[slot], entry->length[slot], 0};
+                transport_t transport;
+                transport_memory(&transport, &source);
+                imap_reader_t reader;
+                reader_init(&reader, &transport);
+                handle_message(&reader, line, entry->length[slot], &context);
+            }
+
+            // A single UID that is not in the folder, as retrieve reports it
+            if (first[i] == last[i] && !strchr(element[i], ':')) {
+                if (!context.multiple) {
+                    printf("Message not found\n");
+                    header_cache_close(cache);
+                    exit(3);
+                }
+                printf("Message %s not found\n", element[i]);
+                missing = 1;
+            }
+        }
+
+        if (missing) {
+            header_cache_close(cache);
+            exit(3);
+        }
+    }
+
+    free(element);
+    free(first);
+    free(last);
+    free(elements);
+    return resolved;
+}
@@ -0,0 +1,47 @@
+#ifndef HEADER_CACHE_H
+#define HEADER_CACHE_H
+
+#include <limits.h>
+
+#include "session.h"
+
+// Length of a slot whose headers have not been fetched yet
+#define CACHE_MISSING ((size_t)-1)
+
+// One message of the folder. The header fields of each slot are a span of the cache's text
+typedef struct cache_entry {
+    unsigned long uid;
+    size_t offset[CACHE_SLOTS];
+    size_t length[CACHE_SLOTS];
+} cache_entry_t;
+
+// Headers of one folder, keyed by UID and kept on disk between runs
+typedef struct header_cache {
+    char path[PATH_MAX];
+    byte_buffer_t key;          // server, port, user and folder the file belongs to
+    unsigned long uidvalidity;
+    unsigned long uidnext;      // every message below this UID has an entry
+    cache_entry_t *entries;     // ascending UID, so once synced entry i is message i + 1
+    size_t count;
+    size_t size;
+    byte_buffer_t text;         // the file as loaded, with newly fetched headers appended
+    byte_buffer_t literal;      // scratch for the literal being read
+    int dirty;                  // changed since it was loaded
+} header_cache_t;
+
+// Load the cache for the session's folder. Returns 0 if there is no cache to use (turned off, or
+// the server does not send UIDVALIDITY and UIDNEXT)
+int header_cache_open(header_cache_t *cache, const session_t *session, const fetch_mail_t *fetch_mail);
+
+// Write the cache back if it changed and free it
+void header_cache_close(header_cache_t *cache);
+
+// Print the list output from the cache, fetching only what is new. Returns 0 if it could not
+int header_cache_list(header_cache_t *cache, session_t *session, const command_plan_t *plan);
+
+// Print the -n messages from the cache, for commands fetching only header fields. Returns 0 if
+// the cache cannot answer (nothing cached yet, or an element it cannot resolve), nothing is
+// printed then and the command should go to the server
+int header_cache_fetch(header_cache_t *cache, session_t *session, const fetch_mail_t *fetch_mail, const command_plan_t *plan);
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "header_index.h"
+#include "scan.h"
+
+/***
+ * Header index for parse. One pass over the header block finds each field's name and value, and
+ * a small open addressing hash on the name in lower case chains the fields with the same name, so
+ * looking up any number of fields costs one probe each instead of a scan of the whole block.
+ * Nothing is copied: fields are spans of the block, and folds are only undone when a value is
+ * printed. Everything is allocated from the message's arena.
+*/
+
+// FNV-1a of the name in lower case
+static unsigned hash_name(const char *name, size_t len) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)tolower((unsigned char)name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to find the slot for a name: the one holding it, or the empty one it would go in
+static header_slot_t *find_slot(const header_index_t *index, const char *name, size_t len, unsigned hash) {
+    size_t mask = index->slot_count - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        header_slot_t *slot = &index->slots[i];
+        if (slot->first == NULL) {
+            return slot;
+        }
+        const mime_span_t *other = &slot->first->name;
+        if (slot->hash == hash && other->length == len && strncasecmp(index->text + other->offset, name, len) == 0) {
+            return slot;
+        }
+    }
+}
+
+// Function to double the slots, the old ones are left to the arena
+static void grow_slots(header_index_t *index) {
+    header_slot_t *old = index->slots;
+    size_t old_count = index->slot_count;
+
+    index->slot_count = old_count * 2;
+    index->slots = arena_alloc(index->arena, index->slot_count * sizeof(header_slot_t));
+    memset(index->slots, 0, index->slot_count * sizeof(header_slot_t));
+    for (size_t i = 0; i < old_count; i++) {
+        if (old[i].first != NULL) {
+            const mime_span_t *name = &old[i].first->name;
+            *find_slot(index, index->text + name->offset, name->length, old[i].hash) = old[i];
+        }
+    }
+}
+
+// Function to add a field to the chain of its name
+static void add_field(header_index_t *index, mime_span_t name, mime_span_t value) {
+    if (2 * (index->names + 1) > index->slot_count) {
+        grow_slots(index);
+    }
+
+    header_field_t *field = arena_alloc(index->arena, sizeof(header_field_t));
+    field->name = name;
+    field->value = value;
+    field->next = NULL;
+    index->count++;
+
+    unsigned hash = hash_name(index->text + name.offset, name.length);
+    header_slot_t *slot = find_slot(index, index->text + name.offset, name.length, hash);
+    if (slot->first == NULL) {
+        slot->hash = hash;
+        slot->first = field;
+        index->names++;
+    } else {
+        slot->last->next = field;
+    }
+    slot->last = field;
+}
+
+void header_index_build(header_index_t *index, const char *text, size_t len, arena_t *arena) {
+    index->text = text;
+    index->arena = arena;
+    index->slot_count = HEADER_INDEX_SLOTS;
+    index->slots = arena_alloc(arena, HEADER_INDEX_SLOTS * sizeof(header_slot_t));
+    memset(index->slots, 0, HEADER_INDEX_SLOTS * sizeof(header_slot_t));
+    index->names = index->count = 0;
+
+    const char *p = text;
+    const char *end = text + len;
+    while (p < end) {
+        // Empty lines (and the blank line ending the block) are skipped
+        if (*p == '\r' || *p == '\n') {
+            p++;
+            continue;
+        }
+
+        // The line runs to a line break that is not a fold
+        const char *line = p;
+        const char *eol = scan_eol(p, end);
+        while (eol != NULL && eol + 2 < end && eol[0] == '\r' && eol[1] == '\n' && (eol[2] == ' ' || eol[2] == '\t')) {
+            eol = scan_eol(eol + 2, end);
+        }
+        p = eol != NULL ? eol : end;
+
+        // The first colon ends the name
+        const char *colon = memchr(line, ':', p - line);
+        if (colon != NULL) {
+            mime_span_t name = {line - text, colon - line};
+            mime_span_t value = {colon + 1 - text, p - colon - 1};
+            add_field(index, name, value);
+        }
+    }
+}
+
+const header_field_t *header_index_find(const header_index_t *index, const char *name, size_t len) {
+    return find_slot(index, name, len, hash_name(name, len))->first;
+}
+
+void header_print_value(const header_index_t *index, const header_field_t *field, FILE *out) {
+    const char *p = index->text + field->value.offset;
+    const char *end = p + field->value.length;
+
+    // Each fold (CRLF and the spaces and tabs after it) becomes one space
+    char *value = arena_alloc(index->arena, field->value.length + 1);
+    size_t len = 0;
+    const char *fold;
+    while ((fold = scan_fold(p, end)) != NULL) {
+        memcpy(value + len, p, fold - p);
+        len += fold - p;
+        value[len++] = ' ';
+        p = fold + 2;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+    }
+    memcpy(value + len, p, end - p);
+    len += end - p;
+
+    size_t start = 0;
+    while (start < len && value[start] == ' ') {
+        start++;
+    }
+    while (len > start && value[len - 1] == ' ') {
+        len--;
+    }
+    fwrite(value + start, 1, len - start, out);
+}
@@ -0,0 +1,54 @@
+#ifndef HEADER_INDEX_H
+#define HEADER_INDEX_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "mime.h"
+
+// Slots the index starts with, it doubles when half of them are in use
+#define HEADER_INDEX_SLOTS 32
+
+// Fields parse prints when --headers is not given
+#define DEFAULT_HEADERS "From,To,Date,Subject"
+
+typedef struct header_field header_field_t;
+
+// One header field of the block, as spans into it. The value is as sent, folds included
+struct header_field {
+    mime_span_t name;
+    mime_span_t value;
+    header_field_t *next;   // next field with the same name, in the order they appear
+};
+
+// Every field with one name
+typedef struct header_slot {
+    unsigned hash;          // of the name in lower case
+    header_field_t *first;  // NULL for an empty slot
+    header_field_t *last;
+} header_slot_t;
+
+// Fields of a header block by name, built in one pass and kept in an arena
+typedef struct header_index {
+    const char *text;
+    header_slot_t *slots;
+    size_t slot_count;      // a power of two
+    size_t names;           // slots in use
+    size_t count;           // fields
+    arena_t *arena;
+} header_index_t;
+
+// Function to index the header block [text, text + len). Lines are split at CR and LF, a CRLF
+// followed by a space or tab continues the line (RFC 5322 folding). Lines without a colon are
+// passed over
+void header_index_build(header_index_t *index, const char *text, size_t len, arena_t *arena);
+
+// Function to find the first field called name (any case), NULL if there is none. The others
+// follow through next
+const header_field_t *header_index_find(const header_index_t *index, const char *name, size_t len);
+
+// Function to write a field's value with folds undone and the spaces around it trimmed
+void header_print_value(const header_index_t *index, const header_field_t *field, FILE *out);
+
+#endif
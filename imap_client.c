@@ -5,10 +5,17 @@
 #include "string.h"
 
 #include "imap_client.h"
+#include "command.h"
 
 #include "server_response.h"
 
 #include "utils.h"
+#include "scan.h"
+#include "mime.h"
+#include "decode.h"
+#include "bodystructure.h"
+#include "header_index.h"
+#include "stats.h"
 
 // Implement functions to connect to the imap server using sockets
 // Functions to log in, select folder, fetch messages, and other IMAP commands.
@@ -20,133 +27,9 @@ void error(const char *msg, int num) {
     exit(num);
 }
 
-// Function to create connection to a socket with specific port
-int create_connection(const char *hostname, const char *port) {
-    struct addrinfo hints, *res, *res0; 
-    // hints: used to provide criteria for selecting the desired socket address structures.
-    // *res0: points to a linked list of address structures
-    // res: temporary pointer used for iterating through the *res list
-    int sockfd; // holds file decriptor of the socket
-
-    memset(&hints, 0, sizeof(hints)); // initialises hints structure to all zeros
-    hints.ai_family = AF_UNSPEC; // Allows IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // we want a stream socket (TCP)
-
-    // Now we create a linked list of struct addrinfo each containing address information that can be used to create a socket
-    // with res0 pointing to the head of the linked list 
-    // the hints structure guides the type of addresses returned
-    if (getaddrinfo(hostname, port, &hints, &res0) != 0) {
-        fprintf(stderr, "error: getaddressinfo\n");
-        exit(1); 
-    }
-
-
-    for (res = res0; res; res = res->ai_next) {
-        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        // create socket using address family, socket type and protocol specified in res (current addrinfo struct)
-        // If successful, sockfd will hold a non-negative file descriptor for the socket.
-        
-        if (sockfd < 0) {
-            continue;
-        }
-
-        if (connect(sockfd, res->ai_addr, res->ai_addrlen) == 0) {
-            break; // successful connection to the address specified by the res (current addrinfo struct)
-            // loop breaks, we have connected the socket. 
-        }
-
-        close(sockfd); // if connection attempt fails, socket is closed
-        // continue looping to try the next address in the list. 
-
-    }
-
-    freeaddrinfo(res0); 
-
-    return sockfd; 
-
-}
-
-// send_command function 
-// sends a string (command) to the server over the socket connection (represented by sockfd)
-void send_command(int sockfd, const char *cmd) {
-    int len = strlen(cmd);
-    int total_sent = 0;  // Total bytes sent so far
-    int bytes_left = len;  // Bytes left to send
-    int bytes_sent;
-
-    // write system call transmits the command string to the server
-    // sockfd: Specifies the file descriptor of the socket, which identifies the connection to the server.
-    // cmd: the command string to be sent
-    // len: tell write() the exact number of bytes to send from the buffer
-
-     // Continuously attempt to write until all bytes are sent
-    while (bytes_left > 0) {
-        bytes_sent = write(sockfd, cmd + total_sent, bytes_left);
-        if (bytes_sent < 0) {
-            // Error handling
-            perror("Failed to write to socket");
-            exit(1); // Exit or handle error appropriately
-        }
-        total_sent += bytes_sent;  // Update total bytes sent
-        bytes_left -= bytes_sent;  // Decrease the byte count remaining
-    }
-
-
-}
-
-
-// now we have to read the response from the server
-void read_response(int sockfd, const char* tag) {
-    // could change to the respnse instead 
-    char buffer[BUFFER_SIZE]; // character array to store received data
-    memset(buffer, 0, BUFFER_SIZE); // initialises buffer with zeros to ensure no residual data from previous
-    int numBytes = read(sockfd, buffer, BUFFER_SIZE - 1); // Attempts to read data from the socket with file descriptor sockfd into the buffer. It reads a maximum of BUFFER_SIZE - 1 bytes to leave room for the null terminator (\0) that will be added later.
-    if (numBytes < 0) {
-        // if negative, an error occured during reading.
-        error("ERROR reading from socket", 2);
-    } else if (numBytes == 0) {
-        // Immediate disconnect
-        fprintf(stderr, "Server disconnected immediately\n");
-        close(sockfd);
-        exit(2); // or exit(3), depending on the specific requirements
-    }
-
-    buffer[numBytes] = '\0'; // null terminator to make it a string
-
-    // Check for specific login failure response
-    if (strstr(buffer, "A01 NO [AUTHENTICATIONFAILED]")) { 
-        printf("Login failure\n");
-        exit(3);  // Exit with status code 3
-    }
-
-    // Check if folder not found 
-    if (strstr(buffer, "A02 NO")) {
-        printf("Folder not found\n");
-        exit(3);
-    }
-
-
-}
-
-
-// Function to log into the server
-void login(int sockfd, const char* username, const char* password) {
-    char command[BUFFER_SIZE]; // Buffer to hold the complete command string
-
-    // Format the login command according to the IMAP protocol
-    snprintf(command, sizeof(command), "A01 LOGIN %s %s\r\n", username, password); 
-
-    // send the login command to the server
-    send_command(sockfd, command); 
-
-    // Read the response to the login command
-    read_response(sockfd, "A01"); // pass tag used in the login command
-}
-
-// Function to select a folder we want to read from 
-void select_folder(int sockfd, const char *folder_name) {
-    char command[BUFFER_SIZE];
-
+// Function to quote a folder name for a command, "INBOX" if it is empty. size should be at
+// least 2*BUFFER_SIZE + 2
+void quote_folder(const char *folder_name, char *quoted, size_t size) {
     // Use "INBOX" if folder_name is NULL or empty
     if (folder_name == NULL || strlen(folder_name) == 0) {
         folder_name = "INBOX";
@@ -154,8 +37,8 @@ void select_folder(int sockfd, const char *folder_name) {
 
     // Escape double quotes and backslashes in folder_name
     char escaped_name[2*BUFFER_SIZE]; // Allow for potential doubling in size
-    int i, j = 0;
-    for (i = 0; folder_name[i] != '\0'; i++) {
+    size_t j = 0;
+    for (size_t i = 0; folder_name[i] != '\0' && j < sizeof(escaped_name) - 2; i++) {
         if (folder_name[i] == '"' || folder_name[i] == '\\') {
             escaped_name[j++] = '\\';
         }
@@ -163,855 +46,572 @@ void select_folder(int sockfd, const char *folder_name) {
     }
     escaped_name[j] = '\0'; // Null-terminate the escaped string
 
-    // Construct SELECT command with quoted and escaped folder name
-    snprintf(command, 3*BUFFER_SIZE, "A02 SELECT \"%s\"\r\n", escaped_name);
-
-    // send the command to server
-    send_command(sockfd, command); 
-
-    // read the response
-    read_response(sockfd, "A02");
-}
-
-
-// If command is retrieve, we fetch the email
-void retrieve(int sockfd, int message_num, list_t *packet_list) {
-    // The command is retrieve, we need to fetch the email:
-    // tag FETCH messageNum BODY.PEEK[]
-
-    // if messageNum = -1, it means the message sequence number was not specified on the command line 
-    // fetch the last added message in the folder 
-
-    char command[BUFFER_SIZE];
-
-    if (message_num == -1) {
-        // Fetch the last message (assuming UIDNEXT is available form SELECT)
-        snprintf(command, BUFFER_SIZE, "A03 FETCH * BODY.PEEK[]\r\n");
-    } else {
-        // Fetch a specific message with messageNum
-        snprintf(command, BUFFER_SIZE, "A03 FETCH %d BODY.PEEK[]\r\n", message_num);
-    }
-
-    // Now we sent the FETCH command
-    send_command(sockfd, command); 
-
-
-    // Read the response and store packets in a linked list 
-    char buffer[BUFFER_SIZE];
-
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int numBytes = read(sockfd, buffer, BUFFER_SIZE -1); 
-        if (numBytes < 0) {
-            error("ERROR reading from socket", 1);
-        }
-        buffer[numBytes] = '\0';
-
-
-        // Check for continuation ("+") response
-        if (buffer[0] == '+') {
-            // More data is coming, store what we have so far
-            insert_at_foot(packet_list, buffer + 1, NULL); // Skip the "+"
-        } else {
-            // Not a continuation, store the entire line
-            insert_at_foot(packet_list, buffer, NULL); 
-        }
-
-        // Check for tagged response
-        if (strstr(buffer, "A03 OK")) {
-            break;  // Exit the loop after storing the last packet
-        }
-
-        // Check for message not found error
-        if (strstr(buffer, "A03 NO")) {
-            printf("Message not found\n");
-            free_list(packet_list); // Free the list before exiting
-            exit(3);  // Exit with status 3
-        }
-
-        if (strstr(buffer, "A03 BAD")) {
-            printf("Message not found\n");
-            free_list(packet_list); // Free the list before exiting
-            exit(3);  // Exit with status 3
-        }
-
-    }
-
+    snprintf(quoted, size, "\"%s\"", escaped_name);
 }
 
+// Function to build the SELECT command for a folder, size should be at least 3*BUFFER_SIZE
+void select_command(const char *folder_name, char *command, size_t size) {
+    char quoted[2*BUFFER_SIZE + 2];
+    quote_folder(folder_name, quoted, sizeof(quoted));
 
-// function that decode MIME messages
-void mime(int sockfd, list_t *packet_list) {
-    
-    // Concatenate all packets into a single buffer 
-    char *buffer = concatenate_packets(packet_list); 
-
-    // Now find the MIME boundary
-    char *boundary = find_mime_boundary(buffer);
-
-    // Now we have to parse and decode the MIME parts
-
-    // Content-Type: text/plain with charset=UTF-8
-    // Content-Transfer-Encoding: quoted-printable | 7 bit | 8 bit
-    
-    parse_mime_parts(buffer, boundary); 
-
-    free(boundary); 
-    free(buffer); 
-    return;
-
+    // Construct SELECT command with quoted and escaped folder name
+    snprintf(command, size, "A02 SELECT %s\r\n", quoted);
 }
 
+// Function to pick the folder state out of one line of a SELECT (or later untagged) response:
+// "* <n> EXISTS", "* OK [UIDVALIDITY <n>]" and "* OK [UIDNEXT <n>]"
+void parse_mailbox_line(const char *line, mailbox_t *mailbox) {
+    unsigned long value;
+    char *code;
 
-// Helper function to concatenate packets into a single buffer 
-char *concatenate_packets(list_t *packet_list) {
-    // calcualte the total size needed
-    size_t total_size = 0; 
-    
-    node_t *current = packet_list ->head; 
-
-    while (current != NULL) {
-        total_size += strlen(current->packet); 
-        current = current->next; 
-
-    }
-    // Allocate memory for the concatenated buffer
-    char *buffer = (char *)malloc(total_size + 1); 
-    if (buffer == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1); 
-    }
-
-    // Copy packet data into the buffer
-    buffer[0] = '\0';
-    current = packet_list->head; 
-    while(current != NULL) {
-        strcat(buffer, current->packet); 
-        current = current->next; 
+    if (sscanf(line, "* %lu", &value) == 1 && strcasestr(line, " EXISTS")) {
+        mailbox->exists = value;
+    } else if ((code = strcasestr(line, "[UIDVALIDITY ")) != NULL) {
+        mailbox->uidvalidity = strtoul(code + 13, NULL, 10);
+    } else if ((code = strcasestr(line, "[UIDNEXT ")) != NULL) {
+        mailbox->uidnext = strtoul(code + 9, NULL, 10);
     }
-
-    return buffer; 
 }
 
+// Function to read the folder state from a whole SELECT response
+void parse_select_response(const char *response, mailbox_t *mailbox) {
+    mailbox->exists = mailbox->uidvalidity = mailbox->uidnext = 0;
 
-// Locate and extract the boundary parameter from MIME headers 
-char *find_mime_boundary(const char *content) {
-
-    
-    // Search for the MIME-Version header (case-insensitive)
-    char *mime_start = strcasestr(content, "mime-version: 1.0");
-    if (!mime_start) {
-        return NULL;
+    // One line at a time, so nothing is matched across lines
+    char line[BUFFER_SIZE];
+    const char *start = response;
+    while (*start != '\0') {
+        size_t len = strcspn(start, "\n");
+        snprintf(line, sizeof(line), "%.*s", (int)len, start);
+        parse_mailbox_line(line, mailbox);
+        start += len + (start[len] == '\n');
     }
+}
 
-    // Search for the Content-Type header with boundary parameter (case-insensitive)
-    char *boundary_start = strcasestr(mime_start, "boundary=");
-    if (!boundary_start) {
-        return NULL;
-    }
 
-    // Move pointer to the start of the boundary value
-    boundary_start += strlen("boundary=");
+// The FETCH data items each command needs, so only retrieve and mime download the body
+// (mime on a session fetches just the part it prints, see retrieve_mime_parts)
+// retrieve streams the body to stdout as it arrives instead of holding it in memory
+static const command_plan_t command_plans[] = {
+    {"retrieve", "BODY.PEEK[]", 0, CACHE_NONE, stream_message_retrieve},
+    {"mime", "BODY.PEEK[]", 0, CACHE_NONE, mime_message},
+    {"parse", "BODY.PEEK[HEADER.FIELDS (FROM TO DATE SUBJECT)]", 0, CACHE_PARSE, parse_message},
+    {"list", "BODY.PEEK[HEADER.FIELDS (SUBJECT)]", 1, CACHE_SUBJECT, collect_subject},
+    {"export", "(UID BODY.PEEK[])", 1, CACHE_NONE, NULL},
+    {NULL, NULL, 0, CACHE_NONE, NULL}
+};
 
-    // Handle potential double quotes around the boundary value
-    char *boundary_end;
-    if (*boundary_start == '\"') {
-        boundary_start++;
-        boundary_end = strchr(boundary_start, '\"');
-        if (!boundary_end) {
-            return NULL;
-        }
-    } else {
-        // In case boundary value is not quoted
-        boundary_end = strpbrk(boundary_start, ";\n");
-        if (!boundary_end) {
-            boundary_end = boundary_start + strlen(boundary_start);
+// Function to look up the plan for a command, returns NULL for unknown commands
+const command_plan_t *plan_command(const char *command) {
+    for (int i = 0; command_plans[i].name != NULL; i++) {
+        if (strcmp(command_plans[i].name, command) == 0) {
+            return &command_plans[i];
         }
     }
+    return NULL;
+}
 
-    // Calculate the length of the boundary value
-    size_t boundary_length = boundary_end - boundary_start;
-
-    // Allocate memory for the actual boundary value
-    char *boundary = (char *)malloc(boundary_length + 1);
-    if (!boundary) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return NULL;
+// Function to apply the options that change what a command fetches: parse --headers fetches the
+// fields asked for, and passes over the header cache, which only holds the default ones
+const command_plan_t *plan_options(const command_plan_t *plan, const fetch_mail_t *fetch_mail, custom_plan_t *custom) {
+    if (fetch_mail->headers == NULL || strcmp(plan->name, "parse") != 0) {
+        return plan;
     }
 
-    // Copy the boundary value into the allocated memory
-    strncpy(boundary, boundary_start, boundary_length);
-    boundary[boundary_length] = '\0';
-
-    return boundary;
+    custom->plan = *plan;
+    custom->plan.cache_slot = CACHE_NONE;
 
+    // parse_args keeps the list under MAX_HEADER_SIZE, the names are sent the way the default ones are
+    size_t len = snprintf(custom->items, sizeof(custom->items), "BODY.PEEK[HEADER.FIELDS (");
+    for (const char *p = fetch_mail->headers; *p != '\0'; p++) {
+        custom->items[len++] = *p == ',' ? ' ' : toupper((unsigned char)*p);
+    }
+    snprintf(custom->items + len, sizeof(custom->items) - len, ")]");
+    custom->plan.items = custom->items;
+    return &custom->plan;
 }
 
+// Fetch the messages in sequence for a single-message command (retrieve, parse or mime)
+// A sequence set is split at its commas and one FETCH is sent per element, with up to
+// MAX_PIPELINED_FETCHES in flight at once, so a whole batch shares one session
+void retrieve(command_queue_t *commands, arena_t *arena, const fetch_mail_t *fetch_mail, const command_plan_t *plan) {
+    // The command is retrieve, we need to fetch the email:
+    // tag FETCH messageNum BODY.PEEK[]
+    // parse and mime use the same FETCH with the items from their command plan
 
-// Function to parse and process MIME parts
-void parse_mime_parts(const char *email_content, const char *boundary) {
-    // initial setup and finding the first boundary
-    char delimiter[256];
-    snprintf(delimiter, sizeof(delimiter), "--%s", boundary);
+    // if messageNum is not given on the command line fetch the last added message in the folder 
+    const char *sequence = fetch_mail->sequence;
+    int use_uid = fetch_mail->useUID;
+    fetch_context_t context = {plan, is_sequence_set(sequence), fetch_mail, arena};
+    size_t count;
+    char **element = split_sequence(sequence, &count);
 
-    // Find the first boundary delimiter
-    char *part = strstr(email_content, delimiter);
-    if (!part) {
-        printf("Error: Boundary delimiter not found\n");
-        return;
+    imap_command_t **fetches = malloc(count * sizeof(imap_command_t *));
+    if (fetches == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
     }
-    // part = contains everything from the boundary including the boundary itself
+    char command[BUFFER_SIZE];
+    size_t sent = 0;
+    int missing = 0;
 
-    // Process each MIME part
-    while (part) {
-        // Skips past the boundary
-        part += strlen(delimiter);
-        if (*part == '-' && *(part + 1) == '-') {
-            break;  // Reached the end of the MIME parts
+    for (size_t done = 0; done < count; done++) {
+        // Keep the pipeline full before waiting on the oldest FETCH
+        while (sent < count && sent - done < MAX_PIPELINED_FETCHES) {
+            fetch_command(command, sizeof(command), element[sent], use_uid, plan);
+            fetches[sent++] = command_send(commands, "%s", command);
         }
 
-        unfold_headers_mime(part); 
-        
-        // // Move to the next CRLF after the boundary delimiter
-        part = strstr(part, "\n");
-        if (!part) part = strstr(part, "\r\n");
-        if (!part) break;
-        part += (part[0] == '\r') ? 2 : 1;  // Move past the line ending
-
-
-        // Find the headers end (empty line)
-        char *headers_end = strstr(part, "\r\n\r\n");
-        if (!headers_end) break;
-
-        // Extract headers
-        char headers[1024];
-        strncpy(headers, part, headers_end - part);
-        headers[headers_end - part] = '\0';
-        //printf("Headers: %s\n", headers);  // Debug print
-
-        // Move to the body part
-        part = headers_end + 4;
-
-        // Check Content-Type and Content-Transfer-Encoding headers
-        char *content_type = NULL;
-        char *encoding = NULL;
-        parse_headers(headers, &content_type, &encoding);
-
-        // Validate headers
-        if (!content_type || !strcasestr(content_type, "text/plain") || !strcasestr(content_type, "charset=UTF-8")) {
-            printf("Error: Invalid Content-Type or charset\n");
-            exit(4);
-        }
+        int found;
+        int status = command_fetch(commands, fetches[done], handle_message, &context, &found);
+        command_free(fetches[done]);
 
-        if (!encoding || !(strcasestr(encoding, "quoted-printable") || strcasestr(encoding, "7bit") || strcasestr(encoding, "8bit"))) {
-            printf("Error: Invalid Content-Transfer-Encoding\n");
-            exit(4);
-        }
-        
-
-        // Process the first text/plain part with charset=UTF-8
-        if (content_type && strcasestr(content_type, "text/plain") && strcasestr(content_type, "charset=UTF-8")) {
-            char body[10240];  // Adjust size if necessary
-            
-            strncpy(body, part, sizeof(body) - 1);
-            body[sizeof(body) - 1] = '\0';
-
-            char *result = get_body_up_to_boundary(part, boundary); // Cut the part into just the part we want
-            printf("%s", result); // Print the body up to the next boundary delimiter
-           
-            free(result); 
-            return;  // Stop after printing the first matching part
+        // NO/BAD means an invalid sequence number, an OK without any literal means nothing matched
+        if (status != IMAP_OK || (!found && !strchr(element[done], ':'))) {
+            if (!context.multiple) {
+                printf("Message not found\n");
+                exit(3);  // Exit with status 3
+            }
+            printf("Message %s not found\n", element[done]);
+            missing = 1;
         }
-
-        // Find the next boundary delimiter
-        part = strstr(part, delimiter);
     }
 
-    return;
-}
-
+    free(fetches);
+    free(element[0]);
+    free(element);
 
-// Function to parse headers and extract values for Content-Type and Content-Transfer-Encoding for MIME
-void parse_headers(const char *headers, char **content_type, char **encoding) {
-    const char *current = headers;
-    while (*current) {
-        if (strncasecmp(current, "Content-Type:", 13) == 0) {
-            *content_type = (char *)current + 13;
-            while (**content_type == ' ' || **content_type == '\t') (*content_type)++;
-        } else if (strncasecmp(current, "Content-Transfer-Encoding:", 26) == 0) {
-            *encoding = (char *)current + 26;
-            while (**encoding == ' ' || **encoding == '\t') (*encoding)++;
-        }
-        // Move to the next line
-        current = strstr(current, "\r\n");
-        if (!current) break;
-        current += 2;
-        // Handle folded headers (lines starting with space or tab)
-        if (*current == ' ' || *current == '\t') {
-            continue;
-        }
+    if (missing) {
+        exit(3);
     }
 }
 
+// A message mime prints, with the part to print picked from its BODYSTRUCTURE
+typedef struct mime_target {
+    unsigned long number;
+    unsigned long uid;          // 0 if the server did not send it
+    body_structure_t structure; // no parts if it could not be parsed, the whole message is fetched
+    const body_part_t *part;    // the part to print, NULL if the message has none
+    const char *missing;        // the -n element that matched nothing, nothing is fetched
+} mime_target_t;
+
+// State while the sections of one message are read
+typedef struct section_context {
+    fetch_context_t fetch;
+    const body_part_t *part;    // NULL when the whole message is fetched instead
+    int encoding;               // DECODE_*, from the part's header once it has arrived
+    int started;                // the message delimiter has been printed
+} section_context_t;
+
+// Function to check whether the literal announced at the end of line is BODY[name]
+static int literal_is_section(const char *line, const char *name) {
+    const char *item = NULL;
+    for (const char *s = line; (s = strcasestr(s, "BODY[")) != NULL; s++) {
+        item = s;
+    }
+    size_t len = strlen(name);
+    return item != NULL && strncasecmp(item + 5, name, len) == 0 && item[5 + len] == ']';
+}
 
-// Helper function to return the body up to the line before the next boundary delimiter as a string
-char *get_body_up_to_boundary(const char *body, const char *boundary) {
-    char delimiter[256];
-    snprintf(delimiter, sizeof(delimiter), "--%s", boundary);
-
-    // Find the boundary delimiter in the body
-    char *body_end = strstr(body, delimiter);
-
-    // Calculate the length of the body to return
-    size_t body_length;
-    if (body_end) {
-        // Backtrack to find the newline before the boundary
-        char *prev_newline = body_end;
-        while (prev_newline > body && *(prev_newline - 1) != '\n') {
-            prev_newline--;
-        }
-
-        // If there's a \r before \n, include it in body_length
-        if (prev_newline > body && *(prev_newline - 2) == '\r') {
-            prev_newline -= 2;
-        } else if (prev_newline > body && *(prev_newline - 1) == '\n') {
-            prev_newline--;
-        }
-
-        // Set body_length to be up to the line before the boundary
-        body_length = prev_newline - body;
-    } else {
-        body_length = strlen(body);
-    }
-
-    // Allocate memory for the resulting string
-    char *result = (char *)malloc(body_length + 1);
-    if (!result) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+// Function to read a whole literal into the arena, NUL terminated
+static char *read_literal_in(imap_reader_t *reader, size_t length, arena_t *arena) {
+    char *data = arena_alloc(arena, length + 1);
+    size_t done = 0;
+    while (done < length) {
+        done += reader_read_chunk(reader, length - done, data + done, length - done);
     }
-
-    // Copy the body content up to the calculated length
-    strncpy(result, body, body_length);
-    result[body_length] = '\0'; // Null-terminate the string
-
-    return result;
+    data[length] = '\0';
+    return data;
 }
 
+// Function to pass a literal to stdout as it arrives, decoded on the way
+static void stream_decoded(imap_reader_t *reader, size_t length, int encoding, arena_t *arena) {
+    char *in = arena_alloc(arena, STREAM_CHUNK_SIZE);
+    char *out = arena_alloc(arena, DECODE_OUT_SIZE(STREAM_CHUNK_SIZE));
 
-void unfold_headers_mime(char *headers) {
-    int read_pos = 0, write_pos = 0;
-    int len = strlen(headers);
-
-    int content_type_pos = -1;
-    int content_transfer_encoding_pos = -1;
-
-    // Find positions of "Content-Type" and "Content-Transfer-Encoding" headers
-    char *content_type_ptr = strstr(headers, "Content-Type:");
-    if (content_type_ptr) {
-        content_type_pos = content_type_ptr - headers;
+    decoder_t decoder;
+    decoder_init(&decoder, encoding);
+    while (length > 0) {
+        size_t chunk = reader_read_chunk(reader, length, in, STREAM_CHUNK_SIZE);
+        length -= chunk;
+        fwrite(out, 1, decode_update(&decoder, in, chunk, out), stdout);
     }
+    fwrite(out, 1, decode_final(&decoder, out), stdout);
+}
 
-    char *content_transfer_encoding_ptr = strstr(headers, "Content-Transfer-Encoding:");
-    if (content_transfer_encoding_ptr) {
-        content_transfer_encoding_pos = content_transfer_encoding_ptr - headers;
+// literal_fn_t for the sections mime fetched: the part's header tells the encoding, the part's
+// body is printed (decoded with --decode) without holding it in memory
+static void section_literal(imap_reader_t *reader, const char *line, size_t length, void *ctx) {
+    section_context_t *section = ctx;
+    if (section->part == NULL) {
+        handle_message(reader, line, length, &section->fetch);
+        return;
     }
-
-    // Determine the position up to which we need to unfold
-    int unfold_pos = len;
-    if (content_type_pos != -1 && content_transfer_encoding_pos != -1) {
-        unfold_pos = (content_type_pos > content_transfer_encoding_pos) ? content_type_pos : content_transfer_encoding_pos;
-    } else if (content_type_pos != -1) {
-        unfold_pos = content_type_pos;
-    } else if (content_transfer_encoding_pos != -1) {
-        unfold_pos = content_transfer_encoding_pos;
+    if (!section->started && section->fetch.multiple) {
+        print_message_delimiter(line);
     }
+    section->started = 1;
 
-    // Loops through the string and unfold headers up to the determined position
-    while (read_pos < unfold_pos && read_pos + 2 < len) {
-        if (headers[read_pos] == '\r' && headers[read_pos + 1] == '\n' &&
-            (headers[read_pos + 2] == ' ' || headers[read_pos + 2] == '\t')) { 
-            read_pos += 2;
-            while (read_pos < len && (headers[read_pos] == ' ' || headers[read_pos] == '\t')) {
-                read_pos++;
-            }
-        } else {
-            headers[write_pos++] = headers[read_pos++];
-        }
+    if (literal_is_section(line, section->part->headers)) {
+        char *headers = read_literal_in(reader, length, section->fetch.arena);
+        stats_begin(STATS_PARSE);
+        mime_tree_t tree;
+        mime_parse(&tree, headers, length);
+        section->encoding = decode_encoding(headers + tree.parts[0].encoding.offset, tree.parts[0].encoding.length);
+        mime_tree_free(&tree);
+        stats_end(STATS_PARSE);
+        return;
     }
 
-    // Copy any remaining characters that were not folded up to the determined position
-    while (read_pos < len) {
-        headers[write_pos++] = headers[read_pos++];
+    stream_decoded(reader, length, section->fetch.fetch_mail->mimeDecode ? section->encoding : DECODE_IDENTITY,
+                   section->fetch.arena);
+    if (section->fetch.multiple) {
+        printf("\n");
     }
-
-    // Null-terminate the string
-    headers[write_pos] = '\0';
+    fflush(stdout);
 }
 
-// This is for unfolding headers in the PARSE 2.4
-void unfold_header(char *header) {
-    char *src = header, *dst = header;
-    while (*src) {
-        if (*src == '\r' && *(src + 1) == '\n' && (*(src + 2) == ' ' || *(src + 2) == '\t')) {
-            src += 2; // Skip CRLF
-            while (*src == ' ' || *src == '\t') {
-                src++; // Skip the folding whitespace
-            }
+// Function to report a message without the part to print and exit, like mime() does
+static void exit_no_part(const mime_target_t *target, const fetch_mail_t *fetch_mail, int multiple) {
+    if (multiple) {
+        char line[64];
+        if (fetch_mail->useUID) {
+            snprintf(line, sizeof(line), "* %lu FETCH (UID %lu", target->number, target->uid);
         } else {
-            *dst++ = *src++;
+            snprintf(line, sizeof(line), "* %lu FETCH (", target->number);
         }
+        print_message_delimiter(line);
+    }
+    if (fetch_mail->mimePart) {
+        printf("Error: No part %s\n", fetch_mail->mimePart);
+    } else {
+        printf("Error: No text/plain UTF-8 part found\n");
     }
-    *dst = '\0'; // Null-terminate the unfolded header
+    exit(4);
 }
 
-// This trims whitespace to print output appropriately for PARSE 2.4
-void trim_whitespace(char *str) {
-    char *end;
-
-    // Trim leading space
-    while (isspace((unsigned char)*str)) str++;
-
-    if (*str == 0) return;
-
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-
-    // Write new null terminator character
-    end[1] = '\0';
+// Function to queue the FETCH for a target's part (its header and body), or for the whole message
+// if its structure could not be read
+static imap_command_t *send_section_fetch(command_queue_t *commands, const mime_target_t *target,
+                                          const body_part_t *part, const fetch_mail_t *fetch_mail) {
+    int use_uid = fetch_mail->useUID && target->uid != 0;
+    unsigned long key = use_uid ? target->uid : target->number;
+    if (part == NULL) {
+        return command_send(commands, "%sFETCH %lu BODY.PEEK[]", use_uid ? "UID " : "", key);
+    }
+    return command_send(commands, "%sFETCH %lu (BODY.PEEK[%s] BODY.PEEK[%s])", use_uid ? "UID " : "", key,
+                        part->headers, part->section);
 }
 
-// Parse header for subject for MIME 2.4
-void parse_headers_parse(const char *buffer, char *date, char *from, char *to, char *subject) {
-    char line[MAX_HEADER_SIZE];
-    const char *p = buffer;
-
-    date[0] = from[0] = to[0] = subject[0] = '\0';
-    strcpy(subject, " <No subject>");
-
-    char *current_header = NULL;
-    size_t current_length = 0;
-
-    while (*p) {
-        const char *line_start = p;
-        while (*p && *p != '\n') p++;
-        int line_length = p - line_start;
-
-        if (*p == '\n') p++; // Move past the newline
-
-        if (line_length > 0 && line_start[line_length - 1] == '\r') {
-            line_length--; // Remove the CR character
-        }
-
-        strncpy(line, line_start, line_length);
-        line[line_length] = '\0';
-
-        // If the line is a continuation of the previous header (starts with space or tab)
-        if (current_header && (line[0] == ' ' || line[0] == '\t')) {
-            if (current_length + line_length < MAX_HEADER_SIZE) {
-                strcat(current_header, line);
-                current_length += line_length;
+// mime without downloading whole messages: fetch each message's BODYSTRUCTURE, pick the part
+// there, then fetch just that section and its header. Both rounds are pipelined like retrieve.
+// Prints the same as retrieve with the mime plan
+void retrieve_mime_parts(command_queue_t *commands, arena_t *arena, const fetch_mail_t *fetch_mail) {
+    static const command_plan_t structure_plan = {"mime", "(UID BODYSTRUCTURE)", 0, CACHE_NONE, NULL};
+    int multiple = is_sequence_set(fetch_mail->sequence);
+    size_t count;
+    char **element = split_sequence(fetch_mail->sequence, &count);
+
+    mime_target_t *targets = NULL;
+    size_t target_count = 0;
+    size_t target_size = 0;
+    byte_buffer_t response;
+    buffer_init(&response);
+    char command[BUFFER_SIZE];
+    imap_command_t **fetches = malloc(count * sizeof(imap_command_t *));
+    if (fetches == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+
+    // The structure of every message first
+    size_t sent = 0;
+    for (size_t done = 0; done < count; done++) {
+        while (sent < count && sent - done < MAX_PIPELINED_FETCHES) {
+            fetch_command(command, sizeof(command), element[sent], fetch_mail->useUID, &structure_plan);
+            fetches[sent++] = command_send(commands, "%s", command);
+        }
+
+        response.len = 0;
+        buffer_append(&response, "", 0);
+        int status = command_stream(commands, fetches[done], command_collect, &response);
+        command_free(fetches[done]);
+        const char *p = response.data;
+        const char *end = response.data + response.len;
+        int found = 0;
+        stats_begin(STATS_PARSE);
+        while (1) {
+            if (target_count == target_size) {
+                target_size = target_size ? target_size * 2 : 16;
+                targets = realloc(targets, target_size * sizeof(mime_target_t));
+                if (targets == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(5);
+                }
             }
-        } else {
-            // Process the previous header if we have one
-            if (current_header) {
-                unfold_header(current_header);
-                trim_whitespace(current_header);
-                current_header = NULL;
+            mime_target_t *target = &targets[target_count];
+            memset(target, 0, sizeof(mime_target_t));
+            if (!bodystructure_next_fetch(&p, end, &target->number, &target->uid, &target->structure)) {
+                break;
             }
+            target_count++;
+            found = 1;
+        }
+        stats_end(STATS_PARSE);
 
-            // Start a new header
-            if (strncasecmp(line, "Date:", 5) == 0) {
-                current_header = date;
-                strcpy(date, line + 5);
-                current_length = strlen(date);
-            } else if (strncasecmp(line, "From:", 5) == 0) {
-                current_header = from;
-                strcpy(from, line + 5);
-                current_length = strlen(from);
-            } else if (strncasecmp(line, "To:", 3) == 0) {
-                current_header = to;
-                strcpy(to, line + 3);
-                current_length = strlen(to);
-            } else if (strncasecmp(line, "Subject:", 8) == 0) {
-                current_header = subject;
-                strcpy(subject, line + 8);
-                current_length = strlen(subject);
+        // NO/BAD means an invalid sequence number, an OK without any message means nothing matched
+        if (status != IMAP_OK || (!found && !strchr(element[done], ':'))) {
+            if (!multiple) {
+                printf("Message not found\n");
+                exit(3);
             }
+            targets[target_count++].missing = element[done];
         }
     }
+    buffer_free(&response);
+    free(fetches);
 
-    // Process the last header if we have one
-    if (current_header) {
-        unfold_header(current_header);
-        trim_whitespace(current_header);
-    }
-}
-
-
-
-void unfold_headers(char *headers) {
-    int read_pos = 0;
-    int write_pos = 0; // Pointers for reading and writing within the same string
-    int len = strlen(headers); // Total length of the headers string
- 
-
-    // Loops through the string
-    while (read_pos + 2 < len) {
-        // Check if the current position is the "start" of a folded line
-        if (headers[read_pos] == '\r' && headers[read_pos + 1] == '\n' &&
-            (headers[read_pos + 2] == ' ' || headers[read_pos + 2] == '\t')) {
-            // Skip the CRLF (\r\n)
-            read_pos += 2;
-
-            // Insert a single space to replace the CRLF and any following whitespace
-            headers[write_pos++] = ' ';
-
-            // Skip the whitespace that follows the CRLF which indicates line folding
-            while (read_pos < len && (headers[read_pos] == ' ' || headers[read_pos] == '\t')) {
-                read_pos++;
+    // Then the sections, printed in order, each with its FETCH or NULL if none was sent
+    fetches = calloc(target_count, sizeof(imap_command_t *));
+    if (target_count > 0 && fetches == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    int missing = 0;
+    sent = 0;
+    for (size_t done = 0; done < target_count; done++) {
+        while (sent < target_count && sent - done < MAX_PIPELINED_FETCHES) {
+            mime_target_t *target = &targets[sent];
+            const body_structure_t *structure = &target->structure;
+            if (target->missing == NULL && structure->count > 0) {
+                target->part = fetch_mail->mimePart ? bodystructure_find_section(structure, fetch_mail->mimePart)
+                                                    : bodystructure_text_part(structure, fetch_mail->mimeDecode);
             }
-        } else {
-            // If it's not a folded line, copy the character from read position to write position
-            headers[write_pos++] = headers[read_pos++];
+            // A message without the part is reported when its turn comes
+            if (target->missing == NULL && (target->part != NULL || structure->count == 0)) {
+                fetches[sent] = send_section_fetch(commands, target, target->part, fetch_mail);
+            }
+            sent++;
         }
-    }
-
-    // Copies any remaining characters that were not folded to the new structured line
-    while (read_pos < len) {
-        headers[write_pos++] = headers[read_pos++];
-    }
-
-    // Null-terminate the string
-    headers[write_pos] = '\0';
-}
-
-// A function to trim the spaces
-char *trim_spaces(char *str) {
-    char *end;
-
-    // Trim leading space
-    while (*str == ' ') str++;
-
-    if (*str == 0)  // All spaces?
-        return str;
-
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while (end > str && *end == ' ') end--;
-
-    // Write new null terminator
-    *(end + 1) = 0;
 
-    return str;
-}
+        mime_target_t *target = &targets[done];
+        if (target->missing != NULL) {
+            printf("Message %s not found\n", target->missing);
+            missing = 1;
+            continue;
+        }
 
-// Function to print the headers while handling missing headers and formatting
-// correctly
-void print_headers(list_t *header_list) {
-    const char *desired_order[] = {"From", "To", "Date", "Subject",
-                                   NULL}; // Define desired order of headers
-
-    for (int i = 0; desired_order[i] != NULL; i++) {
-        node_t *current =
-            header_list
-                ->head; // Start from the head of the list for each search
-        int found = 0;  // Variable to indicate if the header was found
-
-        while (current != NULL) {
-            if (current->type != NULL &&
-                strcasecmp(current->type, desired_order[i]) == 0) {
-                printf("%s: %s\n", desired_order[i],
-                       current->packet); // Print the header
-                found = 1;               // Set to indicate the header was found
-                break; // Break once the header is found and printed
-            }
-            current = current->next;
+        section_context_t section = {{plan_command("mime"), multiple, fetch_mail, arena}, target->part, DECODE_IDENTITY, 0};
+        if (target->structure.count > 0 && target->part == NULL) {
+            exit_no_part(target, fetch_mail, multiple);
+        }
+        if (target->part != NULL) {
+            section.encoding = decode_encoding(target->part->encoding, strlen(target->part->encoding));
         }
 
-        if (!found) { // If the header was not found, print the expected header
-                      // type followed by a colon
-            if (strcasecmp(desired_order[i], "Subject") == 0) {
-                printf("%s: <No subject>\n", desired_order[i]);
-            } else {
-                printf("%s:\n", desired_order[i]);
+        int found;
+        int status = command_fetch(commands, fetches[done], section_literal, &section, &found);
+        command_free(fetches[done]);
+        fetches[done] = NULL;
+        arena_reset(arena);
+        if (status != IMAP_OK || !found) {
+            if (!multiple) {
+                printf("Message not found\n");
+                exit(3);
             }
+            printf("Message %lu not found\n", fetch_mail->useUID ? target->uid : target->number);
+            missing = 1;
         }
     }
-}
 
-// A function parse the headers and print them correctly
-void parse(int sockfd, int message_num, list_t *header_list) {
-    char command[BUFFER_SIZE];
-
-    // Command construction based on if message num is given or not
-    // Formulation of the fetch command
-    if (message_num == -1) {
-        snprintf(command, BUFFER_SIZE, "A04 FETCH * BODY.PEEK[HEADER.FIELDS (FROM TO DATE SUBJECT)]\r\n");
-    } 
-    else {
-        snprintf(command, BUFFER_SIZE, "A04 FETCH %d BODY.PEEK[HEADER.FIELDS (FROM TO DATE SUBJECT)]\r\n", message_num);
+    for (size_t i = 0; i < target_count; i++) {
+        bodystructure_free(&targets[i].structure);
     }
+    free(fetches);
+    free(targets);
+    free(element[0]);
+    free(element);
 
-    send_command(sockfd, command);
-
-    // Initial memory alloc of dynamic buffer
-    // Memory alloc 
-    char *dynamic_buffer = malloc(BUFFER_SIZE / 2);
-    if (!dynamic_buffer) {
-        error("Memory alloc failed\n", 1);
+    if (missing) {
         exit(3);
     }
-    dynamic_buffer[0] = '\0';
-
-    // Initialise variable for reading in server response to dynamic buffer
-    size_t total_bytes = 0;
-    char read_buffer[BUFFER_SIZE];
-    int num_bytes; // Num bytes read per while loop iteration
-    
-
-    // Read and store while read() is working
-    while ((num_bytes = read(sockfd, read_buffer, BUFFER_SIZE - 1)) > 0) {
-        read_buffer[num_bytes] = '\0';
-        // Realloc dynamic buffer to size required after read() call
-        char *new_buffer = realloc(dynamic_buffer, total_bytes + num_bytes + 1);
-        // Error check if realloc fails
-        if (!new_buffer) {
-            error("Memory Alloc failed\n", 1);
-            free(dynamic_buffer);
-            exit(3);
-        }
-        // Reassigning dynamic buffer with the new bigger size and new data
-        dynamic_buffer = new_buffer;
-        memcpy(dynamic_buffer + total_bytes, read_buffer, num_bytes + 1);
-        total_bytes += num_bytes;
-
-        // If the end of headers has been reached stop reading
-        if (strstr(dynamic_buffer, "\r\n\r\n")) {
-            break;
+}
+
+// Split a -n value into its elements, e.g. "3,7,9:12" -> "3", "7", "9:12". No -n means the last
+// message, "*". The elements share one allocation: free element[0] and then the array
+char **split_sequence(const char *sequence, size_t *count) {
+    char *elements = strdup(sequence ? sequence : "*");
+    *count = 1;
+    for (char *c = elements; c != NULL && *c; c++) {
+        if (*c == ',') {
+            *c = '\0';
+            (*count)++;
         }
     }
 
-    // Check if read() fails to read anything at all
-    if (num_bytes < 0) {
-        error("Unable to read from socket\n", 1);
-        free(dynamic_buffer);
-        exit(3);
+    char **element = malloc(*count * sizeof(*element));
+    if (elements == NULL || element == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
     }
+    element[0] = elements;
+    for (size_t i = 1; i < *count; i++) {
+        element[i] = element[i - 1] + strlen(element[i - 1]) + 1;
+    }
+    return element;
+}
 
-    // Unfolds any folded headers according to RFC5322
-    unfold_headers(dynamic_buffer);
-
-    // Stores the headers into the header_list with one node per header
-    char *line = strtok(dynamic_buffer, "\r\n");
-    while (line) {
-        // Looks for the colon which separates the header type and value
-        char *colon = strchr(line, ':');
-        if (colon) {
-            *colon = '\0';
-            char *header = line; // Store the header, From Date Subject To
-            char *value = colon + 1; // Stores the actual value of the header (section of the string after the colon)
-           
-            // Skip leading spaces
-            while (*value == ' ') {
-                value++;
-            }
+// FETCH command for an element of the sequence set, without its tag and CRLF
+void fetch_command(char *command, size_t size, const char *element, int use_uid, const command_plan_t *plan) {
+    snprintf(command, size, "%sFETCH %s %s", use_uid ? "UID " : "", element, plan->items);
+}
 
-            // Trim trailing spaces
-            value = trim_spaces(value);
+// literal_fn_t for every message of the FETCH response, dispatches to the command's handler
+void handle_message(imap_reader_t *reader, const char *line, size_t length, void *ctx) {
+    fetch_context_t *context = ctx;
 
-            insert_at_foot(header_list, value, header);
-        }
-        line = strtok(NULL, "\r\n");
+    if (context->multiple) {
+        print_message_delimiter(line);
     }
 
-    print_headers(header_list);
+    context->plan->on_message(reader, line, length, ctx);
+    fflush(stdout);
 
-    free(dynamic_buffer);
+    // Nothing parsed from a message outlives it
+    arena_reset(context->arena);
 }
 
+// Handler for mime, the whole message is needed to find the text/plain part
+void mime_message(imap_reader_t *reader, const char *line, size_t length, void *ctx) {
+    fetch_context_t *context = ctx;
+    byte_buffer_t message = {read_literal_in(reader, length, context->arena), length, length + 1};
 
-
-
-// A function to handle the List command
-// A function to read in the server response of email subjects and store in a dynamic buffer
-char* read_subjects(int sockfd) {
-    char command[BUFFER_SIZE];
-    // Formation of command to get subject of each email
-    snprintf(command, BUFFER_SIZE, "A06 FETCH 1:* (BODY[HEADER.FIELDS (SUBJECT)])\r\n");
-
-    send_command(sockfd, command);
-
-    // Initial memory alloc for dynamic buffer with check
-    char *dynamic_buffer = malloc(BUFFER_SIZE);
-    if (!dynamic_buffer) {
-        error("Memory allocation failed", 1);
-        return NULL;
-    }
-
-    // Initialization of variables for reading in the server response into dynamic_buffer as a long string
-    int buffer_len = BUFFER_SIZE;
-    char read_buffer[BUFFER_SIZE]; // Buffer for currently read amount in that while loop iteration
-    int num_bytes = 0;             // Num bytes read in the current while loop
-    int total_bytes = 0;
-
-    // While loop runs until the end of response is reached or socket is closed
-    while ((num_bytes = read(sockfd, read_buffer, BUFFER_SIZE - 1)) > 0) {
-        // If buffer needs to be resized
-        if (total_bytes + num_bytes >= buffer_len - 1) {
-            buffer_len *= 2; // Double the buffer size when approaching the limit
-            char *new_buffer = realloc(dynamic_buffer, buffer_len);
-            // Check if realloc fails
-            if (!new_buffer) {
-                perror("Memory reallocation failed");
-                free(dynamic_buffer);
-                return NULL;
-            }
-            // Assign resized buffer to dynamic buffer
-            dynamic_buffer = new_buffer;
-        }
-        // Copy data to dynamic buffer and update counters
-        memcpy(dynamic_buffer + total_bytes, read_buffer, num_bytes);
-        total_bytes += num_bytes;
-        dynamic_buffer[total_bytes] = '\0'; // Null-terminate the dynamic buffer
-
-        // Check for tagged response to determine when to stop reading
-        if (strstr(dynamic_buffer, "A06 OK") ||
-            strstr(dynamic_buffer, "A06 NO") ||
-            strstr(dynamic_buffer, "A06 BAD")) {
-            break;
-        }
+    stats_begin(STATS_PARSE);
+    mime(&message, context->fetch_mail);
+    stats_end(STATS_PARSE);
+    if (context->multiple) {
+        printf("\n");
     }
-
-    // Error check if read() failed to read anything
-    if (num_bytes < 0) {
-        perror("Unable to read from socket");
-        free(dynamic_buffer);
-        return NULL;
-    }
-
-    return dynamic_buffer;
 }
 
+// Handler for parse, the literal holds just the requested header fields. They are printed in the
+// order they were asked for, a field the message has more than once (e.g. Received) once per line
+void parse_message(imap_reader_t *reader, const char *line, size_t length, void *ctx) {
+    fetch_context_t *context = ctx;
+    char *headers = read_literal_in(reader, length, context->arena);
 
-// A function to store the raw email subjects in a structured subject list
-void populate_subject_list(char *dynamic_buffer, list_t *subject_list) {
-    char *line = strtok(dynamic_buffer, "\r\n"); // Defines a line as all the text until "\r\n" is encountered
-    char seq_num[20] = "<No sequence>"; // Buffer to store message sequence number
-    char subject[BUFFER_SIZE] = "<No subject>"; // Buffer to store the subject
-    int subject_found = 0; // Variable to indicate if a subject has been found
-    int first_message = 1; // Variable to handle the first message separately
-
-    // Reads while there is a valid line to be read and stored
-    while (line) {
-        // Check for completion tags and errors
-        if (strstr(line, "A06 OK Fetch completed") || strstr(line, "A06 NO") ||
-            strstr(line, "A06 BAD")) {
-            break; // Exit the loop if the end of the response or an error is encountered
-        }
-
-        // Check if the line starts with "* ", indicating the start of a new message
-        if (strncmp(line, "* ", 2) == 0) {
-            // If a new message is being processed and it's not the very first message processed
-            if (!first_message) {
-                // If no subject was found for the previous message, insert "<No subject>"
-                if (!subject_found) {
-                    insert_at_foot(subject_list, "<No subject>", seq_num);
-                }
-                // Otherwise add the subject in that is present
-                else {
-                    trim_subject(subject); // Trim the subject if necessary
-                    // Check if the last character is ')', and remove it before storing
-                    size_t len = strlen(subject);
-                    if (len > 0 && subject[len - 1] == ')') {
-                        subject[len - 1] = '\0';
-                    }
-                    insert_at_foot(subject_list, subject, seq_num); // Insert the subject into the list
-                }
-            }
-            first_message = 0; // Clear the first message variable after the first iteration
+    // One pass over the block indexes every field, the index goes with the arena
+    stats_begin(STATS_PARSE);
+    header_index_t index;
+    header_index_build(&index, headers, length, context->arena);
 
-            // Extract the sequence number from the line
-            sscanf(line, "* %s FETCH", seq_num);
+    const char *name = context->fetch_mail->headers != NULL ? context->fetch_mail->headers : DEFAULT_HEADERS;
+    while (*name != '\0') {
+        int len = strcspn(name, ",");
+        const header_field_t *field = header_index_find(&index, name, len);
 
-            // Reset subject and flag for the new message
-            strcpy(subject, "<No subject>");
-            subject_found = 0;
+        // A missing field is printed empty, a missing subject says so
+        if (field == NULL) {
+            int subject = len == 7 && strncasecmp(name, "Subject", 7) == 0;
+            printf("%.*s:%s\n", len, name, subject ? " <No subject>" : "");
         }
-
-        // If it isn't the start of a new message then just add the rest of the line to subject
-        else if (subject_found && (line[0] != '*' && line[0] != '\0')) {
-            // Append additional lines to the subject without leading space
-            strncat(subject, line, BUFFER_SIZE - strlen(subject) - 1);
+        for (; field != NULL; field = field->next) {
+            printf("%.*s: ", len, name);
+            header_print_value(&index, field, stdout);
+            printf("\n");
         }
+        name += len + (name[len] == ',');
+    }
+    stats_end(STATS_PARSE);
+}
 
-        // Check if the line contains "Subject: "
-        char *subject_start = strstr(line, "Subject: ");
-        // Store the subject now, after storing the message sequence number
-        if (subject_start) {
-            subject_start += 9; // Skip past "Subject: "
-            strncpy(subject, subject_start, BUFFER_SIZE - 1); // Copy the subject content
-            subject[BUFFER_SIZE - 1] = '\0'; // Ensure null-termination
 
-            // Remove trailing newlines and spaces from the subject
-            trim_subject(subject);
+// Function to print a part body decoded, a chunk at a time like it would come off the socket
+static void print_decoded(const char *body, size_t length, int encoding) {
+    decoder_t decoder;
+    decoder_init(&decoder, encoding);
+    char *out = malloc(DECODE_OUT_SIZE(DECODE_CHUNK_SIZE));
+    if (out == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
 
-            // Mark that the subject was found
-            subject_found = 1;
-        }
+    for (size_t offset = 0; offset < length; offset += DECODE_CHUNK_SIZE) {
+        size_t chunk = length - offset < DECODE_CHUNK_SIZE ? length - offset : DECODE_CHUNK_SIZE;
+        fwrite(out, 1, decode_update(&decoder, body + offset, chunk, out), stdout);
+    }
+    fwrite(out, 1, decode_final(&decoder, out), stdout);
 
-        // Move to the next line
-        line = strtok(NULL, "\r\n");
+    free(out);
+}
 
-        // Check if the next line indicates the start of a new message or end of response
-        if ((line && strncmp(line, "* ", 2) == 0) || (line && strstr(line, "A06 OK Fetch completed"))) {
-            // Trim appropriately before moving onto the next message
-            trim_subject(subject);
-        }
-    }
+// function that decode MIME messages
+void mime(byte_buffer_t *message, const fetch_mail_t *fetch_mail) {
 
-    // Handle the last message if no subject was found
-    if (!first_message) {
-        if (!subject_found) {
-            insert_at_foot(subject_list, "<No subject>", seq_num);
-        } else {
-            trim_subject(subject); // Trim the subject if necessary
-            // Check if the last character is ')', and remove it before storing
-            size_t len = strlen(subject);
-            if (len > 0 && subject[len - 1] == ')') {
-                subject[len - 1] = '\0';
+    // The message is already held in a single buffer, the tree only points into it
+    mime_tree_t tree;
+    mime_parse(&tree, message->data, message->len);
+
+    // --tree lists every part, --part prints one, otherwise the first text/plain UTF-8 part
+    // (Content-Transfer-Encoding: quoted-printable | 7 bit | 8 bit, or base64 with --decode) at
+    // any depth is printed
+    if (fetch_mail->mimeTree) {
+        mime_print_tree(&tree, stdout);
+    } else {
+        const mime_part_t *part = fetch_mail->mimePart ? mime_find_section(&tree, fetch_mail->mimePart)
+                                                       : mime_text_part(&tree, fetch_mail->mimeDecode);
+        if (part == NULL) {
+            if (fetch_mail->mimePart) {
+                printf("Error: No part %s\n", fetch_mail->mimePart);
+            } else {
+                printf("Error: No text/plain UTF-8 part found\n");
             }
-            insert_at_foot(subject_list, subject, seq_num); // Insert the subject into the list
+            exit(4);
+        }
+        if (fetch_mail->mimeDecode) {
+            print_decoded(message->data + part->body.offset, part->body.length,
+                          decode_encoding(message->data + part->encoding.offset, part->encoding.length));
+        } else {
+            fwrite(message->data + part->body.offset, 1, part->body.length, stdout);
         }
     }
+
+    mime_tree_free(&tree);
 }
 
-// A function to read in the subjects of all the emails and print them in the required format
-void list(int sockfd, int message_num, list_t *subject_list) {
-    // Call read_subjects() to get the server response and store in a buffer as one long string
-    char *dynamic_buffer = read_subjects(sockfd);
 
-    // Call populate_subject_list() to store the long string into separate nodes for each new subject
-    // where type = Subject: and then packet = the actual subject body
-    populate_subject_list(dynamic_buffer, subject_list);
+// A function to handle the List command
+// Fetch the subject of every message in the folder and print them in sequence order. Each FETCH
+// response is parsed as it arrives, so the whole server response is never held in memory
+void list(command_queue_t *commands, const command_plan_t *plan) {
+    char command[BUFFER_SIZE];
+    list_command(command, sizeof(command), plan);
+    imap_command_t *fetch = command_send(commands, "%s", command);
+
+    subject_list_t subjects;
+    subject_list_init(&subjects);
 
-    // Code to now sort the subject_list and then print it
-    sort_subject_list(subject_list);
-    print_subject_list(subject_list);
+    int count;
+    command_fetch(commands, fetch, plan->on_message, &subjects, &count);
+    command_free(fetch);
+    print_subject_list(&subjects);
 
-    // Free the dynamically allocated buffer
-    free(dynamic_buffer);
+    subject_list_free(&subjects);
 }
 
+// Formation of command to get subject of each email, without its tag and CRLF
+void list_command(char *command, size_t size, const command_plan_t *plan) {
+    snprintf(command, size, "FETCH 1:* (%s)", plan->items);
+}
 
-// Function to trim the last ")" at the end of each email subject 
-void trim_subject(char *subject) {
-    // Remove trailing newline or space characters from the subject
-    char *end = subject + strlen(subject) - 1; // Grabs the end of subject
-    // Looks for all the undesired character sand replaces with null terminating
-    while (end > subject && (*end == '\r' || *end == '\n' || *end == ' ')) {
-        *end = '\0';
-        end--;
+// Print the subjects in sequence order for list
+void print_subject_list(subject_list_t *subjects) {
+    // An empty folder (or a failed FETCH) has nothing to list
+    if (subjects->count == 0) {
+        printf("No head found\n");
+        exit(3);
     }
+
+    subject_list_sort(subjects);
+    subject_list_print(subjects, stdout);
 }
@@ -12,69 +12,130 @@
 #include <signal.h>
 
 #include "server_response.h"
+#include "imap_reader.h"
+#include "subject_list.h"
+#include "arena.h"
 
 #define BUFFER_SIZE 2048
 
+// Longest --headers list
 #define MAX_HEADER_SIZE 1024
 
+// Number of FETCH commands sent ahead of the responses when fetching a sequence set
+#define MAX_PIPELINED_FETCHES 32
+
 
 // Struct to store the command line arguments
 typedef struct fetch_mail {
         char *username; 
         char *password; 
         char *folder;
-        int messageNum;
+        char *sequence;     // -n value, a message number or a sequence set
+        int useUID;         // -n holds UIDs instead of sequence numbers
         int isTLS;
         char *command;
         char *server_name;
+        char *socket_path;  // daemon socket to send the command to, NULL to run it here
+        char *port;         // --port, NULL for the standard IMAP (143) or IMAPS (993) port
+        char *ca_file;      // --ca, NULL for the default CA certificate
+        int noCompress;     // --no-compress, do not ask for COMPRESS=DEFLATE
+        int useKTLS;        // --ktls, let the kernel decrypt TLS when it can
+        int verbose;        // -v, report the compression ratio on stderr
+        char *out_dir;      // --dir, save each message to a file there instead of printing it
+        int connections;    // -k, connections --dir downloads over, 0 for the default
+        char *maildir;      // --maildir, where export writes the folder
+        char *mbox;         // --mbox, or the mboxrd file it appends to
+        int fsyncEach;      // --fsync-each, export syncs every message instead of every batch
+        int mimeTree;       // --tree, mime lists the parts instead of printing one
+        char *mimePart;     // --part, section number of the part mime prints
+        int mimeDecode;     // --decode, mime undoes the part's quoted-printable or base64
+        int connectTimeout; // --connect-timeout in ms, for reaching the server over all its addresses
+        int readTimeout;    // --timeout in ms, longest wait for the server once connected
+        char *headers;      // --headers, comma separated fields parse prints, NULL for the default ones
+        int stats;          // --stats json, time the command's phases and report them as JSON
+        char *stats_file;   // --stats-file, append the report there instead of writing it to stderr
 } fetch_mail_t;
 
+// Header cache slots, the header fields a command fetches are cached per message under its slot
+#define CACHE_NONE -1
+#define CACHE_SUBJECT 0
+#define CACHE_PARSE 1
+#define CACHE_SLOTS 2
+
+// What a command fetches from the server
+typedef struct command_plan {
+        const char *name;   // command given on the command line
+        const char *items;  // FETCH data items the command needs
+        int all_messages;   // fetch every message in the folder instead of the -n messages
+        int cache_slot;     // CACHE_NONE, or where the fetched headers are kept in the header cache
+        literal_fn_t on_message; // consumes and prints each fetched message
+} command_plan_t;
+
+// A command plan changed by the command line options, with room for the FETCH items it needs
+typedef struct custom_plan {
+        command_plan_t plan;
+        char items[MAX_HEADER_SIZE + 64];
+} custom_plan_t;
+
+// State of the selected folder, from the SELECT response
+typedef struct mailbox {
+        unsigned long exists;       // number of messages
+        unsigned long uidvalidity;  // 0 if the server did not send one
+        unsigned long uidnext;      // UID the next message will get, 0 if not sent
+} mailbox_t;
+
+// State shared by the message handlers while a FETCH response is read
+typedef struct fetch_context {
+        const command_plan_t *plan;
+        int multiple;       // more than one message, print a delimiter before each
+        const fetch_mail_t *fetch_mail; // options of the command, e.g. mime --tree
+        arena_t *arena;     // parse data of the message being handled, reset after each one
+} fetch_context_t;
+
+// Function used to send a command over the connection (transport_send over any transport)
+typedef void (*send_fn_t)(void *sink, const char *cmd);
+
+// Tagged commands in flight over a connection, see command.h
+typedef struct command_queue command_queue_t;
+
 // // Function to read in command line arguments
 // void parse_args(int argc, char *argv[], fetch_mail_t *fetch_mail);
 
-int create_connection(const char *hostname, const char *port);
-
-void send_command(int sockfd, const char *cmd);
-
 void error(const char *msg, int num);
 
-void read_response(int sockfd, const char* tag); 
-
-void login(int sockfd, const char* username, const char* password);
-
-void select_folder(int sockfd, const char *folder_name);
+void quote_folder(const char *folder_name, char *quoted, size_t size);
 
-void retrieve(int sockfd, int message_num, list_t *packet_list);
+void select_command(const char *folder_name, char *command, size_t size);
 
-void mime(int sockfd, list_t *packet_list);
+void parse_mailbox_line(const char *line, mailbox_t *mailbox);
 
-char *concatenate_packets(list_t *packet_list);
+void parse_select_response(const char *response, mailbox_t *mailbox);
 
-char *find_mime_boundary(const char *content);
+const command_plan_t *plan_command(const char *command);
 
-void parse_mime_parts(const char *email_content, const char *boundary);
+const command_plan_t *plan_options(const command_plan_t *plan, const fetch_mail_t *fetch_mail, custom_plan_t *custom);
 
-void parse_headers(const char *headers, char **content_type, char **encoding);
+void retrieve(command_queue_t *commands, arena_t *arena, const fetch_mail_t *fetch_mail, const command_plan_t *plan);
 
-char *get_body_up_to_boundary(const char *body, const char *boundary);
+void retrieve_mime_parts(command_queue_t *commands, arena_t *arena, const fetch_mail_t *fetch_mail);
 
-void unfold_headers_mime(char *headers);
+char **split_sequence(const char *sequence, size_t *count);
 
-void unfold_headers(char *headers);
+void fetch_command(char *command, size_t size, const char *element, int use_uid, const command_plan_t *plan);
 
-void print_headers(list_t *header_list);
+void list_command(char *command, size_t size, const command_plan_t *plan);
 
-char *trim_spaces(char *str);
+void handle_message(imap_reader_t *reader, const char *line, size_t length, void *ctx);
 
-void parse(int sockfd, int message_num, list_t *header_list);
+void mime_message(imap_reader_t *reader, const char *line, size_t length, void *ctx);
 
-void trim_subject(char *subject);
+void parse_message(imap_reader_t *reader, const char *line, size_t length, void *ctx);
 
-char* read_subjects(int sockfd);
+void mime(byte_buffer_t *message, const fetch_mail_t *fetch_mail);
 
-void populate_subject_list(char *dynamic_buffer, list_t *subject_list);
+void list(command_queue_t *commands, const command_plan_t *plan);
 
-void list(int sockfd, int message_num, list_t *subject_list);
+void print_subject_list(subject_list_t *subjects);
 
 
 
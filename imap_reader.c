@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "imap_reader.h"
+#include "stats.h"
+
+/***
+ * Reader for IMAP server responses. Bytes are pulled from the connection into a read-ahead
+ * buffer and split into lines. Literals ({N} followed by N raw bytes) are read by length, so
+ * nothing inside a message body is ever mistaken for a tagged response line.
+*/
+
+// Initialise an empty buffer
+void buffer_init(byte_buffer_t *buf) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+}
+
+// Make sure there is room for extra more bytes plus the NUL terminator
+void buffer_reserve(byte_buffer_t *buf, size_t extra) {
+    size_t needed = buf->len + extra + 1;
+    if (needed <= buf->size) {
+        return;
+    }
+
+    // Grow geometrically so appending stays linear overall
+    size_t new_size = buf->size ? buf->size : 256;
+    while (new_size < needed) {
+        new_size *= 2;
+    }
+
+    char *new_data = realloc(buf->data, new_size);
+    if (new_data == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    buf->data = new_data;
+    buf->size = new_size;
+    stats_buffer(new_size);
+}
+
+// Append len bytes of data to the end of the buffer
+void buffer_append(byte_buffer_t *buf, const char *data, size_t len) {
+    buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+// Free the memory owned by the buffer
+void buffer_free(byte_buffer_t *buf) {
+    free(buf->data);
+    buffer_init(buf);
+}
+
+
+
+void reader_init(imap_reader_t *reader, const transport_t *transport) {
+    reader->transport = *transport;
+    reader->start = reader->end = 0;
+}
+
+// Read from the connection into dest and exit if the server has gone away
+static size_t reader_fill(imap_reader_t *reader, char *dest, size_t len) {
+    int numBytes = reader->transport.read(&reader->transport, dest, len);
+    if (numBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // The socket's read timeout (--timeout) ran out
+        fprintf(stderr, "Connection timed out\n");
+        exit(2);
+    } else if (numBytes < 0) {
+        perror("ERROR reading from server");
+        exit(3);
+    } else if (numBytes == 0) {
+        fprintf(stderr, "Server disconnected unexpectedly\n");
+        exit(3);
+    }
+    stats_read(numBytes);
+    return numBytes;
+}
+
+// Read one line. A line split across several reads is joined here, so callers always see whole lines
+void reader_read_line(imap_reader_t *reader, byte_buffer_t *line) {
+    while (1) {
+        if (reader->start == reader->end) {
+            reader->start = 0;
+            reader->end = reader_fill(reader, reader->buffer, READER_BUFFER_SIZE);
+        }
+
+        char *from = reader->buffer + reader->start;
+        size_t available = reader->end - reader->start;
+        char *newline = memchr(from, '\n', available);
+
+        if (newline) {
+            size_t count = newline - from + 1;
+            buffer_append(line, from, count);
+            reader->start += count;
+            return;
+        }
+
+        buffer_append(line, from, available);
+        reader->start = reader->end;
+    }
+}
+
+// Read a literal of known length. Whatever is already buffered is copied first, and the rest
+// is read straight into the destination buffer
+void reader_read_literal(imap_reader_t *reader, size_t length, byte_buffer_t *out) {
+    buffer_reserve(out, length);
+
+    size_t buffered = reader->end - reader->start;
+    size_t count = buffered < length ? buffered : length;
+    memcpy(out->data + out->len, reader->buffer + reader->start, count);
+    reader->start += count;
+    out->len += count;
+    length -= count;
+
+    while (length > 0) {
+        size_t chunk = length > (1 << 30) ? (1 << 30) : length;
+        size_t numBytes = reader_fill(reader, out->data + out->len, chunk);
+        out->len += numBytes;
+        length -= numBytes;
+    }
+
+    out->data[out->len] = '\0';
+}
+
+// Read the next part of a literal, at most size of the length bytes still to come. Buffered bytes
+// are handed out first. Returns how many bytes were stored in dest
+size_t reader_read_chunk(imap_reader_t *reader, size_t length, char *dest, size_t size) {
+    size_t wanted = length < size ? length : size;
+    size_t buffered = reader->end - reader->start;
+    if (buffered > 0) {
+        size_t count = buffered < wanted ? buffered : wanted;
+        memcpy(dest, reader->buffer + reader->start, count);
+        reader->start += count;
+        return count;
+    }
+    return wanted > 0 ? reader_fill(reader, dest, wanted) : 0;
+}
+
+// Write all of data, retrying after short writes
+void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            perror("Failed to write output");
+            exit(5);
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+// Move length bytes from the socket into a pipe with splice, returns how many were moved
+static size_t splice_literal(imap_reader_t *reader, size_t length, int out_fd) {
+    size_t moved = 0;
+    while (moved < length) {
+        size_t chunk = length - moved > STREAM_CHUNK_SIZE ? STREAM_CHUNK_SIZE : length - moved;
+        ssize_t numBytes = splice(reader->transport.fd, NULL, out_fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (numBytes < 0) {
+            // Not supported for this pair (or a kTLS record that is not data), carry on with read and write
+            break;
+        } else if (numBytes == 0) {
+            fprintf(stderr, "Server disconnected unexpectedly\n");
+            exit(3);
+        }
+        moved += numBytes;
+    }
+    return moved;
+}
+
+// Move length bytes from the socket into a file. splice needs a pipe at one end, so they go
+// through one of our own, and are read back out of it if the file cannot be spliced into
+// (O_APPEND). Returns how many reached the file
+static size_t splice_to_file(imap_reader_t *reader, size_t length, int out_fd) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        return 0;
+    }
+
+    size_t moved = 0;
+    int direct = 1;
+    while (moved < length) {
+        // One call at a time: nothing else empties this pipe, so splicing into it again before it
+        // is drained could block for good
+        size_t wanted = length - moved > STREAM_CHUNK_SIZE ? STREAM_CHUNK_SIZE : length - moved;
+        ssize_t chunk = splice(reader->transport.fd, NULL, pipefd[1], NULL, wanted, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (chunk < 0) {
+            break;
+        } else if (chunk == 0) {
+            fprintf(stderr, "Server disconnected unexpectedly\n");
+            exit(3);
+        }
+
+        size_t left = chunk;
+        while (left > 0 && direct) {
+            ssize_t numBytes = splice(pipefd[0], NULL, out_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (numBytes <= 0) {
+                direct = 0;
+                break;
+            }
+            left -= numBytes;
+        }
+        while (left > 0) {
+            char buffer[STREAM_CHUNK_SIZE];
+            ssize_t numBytes = read(pipefd[0], buffer, left);
+            if (numBytes <= 0) {
+                perror("Failed to write output");
+                exit(5);
+            }
+            write_all(out_fd, buffer, numBytes);
+            left -= numBytes;
+        }
+        moved += chunk;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return moved;
+}
+
+// Function to check whether the rest of a literal can be taken straight from the socket: the
+// transport passes it through unchanged and holds none of it back
+static int can_splice(imap_reader_t *reader) {
+    transport_t *transport = &reader->transport;
+    return transport->fd >= 0 && (transport->pending == NULL || transport->pending(transport) == 0);
+}
+
+// Pass a literal through to out_fd. Buffered bytes are written first, then the rest goes through
+// splice when the socket carries the plain stream (plain, or TLS the kernel decrypts) and out_fd
+// is a pipe or a file, or large reads and writes otherwise
+void reader_stream_literal(imap_reader_t *reader, size_t length, int out_fd) {
+    size_t buffered = reader->end - reader->start;
+    size_t count = buffered < length ? buffered : length;
+    write_all(out_fd, reader->buffer + reader->start, count);
+    reader->start += count;
+    length -= count;
+
+    struct stat out_stat;
+    if (length > 0 && can_splice(reader) && fstat(out_fd, &out_stat) == 0) {
+        size_t moved = 0;
+        if (S_ISFIFO(out_stat.st_mode)) {
+            moved = splice_literal(reader, length, out_fd);
+        } else if (S_ISREG(out_stat.st_mode)) {
+            moved = splice_to_file(reader, length, out_fd);
+        }
+        stats_spliced(moved);
+        length -= moved;
+    }
+
+    char chunk[STREAM_CHUNK_SIZE];
+    while (length > 0) {
+        size_t wanted = length > STREAM_CHUNK_SIZE ? STREAM_CHUNK_SIZE : length;
+        size_t numBytes = reader_fill(reader, chunk, wanted);
+        write_all(out_fd, chunk, numBytes);
+        length -= numBytes;
+    }
+}
+
+// A literal is announced by {N} (or {N+}) just before the CRLF at the end of a line
+int parse_literal_length(const char *line, size_t len, size_t *length) {
+    // Strip the line ending
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        len--;
+    }
+    if (len < 3 || line[len - 1] != '}') {
+        return 0;
+    }
+    len--;
+    if (line[len - 1] == '+') {
+        len--;
+    }
+
+    size_t end = len;
+    while (len > 0 && line[len - 1] >= '0' && line[len - 1] <= '9') {
+        len--;
+    }
+    if (len == 0 || len == end || line[len - 1] != '{' || end - len > 18) {
+        return 0;
+    }
+
+    size_t value = 0;
+    for (size_t i = len; i < end; i++) {
+        value = value * 10 + (line[i] - '0');
+    }
+    *length = value;
+    return 1;
+}
+
+// Check for "<tag> OK|NO|BAD" at the start of a line (status is case-insensitive)
+int parse_tagged_status(const char *line, size_t len, const char *tag) {
+    size_t tag_len = strlen(tag);
+    if (len <= tag_len + 1 || strncmp(line, tag, tag_len) != 0 || line[tag_len] != ' ') {
+        return -1;
+    }
+
+    const char *status = line + tag_len + 1;
+    size_t rest = len - tag_len - 1;
+    if (rest >= 2 && strncasecmp(status, "OK", 2) == 0) {
+        return IMAP_OK;
+    }
+    if (rest >= 2 && strncasecmp(status, "NO", 2) == 0) {
+        return IMAP_NO;
+    }
+    return IMAP_BAD;
+}
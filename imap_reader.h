@@ -0,0 +1,70 @@
+#ifndef IMAP_READER_H
+#define IMAP_READER_H
+
+#include <stddef.h>
+
+#include "transport.h"
+
+#define READER_BUFFER_SIZE 16384
+
+// Chunk size used when a literal is passed straight through to an output file descriptor
+#define STREAM_CHUNK_SIZE 65536
+
+// Completion status carried by a tagged response line
+#define IMAP_OK 0
+#define IMAP_NO 1
+#define IMAP_BAD 2
+
+// Growable contiguous byte buffer, always kept NUL terminated
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} byte_buffer_t;
+
+// Line-aware reader over a connection with its own read-ahead buffer
+typedef struct imap_reader {
+    transport_t transport;  // its fd is the socket to splice from, -1 if the data has to be decoded first
+    char buffer[READER_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+} imap_reader_t;
+
+// Called for each literal in a FETCH response. line is the response text announcing the literal
+// and the function must consume exactly length bytes from the reader
+typedef void (*literal_fn_t)(imap_reader_t *reader, const char *line, size_t length, void *ctx);
+
+// Functions to manage a byte buffer
+void buffer_init(byte_buffer_t *buf);
+
+void buffer_reserve(byte_buffer_t *buf, size_t extra);
+
+void buffer_append(byte_buffer_t *buf, const char *data, size_t len);
+
+void buffer_free(byte_buffer_t *buf);
+
+// Set up a reader pulling from a copy of transport
+void reader_init(imap_reader_t *reader, const transport_t *transport);
+
+// Append one line (including its CRLF) to line
+void reader_read_line(imap_reader_t *reader, byte_buffer_t *line);
+
+// Append exactly length bytes of a literal to out
+void reader_read_literal(imap_reader_t *reader, size_t length, byte_buffer_t *out);
+
+// Read up to size bytes of the length bytes of a literal still to come, returns how many were read
+size_t reader_read_chunk(imap_reader_t *reader, size_t length, char *dest, size_t size);
+
+// Write exactly length bytes of a literal to out_fd without holding them in memory
+void reader_stream_literal(imap_reader_t *reader, size_t length, int out_fd);
+
+// Write the whole of data to fd
+void write_all(int fd, const char *data, size_t len);
+
+// Check whether a line ends with a literal announcement {N} and store N
+int parse_literal_length(const char *line, size_t len, size_t *length);
+
+// Returns the IMAP_* status if the line is the tagged completion for tag, otherwise -1
+int parse_tagged_status(const char *line, size_t len, const char *tag);
+
+#endif
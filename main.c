@@ -12,6 +12,10 @@
 #include "imap_client.h"
 #include "utils.h"
 #include "tls.h"
+#include "session.h"
+#include "daemon.h"
+#include "engine.h"
+#include "stats.h"
 
 int main(int argc, char *argv[]) {
 
@@ -19,8 +23,23 @@ int main(int argc, char *argv[]) {
     signal(SIGPIPE, handle_sigpipe);
 
 
+    // Run as a daemon keeping sessions open for other invocations
+    if (argc >= 2 && strcmp(argv[1], "--daemon") == 0) {
+        const char *socket_path = (argc >= 4 && strcmp(argv[2], "--socket") == 0) ? argv[3] : NULL;
+        return run_daemon(socket_path);
+    }
+
+    // Run the commands of many accounts at once, one per line of the accounts file
+    if (argc >= 3 && strcmp(argv[1], "--accounts") == 0) {
+        int parallel = ENGINE_PARALLEL;
+        if (argc >= 5 && strcmp(argv[3], "--parallel") == 0) {
+            parallel = parse_n_value(argv[4]);
+        }
+        return run_accounts(argv[2], parallel > 0 ? parallel : 1);
+    }
+
     // Initialise the fetch mail struct
-    fetch_mail_t fetch_mail = {NULL, NULL, NULL, -1, 0, NULL, NULL};
+    fetch_mail_t fetch_mail = {0};
 
     // Call parse args to read in the command line arguments present
     int parse_arg = parse_args(argc, argv, &fetch_mail);
@@ -30,75 +49,30 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    int sockfd = 0; 
-
-    list_t *packet_list = make_empty_list(); // create an empty list 
-    list_t *subject_list = make_empty_list(); // Creates empty list for all the subject lines (Task 2.6 List)
-    list_t *header_list = make_empty_list(); // Creates empty list for all headers (Task 2.4 Parse)
-
-    // Now implement logging on and selecting folder
-    // log in using: tag LOGIN <username> <password> \r\n
-    // using the tag A01
-
-
-    // If TLS config, we run the tls connect, login_ssl, select_folder_ssl and retrieve_ssl
-    if (fetch_mail.isTLS) {
-        //printf("*************Is TLS************\n");
-        SSL *ssl = NULL;
-        sockfd = tls_connect(fetch_mail.server_name, "993", &ssl); // we want to establish tsl 
-        login_ssl(ssl, fetch_mail.username, fetch_mail.password);
-
-        select_folder_ssl(ssl, fetch_mail.folder);
-
-        retrieve_ssl(ssl, fetch_mail.messageNum, packet_list);
-        
-    } else {
-        sockfd = create_connection(fetch_mail.server_name, "143");  // we connect the socket in this
-        read_response(sockfd, ""); // read and discard initial server greeting message
-
-        // Perform login 
-        //printf("\nLOGGING IN\n");
-        login(sockfd, fetch_mail.username, fetch_mail.password);
-
-        // Select folder
-        // printf("\nSELECTING FOLDER\n");
-        // printf("%s", fetch_mail.folder);
-        select_folder(sockfd, fetch_mail.folder);
-
-        // retrieve and store response from server into a linked list
-        retrieve(sockfd, fetch_mail.messageNum, packet_list);
-    }
-
-
-
-
-    // If conditions to run the appropriate command given
-    if (strcmp(fetch_mail.command, "retrieve") == 0){
-        // To print raw email 
-        //printf("\n \n\n-----------------RETRIEVE MESSAGE-----------\n");
-        print_list_retrieve(packet_list);
-        exit(0);
+    // Work out what the command needs fetched before connecting
+    const command_plan_t *plan = plan_command(fetch_mail.command);
+    if (plan == NULL) {
+        fprintf(stderr, "Unknown command: %s\n", fetch_mail.command);
+        print_usage();
     }
+    custom_plan_t custom;
+    plan = plan_options(plan, &fetch_mail, &custom);
 
-    if (strcmp(fetch_mail.command, "parse") == 0) {
-        parse(sockfd, fetch_mail.messageNum, header_list);
+    // Hand the command to a running daemon if one was asked for, it exits with the daemon's status
+    // A download over several connections opens its own and export writes files, so they run here
+    if (fetch_mail.socket_path != NULL && fetch_mail.out_dir == NULL && plan->on_message != NULL) {
+        daemon_request(fetch_mail.socket_path, &fetch_mail, argc, argv);
     }
 
-    if (strcmp(fetch_mail.command, "mime") == 0) {
-        //printf("\n------------------------MIME----------------------------\n");
-        mime(sockfd, packet_list); 
+    if (fetch_mail.stats) {
+        stats_start(fetch_mail.command, fetch_mail.stats_file, -1);
     }
 
-    if (strcmp(fetch_mail.command, "list") == 0) {
-        // To fetch email headers and parse them and print them to stdout
-        list(sockfd, fetch_mail.messageNum, subject_list);
-    }
-
-
+    session_t session;
+    open_session(&session, &fetch_mail);
 
-    free_list(packet_list);
-    free_list(subject_list);
-    free_list(header_list);
+    run_command(&session, &fetch_mail, plan);
+    close_session(&session);
 
 
     return 0;
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "mime.h"
+#include "scan.h"
+
+/***
+ * MIME part tree (RFC 2045/2046). Every part is described by spans into the message buffer: its
+ * headers, its body and the values of the two headers that matter. Multiparts are split on their
+ * boundary and message/rfc822 bodies are parsed as messages, to MIME_MAX_DEPTH levels. Nothing is
+ * unfolded, copied or decoded here, callers look at the spans of the parts they want.
+*/
+
+// Function to add an empty part, returns its index (parts may move, so indexes are kept)
+static int add_part(mime_tree_t *tree) {
+    if (tree->count == tree->size) {
+        size_t new_size = tree->size ? tree->size * 2 : 16;
+        mime_part_t *parts = realloc(tree->parts, new_size * sizeof(mime_part_t));
+        if (parts == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(5);
+        }
+        tree->parts = parts;
+        tree->size = new_size;
+    }
+    memset(&tree->parts[tree->count], 0, sizeof(mime_part_t));
+    return tree->count++;
+}
+
+// Function to find a header in the header span and store its value, without the leading white
+// space or the final line ending. Continuation lines are part of the value, still folded
+static void find_header(const char *message, mime_span_t headers, const char *name, mime_span_t *value) {
+    size_t name_len = strlen(name);
+    const char *p = message + headers.offset;
+    const char *end = p + headers.length;
+
+    while (p < end) {
+        const char *line_end = memchr(p, '\n', end - p);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+
+        if ((size_t)(line_end - p) > name_len && p[name_len] == ':' && strncasecmp(p, name, name_len) == 0) {
+            const char *start = p + name_len + 1;
+
+            // The value runs on over lines starting with white space
+            while (line_end + 1 < end && (line_end[1] == ' ' || line_end[1] == '\t')) {
+                const char *next = memchr(line_end + 1, '\n', end - line_end - 1);
+                line_end = next ? next : end;
+            }
+            while (start < line_end && (*start == ' ' || *start == '\t')) {
+                start++;
+            }
+            const char *stop = line_end;
+            while (stop > start && (stop[-1] == '\r' || stop[-1] == '\n' || stop[-1] == ' ' || stop[-1] == '\t')) {
+                stop--;
+            }
+            value->offset = start - message;
+            value->length = stop - start;
+            return;
+        }
+        p = line_end + 1;
+    }
+}
+
+// Function to find the parameter name=value in a header value, e.g. boundary in Content-Type
+static int find_param(const char *message, mime_span_t header, const char *name, mime_span_t *value) {
+    size_t name_len = strlen(name);
+    const char *p = message + header.offset;
+    const char *end = p + header.length;
+
+    while ((p = memchr(p, ';', end - p)) != NULL) {
+        p++;
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+            p++;
+        }
+        if ((size_t)(end - p) <= name_len || p[name_len] != '=' || strncasecmp(p, name, name_len) != 0) {
+            continue;
+        }
+
+        const char *start = p + name_len + 1;
+        const char *stop;
+        if (start < end && *start == '"') {
+            start++;
+            stop = memchr(start, '"', end - start);
+            if (stop == NULL) {
+                stop = end;
+            }
+        } else {
+            stop = start;
+            while (stop < end && *stop != ';' && *stop != ' ' && *stop != '\t' && *stop != '\r' && *stop != '\n') {
+                stop++;
+            }
+        }
+        value->offset = start - message;
+        value->length = stop - start;
+        return 1;
+    }
+    return 0;
+}
+
+// Function to compare a span with a string, ignoring case
+static int span_is(const char *message, mime_span_t span, const char *text) {
+    return span.length == strlen(text) && strncasecmp(message + span.offset, text, span.length) == 0;
+}
+
+// Function to get the media type of a part, e.g. "text/plain", up to any parameters
+static mime_span_t media_type(const mime_tree_t *tree, const mime_part_t *part) {
+    mime_span_t type = part->type;
+    const char *start = tree->message + type.offset;
+    size_t len = 0;
+    while (len < type.length && start[len] != ';' && start[len] != ' ' && start[len] != '\t' &&
+           start[len] != '\r' && start[len] != '\n') {
+        len++;
+    }
+    type.length = len;
+    return type;
+}
+
+int mime_is_type(const mime_tree_t *tree, const mime_part_t *part, const char *type) {
+    mime_span_t media = media_type(tree, part);
+    const char *name = tree->message + media.offset;
+    size_t len = strlen(type);
+
+    // Without a Content-Type a part is text/plain, or message/rfc822 in a digest
+    if (media.length == 0) {
+        name = part->in_digest ? "message/rfc822" : "text/plain";
+        media.length = strlen(name);
+    }
+    if (len > 0 && type[len - 1] == '/') {
+        return media.length > len && strncasecmp(name, type, len) == 0;
+    }
+    return media.length == len && strncasecmp(name, type, len) == 0;
+}
+
+int mime_param(const mime_tree_t *tree, const mime_part_t *part, const char *name, mime_span_t *value) {
+    return find_param(tree->message, part->type, name, value);
+}
+
+// Function to find the next delimiter line "--boundary" from p. A delimiter starts a line and is
+// followed by "--" (the close delimiter) or by white space to the end of the line. Returns its
+// offset, or end if there is none, and stores where the line after it starts in next
+static size_t find_delimiter(const char *message, size_t p, size_t end, size_t body_start,
+                             const char *delimiter, size_t delimiter_len, int *closing, size_t *next) {
+    while (p < end) {
+        const char *match = memmem(message + p, end - p, delimiter, delimiter_len);
+        if (match == NULL) {
+            break;
+        }
+        size_t at = match - message;
+        size_t after = at + delimiter_len;
+        p = at + 1;
+        if (at != body_start && message[at - 1] != '\n') {
+            continue;
+        }
+
+        *closing = end - after >= 2 && message[after] == '-' && message[after + 1] == '-';
+        if (!*closing) {
+            while (after < end && (message[after] == ' ' || message[after] == '\t' || message[after] == '\r')) {
+                after++;
+            }
+            if (after < end && message[after] != '\n') {
+                continue;
+            }
+        }
+        const char *line_end = memchr(message + after, '\n', end - after);
+        *next = line_end ? (size_t)(line_end - message) + 1 : end;
+        return at;
+    }
+    return end;
+}
+
+// Function to set the section number of a child, "n" under the message or "parent.n"
+static void child_section(char *section, const char *parent, int number) {
+    if (parent[0] == '\0') {
+        snprintf(section, MIME_SECTION_SIZE, "%d", number);
+    } else {
+        snprintf(section, MIME_SECTION_SIZE, "%s.%d", parent, number);
+    }
+}
+
+static void parse_entity(mime_tree_t *tree, size_t start, size_t end, int parent, const char *section,
+                         int is_message, int in_digest);
+
+// Function to parse each part of a multipart body as a child of part index
+static void parse_multipart(mime_tree_t *tree, int index) {
+    const char *message = tree->message;
+    mime_part_t *part = &tree->parts[index];
+    mime_span_t boundary;
+    if (!mime_param(tree, part, "boundary", &boundary) || boundary.length == 0 || boundary.length > 200) {
+        return;
+    }
+
+    char delimiter[256];
+    int delimiter_len = snprintf(delimiter, sizeof(delimiter), "--%.*s", (int)boundary.length, message + boundary.offset);
+    int digest = mime_is_type(tree, part, "multipart/digest");
+    char section[MIME_SECTION_SIZE];
+    memcpy(section, part->section, MIME_SECTION_SIZE);
+    size_t body_start = part->body.offset;
+    size_t end = body_start + part->body.length;
+
+    // Everything before the first delimiter is the preamble
+    int closing;
+    size_t next;
+    size_t at = find_delimiter(message, body_start, end, body_start, delimiter, delimiter_len, &closing, &next);
+    int number = 1;
+    while (at < end && !closing) {
+        size_t child_start = next;
+        at = find_delimiter(message, child_start, end, body_start, delimiter, delimiter_len, &closing, &next);
+
+        // The line ending before a delimiter belongs to the delimiter
+        size_t child_end = at;
+        if (child_end > child_start && message[child_end - 1] == '\n') {
+            child_end--;
+        }
+        if (child_end > child_start && message[child_end - 1] == '\r') {
+            child_end--;
+        }
+
+        char child[MIME_SECTION_SIZE];
+        child_section(child, section, number++);
+        parse_entity(tree, child_start, child_end, index, child, 0, digest);
+    }
+}
+
+// Function to parse the headers and body in [start, end). A message (the whole message or a
+// message/rfc822 body) that is not a multipart has its body numbered section.1 in IMAP
+static void parse_entity(mime_tree_t *tree, size_t start, size_t end, int parent, const char *section,
+                         int is_message, int in_digest) {
+    const char *message = tree->message;
+    int index = add_part(tree);
+    mime_part_t *part = &tree->parts[index];
+    part->parent = parent;
+    part->depth = parent < 0 ? 0 : tree->parts[parent].depth + 1;
+    part->in_digest = in_digest;
+
+    // The headers end at the first empty line, a part starting with one has no headers
+    size_t body_start;
+    const char *blank = NULL;
+    if (end - start >= 2 && message[start] == '\r' && message[start + 1] == '\n') {
+        body_start = start + 2;
+    } else if (end - start >= 1 && message[start] == '\n') {
+        body_start = start + 1;
+    } else if ((blank = scan_blank_line(message + start, message + end)) != NULL) {
+        body_start = blank + 4 - message;
+    } else if ((blank = memmem(message + start, end - start, "\n\n", 2)) != NULL) {
+        body_start = blank + 2 - message;
+    } else {
+        body_start = end;
+    }
+    part->headers.offset = start;
+    part->headers.length = (blank ? (size_t)(blank - message) + (blank[0] == '\r' ? 2 : 1) : body_start) - start;
+    part->body.offset = body_start;
+    part->body.length = end - body_start;
+    find_header(message, part->headers, "Content-Type", &part->type);
+    find_header(message, part->headers, "Content-Transfer-Encoding", &part->encoding);
+
+    int multipart = mime_is_type(tree, part, "multipart/");
+    if (is_message && !multipart) {
+        child_section(part->section, section, 1);
+    } else {
+        snprintf(part->section, MIME_SECTION_SIZE, "%s", section);
+    }
+
+    if (part->depth >= MIME_MAX_DEPTH) {
+        return;
+    }
+    // Adding the children may move the parts, part is not used after this
+    if (multipart) {
+        parse_multipart(tree, index);
+    } else if (!is_message && mime_is_type(tree, part, "message/rfc822")) {
+        char child[MIME_SECTION_SIZE];
+        memcpy(child, part->section, MIME_SECTION_SIZE);
+        parse_entity(tree, body_start, end, index, child, 1, 0);
+    }
+}
+
+void mime_parse(mime_tree_t *tree, const char *message, size_t length) {
+    tree->message = message;
+    tree->length = length;
+    tree->parts = NULL;
+    tree->count = 0;
+    tree->size = 0;
+    parse_entity(tree, 0, length, -1, "", 1, 0);
+}
+
+void mime_tree_free(mime_tree_t *tree) {
+    free(tree->parts);
+    tree->parts = NULL;
+    tree->count = tree->size = 0;
+}
+
+// The part mime prints: text/plain in UTF-8, in an encoding that is readable as it is
+const mime_part_t *mime_text_part(const mime_tree_t *tree, int decoding) {
+    for (size_t i = 0; i < tree->count; i++) {
+        const mime_part_t *part = &tree->parts[i];
+        mime_span_t charset;
+        if (!mime_is_type(tree, part, "text/plain") || !mime_param(tree, part, "charset", &charset) ||
+            !span_is(tree->message, charset, "UTF-8")) {
+            continue;
+        }
+        if (part->encoding.length == 0 || span_is(tree->message, part->encoding, "quoted-printable") ||
+            span_is(tree->message, part->encoding, "7bit") || span_is(tree->message, part->encoding, "8bit") ||
+            (decoding && span_is(tree->message, part->encoding, "base64"))) {
+            return part;
+        }
+    }
+    return NULL;
+}
+
+const mime_part_t *mime_find_section(const mime_tree_t *tree, const char *section) {
+    for (size_t i = 0; i < tree->count; i++) {
+        if (strcmp(tree->parts[i].section, section) == 0) {
+            return &tree->parts[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to print a span in lower case
+static void print_lower(const char *text, size_t length, FILE *out) {
+    for (size_t i = 0; i < length; i++) {
+        fputc(tolower((unsigned char)text[i]), out);
+    }
+}
+
+void mime_print_tree(const mime_tree_t *tree, FILE *out) {
+    for (size_t i = 0; i < tree->count; i++) {
+        const mime_part_t *part = &tree->parts[i];
+        fprintf(out, "%*s%s ", part->depth * 2, "", part->section[0] ? part->section : "-");
+
+        mime_span_t media = media_type(tree, part);
+        if (media.length > 0) {
+            print_lower(tree->message + media.offset, media.length, out);
+        } else {
+            fputs(part->in_digest ? "message/rfc822" : "text/plain", out);
+        }
+
+        mime_span_t value;
+        if (mime_param(tree, part, "charset", &value)) {
+            fprintf(out, " charset=%.*s", (int)value.length, tree->message + value.offset);
+        }
+        if (mime_param(tree, part, "name", &value)) {
+            fprintf(out, " name=\"%.*s\"", (int)value.length, tree->message + value.offset);
+        }
+        fputc(' ', out);
+        if (part->encoding.length > 0) {
+            print_lower(tree->message + part->encoding.offset, part->encoding.length, out);
+        } else {
+            fputs("7bit", out);
+        }
+        fprintf(out, " %zu bytes\n", part->body.length);
+    }
+}
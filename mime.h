@@ -0,0 +1,62 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Multiparts nested deeper than this are left as one part
+#define MIME_MAX_DEPTH 32
+
+// Longest IMAP section number kept for a part, e.g. "2.1.3"
+#define MIME_SECTION_SIZE 64
+
+// A run of bytes in the message
+typedef struct mime_span {
+    size_t offset;
+    size_t length;
+} mime_span_t;
+
+// One entity of the message: the message itself, a part of a multipart, or a message/rfc822 body
+typedef struct mime_part {
+    int parent;                 // index of the enclosing part, -1 for the message
+    int depth;
+    int in_digest;              // a part of multipart/digest, message/rfc822 unless it says otherwise
+    char section[MIME_SECTION_SIZE]; // IMAP section number, "" for a multipart message
+    mime_span_t headers;        // header lines, including the CRLF of the last one
+    mime_span_t body;           // content, without the line ending before the next delimiter
+    mime_span_t type;           // Content-Type value, empty if there is none
+    mime_span_t encoding;       // Content-Transfer-Encoding value, empty if there is none
+} mime_part_t;
+
+// The parts of a message as spans into its buffer, nothing is copied or decoded
+typedef struct mime_tree {
+    const char *message;
+    size_t length;
+    mime_part_t *parts;         // depth first, parts[0] is the whole message
+    size_t count;
+    size_t size;
+} mime_tree_t;
+
+// Function to build the part tree of the message, which must stay in memory while the tree is used
+void mime_parse(mime_tree_t *tree, const char *message, size_t length);
+
+void mime_tree_free(mime_tree_t *tree);
+
+// Function to check the media type of a part (e.g. "text/plain"), ignoring case
+// A type ending in '/' (e.g. "multipart/") matches every subtype
+int mime_is_type(const mime_tree_t *tree, const mime_part_t *part, const char *type);
+
+// Function to find a Content-Type parameter (e.g. "charset"), without its quotes. Returns 0 if absent
+int mime_param(const mime_tree_t *tree, const mime_part_t *part, const char *name, mime_span_t *value);
+
+// Function to find the first text/plain UTF-8 part in quoted-printable, 7bit or 8bit (or base64 if
+// the caller decodes it), NULL if none
+const mime_part_t *mime_text_part(const mime_tree_t *tree, int decoding);
+
+// Function to find the part with an IMAP section number such as "1.2", NULL if there is none
+const mime_part_t *mime_find_section(const mime_tree_t *tree, const char *section);
+
+// Function to print one line per part: section, type, charset, name, encoding and size
+void mime_print_tree(const mime_tree_t *tree, FILE *out);
+
+#endif
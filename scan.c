@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// The versions of the scan functions for one instruction set
+typedef struct scan_ops {
+    const char *name;
+    const char *(*eol)(const char *p, const char *end);
+    const char *(*crlf)(const char *p, const char *end);
+    const char *(*blank_line)(const char *p, const char *end);
+    const char *(*fold)(const char *p, const char *end);
+    char *(*casestr)(const char *haystack, const char *needle);
+} scan_ops_t;
+
+
+
+//////////// Scalar versions, also used for the tails of the vector ones ///////////////////////////
+
+static const char *find_eol_scalar(const char *p, const char *end) {
+    for (; p < end; p++) {
+        if (*p == '\r' || *p == '\n') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const char *find_crlf_scalar(const char *p, const char *end) {
+    while (end - p >= 2) {
+        const char *cr = memchr(p, '\r', end - p - 1);
+        if (cr == NULL) {
+            return NULL;
+        }
+        if (cr[1] == '\n') {
+            return cr;
+        }
+        p = cr + 1;
+    }
+    return NULL;
+}
+
+static const char *find_blank_line_scalar(const char *p, const char *end) {
+    while ((p = find_crlf_scalar(p, end)) != NULL) {
+        if (end - p >= 4 && p[2] == '\r' && p[3] == '\n') {
+            return p;
+        }
+        p += 2;
+    }
+    return NULL;
+}
+
+static const char *find_fold_scalar(const char *p, const char *end) {
+    while ((p = find_crlf_scalar(p, end)) != NULL) {
+        if (end - p >= 3 && (p[2] == ' ' || p[2] == '\t')) {
+            return p;
+        }
+        p += 2;
+    }
+    return NULL;
+}
+
+static char *find_casestr_scalar(const char *haystack, const char *needle) {
+    if (!*needle) return (char *) haystack;
+    for (; *haystack; ++haystack) {
+        if (tolower((unsigned char) *haystack) == tolower((unsigned char) *needle)) {
+            const char *h, *n;
+            for (h = haystack, n = needle; *h && *n; ++h, ++n) {
+                if (tolower((unsigned char) *h) != tolower((unsigned char) *n)) break;
+            }
+            if (!*n) return (char *) haystack;
+        }
+    }
+    return NULL;
+}
+
+static const scan_ops_t scan_scalar = {
+    "scalar", find_eol_scalar, find_crlf_scalar, find_blank_line_scalar, find_fold_scalar, find_casestr_scalar
+};
+
+
+
+//////////// SSE2 and AVX2 versions ///////////////////////////
+
+#ifdef SCAN_X86
+
+#define SCAN_ISA sse2
+#define SCAN_TARGET __attribute__((target("sse2")))
+#define VEC __m128i
+#define VEC_WIDTH 16
+#define VEC_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VEC_LOAD_ALIGNED(p) _mm_load_si128((const __m128i *)(p))
+#define VEC_SET1(c) _mm_set1_epi8(c)
+#define VEC_EQ(a, b) _mm_cmpeq_epi8(a, b)
+#define VEC_OR(a, b) _mm_or_si128(a, b)
+#define VEC_AND(a, b) _mm_and_si128(a, b)
+#define VEC_MASK(v) (unsigned int)_mm_movemask_epi8(v)
+#include "scan_simd.h"
+#undef SCAN_ISA
+#undef SCAN_TARGET
+#undef VEC
+#undef VEC_WIDTH
+#undef VEC_LOAD
+#undef VEC_LOAD_ALIGNED
+#undef VEC_SET1
+#undef VEC_EQ
+#undef VEC_OR
+#undef VEC_AND
+#undef VEC_MASK
+
+#define SCAN_ISA avx2
+#define SCAN_TARGET __attribute__((target("avx2")))
+#define VEC __m256i
+#define VEC_WIDTH 32
+#define VEC_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VEC_LOAD_ALIGNED(p) _mm256_load_si256((const __m256i *)(p))
+#define VEC_SET1(c) _mm256_set1_epi8(c)
+#define VEC_EQ(a, b) _mm256_cmpeq_epi8(a, b)
+#define VEC_OR(a, b) _mm256_or_si256(a, b)
+#define VEC_AND(a, b) _mm256_and_si256(a, b)
+#define VEC_MASK(v) (unsigned int)_mm256_movemask_epi8(v)
+#include "scan_simd.h"
+
+static const scan_ops_t scan_sse2 = {
+    "sse2", find_eol_sse2, find_crlf_sse2, find_blank_line_sse2, find_fold_sse2, find_casestr_sse2
+};
+
+static const scan_ops_t scan_avx2 = {
+    "avx2", find_eol_avx2, find_crlf_avx2, find_blank_line_avx2, find_fold_avx2, find_casestr_avx2
+};
+
+#endif
+
+
+
+//////////// Dispatch ///////////////////////////
+
+static const scan_ops_t *scan_ops = NULL;
+
+// Function to pick the best version the CPU supports, or the one FETCHMAIL_SCAN asks for
+static const scan_ops_t *scan_select(void) {
+    const scan_ops_t *ops = &scan_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    const char *forced = getenv("FETCHMAIL_SCAN");
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    if (forced != NULL && strcmp(forced, "scalar") == 0) {
+        ops = &scan_scalar;
+    } else if (forced != NULL && strcmp(forced, "sse2") == 0) {
+        ops = has_sse2 ? &scan_sse2 : &scan_scalar;
+    } else if (has_avx2) {
+        ops = &scan_avx2;
+    } else if (has_sse2) {
+        ops = &scan_sse2;
+    }
+#endif
+    scan_ops = ops;
+    return ops;
+}
+
+// Functions to call the selected version, see scan.h
+char *scan_casestr(const char *haystack, const char *needle) {
+    const scan_ops_t *ops = scan_ops ? scan_ops : scan_select();
+    return ops->casestr(haystack, needle);
+}
+
+const char *scan_eol(const char *p, const char *end) {
+    const scan_ops_t *ops = scan_ops ? scan_ops : scan_select();
+    return ops->eol(p, end);
+}
+
+const char *scan_crlf(const char *p, const char *end) {
+    const scan_ops_t *ops = scan_ops ? scan_ops : scan_select();
+    return ops->crlf(p, end);
+}
+
+const char *scan_blank_line(const char *p, const char *end) {
+    const scan_ops_t *ops = scan_ops ? scan_ops : scan_select();
+    return ops->blank_line(p, end);
+}
+
+const char *scan_fold(const char *p, const char *end) {
+    const scan_ops_t *ops = scan_ops ? scan_ops : scan_select();
+    return ops->fold(p, end);
+}
+
+const char *scan_level(void) {
+    const scan_ops_t *ops = scan_ops ? scan_ops : scan_select();
+    return ops->name;
+}
@@ -0,0 +1,28 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/***
+ * Byte scanning shared by the parsers. Each function has SSE2 and AVX2 versions picked at the
+ * first call from what the CPU supports, with a plain C version for other CPUs.
+ * FETCHMAIL_SCAN=scalar, sse2 or avx2 forces one of them (for testing and benchmarks).
+*/
+
+// Case-insensitive strstr, for NUL terminated strings
+char *scan_casestr(const char *haystack, const char *needle);
+
+// Functions to find the first CR or LF, the first CRLF and the first CRLF CRLF in [p, end)
+// Each returns NULL if there is none
+const char *scan_eol(const char *p, const char *end);
+
+const char *scan_crlf(const char *p, const char *end);
+
+const char *scan_blank_line(const char *p, const char *end);
+
+// Function to find the first folded header line (CRLF followed by a space or tab) in [p, end)
+// Returns the CR, or NULL if there is none
+const char *scan_fold(const char *p, const char *end);
+
+// Name of the version in use: "scalar", "sse2" or "avx2"
+const char *scan_level(void);
+
+#endif
@@ -0,0 +1,115 @@
+/***
+ * Vector versions of the scan.h functions. This file is included by scan.c once per instruction
+ * set, with SCAN_ISA naming it and the VEC_* macros mapping to its intrinsics, so it has no
+ * include guard. Every vector loop stops where a load would pass end and leaves the rest to the
+ * scalar version. scan_casestr only knows where the string ends once it has seen the NUL, so
+ * it uses aligned loads, which never cross into the next page.
+*/
+
+#define SCAN_JOIN2(name, isa) name##_##isa
+#define SCAN_JOIN(name, isa) SCAN_JOIN2(name, isa)
+#define SCAN_FN(name) SCAN_JOIN(name, SCAN_ISA)
+
+static SCAN_TARGET const char *SCAN_FN(find_eol)(const char *p, const char *end) {
+    VEC cr = VEC_SET1('\r');
+    VEC lf = VEC_SET1('\n');
+    while (end - p >= VEC_WIDTH) {
+        VEC v = VEC_LOAD(p);
+        unsigned int mask = VEC_MASK(VEC_OR(VEC_EQ(v, cr), VEC_EQ(v, lf)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += VEC_WIDTH;
+    }
+    return find_eol_scalar(p, end);
+}
+
+static SCAN_TARGET const char *SCAN_FN(find_crlf)(const char *p, const char *end) {
+    VEC cr = VEC_SET1('\r');
+    VEC lf = VEC_SET1('\n');
+    while (end - p >= VEC_WIDTH + 1) {
+        unsigned int mask = VEC_MASK(VEC_AND(VEC_EQ(VEC_LOAD(p), cr), VEC_EQ(VEC_LOAD(p + 1), lf)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += VEC_WIDTH;
+    }
+    return find_crlf_scalar(p, end);
+}
+
+static SCAN_TARGET const char *SCAN_FN(find_blank_line)(const char *p, const char *end) {
+    VEC cr = VEC_SET1('\r');
+    VEC lf = VEC_SET1('\n');
+    while (end - p >= VEC_WIDTH + 3) {
+        VEC first = VEC_AND(VEC_EQ(VEC_LOAD(p), cr), VEC_EQ(VEC_LOAD(p + 1), lf));
+        VEC second = VEC_AND(VEC_EQ(VEC_LOAD(p + 2), cr), VEC_EQ(VEC_LOAD(p + 3), lf));
+        unsigned int mask = VEC_MASK(VEC_AND(first, second));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += VEC_WIDTH;
+    }
+    return find_blank_line_scalar(p, end);
+}
+
+static SCAN_TARGET const char *SCAN_FN(find_fold)(const char *p, const char *end) {
+    VEC cr = VEC_SET1('\r');
+    VEC lf = VEC_SET1('\n');
+    VEC space = VEC_SET1(' ');
+    VEC tab = VEC_SET1('\t');
+    while (end - p >= VEC_WIDTH + 2) {
+        VEC crlf = VEC_AND(VEC_EQ(VEC_LOAD(p), cr), VEC_EQ(VEC_LOAD(p + 1), lf));
+        VEC next = VEC_LOAD(p + 2);
+        unsigned int mask = VEC_MASK(VEC_AND(crlf, VEC_OR(VEC_EQ(next, space), VEC_EQ(next, tab))));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += VEC_WIDTH;
+    }
+    return find_fold_scalar(p, end);
+}
+
+// Candidates are the bytes matching the first character of the needle in either case, checked
+// one by one. A NUL ends the search
+static SCAN_TARGET char *SCAN_FN(find_casestr)(const char *haystack, const char *needle) {
+    if (needle[0] == '\0') {
+        return (char *)haystack;
+    }
+    size_t rest = strlen(needle + 1);
+    VEC lower = VEC_SET1((char)tolower((unsigned char)needle[0]));
+    VEC upper = VEC_SET1((char)toupper((unsigned char)needle[0]));
+    VEC nul = VEC_SET1('\0');
+
+    const char *block = (const char *)((uintptr_t)haystack & ~(uintptr_t)(VEC_WIDTH - 1));
+    unsigned int skip = haystack - block;
+    while (1) {
+        VEC v = VEC_LOAD_ALIGNED(block);
+        unsigned int zeros = VEC_MASK(VEC_EQ(v, nul));
+        unsigned int mask = VEC_MASK(VEC_OR(VEC_EQ(v, lower), VEC_EQ(v, upper)));
+
+        // Bytes before the start of the haystack are not part of it
+        zeros = (zeros >> skip) << skip;
+        mask = (mask >> skip) << skip;
+        skip = 0;
+
+        // Only candidates before the NUL count
+        if (zeros) {
+            mask &= (zeros ^ (zeros - 1)) >> 1;
+        }
+        while (mask) {
+            const char *candidate = block + __builtin_ctz(mask);
+            if (strncasecmp(candidate + 1, needle + 1, rest) == 0) {
+                return (char *)candidate;
+            }
+            mask &= mask - 1;
+        }
+        if (zeros) {
+            return NULL;
+        }
+        block += VEC_WIDTH;
+    }
+}
+
+#undef SCAN_FN
+#undef SCAN_JOIN
+#undef SCAN_JOIN2
@@ -3,57 +3,13 @@
 
 #include <math.h>
 
-#define NUL_PLACEHOLDER '\x01'
+#include "imap_reader.h"
 
-// linked list node
-typedef struct node node_t;
+// Function to stream raw email for retrieve, used as the literal_fn_t of the FETCH response
+void stream_message_retrieve(imap_reader_t *reader, const char *line, size_t length, void *ctx);
 
-struct node {
-    char *type;
-    char *packet;
-    node_t *next;
-};
-
-
-// construct a linked list
-typedef struct {
-    node_t *head;
-    node_t *foot;
-}list_t;
-
-// create an empty linked list 
-list_t *make_empty_list(void);
-
-// function to append node to end of the list. Append to foot
-void insert_at_foot(list_t *list, const char *packet, const char *type);
-
-// print packet
-void print_packet(node_t *node);
-
-// prints the whole list
-void print_list(list_t *list);
-
-// Function to free the process linked list node
-void free_node(node_t *node);
-
-// Function to free the entire linked list
-void free_list(list_t *list);
-
-// Function that finds length of list.
-int len_list(list_t *list);
-
-// Function that checks if list is empty
-int is_list_empty(list_t *list);
-
-// Function to print raw email for retrieve 
-void print_list_retrieve(list_t *list);
+void print_message_delimiter(const char *line);
 
 void printUpToIndex(char *string, int index);
 
-void print_subject_list(list_t *subject_list);
-
-void sort_subject_list(list_t *list);
-
-void print_string_with_nul_handling(const char *str);
-
 #endif
\ No newline at end of file
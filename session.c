@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "session.h"
+#include "connect.h"
+#include "header_cache.h"
+#include "download.h"
+#include "export.h"
+#include "stats.h"
+
+/***
+ * A session is one logged in connection with a folder selected. main runs a single command on
+ * it, the daemon keeps it open and runs many.
+*/
+
+// Function to tell whether the server offers COMPRESS=DEFLATE. response holds the LOGIN response,
+// whose OK usually carries the capabilities of the logged in session. Returns -1 if it does not
+static int compress_offered(const char *response) {
+    if (strcasestr(response, "[CAPABILITY ") == NULL) {
+        return -1;
+    }
+    return strcasestr(response, "COMPRESS=DEFLATE") != NULL;
+}
+
+// Function to connect to the server, log in and select the folder
+// LOGIN and SELECT are sent together without waiting for the greeting. COMPRESS is only asked for
+// once the capabilities after LOGIN list COMPRESS=DEFLATE, from the [CAPABILITY] code of its OK or
+// else from a CAPABILITY command. Either is sent while SELECT is still on its way, so a server
+// that lists it in its LOGIN OK has the session ready one round trip after connecting. Nothing is
+// sent after COMPRESS, the server compresses everything after its OK
+void open_session(session_t *session, const fetch_mail_t *fetch_mail) {
+    session->ssl = NULL;
+    session->compress = NULL;
+    arena_init(&session->arena);
+
+    const char *port = fetch_mail->port ? fetch_mail->port : (fetch_mail->isTLS ? "993" : "143");
+    session->sockfd = connect_server(fetch_mail->server_name, port, fetch_mail->connectTimeout, fetch_mail->readTimeout);
+    stats_connection(session->sockfd);
+
+    // If TLS config, the handshake runs on the connected socket
+    if (fetch_mail->isTLS) {
+        stats_begin(STATS_TLS);
+        if (tls_connect(session->sockfd, fetch_mail->server_name, port, fetch_mail->ca_file, fetch_mail->useKTLS,
+                        &session->ssl) < 0) {
+            exit(2);
+        }
+        stats_end(STATS_TLS);
+        transport_tls(&session->transport, session->ssl);
+    } else {
+        transport_plain(&session->transport, session->sockfd);
+    }
+
+    // Everything goes through the transport, so nothing below depends on how it is carried
+    reader_init(&session->reader, &session->transport);
+    session->send_fn = transport_send;
+    session->sink = &session->transport;
+
+    command_queue_t *commands = &session->commands;
+    command_queue_init(commands, &session->reader, session->send_fn, session->sink, 1);
+
+    char folder[2*BUFFER_SIZE + 2];
+    quote_folder(fetch_mail->folder, folder, sizeof(folder));
+    stats_begin(STATS_LOGIN);
+    stats_begin(STATS_SELECT);
+    imap_command_t *login = command_send(commands, "LOGIN %s %s", fetch_mail->username, fetch_mail->password);
+    imap_command_t *select = command_send(commands, "SELECT %s", folder);
+
+    // A server that is already authenticated (PREAUTH) refuses the LOGIN, which is fine
+    int status = command_wait(commands, login);
+    if (status != IMAP_OK && strncasecmp(commands->greeting, "* PREAUTH", 9) != 0) {
+        printf("Login failure\n");
+        exit(3);
+    }
+    stats_end(STATS_LOGIN);
+    int offered = fetch_mail->noCompress ? 0 : compress_offered(login->response.data);
+    command_free(login);
+
+    // Without a [CAPABILITY] code the server is asked, behind the SELECT already sent
+    imap_command_t *capability = offered < 0 ? command_send(commands, "CAPABILITY") : NULL;
+    imap_command_t *compress = NULL;
+    if (offered > 0) {
+        stats_begin(STATS_COMPRESS);
+        compress = command_send(commands, "COMPRESS DEFLATE");
+    }
+
+    if (command_wait(commands, select) != IMAP_OK) {
+        printf("Folder not found\n");
+        exit(3);
+    }
+    stats_end(STATS_SELECT);
+    parse_select_response(select->response.data, &session->mailbox);
+    command_free(select);
+
+    if (capability != NULL) {
+        command_wait(commands, capability);
+        if (strcasestr(capability->response.data, "COMPRESS=DEFLATE") != NULL) {
+            stats_begin(STATS_COMPRESS);
+            compress = command_send(commands, "COMPRESS DEFLATE");
+        }
+        command_free(capability);
+    }
+
+    // From here on every command and response goes through deflate if the server agreed
+    int compressing = compress != NULL && command_wait(commands, compress) == IMAP_OK;
+    stats_end(STATS_COMPRESS);
+    if (compressing) {
+        // The transport is swapped in place, the reader and the commands keep using it
+        imap_reader_t *reader = &session->reader;
+        session->compress = compress_start(&session->transport);
+        compress_feed(session->compress, reader->buffer + reader->start, reader->end - reader->start);
+        transport_compress(&session->transport, session->compress);
+        reader_init(reader, &session->transport);
+    }
+    if (compress != NULL) {
+        command_free(compress);
+    }
+
+    session->used = 0;
+}
+
+// Function to bring the folder state up to date on a session that has already run commands. Any
+// EXISTS sent since has been passed over, so the folder is selected again
+static void refresh_mailbox(session_t *session, const char *folder_name) {
+    char folder[2*BUFFER_SIZE + 2];
+    quote_folder(folder_name, folder, sizeof(folder));
+    stats_begin(STATS_SELECT);
+    imap_command_t *select = command_send(&session->commands, "SELECT %s", folder);
+
+    if (command_wait(&session->commands, select) != IMAP_OK) {
+        printf("Folder not found\n");
+        exit(3);
+    }
+    stats_end(STATS_SELECT);
+    parse_select_response(select->response.data, &session->mailbox);
+    command_free(select);
+}
+
+// Function to close a session, safe to call again on a closed one
+void close_session(session_t *session) {
+    compress_free(session->compress);
+    session->compress = NULL;
+    if (session->ssl != NULL) {
+        free_ssl_connection(session->ssl);
+        session->ssl = NULL;
+    }
+    if (session->sockfd >= 0) {
+        close(session->sockfd);
+        session->sockfd = -1;
+    }
+    buffer_free(&session->commands.out);
+    arena_free(&session->arena);
+}
+
+// Function to run a command on an open session
+void run_command(session_t *session, const fetch_mail_t *fetch_mail, const command_plan_t *plan) {
+    // retrieve --dir saves the messages over several connections instead of printing them
+    if (fetch_mail->out_dir != NULL) {
+        download_messages(session, fetch_mail);
+        return;
+    }
+    if (strcmp(plan->name, "export") == 0) {
+        export_messages(session, fetch_mail);
+        fflush(stdout);
+        stats_report();
+        return;
+    }
+
+    // Commands working on messages fetch only the items in their plan and print each message
+    // as its response arrives, list fetches the subjects of the whole folder itself
+    // Header fields are answered from the header cache where it can
+    compress_counts_t before = {0, 0, 0, 0};
+    if (session->compress != NULL) {
+        before = session->compress->counts;
+    }
+
+    int served = 0;
+    if (plan->cache_slot != CACHE_NONE) {
+        if (session->used) {
+            refresh_mailbox(session, fetch_mail->folder);
+        }
+
+        header_cache_t cache;
+        if (header_cache_open(&cache, session, fetch_mail)) {
+            served = plan->all_messages ? header_cache_list(&cache, session, plan)
+                                        : header_cache_fetch(&cache, session, fetch_mail, plan);
+            header_cache_close(&cache);
+        }
+    }
+    session->used = 1;
+
+    if (!served && plan->all_messages) {
+        // To fetch email headers and parse them and print them to stdout
+        list(&session->commands, plan);
+    } else if (!served && strcmp(plan->name, "mime") == 0 && !fetch_mail->mimeTree) {
+        // mime fetches the part it prints, --tree needs every header of the message
+        retrieve_mime_parts(&session->commands, &session->arena, fetch_mail);
+    } else if (!served) {
+        retrieve(&session->commands, &session->arena, fetch_mail, plan);
+    }
+
+    fflush(stdout);
+    stats_arena(session->arena.stats.peak);
+    stats_report();
+    if (fetch_mail->verbose) {
+        compress_report(session->compress, &before, stderr);
+        arena_report(&session->arena, stderr);
+        if (session->ssl != NULL && fetch_mail->useKTLS) {
+            ktls_report(session->ssl, stderr);
+        }
+    }
+
+    // Everything parsed for the command goes in one go, a pooled session holds none of it idle
+    arena_free(&session->arena);
+}
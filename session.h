@@ -0,0 +1,36 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "imap_client.h"
+#include "tls.h"
+#include "compress.h"
+#include "command.h"
+#include "transport.h"
+#include "arena.h"
+
+// An authenticated connection with the folder selected, ready for commands
+typedef struct session {
+    int sockfd;
+    SSL *ssl;             // NULL unless -t was given
+    transport_t transport; // plain, TLS or either with deflate on top, what every command uses
+    imap_reader_t reader; // reads responses, kept for the whole session
+    send_fn_t send_fn;    // sends commands over the same connection, transport_send
+    void *sink;           // the transport
+    compress_stream_t *compress; // NULL unless the server agreed to COMPRESS=DEFLATE
+    command_queue_t commands; // tags and routes the session's own commands (LOGIN, SELECT)
+    arena_t arena;        // parse data of the message being handled, its blocks reused for the next
+    mailbox_t mailbox;    // state of the selected folder
+    int used;             // commands have run since the folder was selected
+} session_t;
+
+// Connect, log in and select the folder given in fetch_mail
+void open_session(session_t *session, const fetch_mail_t *fetch_mail);
+
+// Close the connection and release everything the session holds. A forked process can close its
+// copy of a session, nothing is sent over the connection
+void close_session(session_t *session);
+
+// Run the command on an open session and print its output to stdout
+void run_command(session_t *session, const fetch_mail_t *fetch_mail, const command_plan_t *plan);
+
+#endif
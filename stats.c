@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include "stats.h"
+
+/***
+ * --stats json: timings and counts for one command, written as one JSON object on stderr (or
+ * appended as a line to --stats-file) when it ends, or when it exits early. Phases are timed with
+ * the monotonic clock where the code enters and leaves them, so a slow run can be put down to the
+ * lookup, the connection, TLS, the server or parsing. The kernel's own counts complete the
+ * picture: TCP_INFO for the bytes on the wire and the round trip time, /proc/self/io for the read
+ * and write syscalls of the whole process.
+*/
+
+static const char *phase_names[STATS_PHASES] = {
+    "dns", "connect", "tls", "login", "select", "compress", "first_byte", "fetch", "parse"
+};
+
+// Kernel counts, taken at the start and at the report
+typedef struct kernel_counts {
+    int have_tcp;
+    struct tcp_info tcp;
+    int have_io;
+    unsigned long long syscr;
+    unsigned long long syscw;
+} kernel_counts_t;
+
+// The command being timed, one per process (a daemon worker starts again for each request)
+static struct {
+    int enabled;            // until the report is written
+    const char *command;
+    const char *path;       // file the object is appended to, NULL for stderr
+    int sockfd;
+    long long started;
+    stats_timer_t phases[STATS_PHASES];
+    stats_counts_t counts;
+    kernel_counts_t before;
+} stats;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Function to read the kernel's counts for the connection and the process
+static void read_kernel_counts(int sockfd, kernel_counts_t *counts) {
+    memset(counts, 0, sizeof(*counts));
+
+    socklen_t len = sizeof(counts->tcp);
+    counts->have_tcp = sockfd >= 0 && getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &counts->tcp, &len) == 0;
+
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io != NULL) {
+        char line[128];
+        int found = 0;
+        while (fgets(line, sizeof(line), io) != NULL) {
+            found += sscanf(line, "syscr: %llu", &counts->syscr);
+            found += sscanf(line, "syscw: %llu", &counts->syscw);
+        }
+        counts->have_io = found == 2;
+        fclose(io);
+    }
+}
+
+static void write_report(int completed);
+
+// Function run at exit, for a command that stopped before it could report
+static void report_on_exit(void) {
+    write_report(0);
+}
+
+void stats_start(const char *command, const char *path, int sockfd) {
+    static int registered = 0;
+    if (!registered) {
+        atexit(report_on_exit);
+        registered = 1;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    stats.enabled = 1;
+    stats.command = command;
+    stats.path = path;
+    stats.sockfd = sockfd;
+    stats.started = now_ns();
+    read_kernel_counts(sockfd, &stats.before);
+}
+
+void stats_connection(int sockfd) {
+    if (stats.enabled) {
+        // A new connection, everything on it is counted
+        stats.sockfd = sockfd;
+        stats.before.have_tcp = 1;
+        memset(&stats.before.tcp, 0, sizeof(stats.before.tcp));
+    }
+}
+
+void stats_begin(stats_phase_t phase) {
+    if (stats.enabled) {
+        stats.phases[phase].started = now_ns();
+    }
+}
+
+void stats_end(stats_phase_t phase) {
+    stats_timer_t *timer = &stats.phases[phase];
+    if (!stats.enabled || timer->started == 0) {
+        return;
+    }
+
+    long long elapsed = now_ns() - timer->started;
+    if (timer->count == 0) {
+        timer->first = timer->started - stats.started;
+    }
+    timer->count++;
+    timer->total += elapsed;
+    if (elapsed > timer->max) {
+        timer->max = elapsed;
+    }
+    timer->started = 0;
+}
+
+void stats_read(size_t len) {
+    stats.counts.reads++;
+    stats.counts.bytes_in += len;
+}
+
+void stats_write(size_t len) {
+    stats.counts.writes++;
+    stats.counts.bytes_out += len;
+}
+
+void stats_spliced(size_t len) {
+    stats.counts.spliced += len;
+}
+
+void stats_buffer(size_t size) {
+    if (size > stats.counts.buffer_peak) {
+        stats.counts.buffer_peak = size;
+    }
+}
+
+void stats_arena(size_t peak) {
+    if (peak > stats.counts.arena_peak) {
+        stats.counts.arena_peak = peak;
+    }
+}
+
+void stats_report(void) {
+    write_report(1);
+}
+
+// Function to write the JSON object, one line of it
+static void write_report(int completed) {
+    if (!stats.enabled) {
+        return;
+    }
+    stats.enabled = 0;
+
+    kernel_counts_t after;
+    read_kernel_counts(stats.sockfd, &after);
+    const kernel_counts_t *before = &stats.before;
+
+    FILE *out = stderr;
+    if (stats.path != NULL && (out = fopen(stats.path, "a")) == NULL) {
+        perror("Failed to open the --stats-file");
+        return;
+    }
+
+    fprintf(out, "{\"command\": \"%s\", \"completed\": %s, \"elapsed_us\": %lld, \"phases\": {",
+            stats.command, completed ? "true" : "false", (now_ns() - stats.started) / 1000);
+    for (int i = 0; i < STATS_PHASES; i++) {
+        const stats_timer_t *timer = &stats.phases[i];
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"start_us\": %lld, \"total_us\": %lld, \"max_us\": %lld}",
+                i == 0 ? "" : ", ", phase_names[i], timer->count, timer->first / 1000, timer->total / 1000,
+                timer->max / 1000);
+    }
+
+    const stats_counts_t *counts = &stats.counts;
+    fprintf(out, "}, \"transport\": {\"reads\": %llu, \"writes\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, \"spliced\": %llu}",
+            counts->reads, counts->writes, counts->bytes_in, counts->bytes_out, counts->spliced);
+
+    // Wire bytes include TLS records and are before deflate, RTT is the kernel's smoothed estimate
+    if (after.have_tcp && before->have_tcp) {
+        fprintf(out, ", \"tcp\": {\"bytes_received\": %llu, \"bytes_sent\": %llu, \"segs_in\": %u, \"segs_out\": %u, \"retransmits\": %u, \"rtt_us\": %u}",
+                (unsigned long long)(after.tcp.tcpi_bytes_received - before->tcp.tcpi_bytes_received),
+                (unsigned long long)(after.tcp.tcpi_bytes_sent - before->tcp.tcpi_bytes_sent),
+                after.tcp.tcpi_segs_in - before->tcp.tcpi_segs_in, after.tcp.tcpi_segs_out - before->tcp.tcpi_segs_out,
+                after.tcp.tcpi_total_retrans - before->tcp.tcpi_total_retrans, after.tcp.tcpi_rtt);
+    }
+    if (after.have_io && before->have_io) {
+        fprintf(out, ", \"syscalls\": {\"read\": %llu, \"write\": %llu}",
+                after.syscr - before->syscr, after.syscw - before->syscw);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(out, ", \"memory\": {\"buffer_peak\": %zu, \"arena_peak\": %zu, \"max_rss_kb\": %ld}}\n",
+            counts->buffer_peak, counts->arena_peak, usage.ru_maxrss);
+
+    if (out != stderr) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+}
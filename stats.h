@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// What --stats times. A phase can happen many times (one FETCH per message), each kind is summed
+typedef enum stats_phase {
+    STATS_DNS,          // resolving the server name
+    STATS_CONNECT,      // racing the server's addresses
+    STATS_TLS,          // TLS handshake
+    STATS_LOGIN,        // LOGIN sent until its OK (sent together with SELECT and COMPRESS)
+    STATS_SELECT,       // SELECT sent until its OK
+    STATS_COMPRESS,     // COMPRESS sent until its OK
+    STATS_FIRST_BYTE,   // waiting on a FETCH response until its first line
+    STATS_FETCH,        // waiting on a FETCH response until its tagged completion, parsing included
+    STATS_PARSE,        // parsing fetched messages in the client
+    STATS_PHASES
+} stats_phase_t;
+
+// One kind of phase, times in nanoseconds
+typedef struct stats_timer {
+    unsigned long long count;
+    long long first;    // start of the first one, from the start of the command
+    long long total;
+    long long max;
+    long long started;  // start of the one in progress, 0 if none is
+} stats_timer_t;
+
+// Counts of the connection as the client sees it, over any of the transports
+typedef struct stats_counts {
+    unsigned long long reads;       // transport reads (one syscall each on a plain socket)
+    unsigned long long writes;      // transport writes
+    unsigned long long bytes_in;    // after TLS and deflate
+    unsigned long long bytes_out;
+    unsigned long long spliced;     // bytes moved from the socket by splice, not read at all
+    size_t buffer_peak;             // largest response buffer
+    size_t arena_peak;              // most parse arena in use for one message
+} stats_counts_t;
+
+// Function to start timing a command (for --stats json), the object goes to path or stderr if it is
+// NULL. sockfd is the connection if it is already open, else -1. Nothing is timed until this is called
+void stats_start(const char *command, const char *path, int sockfd);
+
+// Function to name the connection the TCP counts are taken from, once it is open
+void stats_connection(int sockfd);
+
+// Functions to time a phase, stats_end without a stats_begin does nothing
+void stats_begin(stats_phase_t phase);
+
+void stats_end(stats_phase_t phase);
+
+// Functions to count what crosses the transport
+void stats_read(size_t len);
+
+void stats_write(size_t len);
+
+void stats_spliced(size_t len);
+
+void stats_buffer(size_t size);
+
+void stats_arena(size_t peak);
+
+// Function to write the JSON object once the command has finished. A command that exits before
+// then is reported at exit, with "completed": false
+void stats_report(void);
+
+#endif
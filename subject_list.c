@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "subject_list.h"
+#include "scan.h"
+#include "stats.h"
+
+/***
+ * Engine behind the list command. Each FETCH response is parsed as it arrives into a record
+ * {seq, subject span} in one contiguous array, with the subject text in a single buffer, so a
+ * folder of any size costs a few allocations. Servers answer 1:* in order, so the sort is
+ * usually skipped; otherwise a radix sort on the sequence number keeps it linear.
+*/
+
+// Initialise an empty list
+void subject_list_init(subject_list_t *list) {
+    list->records = NULL;
+    list->count = 0;
+    list->size = 0;
+    buffer_init(&list->text);
+    buffer_init(&list->literal);
+    list->ordered = 1;
+}
+
+// Free the memory owned by the list
+void subject_list_free(subject_list_t *list) {
+    free(list->records);
+    buffer_free(&list->text);
+    buffer_free(&list->literal);
+    subject_list_init(list);
+}
+
+// Append a record, growing the array geometrically
+static subject_record_t *add_record(subject_list_t *list) {
+    if (list->count == list->size) {
+        size_t new_size = list->size ? list->size * 2 : 1024;
+        subject_record_t *records = realloc(list->records, new_size * sizeof(subject_record_t));
+        if (records == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(5);
+        }
+        list->records = records;
+        list->size = new_size;
+    }
+    return &list->records[list->count++];
+}
+
+// Drop trailing CR, LF and spaces from the subject being built, keeping at least one character
+static void trim_text(byte_buffer_t *text, size_t start) {
+    while (text->len > start + 1 && (text->data[text->len - 1] == '\r' || text->data[text->len - 1] == '\n' ||
+                                     text->data[text->len - 1] == ' ')) {
+        text->len--;
+    }
+    text->data[text->len] = '\0';
+}
+
+// The subject is the value of the "Subject: " line, with any continuation lines appended as they
+// are (no separator, leading white space kept). Lines are split on CR and LF and empty ones skipped
+void subject_list_add(subject_list_t *list, unsigned long seq, const char *literal, size_t length) {
+    subject_record_t *record = add_record(list);
+    record->seq = seq;
+    record->offset = list->text.len;
+    buffer_append(&list->text, "", 0);
+
+    if (list->count > 1 && record->seq < list->records[list->count - 2].seq) {
+        list->ordered = 0;
+    }
+
+    int found = 0;
+    const char *p = literal;
+    const char *end = literal + length;
+    while (p < end) {
+        // Skip the line ending (and any empty lines)
+        while (p < end && (*p == '\r' || *p == '\n')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        const char *line_start = p;
+        p = scan_eol(p, end);
+        if (p == NULL) {
+            p = end;
+        }
+        size_t line_len = p - line_start;
+
+        if (found && line_start[0] != '*') {
+            buffer_append(&list->text, line_start, line_len);
+        }
+
+        const char *subject = memmem(line_start, line_len, "Subject: ", 9);
+        if (subject != NULL) {
+            subject += 9;
+            list->text.len = record->offset;
+            buffer_append(&list->text, subject, line_start + line_len - subject);
+            trim_text(&list->text, record->offset);
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        buffer_append(&list->text, "<No subject>", 12);
+    }
+    record->length = list->text.len - record->offset;
+}
+
+// Read the header literal of one FETCH response into the list
+void collect_subject(imap_reader_t *reader, const char *line, size_t length, void *ctx) {
+    subject_list_t *list = ctx;
+    list->literal.len = 0;
+    reader_read_literal(reader, length, &list->literal);
+    stats_begin(STATS_PARSE);
+    subject_list_add(list, strtoul(line + 2, NULL, 10), list->literal.data, list->literal.len); // "* <seq> FETCH ("
+    stats_end(STATS_PARSE);
+}
+
+// Stable LSD radix sort on the 32 bit sequence number, one byte per pass. Passes where every
+// record has the same byte are skipped, so small folders only pay for one or two passes
+void subject_list_sort(subject_list_t *list) {
+    if (list->ordered || list->count < 2) {
+        return;
+    }
+
+    subject_record_t *from = list->records;
+    subject_record_t *to = malloc(list->count * sizeof(subject_record_t));
+    if (to == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        size_t counts[257] = {0};
+        for (size_t i = 0; i < list->count; i++) {
+            counts[((from[i].seq >> shift) & 0xff) + 1]++;
+        }
+        if (counts[((from[0].seq >> shift) & 0xff) + 1] == list->count) {
+            continue;
+        }
+        for (int b = 0; b < 256; b++) {
+            counts[b + 1] += counts[b];
+        }
+        for (size_t i = 0; i < list->count; i++) {
+            to[counts[(from[i].seq >> shift) & 0xff]++] = from[i];
+        }
+        subject_record_t *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    // Keep the sorted records in the array the list owns
+    if (from != list->records) {
+        memcpy(list->records, from, list->count * sizeof(subject_record_t));
+        to = from;
+    }
+    free(to);
+    list->ordered = 1;
+}
+
+// Print the records in order, as "seq: subject"
+void subject_list_print(const subject_list_t *list, FILE *out) {
+    for (size_t i = 0; i < list->count; i++) {
+        const subject_record_t *record = &list->records[i];
+        fprintf(out, "%lu: ", record->seq);
+        fwrite(list->text.data + record->offset, 1, record->length, out);
+        fputc('\n', out);
+    }
+}
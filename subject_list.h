@@ -0,0 +1,42 @@
+#ifndef SUBJECT_LIST_H
+#define SUBJECT_LIST_H
+
+#include <stdio.h>
+
+#include "imap_reader.h"
+
+// One message in the list output. The subject is a span of the list's text buffer
+typedef struct subject_record {
+    unsigned long seq;
+    size_t offset;
+    size_t length;
+} subject_record_t;
+
+// Subjects of a folder, collected one FETCH response at a time
+typedef struct subject_list {
+    subject_record_t *records;
+    size_t count;
+    size_t size;
+    byte_buffer_t text;     // every subject, back to back
+    byte_buffer_t literal;  // the FETCH literal being parsed, reused for each message
+    int ordered;            // records arrived in ascending sequence order, no sort needed
+} subject_list_t;
+
+// Functions to manage a subject list
+void subject_list_init(subject_list_t *list);
+
+void subject_list_free(subject_list_t *list);
+
+// Add message seq, given the header literal fetched for it
+void subject_list_add(subject_list_t *list, unsigned long seq, const char *literal, size_t length);
+
+// literal_fn_t that reads the header literal and adds it to the subject_list_t passed as ctx
+void collect_subject(imap_reader_t *reader, const char *line, size_t length, void *ctx);
+
+// Sort the records by sequence number, skipped when they arrived in order
+void subject_list_sort(subject_list_t *list);
+
+// Print "seq: subject" for every record
+void subject_list_print(const subject_list_t *list, FILE *out);
+
+#endif
@@ -0,0 +1,1412 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <zlib.h>
+
+#include "../mime.h"
+
+/***
+ * Stand-in IMAP server for testing and benchmarking fetchmail on loopback.
+ *
+ * Serves the folders found in a mail directory (one subdirectory per folder, one file per
+ * message, in name order, a numeric file name is the message's UID) plus a synthetic folder whose message count, size, MIME shape and
+ * header folding are set on the command line. Responses can be delayed (latency), paced
+ * (bandwidth) and cut into tiny TCP segments to shake out client bugs.
+ *
+ * Only what fetchmail uses is implemented: LOGIN, SELECT, FETCH, UID FETCH, CAPABILITY,
+ * COMPRESS DEFLATE, NOOP and LOGOUT. Each connection is served by its own process. BODYSTRUCTURE
+ * and numbered sections come from the client's own MIME parser (mime.c).
+*/
+
+#define MAX_FOLDERS 64
+#define MAX_USERS 16
+#define LINE_SIZE 8192
+#define UIDVALIDITY 1714000000
+
+// Responses are sent once this much output has been queued
+#define FLUSH_SIZE (256 * 1024)
+
+typedef struct message {
+    char *data;
+    size_t len;
+    unsigned int uid;
+} message_t;
+
+typedef struct folder {
+    char *name;
+    message_t *messages;
+    size_t count;
+    unsigned int uidnext;
+} folder_t;
+
+typedef struct server_options {
+    const char *mail_dir;
+    int port;
+    int tls_port;
+    const char *cert_file;
+    const char *key_file;
+    const char *password;
+    int latency_ms;         // delay before the response to each command
+    long bandwidth;         // bytes per second, 0 for unlimited
+    int segment;            // largest single send, 0 for unlimited
+    const char *synthetic;  // name of the synthetic folder
+    int messages;
+    size_t size;            // approximate body size of each synthetic message
+    const char *mime;       // plain, alternative, mixed, nested or random
+    int fold;               // continuation lines in folded headers
+    unsigned int uidvalidity;
+    const char *log_file;   // every command received is appended here
+    int compress;           // offer COMPRESS=DEFLATE after login
+    int login_capability;   // list the capabilities in the LOGIN OK, else only in CAPABILITY
+} server_options_t;
+
+typedef struct connection {
+    int fd;
+    SSL *ssl;
+    char in[LINE_SIZE];
+    size_t start;
+    size_t end;
+    double received;        // when the command being answered arrived
+    int answered;           // latency already applied to this command
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    folder_t *selected;
+    z_stream *deflater;     // set once COMPRESS DEFLATE is active
+    z_stream *inflater;
+    char zin[LINE_SIZE];    // compressed input not inflated yet
+} connection_t;
+
+static server_options_t options = {
+    NULL, 1143, 1993, "test_server/server.crt", "test_server/server.key", "pass",
+    0, 0, 0, "Synthetic", 0, 2048, "plain", 0, UIDVALIDITY, NULL, 1, 1
+};
+
+static folder_t folders[MAX_FOLDERS];
+static int num_folders = 0;
+
+// Accounts given with --user (name, password, own mail directory or NULL), anyone else logs
+// in with options.password and sees the shared folders
+static const char *users[MAX_USERS][3];
+static int num_users = 0;
+
+
+static void die(const char *message) {
+    perror(message);
+    exit(1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_seconds(double seconds) {
+    if (seconds <= 0) {
+        return;
+    }
+    struct timespec ts = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+
+
+//////////// Mailboxes ///////////////////////////
+
+// Growable string used to build messages and responses
+typedef struct text {
+    char *data;
+    size_t len;
+    size_t size;
+} text_t;
+
+static void text_append(text_t *text, const char *data, size_t len) {
+    if (text->len + len + 1 > text->size) {
+        size_t size = text->size ? text->size : 1024;
+        while (size < text->len + len + 1) {
+            size *= 2;
+        }
+        text->data = realloc(text->data, size);
+        if (text->data == NULL) {
+            die("realloc");
+        }
+        text->size = size;
+    }
+    memcpy(text->data + text->len, data, len);
+    text->len += len;
+    text->data[text->len] = '\0';
+}
+
+static void text_printf(text_t *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_printf(text_t *text, const char *format, ...) {
+    char buffer[LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    text_append(text, buffer, len < (int)sizeof(buffer) ? (size_t)len : sizeof(buffer) - 1);
+}
+
+static folder_t *add_folder(const char *name) {
+    if (num_folders == MAX_FOLDERS) {
+        fprintf(stderr, "Too many folders\n");
+        exit(1);
+    }
+    folder_t *folder = &folders[num_folders++];
+    folder->name = strdup(name);
+    folder->messages = NULL;
+    folder->count = 0;
+    folder->uidnext = 1;
+    return folder;
+}
+
+// uid is 0 for the next free UID
+static void add_message(folder_t *folder, char *data, size_t len, unsigned int uid) {
+    folder->messages = realloc(folder->messages, (folder->count + 1) * sizeof(message_t));
+    if (folder->messages == NULL) {
+        die("realloc");
+    }
+    message_t *message = &folder->messages[folder->count++];
+    message->data = data;
+    message->len = len;
+    if (uid >= folder->uidnext) {
+        folder->uidnext = uid;
+    }
+    message->uid = folder->uidnext++;
+}
+
+static folder_t *find_folder(const char *name) {
+    for (int i = 0; i < num_folders; i++) {
+        // INBOX is case-insensitive, every other name is not
+        if (strcmp(folders[i].name, name) == 0 ||
+            (strcasecmp(name, "INBOX") == 0 && strcasecmp(folders[i].name, "INBOX") == 0)) {
+            return &folders[i];
+        }
+    }
+    return NULL;
+}
+
+// Read a message file, line endings are turned into CRLF so fixtures can be stored with LF
+static void load_message(folder_t *folder, const char *path, unsigned int uid) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        die(path);
+    }
+
+    text_t text = {NULL, 0, 0};
+    int c, prev = 0;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '\n' && prev != '\r') {
+            text_append(&text, "\r", 1);
+        }
+        char byte = c;
+        text_append(&text, &byte, 1);
+        prev = c;
+    }
+    fclose(file);
+
+    if (text.data == NULL) {
+        text_append(&text, "", 0);
+    }
+    add_message(folder, text.data, text.len, uid);
+}
+
+// Numeric names in numeric order (so 10.eml follows 9.eml), then the rest by name
+static int compare_names(const void *a, const void *b) {
+    const char *name_a = *(char *const *)a, *name_b = *(char *const *)b;
+    unsigned long uid_a = strtoul(name_a, NULL, 10), uid_b = strtoul(name_b, NULL, 10);
+    if (uid_a != uid_b) {
+        return uid_a == 0 ? 1 : uid_b == 0 ? -1 : (uid_a < uid_b ? -1 : 1);
+    }
+    return strcmp(name_a, name_b);
+}
+
+// Each subdirectory of dir is a folder, each file in it a message
+static void load_mail_dir(const char *dir) {
+    DIR *top = opendir(dir);
+    if (top == NULL) {
+        die(dir);
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(top)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+
+        folder_t *folder = add_folder(entry->d_name);
+        DIR *sub = opendir(path);
+        if (sub == NULL) {
+            die(path);
+        }
+
+        char *names[4096];
+        int count = 0;
+        struct dirent *file;
+        while ((file = readdir(sub)) != NULL && count < 4096) {
+            if (file->d_name[0] != '.') {
+                names[count++] = strdup(file->d_name);
+            }
+        }
+        closedir(sub);
+
+        qsort(names, count, sizeof(char *), compare_names);
+        for (int i = 0; i < count; i++) {
+            char file_path[2 * PATH_MAX];
+            snprintf(file_path, sizeof(file_path), "%s/%s", path, names[i]);
+            load_message(folder, file_path, strtoul(names[i], NULL, 10));
+            free(names[i]);
+        }
+    }
+    closedir(top);
+}
+
+
+
+//////////// Synthetic messages ///////////////////////////
+
+static const char *words[] = {
+    "systems", "socket", "kernel", "buffer", "packet", "thread", "memory", "latency", "server",
+    "client", "message", "folder", "network", "process", "signal", "handshake", "cache", "page"
+};
+
+static unsigned int next_random(unsigned int *state) {
+    *state = *state * 1103515245 + 12345;
+    return (*state >> 16) & 0x7fff;
+}
+
+// Lines of words up to roughly size bytes
+static void append_text(text_t *text, size_t size, unsigned int *state, int qp) {
+    size_t start = text->len;
+    while (text->len - start < size) {
+        size_t line_start = text->len;
+        while (text->len - line_start < 68) {
+            const char *word = words[next_random(state) % (sizeof(words) / sizeof(words[0]))];
+            text_append(text, word, strlen(word));
+            // Some encoded characters and soft line breaks for the quoted-printable parts
+            if (qp && next_random(state) % 8 == 0) {
+                text_append(text, "=C3=A9", 6);
+            }
+            text_append(text, " ", 1);
+        }
+        if (qp && next_random(state) % 2 == 0) {
+            text_append(text, "=\r\n", 3);
+        } else {
+            text_append(text, "\r\n", 2);
+        }
+    }
+}
+
+// Base64 lines of pseudo random bytes up to roughly size bytes
+static void append_base64(text_t *text, size_t size, unsigned int *state) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char line[78];
+    size_t start = text->len;
+    while (text->len - start < size) {
+        for (int i = 0; i < 76; i++) {
+            line[i] = alphabet[next_random(state) & 63];
+        }
+        line[76] = '\r';
+        line[77] = '\n';
+        text_append(text, line, sizeof(line));
+    }
+}
+
+static void append_plain_part(text_t *text, size_t size, unsigned int *state, int qp) {
+    if (qp) {
+        text_printf(text, "Content-Type: text/plain; charset=UTF-8\r\nContent-Transfer-Encoding: quoted-printable\r\n\r\n");
+    } else {
+        text_printf(text, "Content-Type: text/plain; charset=UTF-8\r\nContent-Transfer-Encoding: 7bit\r\n\r\n");
+    }
+    append_text(text, size, state, qp);
+}
+
+static void append_html_part(text_t *text, size_t size, unsigned int *state) {
+    text_printf(text, "Content-Type: text/html; charset=UTF-8\r\nContent-Transfer-Encoding: 7bit\r\n\r\n<html><body><p>\r\n");
+    append_text(text, size, state, 0);
+    text_printf(text, "</p></body></html>\r\n");
+}
+
+static void append_alternative(text_t *text, const char *boundary, size_t size, unsigned int *state) {
+    text_printf(text, "\r\n--%s\r\n", boundary);
+    append_plain_part(text, size / 2, state, 1);
+    text_printf(text, "\r\n--%s\r\n", boundary);
+    append_html_part(text, size / 2, state);
+    text_printf(text, "\r\n--%s--\r\n", boundary);
+}
+
+static void append_attachment(text_t *text, size_t size, unsigned int *state, int number) {
+    text_printf(text, "Content-Type: application/octet-stream; name=\"data%d.bin\"\r\n"
+                      "Content-Disposition: attachment; filename=\"data%d.bin\"\r\n"
+                      "Content-Transfer-Encoding: base64\r\n\r\n", number, number);
+    append_base64(text, size, state);
+}
+
+// A header field with its value folded over options.fold continuation lines, separator ends
+// every line but the last
+static void append_folded(text_t *text, const char *name, const char *first, const char *format,
+                          const char *separator, int number) {
+    text_printf(text, "%s: %s", name, first);
+    for (int i = 1; i <= options.fold; i++) {
+        text_printf(text, "%s\r\n\t", separator);
+        text_printf(text, format, number, i);
+    }
+    text_printf(text, "\r\n");
+}
+
+static void generate_message(folder_t *folder, int number) {
+    static const char *shapes[] = {"plain", "alternative", "mixed", "nested"};
+    unsigned int state = number * 2654435761u;
+    text_t text = {NULL, 0, 0};
+    char first[128];
+
+    const char *shape = options.mime;
+    if (strcmp(shape, "random") == 0) {
+        shape = shapes[number % 4];
+    }
+
+    text_printf(&text, "Return-Path: <sender%d@bench.test>\r\n", number);
+    text_printf(&text, "From: Sender %d <sender%d@bench.test>\r\n", number, number);
+    append_folded(&text, "To", "recipient@bench.test", "copy%d.%d@bench.test", ",", number);
+    text_printf(&text, "Date: Mon, 22 Apr 2024 %02d:%02d:%02d +0000\r\n", number / 3600 % 24, number / 60 % 60, number % 60);
+    snprintf(first, sizeof(first), "Synthetic message %d", number);
+    append_folded(&text, "Subject", first, "continued %d.%d", "", number);
+    text_printf(&text, "Message-ID: <%d@bench.test>\r\nMIME-Version: 1.0\r\n", number);
+
+    if (strcmp(shape, "alternative") == 0) {
+        text_printf(&text, "Content-Type: multipart/alternative; boundary=\"alt-%d\"\r\n", number);
+        char boundary[32];
+        snprintf(boundary, sizeof(boundary), "alt-%d", number);
+        append_alternative(&text, boundary, options.size, &state);
+    } else if (strcmp(shape, "mixed") == 0) {
+        text_printf(&text, "Content-Type: multipart/mixed; boundary=\"mix-%d\"\r\n", number);
+        text_printf(&text, "\r\n--mix-%d\r\n", number);
+        append_plain_part(&text, 512, &state, 0);
+        text_printf(&text, "\r\n--mix-%d\r\n", number);
+        append_attachment(&text, options.size, &state, number);
+        text_printf(&text, "\r\n--mix-%d--\r\n", number);
+    } else if (strcmp(shape, "nested") == 0) {
+        text_printf(&text, "Content-Type: multipart/mixed; boundary=\"mix-%d\"\r\n", number);
+        text_printf(&text, "\r\n--mix-%d\r\n", number);
+        text_printf(&text, "Content-Type: multipart/alternative; boundary=\"alt-%d\"\r\n", number);
+        char boundary[32];
+        snprintf(boundary, sizeof(boundary), "alt-%d", number);
+        append_alternative(&text, boundary, options.size / 4, &state);
+        text_printf(&text, "\r\n--mix-%d\r\n", number);
+        append_attachment(&text, options.size - options.size / 4, &state, number);
+        text_printf(&text, "\r\n--mix-%d--\r\n", number);
+    } else {
+        text_printf(&text, "Content-Type: text/plain; charset=UTF-8\r\nContent-Transfer-Encoding: 7bit\r\n\r\n");
+        append_text(&text, options.size, &state, 0);
+    }
+
+    add_message(folder, text.data, text.len, 0);
+}
+
+
+
+//////////// Output ///////////////////////////
+
+static void queue(connection_t *conn, const char *data, size_t len) {
+    if (conn->out_len + len > conn->out_size) {
+        size_t size = conn->out_size ? conn->out_size : FLUSH_SIZE;
+        while (size < conn->out_len + len) {
+            size *= 2;
+        }
+        conn->out = realloc(conn->out, size);
+        if (conn->out == NULL) {
+            die("realloc");
+        }
+        conn->out_size = size;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+}
+
+static void queue_printf(connection_t *conn, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void queue_printf(connection_t *conn, const char *format, ...) {
+    char buffer[LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    queue(conn, buffer, len < (int)sizeof(buffer) ? (size_t)len : sizeof(buffer) - 1);
+}
+
+static void send_bytes(connection_t *conn, const char *data, size_t len) {
+    while (len > 0) {
+        int n = conn->ssl ? SSL_write(conn->ssl, data, len) : (int)send(conn->fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            exit(0); // Client went away
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Deflate the queued output, flushed so the client can inflate all of it
+static void deflate_output(connection_t *conn, text_t *packed) {
+    z_stream *deflater = conn->deflater;
+    deflater->next_in = (Bytef *)conn->out;
+    deflater->avail_in = conn->out_len;
+
+    char chunk[16384];
+    do {
+        deflater->next_out = (Bytef *)chunk;
+        deflater->avail_out = sizeof(chunk);
+        deflate(deflater, Z_SYNC_FLUSH);
+        text_append(packed, chunk, sizeof(chunk) - deflater->avail_out);
+    } while (deflater->avail_out == 0);
+}
+
+// Send the queued output, after the latency for the current command and at the set bandwidth.
+// With COMPRESS active the bandwidth applies to the compressed bytes, as on a real link
+static void flush_output(connection_t *conn) {
+    if (!conn->answered) {
+        sleep_seconds(conn->received + options.latency_ms / 1000.0 - now());
+        conn->answered = 1;
+    }
+
+    const char *data = conn->out;
+    size_t total = conn->out_len;
+    text_t packed = {NULL, 0, 0};
+    if (conn->deflater != NULL && total > 0) {
+        deflate_output(conn, &packed);
+        data = packed.data;
+        total = packed.len;
+    }
+
+    size_t chunk = options.segment > 0 ? (size_t)options.segment : 16384;
+    double start = now();
+    size_t sent = 0;
+
+    while (sent < total) {
+        size_t len = total - sent < chunk ? total - sent : chunk;
+        send_bytes(conn, data + sent, len);
+        sent += len;
+        if (options.bandwidth > 0) {
+            sleep_seconds(start + (double)sent / options.bandwidth - now());
+        }
+    }
+    free(packed.data);
+    conn->out_len = 0;
+}
+
+
+
+//////////// Input ///////////////////////////
+
+static int receive_raw(connection_t *conn, char *buf, size_t len) {
+    return conn->ssl ? SSL_read(conn->ssl, buf, len) : (int)recv(conn->fd, buf, len, 0);
+}
+
+// Read from the client, inflating once COMPRESS is active
+static int receive_bytes(connection_t *conn, char *buf, size_t len) {
+    if (conn->inflater == NULL) {
+        return receive_raw(conn, buf, len);
+    }
+
+    z_stream *inflater = conn->inflater;
+    inflater->next_out = (Bytef *)buf;
+    inflater->avail_out = len;
+    while (inflater->avail_out == len) {
+        if (inflater->avail_in == 0) {
+            int n = receive_raw(conn, conn->zin, sizeof(conn->zin));
+            if (n <= 0) {
+                return n;
+            }
+            inflater->next_in = (Bytef *)conn->zin;
+            inflater->avail_in = n;
+        }
+        int result = inflate(inflater, Z_SYNC_FLUSH);
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            return -1;
+        }
+    }
+    return len - inflater->avail_out;
+}
+
+// Read one command line without its CRLF, returns 0 when the client disconnects
+static int read_line(connection_t *conn, char *line, size_t size) {
+    size_t len = 0;
+    while (1) {
+        if (conn->start == conn->end) {
+            int n = receive_bytes(conn, conn->in, sizeof(conn->in));
+            if (n <= 0) {
+                return 0;
+            }
+            conn->start = 0;
+            conn->end = n;
+        }
+
+        char c = conn->in[conn->start++];
+        if (c == '\n') {
+            break;
+        }
+        if (len < size - 1) {
+            line[len++] = c;
+        }
+    }
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    line[len] = '\0';
+    return 1;
+}
+
+// Take the next argument: an atom, or a quoted string with \" and \\ escapes
+static char *next_argument(char **cursor) {
+    char *p = *cursor;
+    while (*p == ' ') {
+        p++;
+    }
+    if (*p == '\0') {
+        return NULL;
+    }
+
+    char *arg = p;
+    if (*p == '"') {
+        char *out = p;
+        p++;
+        while (*p != '\0' && *p != '"') {
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            *out++ = *p++;
+        }
+        if (*p == '"') {
+            p++;
+        }
+        // The unquoted value was copied over the opening quote
+        *out = '\0';
+    } else {
+        while (*p != '\0' && *p != ' ') {
+            p++;
+        }
+        if (*p == ' ') {
+            *p++ = '\0';
+        }
+    }
+    *cursor = p;
+    return arg;
+}
+
+
+
+//////////// FETCH ///////////////////////////
+
+// Parse a sequence set into a flag per message. uid selects UIDs instead of sequence numbers
+// Returns 0 if the set is malformed or names a sequence number that does not exist
+static int parse_set(const folder_t *folder, const char *set, int uid, char *selected) {
+    unsigned long max = 0;
+    if (folder->count > 0) {
+        max = uid ? folder->messages[folder->count - 1].uid : folder->count;
+    }
+
+    const char *p = set;
+    while (*p != '\0') {
+        unsigned long range[2];
+        for (int i = 0; i < 2; i++) {
+            if (*p == '*') {
+                range[i] = max;
+                p++;
+            } else if (isdigit((unsigned char)*p)) {
+                range[i] = strtoul(p, (char **)&p, 10);
+            } else {
+                return 0;
+            }
+            if (i == 0 && *p != ':') {
+                range[1] = range[0];
+                break;
+            }
+            if (i == 0) {
+                p++;
+            }
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return 0;
+        }
+
+        unsigned long low = range[0] < range[1] ? range[0] : range[1];
+        unsigned long high = range[0] < range[1] ? range[1] : range[0];
+        if (!uid && (low == 0 || high > max)) {
+            return 0;
+        }
+        for (size_t i = 0; i < folder->count; i++) {
+            unsigned long key = uid ? folder->messages[i].uid : i + 1;
+            if (key >= low && key <= high) {
+                selected[i] = 1;
+            }
+        }
+    }
+    return 1;
+}
+
+// Split the FETCH items into single items, keeping bracketed sections together
+static int split_items(char *items, char **list, int max) {
+    size_t len = strlen(items);
+    if (len >= 2 && items[0] == '(' && items[len - 1] == ')') {
+        items[len - 1] = '\0';
+        items++;
+    }
+
+    int count = 0;
+    char *p = items;
+    while (*p != '\0' && count < max) {
+        while (*p == ' ') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        list[count++] = p;
+        int depth = 0;
+        while (*p != '\0' && (*p != ' ' || depth > 0)) {
+            if (*p == '[') {
+                depth++;
+            } else if (*p == ']') {
+                depth--;
+            }
+            p++;
+        }
+        if (*p == ' ') {
+            *p++ = '\0';
+        }
+    }
+    return count;
+}
+
+// Length of the header, including the blank line that ends it
+static size_t header_length(const message_t *message) {
+    const char *end = memmem(message->data, message->len, "\r\n\r\n", 4);
+    return end ? (size_t)(end - message->data) + 4 : message->len;
+}
+
+// Check whether field (up to its colon) is one of the names in the list "(A B C)"
+static int field_listed(const char *field, size_t len, const char *list) {
+    const char *colon = memchr(field, ':', len);
+    if (colon == NULL) {
+        return 0;
+    }
+    size_t name_len = colon - field;
+    while (name_len > 0 && (field[name_len - 1] == ' ' || field[name_len - 1] == '\t')) {
+        name_len--;
+    }
+
+    const char *p = list;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '(') {
+            p++;
+        }
+        const char *start = p;
+        while (*p != '\0' && *p != ' ' && *p != ')') {
+            p++;
+        }
+        if ((size_t)(p - start) == name_len && name_len > 0 && strncasecmp(start, field, name_len) == 0) {
+            return 1;
+        }
+        if (*p == ')') {
+            break;
+        }
+    }
+    return 0;
+}
+
+// The header fields named in list, folded lines and all, followed by a blank line
+static void header_fields(const message_t *message, const char *list, int exclude, text_t *out) {
+    size_t header_len = header_length(message);
+    const char *p = message->data;
+    const char *end = message->data + header_len;
+
+    while (p < end) {
+        // A field runs until a line that does not start with white space
+        const char *field = p;
+        do {
+            const char *newline = memchr(p, '\n', end - p);
+            p = newline ? newline + 1 : end;
+        } while (p < end && (*p == ' ' || *p == '\t'));
+
+        size_t len = p - field;
+        if (len <= 2) {
+            continue; // The blank line
+        }
+        if (field_listed(field, len, list) != exclude) {
+            text_append(out, field, len);
+        }
+    }
+    text_append(out, "\r\n", 2);
+}
+
+// Append a string quoted, or as a literal if it has 8-bit characters or line breaks
+static void append_string(text_t *out, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = data[i];
+        if (c >= 0x80 || c == '\r' || c == '\n' || c == '\0') {
+            text_printf(out, "{%zu}\r\n", len);
+            text_append(out, data, len);
+            return;
+        }
+    }
+    text_append(out, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '"' || data[i] == '\\') {
+            text_append(out, "\\", 1);
+        }
+        text_append(out, &data[i], 1);
+    }
+    text_append(out, "\"", 1);
+}
+
+// Append the Content-Type parameters this server knows about, or NIL
+static void append_params(text_t *out, const mime_tree_t *tree, const mime_part_t *part) {
+    static const char *names[] = {"charset", "name", "boundary", "format"};
+    int count = 0;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        mime_span_t value;
+        if (mime_param(tree, part, names[i], &value)) {
+            text_append(out, count++ ? " " : "(", 1);
+            append_string(out, names[i], strlen(names[i]));
+            text_append(out, " ", 1);
+            append_string(out, tree->message + value.offset, value.length);
+        }
+    }
+    text_printf(out, "%s", count ? ")" : "NIL");
+}
+
+static size_t count_lines(const char *data, size_t len) {
+    size_t lines = 0;
+    for (const char *p = data; (p = memchr(p, '\n', data + len - p)) != NULL; p++) {
+        lines++;
+    }
+    return lines;
+}
+
+// Append the BODYSTRUCTURE of part index and everything under it, returns the index after them
+static size_t append_body(text_t *out, const mime_tree_t *tree, size_t index) {
+    const mime_part_t *part = &tree->parts[index];
+    const char *body = tree->message + part->body.offset;
+    size_t next = index + 1;
+    int has_child = next < tree->count && tree->parts[next].parent == (int)index;
+
+    // The media type up to its parameters, with the defaults of mime_is_type
+    const char *type = tree->message + part->type.offset;
+    size_t type_len = strcspn(type, "; \t\r\n");
+    if (type_len > part->type.length) {
+        type_len = part->type.length;
+    }
+    if (type_len == 0 || memchr(type, '/', type_len) == NULL) {
+        type = part->in_digest ? "message/rfc822" : "text/plain";
+        type_len = strlen(type);
+    }
+    const char *slash = memchr(type, '/', type_len);
+    const char *subtype = slash + 1;
+    size_t subtype_len = type + type_len - subtype;
+
+    text_append(out, "(", 1);
+    if (mime_is_type(tree, part, "multipart/") && has_child) {
+        while (next < tree->count && tree->parts[next].parent == (int)index) {
+            next = append_body(out, tree, next);
+        }
+        text_append(out, " ", 1);
+        append_string(out, subtype, subtype_len);
+        text_append(out, " ", 1);
+        append_params(out, tree, part);
+        text_append(out, ")", 1);
+        return next;
+    }
+
+    append_string(out, type, slash - type);
+    text_append(out, " ", 1);
+    append_string(out, subtype, subtype_len);
+    text_append(out, " ", 1);
+    append_params(out, tree, part);
+    text_append(out, " NIL NIL ", 9);
+    if (part->encoding.length > 0) {
+        append_string(out, tree->message + part->encoding.offset, part->encoding.length);
+    } else {
+        text_append(out, "\"7BIT\"", 6);
+    }
+    text_printf(out, " %zu", part->body.length);
+
+    if (mime_is_type(tree, part, "message/rfc822")) {
+        // No envelope, then the message inside (an empty text part past MIME_MAX_DEPTH)
+        text_printf(out, " (NIL NIL NIL NIL NIL NIL NIL NIL NIL NIL) ");
+        if (has_child) {
+            next = append_body(out, tree, next);
+        } else {
+            text_printf(out, "(\"text\" \"plain\" NIL NIL NIL \"7bit\" 0 0)");
+        }
+        text_printf(out, " %zu", count_lines(body, part->body.length));
+    } else if (mime_is_type(tree, part, "text/")) {
+        text_printf(out, " %zu", count_lines(body, part->body.length));
+    }
+    text_append(out, ")", 1);
+    return next;
+}
+
+// Find a numbered section such as 1.2, 1.2.MIME or 2.HEADER, storing its bytes (or copying them
+// to data). Returns 0 if the message has no such section
+static int numbered_section(const message_t *message, const char *section, const char **content, size_t *len,
+                            text_t *data) {
+    // The part number, then what of the part is wanted
+    size_t number_len = 0;
+    while (isdigit((unsigned char)section[number_len]) ||
+           (section[number_len] == '.' && isdigit((unsigned char)section[number_len + 1]))) {
+        number_len++;
+    }
+    const char *what = section[number_len] == '.' ? section + number_len + 1 : section + number_len;
+    char number[MIME_SECTION_SIZE];
+    if (number_len >= sizeof(number)) {
+        return 0;
+    }
+    memcpy(number, section, number_len);
+    number[number_len] = '\0';
+
+    mime_tree_t tree;
+    mime_parse(&tree, message->data, message->len);
+    const mime_part_t *part = mime_find_section(&tree, number);
+    int found = part != NULL;
+    if (found && (strcasecmp(what, "HEADER") == 0 || strcasecmp(what, "TEXT") == 0)) {
+        // Only a message/rfc822 part has a header and text of its own
+        size_t index = part - tree.parts;
+        if (!mime_is_type(&tree, part, "message/rfc822") || index + 1 >= tree.count ||
+            tree.parts[index + 1].parent != (int)index) {
+            found = 0;
+        } else {
+            part = &tree.parts[index + 1];
+            what = strcasecmp(what, "HEADER") == 0 ? "MIME" : "";
+        }
+    }
+
+    if (!found) {
+    } else if (what[0] == '\0') {
+        *content = message->data + part->body.offset;
+        *len = part->body.length;
+    } else if (strcasecmp(what, "MIME") == 0) {
+        // The header with the blank line that ends it
+        text_append(data, message->data + part->headers.offset, part->headers.length);
+        text_append(data, "\r\n", 2);
+    } else {
+        found = 0;
+    }
+    mime_tree_free(&tree);
+    return found;
+}
+
+// Queue one BODY[section] item. Returns 0 for a section this server does not know
+static int fetch_body(connection_t *conn, const message_t *message, char *item) {
+    char *open = strchr(item, '[');
+    char *close = strrchr(item, ']');
+    if (open == NULL || close == NULL) {
+        return 0;
+    }
+
+    char section[LINE_SIZE];
+    snprintf(section, sizeof(section), "%.*s", (int)(close - open - 1), open + 1);
+
+    text_t data = {NULL, 0, 0};
+    const char *content = message->data;
+    size_t len = message->len;
+    size_t header_len = header_length(message);
+
+    if (section[0] == '\0') {
+        // Whole message
+    } else if (strcasecmp(section, "HEADER") == 0) {
+        len = header_len;
+    } else if (strcasecmp(section, "TEXT") == 0) {
+        content += header_len;
+        len -= header_len;
+    } else if (strncasecmp(section, "HEADER.FIELDS.NOT ", 18) == 0) {
+        header_fields(message, section + 18, 1, &data);
+    } else if (strncasecmp(section, "HEADER.FIELDS ", 14) == 0) {
+        header_fields(message, section + 14, 0, &data);
+    } else if (!isdigit((unsigned char)section[0]) || !numbered_section(message, section, &content, &len, &data)) {
+        free(data.data);
+        return 0;
+    }
+    if (data.data != NULL) {
+        content = data.data;
+        len = data.len;
+    }
+
+    // The response names the section without .PEEK
+    queue_printf(conn, "BODY[%s] {%zu}\r\n", section, len);
+    queue(conn, content, len);
+    free(data.data);
+    return 1;
+}
+
+static void do_fetch(connection_t *conn, const char *tag, char *args, int uid) {
+    char *set = next_argument(&args);
+    while (args != NULL && *args == ' ') {
+        args++;
+    }
+    if (conn->selected == NULL) {
+        queue_printf(conn, "%s BAD No mailbox selected.\r\n", tag);
+        return;
+    }
+    if (set == NULL || args == NULL || *args == '\0') {
+        queue_printf(conn, "%s BAD Error in IMAP command FETCH: Invalid arguments.\r\n", tag);
+        return;
+    }
+
+    folder_t *folder = conn->selected;
+    char *selected = calloc(folder->count + 1, 1);
+    if (selected == NULL) {
+        die("calloc");
+    }
+    if (!parse_set(folder, set, uid, selected)) {
+        queue_printf(conn, "%s BAD Error in IMAP command FETCH: Invalid messageset (0.001 + 0.000 secs).\r\n", tag);
+        free(selected);
+        return;
+    }
+
+    char *items[32];
+    int count = split_items(args, items, 32);
+
+    for (size_t i = 0; i < folder->count; i++) {
+        if (!selected[i]) {
+            continue;
+        }
+        const message_t *message = &folder->messages[i];
+        queue_printf(conn, "* %zu FETCH (", i + 1);
+
+        int first = 1;
+        int sent_uid = 0;
+        if (uid) {
+            queue_printf(conn, "UID %u", message->uid);
+            first = 0;
+            sent_uid = 1;
+        }
+        for (int j = 0; j < count; j++) {
+            if (strcasecmp(items[j], "UID") == 0 && sent_uid) {
+                continue;
+            }
+            if (!first) {
+                queue(conn, " ", 1);
+            }
+            first = 0;
+
+            if (strcasecmp(items[j], "UID") == 0) {
+                queue_printf(conn, "UID %u", message->uid);
+            } else if (strcasecmp(items[j], "RFC822.SIZE") == 0) {
+                queue_printf(conn, "RFC822.SIZE %zu", message->len);
+            } else if (strcasecmp(items[j], "FLAGS") == 0) {
+                queue_printf(conn, "FLAGS (\\Seen)");
+            } else if (strcasecmp(items[j], "INTERNALDATE") == 0) {
+                queue_printf(conn, "INTERNALDATE \"22-Apr-2024 23:44:11 +0000\"");
+            } else if (strcasecmp(items[j], "BODYSTRUCTURE") == 0) {
+                mime_tree_t tree;
+                text_t structure = {NULL, 0, 0};
+                mime_parse(&tree, message->data, message->len);
+                append_body(&structure, &tree, 0);
+                queue_printf(conn, "BODYSTRUCTURE ");
+                queue(conn, structure.data, structure.len);
+                mime_tree_free(&tree);
+                free(structure.data);
+            } else if (strncasecmp(items[j], "BODY", 4) != 0 || !fetch_body(conn, message, items[j])) {
+                // Close the partial response and fail the command
+                queue_printf(conn, ")\r\n%s BAD Error in IMAP command FETCH: Unknown item %s.\r\n", tag, items[j]);
+                free(selected);
+                return;
+            }
+        }
+        queue(conn, ")\r\n", 3);
+
+        if (conn->out_len >= FLUSH_SIZE) {
+            flush_output(conn);
+        }
+    }
+
+    free(selected);
+    queue_printf(conn, "%s OK Fetch completed (0.001 + 0.000 secs).\r\n", tag);
+}
+
+
+
+//////////// Commands ///////////////////////////
+
+static void do_select(connection_t *conn, const char *tag, char *args) {
+    char *name = next_argument(&args);
+    folder_t *folder = name ? find_folder(name) : NULL;
+    if (folder == NULL) {
+        conn->selected = NULL;
+        queue_printf(conn, "%s NO Mailbox doesn't exist: %s (0.001 + 0.000 secs).\r\n", tag, name ? name : "");
+        return;
+    }
+
+    conn->selected = folder;
+    queue_printf(conn, "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n");
+    queue_printf(conn, "* %zu EXISTS\r\n* 0 RECENT\r\n", folder->count);
+    queue_printf(conn, "* OK [UIDVALIDITY %u] UIDs valid\r\n", options.uidvalidity);
+    queue_printf(conn, "* OK [UIDNEXT %u] Predicted next UID\r\n", folder->uidnext);
+    queue_printf(conn, "%s OK [READ-WRITE] Select completed (0.001 + 0.000 secs).\r\n", tag);
+}
+
+static void do_login(connection_t *conn, const char *tag, char *args) {
+    char *user = next_argument(&args);
+    char *password = next_argument(&args);
+    const char *expected = options.password;
+    const char *mail_dir = NULL;
+    for (int i = 0; user != NULL && i < num_users; i++) {
+        if (strcmp(users[i][0], user) == 0) {
+            expected = users[i][1];
+            mail_dir = users[i][2];
+        }
+    }
+    if (user == NULL || password == NULL || strcmp(password, expected) != 0) {
+        queue_printf(conn, "%s NO [AUTHENTICATIONFAILED] Authentication failed.\r\n", tag);
+        return;
+    }
+
+    // This process only serves this connection, so the user's own folders can simply replace
+    // the shared ones
+    if (mail_dir != NULL) {
+        num_folders = 0;
+        load_mail_dir(mail_dir);
+    }
+    if (options.login_capability) {
+        queue_printf(conn, "%s OK [CAPABILITY IMAP4rev1 LITERAL+ UIDPLUS%s] Logged in\r\n", tag,
+                     options.compress ? " COMPRESS=DEFLATE" : "");
+    } else {
+        queue_printf(conn, "%s OK Logged in\r\n", tag);
+    }
+}
+
+// Switch both directions to raw deflate (RFC 4978) after the tagged OK has gone out uncompressed
+static void do_compress(connection_t *conn, const char *tag, char *args) {
+    char *mechanism = next_argument(&args);
+    if (!options.compress || mechanism == NULL || strcasecmp(mechanism, "DEFLATE") != 0) {
+        queue_printf(conn, "%s BAD Error in IMAP command COMPRESS: Unsupported mechanism.\r\n", tag);
+        return;
+    }
+    if (conn->deflater != NULL) {
+        queue_printf(conn, "%s NO [COMPRESSIONACTIVE] Compression already active.\r\n", tag);
+        return;
+    }
+    queue_printf(conn, "%s OK DEFLATE active\r\n", tag);
+    flush_output(conn);
+
+    conn->deflater = calloc(1, sizeof(z_stream));
+    conn->inflater = calloc(1, sizeof(z_stream));
+    if (conn->deflater == NULL || conn->inflater == NULL ||
+        deflateInit2(conn->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK ||
+        inflateInit2(conn->inflater, -15) != Z_OK) {
+        die("zlib");
+    }
+
+    // Anything the client sent after the command is already compressed
+    size_t pending = conn->end - conn->start;
+    memcpy(conn->zin, conn->in + conn->start, pending);
+    conn->inflater->next_in = (Bytef *)conn->zin;
+    conn->inflater->avail_in = pending;
+    conn->start = conn->end = 0;
+}
+
+// Append a command to the --log file, with the connection's pid
+static void log_command(const char *line) {
+    if (options.log_file == NULL) {
+        return;
+    }
+    FILE *log = fopen(options.log_file, "a");
+    if (log != NULL) {
+        fprintf(log, "%d %s\n", (int)getpid(), line);
+        fclose(log);
+    }
+}
+
+static void serve_connection(connection_t *conn) {
+    char line[LINE_SIZE];
+
+    queue_printf(conn, "* OK [CAPABILITY IMAP4rev1 LITERAL+ UIDPLUS] Stand-in server ready.\r\n");
+    conn->received = now();
+    flush_output(conn);
+
+    while (1) {
+        // Commands already buffered were pipelined with the one before, so they arrived with it
+        int buffered = conn->start < conn->end;
+        if (!read_line(conn, line, sizeof(line))) {
+            return;
+        }
+        if (!buffered) {
+            conn->received = now();
+        }
+        conn->answered = 0;
+        log_command(line);
+
+        char *cursor = line;
+        char *tag = next_argument(&cursor);
+        char *command = next_argument(&cursor);
+        if (tag == NULL || command == NULL) {
+            queue_printf(conn, "%s BAD Error in IMAP command received by server.\r\n", tag ? tag : "*");
+        } else if (strcasecmp(command, "LOGIN") == 0) {
+            do_login(conn, tag, cursor);
+        } else if (strcasecmp(command, "SELECT") == 0 || strcasecmp(command, "EXAMINE") == 0) {
+            do_select(conn, tag, cursor);
+        } else if (strcasecmp(command, "FETCH") == 0) {
+            do_fetch(conn, tag, cursor, 0);
+        } else if (strcasecmp(command, "UID") == 0) {
+            char *sub = next_argument(&cursor);
+            if (sub != NULL && strcasecmp(sub, "FETCH") == 0) {
+                do_fetch(conn, tag, cursor, 1);
+            } else {
+                queue_printf(conn, "%s BAD Error in IMAP command UID: Unknown command.\r\n", tag);
+            }
+        } else if (strcasecmp(command, "CAPABILITY") == 0) {
+            queue_printf(conn, "* CAPABILITY IMAP4rev1 LITERAL+ UIDPLUS%s\r\n%s OK Capability completed.\r\n",
+                         options.compress ? " COMPRESS=DEFLATE" : "", tag);
+        } else if (strcasecmp(command, "COMPRESS") == 0) {
+            do_compress(conn, tag, cursor);
+        } else if (strcasecmp(command, "NOOP") == 0) {
+            queue_printf(conn, "%s OK NOOP completed.\r\n", tag);
+        } else if (strcasecmp(command, "LOGOUT") == 0) {
+            queue_printf(conn, "* BYE Logging out\r\n%s OK Logout completed.\r\n", tag);
+            flush_output(conn);
+            return;
+        } else {
+            queue_printf(conn, "%s BAD Error in IMAP command %s: Unknown command.\r\n", tag, command);
+        }
+        flush_output(conn);
+    }
+}
+
+
+
+//////////// Listening ///////////////////////////
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        die("listen");
+    }
+    return fd;
+}
+
+static SSL_CTX *server_context() {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL || SSL_CTX_use_certificate_chain_file(ctx, options.cert_file) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, options.key_file, SSL_FILETYPE_PEM) <= 0) {
+        fprintf(stderr, "Cannot load %s and %s (make test_cert creates them)\n", options.cert_file, options.key_file);
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+    return ctx;
+}
+
+// Serve one client in a child process
+static void handle_client(int fd, SSL_CTX *ctx) {
+    connection_t conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.fd = fd;
+
+    // Tiny segments only reach the client as such if Nagle does not merge them again
+    if (options.segment > 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    if (ctx != NULL) {
+        conn.ssl = SSL_new(ctx);
+        SSL_set_fd(conn.ssl, fd);
+        if (SSL_accept(conn.ssl) <= 0) {
+            exit(0);
+        }
+    }
+
+    serve_connection(&conn);
+    if (conn.ssl) {
+        SSL_shutdown(conn.ssl);
+    }
+    exit(0);
+}
+
+static void print_usage() {
+    fprintf(stderr,
+            "Usage: imap_test_server [options]\n"
+            "  -d <dir>            mail directory, one subdirectory per folder\n"
+            "  -p <port>           plain IMAP port (default 1143)\n"
+            "  -s <port>           TLS port (default 1993, 0 to disable)\n"
+            "  --cert <file>       certificate (default test_server/server.crt)\n"
+            "  --key <file>        private key (default test_server/server.key)\n"
+            "  --password <pass>   password accepted for every user (default pass)\n"
+            "  --user <name:pass[:dir]>  account with its own password and optionally its own\n"
+            "                      mail directory, may be repeated\n"
+            "  --latency <ms>      delay before each response\n"
+            "  --bandwidth <B/s>   pace responses to this rate\n"
+            "  --segment <bytes>   send responses in segments of at most this size\n"
+            "  --folder <name>     name of the synthetic folder (default Synthetic)\n"
+            "  --messages <n>      number of synthetic messages\n"
+            "  --size <bytes>      approximate body size of each synthetic message\n"
+            "  --mime <shape>      plain, alternative, mixed, nested or random\n"
+            "  --fold <n>          continuation lines in the To and Subject headers\n"
+            "  --uidvalidity <n>   UIDVALIDITY of every folder\n"
+            "  --log <file>        append every command received to file\n"
+            "  --no-compress       do not offer COMPRESS=DEFLATE\n"
+            "  --no-login-capability  leave the capabilities out of the LOGIN OK\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--no-compress") == 0) {
+            options.compress = 0;
+            continue;
+        }
+        if (strcmp(arg, "--no-login-capability") == 0) {
+            options.login_capability = 0;
+            continue;
+        }
+        char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            print_usage();
+        }
+        i++;
+
+        if (strcmp(arg, "-d") == 0) {
+            options.mail_dir = value;
+        } else if (strcmp(arg, "-p") == 0) {
+            options.port = atoi(value);
+        } else if (strcmp(arg, "-s") == 0) {
+            options.tls_port = atoi(value);
+        } else if (strcmp(arg, "--cert") == 0) {
+            options.cert_file = value;
+        } else if (strcmp(arg, "--key") == 0) {
+            options.key_file = value;
+        } else if (strcmp(arg, "--password") == 0) {
+            options.password = value;
+        } else if (strcmp(arg, "--user") == 0) {
+            char *colon = strchr(value, ':');
+            if (colon == NULL || num_users == MAX_USERS) {
+                print_usage();
+            }
+            *colon = '\0';
+            users[num_users][0] = value;
+            users[num_users][1] = colon + 1;
+            users[num_users][2] = NULL;
+            if ((colon = strchr(colon + 1, ':')) != NULL) {
+                *colon = '\0';
+                users[num_users][2] = colon + 1;
+            }
+            num_users++;
+        } else if (strcmp(arg, "--latency") == 0) {
+            options.latency_ms = atoi(value);
+        } else if (strcmp(arg, "--bandwidth") == 0) {
+            options.bandwidth = atol(value);
+        } else if (strcmp(arg, "--segment") == 0) {
+            options.segment = atoi(value);
+        } else if (strcmp(arg, "--folder") == 0) {
+            options.synthetic = value;
+        } else if (strcmp(arg, "--messages") == 0) {
+            options.messages = atoi(value);
+        } else if (strcmp(arg, "--size") == 0) {
+            options.size = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--mime") == 0) {
+            options.mime = value;
+        } else if (strcmp(arg, "--fold") == 0) {
+            options.fold = atoi(value);
+        } else if (strcmp(arg, "--uidvalidity") == 0) {
+            options.uidvalidity = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--log") == 0) {
+            options.log_file = value;
+        } else {
+            print_usage();
+        }
+    }
+
+    if (options.mail_dir != NULL) {
+        load_mail_dir(options.mail_dir);
+    }
+    if (options.messages > 0) {
+        folder_t *folder = find_folder(options.synthetic);
+        if (folder == NULL) {
+            folder = add_folder(options.synthetic);
+        }
+        for (int i = 1; i <= options.messages; i++) {
+            generate_message(folder, i);
+        }
+    }
+    if (find_folder("INBOX") == NULL) {
+        add_folder("INBOX");
+    }
+
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    SSL_CTX *ctx = options.tls_port > 0 ? server_context() : NULL;
+    struct pollfd pfds[2] = {{listen_on(options.port), POLLIN, 0}, {-1, POLLIN, 0}};
+    if (ctx != NULL) {
+        pfds[1].fd = listen_on(options.tls_port);
+    }
+
+    fprintf(stderr, "imap_test_server: plain on %d", options.port);
+    if (ctx != NULL) {
+        fprintf(stderr, ", TLS on %d", options.tls_port);
+    }
+    fprintf(stderr, ", %d folders\n", num_folders);
+
+    while (1) {
+        if (poll(pfds, ctx ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll");
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (pfds[i].fd < 0 || !(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            int fd = accept(pfds[i].fd, NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+            if (fork() == 0) {
+                close(pfds[0].fd);
+                if (pfds[1].fd >= 0) {
+                    close(pfds[1].fd);
+                }
+                handle_client(fd, i == 1 ? ctx : NULL);
+            }
+            close(fd);
+        }
+    }
+}
@@ -0,0 +1,267 @@
+#!/bin/sh
+# Run the `make test` cases against the stand-in server on loopback instead of the live server.
+# Every case runs three times: with whole responses, with responses cut into 7 byte segments
+# (both over COMPRESS=DEFLATE, the second found through CAPABILITY as the LOGIN OK does not list
+# it), then with the server not offering compression.
+# Usage: test_server/localtest.sh (from the repository root, after make, make imap_test_server and make test_cert)
+
+PORT=${PORT:-1143}
+TLS_PORT=${TLS_PORT:-1993}
+SERVER="--port $PORT localhost"
+TLS_SERVER="--port $TLS_PORT --ca test_server/server.crt localhost"
+failed=0
+pid=
+daemon=
+tmp=$(mktemp -d)
+
+# The cases run with the header cache off, cache_cases turns it on in a directory of its own
+export FETCHMAIL_HEADER_CACHE=
+
+start_server() {
+    ./imap_test_server -d test_server/mail -p "$PORT" -s "$TLS_PORT" --messages 1200 --size 256 --user 'test.test@comp30023:-p:test_server/users/test.test@comp30023' "$@" 2>/dev/null &
+    pid=$!
+    # Wait until it accepts connections
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        (exec 3<>/dev/tcp/127.0.0.1/"$PORT") 2>/dev/null && return
+        sleep 0.1
+    done
+}
+
+stop_server() {
+    [ -n "$pid" ] && kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+    pid=
+}
+
+trap 'stop_server; [ -n "$daemon" ] && kill "$daemon"; rm -rf "$tmp"' EXIT
+
+check() {
+    expected=$1
+    shift
+    # The expected files are stored with LF line endings, retrieve prints the raw CRLF message
+    if ! ./fetchmail "$@" | diff --strip-trailing-cr - "out/$expected" >/dev/null; then
+        echo "FAIL: ./fetchmail $* (expected out/$expected)"
+        failed=1
+    fi
+}
+
+# Like check, the command must also exit with the given status
+check_status() {
+    status=$1
+    expected=$2
+    shift 2
+    ./fetchmail "$@" >"$tmp/stdout"
+    actual=$?
+    if [ $actual -ne "$status" ] || ! diff --strip-trailing-cr "$tmp/stdout" "out/$expected" >/dev/null; then
+        echo "FAIL: ./fetchmail $* (expected out/$expected and exit status $status, got $actual)"
+        failed=1
+    fi
+}
+
+run_cases() {
+    check ret-ed512.out -f Test -p pass -u test@comp30023 -n 1 retrieve $SERVER
+    check ret-mst.out -f Test -p pass -u test@comp30023 -n 2 retrieve $SERVER
+    check ret-nofolder.out -u test@comp30023 -p pass -n 1 -f Test1 retrieve $SERVER
+    check ret-loginfail.out -f Test -u test@comp30023 -p pass1 -n 1 retrieve $SERVER
+    check ret-nomessage.out -n 42 -u test@comp30023 -p pass -f Test retrieve $SERVER
+    check ret-mst.out -u test.test@comp30023 -p -p -f Test -n 1 retrieve $SERVER
+    check ret-mst.out -f 'With Space' -n 1 -u test@comp30023 -p pass retrieve $SERVER
+    check mime-ed512.out -n 1 -p pass -u test@comp30023 mime $SERVER
+    check mime-mst.out -f Test -n 2 -p pass -u test@comp30023 mime $SERVER
+    check parse-mst.out -f Test -p pass -n 2 -u test@comp30023 parse $SERVER
+    check parse-minimal.out -f Test -n 3 -p pass -u test@comp30023 parse $SERVER
+    check parse-caps.out -p pass -f headers -u test@comp30023 -n 2 parse $SERVER
+    check parse-nosubj.out -f headers -u test@comp30023 -p pass -n 3 parse $SERVER
+    check parse-nested.out -u test@comp30023 -n 4 -p pass -f headers parse $SERVER
+    check parse-ws.out.2 -f headers -u test@comp30023 -n 5 -p pass parse $SERVER
+    check parse-repeated.out -f headers -u test@comp30023 -n 7 -p pass parse $SERVER
+    check parse-headers-repeated.out -f headers -u test@comp30023 -n 7 -p pass --headers Received,X-Label,To parse $SERVER
+    check parse-headers-missing.out -f headers -u test@comp30023 -n 7 -p pass --headers Subject,Cc,From parse $SERVER
+    check parse-headers-nosubj.out -f headers -u test@comp30023 -n 1 -p pass --headers Subject,Received parse $SERVER
+    check list-Test.out -p pass -u test@comp30023 -f Test list $SERVER
+    check list-INBOX.out -p pass -u test@comp30023 list $SERVER
+    check ret-ed512.out -f Test -p pass -u test@comp30023 -n 1 -t retrieve $TLS_SERVER
+
+    # Message sets, one "==== Message n ====" separator per message, in the order asked for
+    check_status 0 ret-range.out -f Test -p pass -u test@comp30023 -n 1:3 retrieve $SERVER
+    check_status 0 parse-set.out -f Test -p pass -u test@comp30023 -n 3,1 parse $SERVER
+    check_status 0 parse-uid.out -f Test -p pass -u test@comp30023 --uid -n 1:3 parse $SERVER
+    check_status 0 ret-mst.out -f Test -p pass -u test@comp30023 --uid -n 2 retrieve $SERVER
+    check_status 3 parse-missing.out -f Test -p pass -u test@comp30023 -n 1,42,2 parse $SERVER
+    # Sequence numbers past 1000, in the server's 1200 message Synthetic folder
+    check_status 0 parse-1001.out -f Synthetic -p pass -u test@comp30023 -n 1001 parse $SERVER
+    check_status 0 parse-over-1000.out -f Synthetic -p pass -u test@comp30023 -n 999:1001,1200 parse $SERVER
+
+    # A multipart/mixed holding a multipart/alternative, a base64 text part and a base64 binary part
+    check_status 0 mime-tree.out -f mime -n 1 -p pass -u test@comp30023 --tree mime $SERVER
+    check_status 0 mime-nested.out -f mime -n 1 -p pass -u test@comp30023 mime $SERVER
+    check_status 0 mime-part-qp.out -f mime -n 1 -p pass -u test@comp30023 --part 1.1 mime $SERVER
+    check_status 0 mime-part-base64.out -f mime -n 1 -p pass -u test@comp30023 --part 3 mime $SERVER
+    check_status 0 mime-decode-qp.out -f mime -n 1 -p pass -u test@comp30023 --part 1.1 --decode mime $SERVER
+    check_status 0 mime-decode-base64.out -f mime -n 1 -p pass -u test@comp30023 --part 2 --decode mime $SERVER
+    check_status 0 mime-decode-binary.out -f mime -n 1 -p pass -u test@comp30023 --part 3 --decode mime $SERVER
+}
+
+# list and parse with the header cache, cold and then warm. Both runs must print what the server
+# alone gives
+cache_cases() {
+    rm -rf "$tmp/cache"
+    mkdir "$tmp/cache"
+    export FETCHMAIL_HEADER_CACHE="$tmp/cache"
+    for run in cold warm; do
+        check list-Test.out -p pass -u test@comp30023 -f Test list $SERVER
+        check list-INBOX.out -p pass -u test@comp30023 list $SERVER
+        check parse-mst.out -f Test -p pass -n 2 -u test@comp30023 parse $SERVER
+        check parse-caps.out -p pass -f headers -u test@comp30023 -n 2 parse $SERVER
+        check parse-headers-repeated.out -f headers -u test@comp30023 -n 7 -p pass --headers Received,X-Label,To parse $SERVER
+        if [ -z "$(ls "$tmp/cache")" ]; then
+            echo "FAIL: FETCHMAIL_HEADER_CACHE (nothing cached after the $run run)"
+            failed=1
+        fi
+    done
+    export FETCHMAIL_HEADER_CACHE=
+}
+
+# Commands sent through a --daemon must print and exit exactly as a direct run does
+daemon_cases() {
+    ./fetchmail --daemon --socket "$tmp/daemon.sock" 2>"$tmp/daemon.log" &
+    daemon=$!
+    # The socket file is there from bind(), the line only once it listens
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        grep -q listening "$tmp/daemon.log" && break
+        sleep 0.1
+    done
+
+    check_status 0 ret-ed512.out --socket "$tmp/daemon.sock" -f Test -p pass -u test@comp30023 -n 1 retrieve $SERVER
+    # A client that cannot reach the daemon runs the command itself, a pooled worker shows it did not
+    if ! pgrep -P "$daemon" >/dev/null; then
+        echo "FAIL: ./fetchmail --daemon (no worker after a request, the client ran the command itself)"
+        failed=1
+    fi
+    check_status 0 ret-ed512.out --socket "$tmp/daemon.sock" -f Test -p pass -u test@comp30023 -n 1 -t retrieve $TLS_SERVER
+    check_status 0 parse-mst.out --socket "$tmp/daemon.sock" -f Test -p pass -n 2 -u test@comp30023 parse $SERVER
+    check_status 3 parse-missing.out --socket "$tmp/daemon.sock" -f Test -p pass -u test@comp30023 -n 1,42,2 parse $SERVER
+    check_status 3 ret-loginfail.out --socket "$tmp/daemon.sock" -f Test -u test@comp30023 -p pass1 -n 1 retrieve $SERVER
+
+    kill "$daemon"
+    wait "$daemon" 2>/dev/null
+    daemon=
+}
+
+# retrieve --dir saves each message as <uid>.eml, the same bytes retrieve -n <uid> prints
+dir_cases() {
+    rm -rf "$tmp/dir"
+    mkdir "$tmp/dir"
+    if ! ./fetchmail -f Test -p pass -u test@comp30023 --dir "$tmp/dir" retrieve $SERVER >/dev/null; then
+        echo "FAIL: ./fetchmail --dir (exit status)"
+        failed=1
+    fi
+    if [ "$(ls "$tmp/dir" | wc -l)" -ne 3 ]; then
+        echo "FAIL: ./fetchmail --dir (expected 3 files)"
+        failed=1
+    fi
+    for uid in 1 2 3; do
+        ./fetchmail -f Test -p pass -u test@comp30023 -n $uid retrieve $SERVER >"$tmp/retrieve"
+        if ! cmp -s "$tmp/retrieve" "$tmp/dir/$uid.eml"; then
+            echo "FAIL: ./fetchmail --dir ($uid.eml differs from retrieve -n $uid)"
+            failed=1
+        fi
+    done
+}
+
+# --stats json writes one JSON object per command, "completed" is false for one that exits early
+stats_cases() {
+    for case in "0 true ret-mst.out -n 2 -p pass" "3 false ret-loginfail.out -n 1 -p pass1"; do
+        set -- $case
+        rm -f "$tmp/stats.json"
+        check_status $1 $3 --stats json --stats-file "$tmp/stats.json" -f Test -u test@comp30023 $4 $5 $6 $7 retrieve $SERVER
+        if ! python3 -c 'import json, sys; sys.exit(json.load(open(sys.argv[1]))["completed"] is not (sys.argv[2] == "true"))' "$tmp/stats.json" "$2"; then
+            echo "FAIL: ./fetchmail --stats json (expected one JSON object with \"completed\": $2)"
+            failed=1
+        fi
+    done
+}
+
+# The same commands from an accounts file, each account's -o file must match a direct run
+accounts_cases() {
+    rm -f "$tmp"/account-*.out
+    cat >"$tmp/accounts" <<EOF
+-f Test -p pass -u test@comp30023 -n 1 retrieve $SERVER -o $tmp/account-plain.out
+-f Test -p pass -u test@comp30023 -n 1 -t retrieve $TLS_SERVER -o $tmp/account-tls.out
+-f Test -u test@comp30023 -p pass1 -n 1 retrieve $SERVER -o $tmp/account-loginfail.out
+EOF
+    ./fetchmail --accounts "$tmp/accounts" --parallel 3 2>/dev/null
+    status=$?
+    # The worst exit status of the accounts, the login failure's
+    if [ $status -ne 3 ]; then
+        echo "FAIL: ./fetchmail --accounts (expected exit status 3, got $status)"
+        failed=1
+    fi
+    for pair in plain:ret-ed512.out tls:ret-ed512.out loginfail:ret-loginfail.out; do
+        if ! diff --strip-trailing-cr "$tmp/account-${pair%%:*}.out" "out/${pair#*:}" >/dev/null; then
+            echo "FAIL: ./fetchmail --accounts (expected out/${pair#*:} in account-${pair%%:*}.out)"
+            failed=1
+        fi
+    done
+}
+
+# Export the From folder twice into a Maildir and an mbox file, the second run finds nothing new
+export_cases() {
+    rm -rf "$tmp/maildir" "$tmp/mbox" "$tmp/mbox.fetchmail-export"
+    for run in 1 2; do
+        [ $run -eq 1 ] && expected=export-From.out || expected=export-From-again.out
+        check_status 0 $expected -f From -p pass -u test@comp30023 --maildir "$tmp/maildir" export $SERVER
+        check_status 0 $expected -f From -p pass -u test@comp30023 --mbox "$tmp/mbox" export $SERVER
+    done
+
+    # One Maildir file per message, as sent (no quoting), and nothing left in tmp/
+    if [ "$(ls "$tmp/maildir/new" | wc -l)" -ne 2 ] || [ -n "$(ls "$tmp/maildir/tmp")" ]; then
+        echo "FAIL: export --maildir (expected 2 files in new/ and none in tmp/)"
+        failed=1
+    fi
+    for uid in 1 2; do
+        if ! cmp -s "$tmp/maildir/new/"*".U${uid}V"* "test_server/mail/From/$uid.eml"; then
+            echo "FAIL: export --maildir (message $uid differs from test_server/mail/From/$uid.eml)"
+            failed=1
+        fi
+    done
+
+    # mboxrd: From lines quoted with one more >, each message once. The dates of the separators vary
+    if ! sed 's/^From MAILER-DAEMON .*/From MAILER-DAEMON/' "$tmp/mbox" | diff - out/export-mbox.out >/dev/null; then
+        echo "FAIL: export --mbox (expected out/export-mbox.out)"
+        failed=1
+    fi
+}
+
+start_server
+run_cases
+export_cases
+accounts_cases
+cache_cases
+daemon_cases
+dir_cases
+stats_cases
+stop_server
+
+start_server --segment 7 --no-login-capability
+run_cases
+export_cases
+accounts_cases
+cache_cases
+daemon_cases
+dir_cases
+stats_cases
+stop_server
+
+start_server --no-compress
+run_cases
+export_cases
+accounts_cases
+cache_cases
+daemon_cases
+dir_cases
+stats_cases
+stop_server
+
+[ $failed -eq 0 ] && echo "All local tests passed"
+exit $failed
@@ -6,79 +6,42 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <openssl/pem.h>
+#include <openssl/evp.h>
 #include "tls.h"
 #include "utils.h"
 
 
-// Initialise OpenSSL 
+// Set up TLS over a socket connect_server has connected:
 // Create an SSL conext - to establish SSL connection 
 // Load the certificate
 // create and configure an SSL connection 
 
 
-int tls_connect(const char *hostname, const char *port, SSL **ssl_out) {
-    
-    int sockfd; 
+int tls_connect(int sockfd, const char *hostname, const char *port, const char *ca_file, int ktls, SSL **ssl_out) {
+    // The context (and the CA store parsed into it) is built once per process
+    SSL_CTX *ctx = tls_context(ca_file);
 
-    struct hostent *server;
-    struct sockaddr_in serv_addr;
-
-    // Resolve the hostname to an IP address
-    server = gethostbyname(hostname);
-    if (server == NULL) {
-        fprintf(stderr, "ERROR, no such host\n");
-        return -1;
-    }
-
-    // Create a socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("ERROR opening socket");
-        return -1;
-    }
-
-    // Zero out the server address structure and set the family and port
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(atoi(port)); // Convert port from string to integer
-
-    // Connect to the server
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        perror("ERROR connecting");
-        close(sockfd);
-        return -1;
-    }
-
-    // Initialize OpenSSL libraries
-    initialize_openssl();
-
-    // Create an SSL context using the CA certificate
-    SSL_CTX *ctx = create_ssl_context("/usr/local/share/ca-certificates/ca.crt");
-    if (!ctx) {
-        close(sockfd);
-        return -1;
-    }
-
-    // Create an SSL connection using the context and socket file descriptor
-    SSL *ssl = create_ssl_connection(ctx, sockfd);
+    // Create an SSL connection using the context and socket file descriptor, resuming the
+    // last session with this server if one was cached
+    SSL *ssl = create_ssl_connection(ctx, sockfd, hostname, port, ktls);
     if (!ssl) {
         close(sockfd);
-        SSL_CTX_free(ctx);
         return -1;
     }
 
     // Check the result of the certificate verification
     if (SSL_get_verify_result(ssl) != X509_V_OK) {
         fprintf(stderr, "Certificate verification failed\n");
-        SSL_free(ssl);
-        SSL_CTX_free(ctx);
+        free_ssl_connection(ssl);
         close(sockfd);
         return -1;
     }
 
-    // Read the initial server response
-    read_ssl_response(ssl);
+    // The greeting is not read here, the first commands go out before it arrives
 
     // Return the SSL pointer to the caller
     *ssl_out = ssl;
@@ -88,258 +51,335 @@ int tls_connect(const char *hostname, const char *port, SSL **ssl_out) {
 
 
 
-// Function to read the initial server response
-void read_initial_server_response(SSL *ssl) {
-    char buffer[BUFFER_SIZE_TLS];
-    int bytes;
-
-    while ((bytes = SSL_read(ssl, buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[bytes] = 0; // Null-terminate the buffer
-        //printf("%s", buffer);
+// Function to read from the SSL connection for the reader
+static int tls_read(transport_t *transport, char *buf, int len) {
+    int numBytes = SSL_read(transport->ctx, buf, len);
+    if (numBytes < 0) {
+        ERR_print_errors_fp(stderr);
     }
+    return numBytes;
+}
 
-    if (bytes < 0) {
-        int err = SSL_get_error(ssl, bytes);
-        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
-            perror("Error reading server response");
-            ERR_print_errors_fp(stderr);
-        }
+
+// Function to write to the SSL connection, transport_send retries what is left over
+static int tls_write(transport_t *transport, const char *buf, int len) {
+    int numBytes = SSL_write(transport->ctx, buf, len);
+    if (numBytes <= 0) {
+        ERR_print_errors_fp(stderr);
     }
+    return numBytes;
 }
 
 
+// Function to count decrypted bytes OpenSSL holds from a record read only in part
+static size_t tls_pending(transport_t *transport) {
+    return SSL_pending(transport->ctx);
+}
 
 
-// Function to print the server response
-void print_server_response(SSL *ssl) {
-    char buffer[BUFFER_SIZE_TLS];
-    int bytes;
+void transport_tls(transport_t *transport, SSL *ssl) {
+    transport->read = tls_read;
+    transport->write = tls_write;
+    transport->pending = tls_pending;
+    transport->ctx = ssl;
+    // The socket carries records, so it can only be spliced once the kernel decrypts them
+    transport->fd = tls_kernel_receive(ssl) ? SSL_get_fd(ssl) : -1;
+}
 
-    while ((bytes = SSL_read(ssl, buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[bytes] = 0; // Null-terminate the buffer
-        printf("%s", buffer);
-    }
 
-    if (bytes < 0) {
-        perror("Error reading server response");
-        ERR_print_errors_fp(stderr);
-    }
+int tls_kernel_receive(SSL *ssl) {
+#ifdef BIO_get_ktls_recv
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    return 0;
+#endif
 }
 
 
-
-// Function to send a command over an SSL connection
-void send_ssl_command(SSL *ssl, const char *command) {
-    int len = strlen(command);
-    int bytes = SSL_write(ssl, command, len);
-    if (bytes < 0) {
-        error("ERROR writing to SSL connection", 2);
-    } else if (bytes != len) {
-        fprintf(stderr, "Partial write\n");
+// Function to say on -v whether --ktls got the kernel to decrypt
+void ktls_report(SSL *ssl, FILE *out) {
+    if (tls_kernel_receive(ssl)) {
+        fprintf(out, "Kernel TLS: records decrypted by the kernel\n");
+    } else {
+        fprintf(out, "Kernel TLS: not available for this connection, decrypted by OpenSSL\n");
     }
 }
 
 
 
-// Function to read response from an SSL connection
-void read_ssl_response(SSL *ssl) {
-    char buffer[BUFFER_SIZE_TLS]; // Character array to store received data
-    memset(buffer, 0, BUFFER_SIZE_TLS); // Initializes buffer with zeros to ensure no residual data
 
-    int numBytes = SSL_read(ssl, buffer, BUFFER_SIZE_TLS - 1); // Attempts to read data from the SSL connection
-    if (numBytes < 0) {
-        // If negative, an error occurred during reading
-        error("ERROR reading from SSL connection", 2);
-    } else if (numBytes == 0) {
-        // Immediate disconnect
-        fprintf(stderr, "Server disconnected immediately\n");
-        SSL_free(ssl);
-        exit(2); // or exit(3), depending on the specific requirements
-    }
-
-    buffer[numBytes] = '\0'; // Null terminator to make it a string
+//////////// OPENSSL Library Initialisation Functions ///////////////////////////
 
-    // Output the server's response for debugging or information purposes
-    //printf("Server Response: %s\n\n", buffer);
+// Function to initialise OpenSSL Libraries
+void initialize_openssl() {
+    SSL_library_init();
+    SSL_load_error_strings();
+    OpenSSL_add_all_algorithms();
+}
 
-    // Check for specific login failure response
-    if (strstr(buffer, "A01 NO [AUTHENTICATIONFAILED]")) { 
-        printf("Login failure\n");
-        exit(3);  // Exit with status code 3
+// Function to create an SSL context using a CA certificate that we stored as "ca.crt"
+SSL_CTX* create_ssl_context(const char* ca_cert_file) {
+    SSL_CTX* ctx = SSL_CTX_new(SSLv23_client_method());
+    if (!ctx) {
+        fprintf(stderr, "Error creating SSL context\n");
+        ERR_print_errors_fp(stderr);
+        exit(2);
     }
 
-    // Check if folder not found 
-    if (strstr(buffer, "A02 NO")) {
-        printf("Folder not found\n");
-        exit(3);
+    if (!SSL_CTX_load_verify_locations(ctx, ca_cert_file, NULL)) {
+        fprintf(stderr, "Error loading root CA certificate\n");
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        exit(2);
     }
+
+    return ctx;
 }
 
+// Function to hash the contents of a CA file (SHA-256), returns 0 if it cannot be read
+static int ca_file_digest(const char *ca_file, unsigned char *digest, unsigned int *len) {
+    FILE *file = fopen(ca_file, "rb");
+    if (file == NULL) {
+        return 0;
+    }
 
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    int ok = md != NULL && EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+    char buffer[4096];
+    size_t numBytes;
+    while (ok && (numBytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        ok = EVP_DigestUpdate(md, buffer, numBytes);
+    }
+    ok = ok && !ferror(file) && EVP_DigestFinal_ex(md, digest, len);
 
+    EVP_MD_CTX_free(md);
+    fclose(file);
+    return ok;
+}
 
+// Frees the CA store id of a context along with it
+static void free_store_id(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp) {
+    free(ptr);
+}
 
+// Index of the ex_data slot holding the CA store id of a context (hex digest of its CA file)
+static int tls_store_index() {
+    static int index = -1;
+    if (index < 0) {
+        index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, free_store_id);
+    }
+    return index;
+}
 
-// Function to log into the server over an SSL connection
-void login_ssl(SSL *ssl, const char* username, const char* password) {
-    char command[BUFFER_SIZE_TLS]; // Buffer to hold the complete command string
+// Function to get the SSL context shared by every connection in this process. Building it
+// parses the CA file, so it is only done once per file (the daemon does it before starting
+// workers). ca_file is NULL for the default CA certificate
+SSL_CTX *tls_context(const char *ca_file) {
+    static SSL_CTX *ctx = NULL;
+    static char *ctx_ca_file = NULL;
 
-    // Format the login command according to the IMAP protocol
-    snprintf(command, sizeof(command), "A01 LOGIN %s %s\r\n", username, password); 
+    if (ca_file == NULL) {
+        ca_file = TLS_CA_FILE;
+    }
+    if (ctx != NULL && strcmp(ctx_ca_file, ca_file) == 0) {
+        return ctx;
+    }
 
-    // Send the login command to the server
-    send_ssl_command(ssl, command); 
+    // Another CA file was asked for (a daemon worker serving --ca), the old context goes
+    if (ctx != NULL) {
+        SSL_CTX_free(ctx);
+        free(ctx_ca_file);
+    } else {
+        initialize_openssl();
+    }
+    ctx = create_ssl_context(ca_file);
+    ctx_ca_file = strdup(ca_file);
+
+    // A session is only resumed under the trust store it was verified with: the digest of the CA
+    // file is part of the cache file name and the session id context, which OpenSSL checks
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+    if (!ca_file_digest(ca_file, digest, &digest_len)) {
+        fprintf(stderr, "Error reading root CA certificate\n");
+        exit(2);
+    }
+    char *store_id = malloc(2 * digest_len + 1);
+    if (store_id == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(5);
+    }
+    for (unsigned int i = 0; i < digest_len; i++) {
+        sprintf(store_id + 2 * i, "%02x", digest[i]);
+    }
+    SSL_CTX_set_ex_data(ctx, tls_store_index(), store_id);
+    SSL_CTX_set_session_id_context(ctx, digest, digest_len);
 
-    // Read the response to the login command
-    read_ssl_response(ssl); // No need to pass the tag, the function can handle the response checking
+    // Sessions are kept in the cache file rather than in the context, so the next run can resume
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, save_tls_session);
+    return ctx;
 }
 
 
 
+//////////// TLS session cache ///////////////////////////
 
-// Function to select a folder to read from over an SSL connection 
-void select_folder_ssl(SSL *ssl, const char *folder_name) {
-    char command[BUFFER_SIZE];
-
-    // Use "INBOX" if folder_name is NULL or empty
-    if (folder_name == NULL || strlen(folder_name) == 0) {
-        folder_name = "INBOX";
+// Function to find the session cache file for a server and CA store, in the cache directory
+// chosen by FETCHMAIL_TLS_CACHE. Returns 0 if there is no cache to use
+static int tls_cache_path(const char *hostname, const char *port, const char *store_id, char *path, size_t size) {
+    char dir[PATH_MAX];
+    if (!cache_dir("FETCHMAIL_TLS_CACHE", dir, sizeof(dir))) {
+        return 0;
     }
 
-    // Escape double quotes and backslashes in folder_name
-    char escaped_name[2*BUFFER_SIZE]; // Allow for potential doubling in size
-    int i, j = 0;
-    for (i = 0; folder_name[i] != '\0'; i++) {
-        if (folder_name[i] == '"' || folder_name[i] == '\\') {
-            escaped_name[j++] = '\\';
-        }
-        escaped_name[j++] = folder_name[i];
+    // One file per server, keeping only characters that are safe in a file name
+    int len = snprintf(path, size, "%s/tls-", dir);
+    for (const char *c = hostname; *c != '\0' && len < (int)size - 1; c++) {
+        path[len++] = (isalnum((unsigned char)*c) || *c == '.' || *c == '-') ? *c : '_';
     }
-    escaped_name[j] = '\0'; // Null-terminate the escaped string
-
-    // Construct SELECT command with quoted and escaped folder name
-    snprintf(command, 3*BUFFER_SIZE, "A02 SELECT \"%s\"\r\n", escaped_name);
-
-    // Send the command to the server
-    send_ssl_command(ssl, command); 
-
-    // Read the response
-    read_ssl_response(ssl);
+    path[len] = '\0';
+    return store_id != NULL && snprintf(path + len, size - len, "-%s-%.16s.pem", port, store_id) < (int)(size - len);
 }
 
-
-
-
-// Function to read FETCH response from an SSL connection
-void read_ssl_fetch_response(SSL *ssl, list_t *packet_list, const char *tag) {
-    char buffer[BUFFER_SIZE];
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int numBytes = SSL_read(ssl, buffer, BUFFER_SIZE - 1);
-        if (numBytes < 0) {
-            perror("ERROR reading from SSL connection");
-            ERR_print_errors_fp(stderr);
-            exit(2);
-        }
-        buffer[numBytes] = '\0';
-
-        // Check for continuation ("+") response
-        if (buffer[0] == '+') {
-            // More data is coming, store what we have so far
-            insert_at_foot(packet_list, buffer + 1, NULL); // Skip the "+"
-        } else {
-            // Not a continuation, store the entire line
-            insert_at_foot(packet_list, buffer, NULL); 
-        }
-
-        // Check for tagged response
-        if (strstr(buffer, tag)) {
-            if (strstr(buffer, "OK")) {
-                break;  // Exit the loop after storing the last packet
-            } else if (strstr(buffer, "NO") || strstr(buffer, "BAD")) {
-                printf("Message not found\n");
-                free_list(packet_list); // Free the list before exiting
-                exit(3);  // Exit with status 3
-            }
+// Function to check that a session was made under the context's CA store
+static int same_store(SSL_CTX *ctx, SSL_SESSION *session) {
+    const char *store_id = SSL_CTX_get_ex_data(ctx, tls_store_index());
+    unsigned int len;
+    const unsigned char *id = SSL_SESSION_get0_id_context(session, &len);
+    if (store_id == NULL || 2 * len != strlen(store_id)) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < len; i++) {
+        char hex[3];
+        sprintf(hex, "%02x", id[i]);
+        if (memcmp(hex, store_id + 2 * i, 2) != 0) {
+            return 0;
         }
     }
+    return 1;
 }
 
-
-// Function to retrieve an email over an SSL connection
-void retrieve_ssl(SSL *ssl, int message_num, list_t *packet_list) {
-    // The command is retrieve, we need to fetch the email:
-    // tag FETCH messageNum BODY.PEEK[]
-
-    // if messageNum = -1, it means the message sequence number was not specified on the command line 
-    // fetch the last added message in the folder 
-
-    char command[BUFFER_SIZE];
-
-    if (message_num == -1) {
-        // Fetch the last message (assuming UIDNEXT is available from SELECT)
-        snprintf(command, BUFFER_SIZE, "A03 FETCH * BODY.PEEK[]\r\n");
-    } else {
-        // Fetch a specific message with messageNum
-        snprintf(command, BUFFER_SIZE, "A03 FETCH %d BODY.PEEK[]\r\n", message_num);
+// Function to load the cached session for a server, NULL if there is none that can be resumed
+// under the context's CA store
+static SSL_SESSION *load_tls_session(SSL_CTX *ctx, const char *hostname, const char *port) {
+    char path[PATH_MAX];
+    if (!tls_cache_path(hostname, port, SSL_CTX_get_ex_data(ctx, tls_store_index()), path, sizeof(path))) {
+        return NULL;
     }
 
-    // Now we send the FETCH command
-    send_ssl_command(ssl, command); 
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    SSL_SESSION *session = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+    fclose(file);
 
-    // Read the response and store packets in a linked list
-    read_ssl_fetch_response(ssl, packet_list, "A03");
+    // A stale or damaged file, or one from another store, just means a full handshake
+    ERR_clear_error();
+    if (session != NULL && (!SSL_SESSION_is_resumable(session) || !same_store(ctx, session))) {
+        SSL_SESSION_free(session);
+        return NULL;
+    }
+    return session;
 }
 
+// Called by OpenSSL whenever the server hands out a session (TLS 1.3 sends its tickets after the
+// handshake). The file is replaced atomically so concurrent runs never read half a session. Only
+// sessions whose certificate was verified are kept, resuming one carries its verify result over
+int save_tls_session(SSL *ssl, SSL_SESSION *session) {
+    const char *hostname = SSL_get_app_data(ssl);
+    const char *port = SSL_get_ex_data(ssl, tls_port_index());
+    const char *store_id = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_store_index());
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 16];
 
+    if (SSL_get_verify_result(ssl) != X509_V_OK) {
+        return 0;
+    }
+    if (hostname == NULL || port == NULL || !tls_cache_path(hostname, port, store_id, path, sizeof(path))) {
+        return 0;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
 
+    mode_t old_mask = umask(077);
+    FILE *file = fopen(tmp_path, "w");
+    umask(old_mask);
+    if (file == NULL) {
+        return 0;
+    }
 
+    int ok = PEM_write_SSL_SESSION(file, session);
+    if (fclose(file) != 0 || !ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+    }
+    ERR_clear_error();
 
+    // The session is not kept, OpenSSL frees it
+    return 0;
+}
 
-
-//////////// OPENSSL Library Initialisation Functions ///////////////////////////
-
-// Function to initialise OpenSSL Libraries
-void initialize_openssl() {
-    SSL_library_init();
-    SSL_load_error_strings();
-    OpenSSL_add_all_algorithms();
+// Index of the ex_data slot holding the port of a connection, for the session cache
+int tls_port_index() {
+    static int index = -1;
+    if (index < 0) {
+        index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    }
+    return index;
 }
 
-// Function to create an SSL context using a CA certificate that we stored as "ca.crt"
-SSL_CTX* create_ssl_context(const char* ca_cert_file) {
-    SSL_CTX* ctx = SSL_CTX_new(SSLv23_client_method());
-    if (!ctx) {
-        fprintf(stderr, "Error creating SSL context\n");
+// Function to create an SSL connection to hostname:port, not yet attached to a socket
+// A cached session for hostname:port is offered to the server so it can skip the full handshake
+SSL *new_ssl_connection(SSL_CTX *ctx, const char *hostname, const char *port) {
+    SSL* ssl = SSL_new(ctx);
+    if (!ssl) {
+        fprintf(stderr, "Error creating SSL object\n");
         ERR_print_errors_fp(stderr);
-        exit(2);
+        return NULL;
     }
 
-    if (!SSL_CTX_load_verify_locations(ctx, ca_cert_file, NULL)) {
-        fprintf(stderr, "Error loading root CA certificate\n");
-        ERR_print_errors_fp(stderr);
-        SSL_CTX_free(ctx);
-        exit(2);
+    // SNI, so the server can issue (and accept) tickets for this name
+    SSL_set_tlsext_host_name(ssl, hostname);
+    // Tickets can arrive at any time, so the connection keeps its own copy of the cache key
+    SSL_set_app_data(ssl, strdup(hostname));
+    SSL_set_ex_data(ssl, tls_port_index(), strdup(port));
+
+    // No early data: the server speaks first in IMAP, and the first thing we send is LOGIN,
+    // which must not go out in replayable 0-RTT data
+    SSL_SESSION *session = load_tls_session(ctx, hostname, port);
+    if (session != NULL) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
     }
+    return ssl;
+}
 
-    return ctx;
+// Function to free a connection made by new_ssl_connection, with the cache key it keeps
+void free_ssl_connection(SSL *ssl) {
+    free(SSL_get_app_data(ssl));
+    free(SSL_get_ex_data(ssl, tls_port_index()));
+    SSL_free(ssl);
 }
 
 // Function to create an SSL connection using the context and socket file descriptor
-SSL* create_ssl_connection(SSL_CTX* ctx, int sockfd) {
-    SSL* ssl = SSL_new(ctx);
+SSL* create_ssl_connection(SSL_CTX* ctx, int sockfd, const char *hostname, const char *port, int ktls) {
+    SSL *ssl = new_ssl_connection(ctx, hostname, port);
     if (!ssl) {
-        fprintf(stderr, "Error creating SSL object\n");
-        ERR_print_errors_fp(stderr);
         return NULL;
     }
 
-    SSL_set_fd(ssl, sockfd);
+    // With --ktls OpenSSL hands the record layer to the kernel after the handshake if the kernel
+    // has the tls module and supports the cipher, and keeps it otherwise
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ktls) {
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+    }
+#endif
 
+    SSL_set_fd(ssl, sockfd);
     if (SSL_connect(ssl) <= 0) {
         fprintf(stderr, "Error performing SSL handshake\n");
         ERR_print_errors_fp(stderr);
-        SSL_free(ssl);
+        free_ssl_connection(ssl);
         return NULL;
     }
 
@@ -349,7 +389,7 @@ SSL* create_ssl_connection(SSL_CTX* ctx, int sockfd) {
 // Function to clean up the connection when it is closed. 
 void cleanup_ssl(SSL* ssl, SSL_CTX* ctx) {
     if (ssl) {
-        SSL_free(ssl);
+        free_ssl_connection(ssl);
     }
     if (ctx) {
         SSL_CTX_free(ctx);
@@ -5,13 +5,18 @@
 #include <openssl/err.h>
 
 #include "server_response.h"
+#include "imap_reader.h"
+#include "transport.h"
+#include "imap_client.h"
 
-#define BUFFER_SIZE_TLS 4906
+// CA certificate used to verify the server
+#define TLS_CA_FILE "/usr/local/share/ca-certificates/ca.crt"
 
 
 
-// Function to connect using TLS
-int tls_connect(const char *hostname, const char *port, SSL **ssl_out);
+// Function to start TLS on a connected socket, returns the socket or -1 (closed) on failure.
+// ktls asks for kernel TLS, used when the kernel and cipher allow it
+int tls_connect(int sockfd, const char *hostname, const char *port, const char *ca_file, int ktls, SSL **ssl_out);
 
 // Function to clean up SSL resources
 void cleanup_ssl(SSL* ssl, SSL_CTX* ctx);
@@ -22,24 +27,32 @@ void initialize_openssl();
 // Function to create and configure an SSL context
 SSL_CTX* create_ssl_context(const char* ca_cert_file);
 
-// Function to create an SSL connection
-SSL* create_ssl_connection(SSL_CTX* ctx, int sockfd);
+// Function to get the SSL context shared by all connections of this process (NULL for the default CA)
+SSL_CTX *tls_context(const char *ca_file);
 
-void print_server_response(SSL *ssl);
+// Function to create an SSL connection, resuming a cached session with hostname:port if possible
+SSL* create_ssl_connection(SSL_CTX* ctx, int sockfd, const char *hostname, const char *port, int ktls);
 
-void read_initial_server_response(SSL *ssl);
+// Function to set up an SSL connection without a socket, for driving it through memory BIOs
+SSL *new_ssl_connection(SSL_CTX *ctx, const char *hostname, const char *port);
 
-void send_ssl_command(SSL *ssl, const char *command);
+// Function to free a connection made by new_ssl_connection
+void free_ssl_connection(SSL *ssl);
 
-void login_ssl(SSL *ssl, const char* username, const char* password);
+// Session cache callback, stores a new session from the server in the cache file
+int save_tls_session(SSL *ssl, SSL_SESSION *session);
 
-void read_ssl_response(SSL *ssl);
+// ex_data slot holding the port of a connection
+int tls_port_index();
 
-void select_folder_ssl(SSL *ssl, const char *folder_name);
+// Function to set up a transport over an SSL connection. It can be spliced from when the kernel
+// decrypts what is received
+void transport_tls(transport_t *transport, SSL *ssl);
 
+// Function to check whether the kernel decrypts what the connection receives (kTLS)
+int tls_kernel_receive(SSL *ssl);
 
-void retrieve_ssl(SSL *ssl, int message_num, list_t *packet_list);
-
-void read_ssl_fetch_response(SSL *ssl, list_t *packet_list, const char *tag);
+// Function to report whether the kernel decrypts the connection
+void ktls_report(SSL *ssl, FILE *out);
 
 #endif // TLS_H
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "stats.h"
+
+/***
+ * Transports: the byte stream under the reader and the commands. Plain sockets and memory are
+ * here, TLS (transport_tls) and COMPRESS=DEFLATE (transport_compress) live with the rest of their
+ * code. Every command goes out through transport_send, whichever transport is underneath.
+*/
+
+static int plain_read(transport_t *transport, char *buf, int len) {
+    return read(transport->fd, buf, len);
+}
+
+static int plain_write(transport_t *transport, const char *buf, int len) {
+    return write(transport->fd, buf, len);
+}
+
+void transport_plain(transport_t *transport, int sockfd) {
+    transport->read = plain_read;
+    transport->write = plain_write;
+    transport->pending = NULL;
+    transport->ctx = NULL;
+    transport->fd = sockfd;
+}
+
+static int memory_read(transport_t *transport, char *buf, int len) {
+    memory_source_t *memory = transport->ctx;
+    size_t left = memory->len - memory->offset;
+    size_t count = left < (size_t)len ? left : (size_t)len;
+    memcpy(buf, memory->data + memory->offset, count);
+    memory->offset += count;
+    return count;
+}
+
+static int memory_write(transport_t *transport, const char *buf, int len) {
+    return len;
+}
+
+void transport_memory(transport_t *transport, memory_source_t *memory) {
+    transport->read = memory_read;
+    transport->write = memory_write;
+    transport->pending = NULL;
+    transport->ctx = memory;
+    transport->fd = -1;
+}
+
+// Write the whole command, retrying after short writes
+void transport_send(void *sink, const char *cmd) {
+    transport_t *transport = sink;
+    size_t len = strlen(cmd);
+    size_t sent = 0;
+
+    while (sent < len) {
+        int numBytes = transport->write(transport, cmd + sent, len - sent);
+        if (numBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // The socket's write timeout (--timeout) ran out
+            fprintf(stderr, "Connection timed out\n");
+            exit(2);
+        } else if (numBytes <= 0) {
+            fprintf(stderr, "Failed to write to the server\n");
+            exit(2);
+        }
+        stats_write(numBytes);
+        sent += numBytes;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+
+typedef struct transport transport_t;
+
+// A connection's bytes in both directions: a plain socket, TLS, deflate over either of them, or
+// memory standing in for the server. The reader and the commands only ever see this
+struct transport {
+    // Returns the number of bytes read, 0 on disconnect and negative on error
+    int (*read)(transport_t *transport, char *buf, int len);
+    // Returns the number of bytes written, <= 0 on error
+    int (*write)(transport_t *transport, const char *buf, int len);
+    // Bytes the transport has read from fd and holds, which splicing from fd would skip. NULL
+    // when it never holds any
+    size_t (*pending)(transport_t *transport);
+    void *ctx;  // the SSL connection, compress stream or memory source
+    int fd;     // the socket when its bytes are the stream itself (plain or kTLS), so it can be spliced, else -1
+};
+
+// Bytes already in memory, handed out as if they came from the server
+typedef struct memory_source {
+    const char *data;
+    size_t len;
+    size_t offset;
+} memory_source_t;
+
+// Set up a transport over a plain socket
+void transport_plain(transport_t *transport, int sockfd);
+
+// Set up a transport reading from memory, what is written to it is dropped
+void transport_memory(transport_t *transport, memory_source_t *memory);
+
+// Function to send a command, sink is the transport_t. Exits if the server cannot be written to
+void transport_send(void *sink, const char *cmd);
+
+#endif
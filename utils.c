@@ -1,9 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "utils.h"
 #include "imap_client.h"
+#include "scan.h"
+#include "connect.h"
 
 
 // Signal handler for SIGPIPE
@@ -17,6 +21,20 @@ void handle_sigpipe(int sig) {
 // Function to print usage instructions and exit
 void print_usage() {
     fprintf(stderr, "Usage: ./fetchmail -n <number> -u <username> -p <password> -f <folder> <command> <server>\n");
+    fprintf(stderr, "       -n also takes a sequence set such as 1:500 or 3,7,9 (UIDs with --uid)\n");
+    fprintf(stderr, "       --port <port> and --ca <file> point it at another server, e.g. the test server\n");
+    fprintf(stderr, "       --connect-timeout <s> (default 10) and --timeout <s> (default 60) limit waits for the server\n");
+    fprintf(stderr, "       --no-compress turns off COMPRESS=DEFLATE, -v reports the compression ratio\n");
+    fprintf(stderr, "       --stats json [--stats-file <file>] reports phase timings and byte counts as JSON on stderr\n");
+    fprintf(stderr, "       -t --ktls has the kernel decrypt TLS (Linux kTLS) where it can\n");
+    fprintf(stderr, "       retrieve --dir <dir> [-k <connections>] saves the -n messages (default all) to <dir>/<uid>.eml\n");
+    fprintf(stderr, "       parse --headers <field>,<field>,... prints those header fields (default From,To,Date,Subject)\n");
+    fprintf(stderr, "       mime --tree lists the parts of the message, mime --part <section> prints one of them\n");
+    fprintf(stderr, "       mime --decode [--part <section>] undoes the quoted-printable or base64 of the part printed\n");
+    fprintf(stderr, "       export --maildir <dir> | --mbox <file> [--fsync-each] saves the folder, resuming by UID\n");
+    fprintf(stderr, "       ./fetchmail --daemon [--socket <path>] keeps sessions open, use them with --socket <path>\n");
+    fprintf(stderr, "       ./fetchmail --accounts <file> [--parallel <n>] runs one command line per line of file,\n");
+    fprintf(stderr, "       each with -o <output file>, concurrently\n");
     exit(1);
 }
 
@@ -34,6 +52,91 @@ int parse_n_value(const char *n_str) {
     return (int)n;
 }
 
+// Function to check a --port value
+void parse_port(const char *port_str) {
+    char *endptr;
+    errno = 0;
+    long port = strtol(port_str, &endptr, 10);
+
+    if (errno == ERANGE || port < 1 || port > 65535 || endptr == port_str || *endptr != '\0') {
+        fprintf(stderr, "Invalid --port value: %s\n", port_str);
+        print_usage();
+    }
+}
+
+// Function to read a timeout given in seconds (fractions allowed), returns it in milliseconds
+int parse_timeout(const char *value, const char *option) {
+    char *endptr;
+    errno = 0;
+    double seconds = strtod(value, &endptr);
+
+    if (errno == ERANGE || !(seconds > 0) || seconds > 86400 || endptr == value || *endptr != '\0') {
+        fprintf(stderr, "Invalid %s value: %s\n", option, value);
+        print_usage();
+    }
+    return seconds * 1000 < 1 ? 1 : (int)(seconds * 1000);
+}
+
+// Function to check a -n value that is an IMAP sequence set (or UID set), e.g. 1:500 or 3,7,9:*
+// Each element is a number or *, optionally followed by :number or :*. Sequence numbers and UIDs
+// are both 32 bit numbers in IMAP, so either can address any message of a folder
+void check_sequence_set(const char *n_str) {
+    const char *p = n_str;
+
+    while (1) {
+        for (int side = 0; side < 2; side++) {
+            if (*p == '*') {
+                p++;
+            } else {
+                char *endptr;
+                errno = 0;
+                unsigned long n = isdigit((unsigned char)*p) ? strtoul(p, &endptr, 10) : 0;
+                if (!isdigit((unsigned char)*p) || errno == ERANGE || n == 0 || n > UID_MAX_UTIL) {
+                    fprintf(stderr, "Invalid -n value: %s\n", n_str);
+                    print_usage();
+                }
+                p = endptr;
+            }
+
+            // A range has a second number after the colon
+            if (side == 1 || *p != ':') {
+                break;
+            }
+            p++;
+        }
+
+        if (*p == '\0') {
+            return;
+        }
+        if (*p != ',') {
+            fprintf(stderr, "Invalid -n value: %s\n", n_str);
+            print_usage();
+        }
+        p++;
+    }
+}
+
+// Function to tell whether a -n value selects more than one message
+int is_sequence_set(const char *n_str) {
+    return n_str != NULL && strpbrk(n_str, ",:") != NULL;
+}
+
+// Function to check a --headers value: a comma separated list of header field names, each of
+// which has to go into the FETCH as an IMAP atom
+void check_header_names(const char *headers) {
+    size_t len = strlen(headers);
+    int valid = len > 0 && len <= MAX_HEADER_SIZE && headers[0] != ',' && headers[len - 1] != ',' &&
+                strstr(headers, ",,") == NULL;
+
+    for (const char *p = headers; valid && *p != '\0'; p++) {
+        valid = *p > ' ' && *p < 127 && strchr(":(){%*\"\\]", *p) == NULL;
+    }
+    if (!valid) {
+        fprintf(stderr, "Invalid --headers value: %s\n", headers);
+        print_usage();
+    }
+}
+
 void check_for_injection(const char *input) {
     if (strchr(input, '\n') != NULL || strchr(input, '\r') != NULL) {
         fprintf(stderr, "Error: Input contains illegal characters.\n");
@@ -61,9 +164,59 @@ int parse_args(int argc, char *argv[], fetch_mail_t *fetch_mail) {
             }
             check_for_injection(fetch_mail->folder);
         } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
-            fetch_mail->messageNum = parse_n_value(argv[++i]);
+            fetch_mail->sequence = argv[++i];
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            fetch_mail->socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            fetch_mail->port = argv[++i];
+            parse_port(fetch_mail->port);
+        } else if (strcmp(argv[i], "--connect-timeout") == 0 && i + 1 < argc) {
+            fetch_mail->connectTimeout = parse_timeout(argv[++i], "--connect-timeout");
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            fetch_mail->readTimeout = parse_timeout(argv[++i], "--timeout");
+        } else if (strcmp(argv[i], "--ca") == 0 && i + 1 < argc) {
+            fetch_mail->ca_file = argv[++i];
+        } else if (strcmp(argv[i], "--uid") == 0) {
+            fetch_mail->useUID = 1;
         } else if (strcmp(argv[i], "-t") == 0) {
             fetch_mail->isTLS = 1;
+        } else if (strcmp(argv[i], "--no-compress") == 0) {
+            fetch_mail->noCompress = 1;
+        } else if (strcmp(argv[i], "--ktls") == 0) {
+            fetch_mail->useKTLS = 1;
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            fetch_mail->out_dir = argv[++i];
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            fetch_mail->connections = parse_n_value(argv[++i]);
+            if (fetch_mail->connections < 1) {
+                fprintf(stderr, "Invalid -k value: %s\n", argv[i]);
+                print_usage();
+            }
+        } else if (strcmp(argv[i], "--maildir") == 0 && i + 1 < argc) {
+            fetch_mail->maildir = argv[++i];
+        } else if (strcmp(argv[i], "--mbox") == 0 && i + 1 < argc) {
+            fetch_mail->mbox = argv[++i];
+        } else if (strcmp(argv[i], "--tree") == 0) {
+            fetch_mail->mimeTree = 1;
+        } else if (strcmp(argv[i], "--part") == 0 && i + 1 < argc) {
+            fetch_mail->mimePart = argv[++i];
+        } else if (strcmp(argv[i], "--headers") == 0 && i + 1 < argc) {
+            fetch_mail->headers = argv[++i];
+            check_header_names(fetch_mail->headers);
+        } else if (strcmp(argv[i], "--decode") == 0) {
+            fetch_mail->mimeDecode = 1;
+        } else if (strcmp(argv[i], "--fsync-each") == 0) {
+            fetch_mail->fsyncEach = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            if (strcmp(argv[++i], "json") != 0) {
+                fprintf(stderr, "Invalid --stats value: %s\n", argv[i]);
+                print_usage();
+            }
+            fetch_mail->stats = 1;
+        } else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            fetch_mail->stats_file = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            fetch_mail->verbose = 1;
         } else if (fetch_mail->command == NULL) {
             fetch_mail->command = argv[i];
             check_for_injection(fetch_mail->command);
@@ -81,6 +234,72 @@ int parse_args(int argc, char *argv[], fetch_mail_t *fetch_mail) {
         print_usage();
     }
 
+    // --dir saves the messages retrieve would print, the whole folder unless -n says otherwise
+    if (fetch_mail->out_dir != NULL && strcmp(fetch_mail->command, "retrieve") != 0) {
+        fprintf(stderr, "Error: --dir only works with retrieve.\n");
+        print_usage();
+    }
+    if (fetch_mail->out_dir == NULL && fetch_mail->connections != 0) {
+        fprintf(stderr, "Error: -k needs --dir.\n");
+        print_usage();
+    }
+
+    // --stats follows one connection, --dir downloads over several from processes of their own
+    if (fetch_mail->stats_file != NULL && !fetch_mail->stats) {
+        fprintf(stderr, "Error: --stats-file needs --stats json.\n");
+        print_usage();
+    }
+    if (fetch_mail->stats && fetch_mail->out_dir != NULL) {
+        fprintf(stderr, "Error: --stats cannot be used with --dir.\n");
+        print_usage();
+    }
+
+    // export writes the whole folder to exactly one Maildir or mbox file
+    if (strcmp(fetch_mail->command, "export") == 0) {
+        if ((fetch_mail->maildir == NULL) == (fetch_mail->mbox == NULL)) {
+            fprintf(stderr, "Error: export needs either --maildir <dir> or --mbox <file>.\n");
+            print_usage();
+        }
+        if (fetch_mail->sequence != NULL) {
+            fprintf(stderr, "Error: export always exports the whole folder, -n cannot be used.\n");
+            print_usage();
+        }
+    } else if (fetch_mail->maildir != NULL || fetch_mail->mbox != NULL || fetch_mail->fsyncEach) {
+        fprintf(stderr, "Error: --maildir, --mbox and --fsync-each only work with export.\n");
+        print_usage();
+    }
+
+    if ((fetch_mail->mimeTree || fetch_mail->mimePart != NULL || fetch_mail->mimeDecode) &&
+        strcmp(fetch_mail->command, "mime") != 0) {
+        fprintf(stderr, "Error: --tree, --part and --decode only work with mime.\n");
+        print_usage();
+    }
+    if (fetch_mail->headers != NULL && strcmp(fetch_mail->command, "parse") != 0) {
+        fprintf(stderr, "Error: --headers only works with parse.\n");
+        print_usage();
+    }
+    if (fetch_mail->mimeTree && fetch_mail->mimeDecode) {
+        fprintf(stderr, "Error: --decode prints a part, it cannot be used with --tree.\n");
+        print_usage();
+    }
+
+    if (fetch_mail->connectTimeout == 0) {
+        fetch_mail->connectTimeout = CONNECT_TIMEOUT_MS;
+    }
+    if (fetch_mail->readTimeout == 0) {
+        fetch_mail->readTimeout = READ_TIMEOUT_MS;
+    }
+
+    // The daemon socket can also come from the environment
+    if (fetch_mail->socket_path == NULL) {
+        fetch_mail->socket_path = getenv("FETCHMAIL_SOCKET");
+    }
+
+    // -n is either a single message number or a sequence set, a single number being the smallest set
+    if (fetch_mail->sequence != NULL) {
+        check_sequence_set(fetch_mail->sequence);
+    }
+
     return 1;
 
 }
@@ -105,15 +324,29 @@ void to_lowercase(char *str) {
 
 // Case-insensitive strstr function
 char *strcasestr(const char *haystack, const char *needle) {
-    if (!*needle) return (char *) haystack;
-    for (; *haystack; ++haystack) {
-        if (tolower((unsigned char) *haystack) == tolower((unsigned char) *needle)) {
-            const char *h, *n;
-            for (h = haystack, n = needle; *h && *n; ++h, ++n) {
-                if (tolower((unsigned char) *h) != tolower((unsigned char) *n)) break;
-            }
-            if (!*n) return (char *) haystack;
+    return scan_casestr(haystack, needle);
+}
+
+
+// Function to find the directory for one of the caches. The environment variable env names the
+// directory (empty turns that cache off), otherwise $XDG_CACHE_HOME/fetchmail or ~/.cache/fetchmail
+// is used. The directory is created readable only by this user. Returns 0 if there is no cache to use
+int cache_dir(const char *env_name, char *dir, size_t size) {
+    const char *env = getenv(env_name);
+
+    if (env != NULL) {
+        if (env[0] == '\0') {
+            return 0;
         }
+        snprintf(dir, size, "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0') {
+        snprintf(dir, size, "%s/fetchmail", env);
+    } else if ((env = getenv("HOME")) != NULL && env[0] != '\0') {
+        snprintf(dir, size, "%s/.cache/fetchmail", env);
+    } else {
+        return 0;
     }
-    return NULL;
-}
\ No newline at end of file
+
+    // The caches hold key material and mail headers, so only this user may read the directory
+    return mkdir(dir, 0700) == 0 || errno == EEXIST;
+}
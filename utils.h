@@ -12,10 +12,20 @@
 
 #define INT_MAX_UTIL 1000
 
+#define UID_MAX_UTIL 4294967295UL
+
 void print_usage();
 
 int parse_n_value(const char *n_str);
 
+void check_sequence_set(const char *n_str);
+
+void parse_port(const char *port_str);
+
+int parse_timeout(const char *value, const char *option);
+
+int is_sequence_set(const char *n_str);
+
 // Function to read in command line arguments
 int parse_args(int argc, char *argv[], fetch_mail_t *fetch_mail);
 
@@ -23,10 +33,15 @@ void to_lowercase(char *str);
 
 char *strcasestr(const char *haystack, const char *needle);
 
+void check_header_names(const char *headers);
+
 void check_for_injection(const char *input);
 
 void handle_sigpipe(int sig);
 
+// Function to find (and create) the cache directory, env_name overrides it and empty disables it
+int cache_dir(const char *env_name, char *dir, size_t size);
+
 
 
 